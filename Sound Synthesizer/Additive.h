@@ -0,0 +1,515 @@
+#pragma once
+#include <complex>
+#include <filesystem>
+
+// FMA comes with AVX2 on every CPU that has it; GCC and Clang still want it
+// enabled separately (-mfma)
+#if defined(__AVX2__) && (defined(__FMA__) || defined(_MSC_VER))
+#define SYNTH_FMA
+#include <immintrin.h>
+#endif
+
+#include "Core.h"
+
+namespace synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Additive Resynthesis
+	//
+	// A recording is analysed into a few dozen sine partials at fixed ratios to
+	// the played pitch, each with its own amplitude envelope sampled at a low
+	// frame rate. Playing one back is a bank of sines, so the cost per voice is
+	// fixed by the partial count and a patch takes kilobytes where the sample
+	// would take megabytes. Phases are not kept, only what the ear follows.
+
+	struct additive_header
+	{
+		char magic[4];			// "CADD"
+		uint32_t nVersion;
+		uint32_t nPartials;
+		uint32_t nFrames;		// Envelope points per partial
+		double dFrameRate;		// Envelope points per second
+		double dBaseHertz;		// Analysed pitch the ratios are relative to
+	};
+
+	static_assert(sizeof(additive_header) == 32, "additive_header layout");
+	const uint32_t ADDITIVE_VERSION = 1;
+
+	struct additive_patch
+	{
+	public:
+		additive_patch(memory_account *account = nullptr)
+			: vecRatio(tracked_allocator<float, MEM_TABLES>(account)), vecAmp(tracked_allocator<float, MEM_TABLES>(account))
+		{
+			nFrames = 0;
+			dFrameRate = 100.0;
+			dBaseHertz = 0.0;
+		}
+
+		size_t Partials() const { return vecRatio.size(); }
+		FTYPE Duration() const { return nFrames > 0 ? (nFrames - 1) / dFrameRate : 0.0; }
+
+		// Envelope of partial p, nFrames points
+		const float* Amplitudes(size_t p) const { return vecAmp.data() + p * nFrames; }
+
+		// [additive_header][float ratio x nPartials][float amplitude x nFrames, per partial]
+		bool Write(const wstring &sPath) const
+		{
+			ofstream f(filesystem::path(sPath), ios::binary);
+			if (!f.is_open())
+				return false;
+
+			additive_header h = {};
+			memcpy(h.magic, "CADD", 4);
+			h.nVersion = ADDITIVE_VERSION;
+			h.nPartials = (uint32_t)Partials();
+			h.nFrames = nFrames;
+			h.dFrameRate = dFrameRate;
+			h.dBaseHertz = dBaseHertz;
+			f.write((const char*)&h, sizeof(h));
+			f.write((const char*)vecRatio.data(), vecRatio.size() * sizeof(float));
+			f.write((const char*)vecAmp.data(), vecAmp.size() * sizeof(float));
+			return f.good();
+		}
+
+		bool Read(const wstring &sPath)
+		{
+			ifstream f(filesystem::path(sPath), ios::binary);
+			additive_header h;
+			if (!f.read((char*)&h, sizeof(h)) || memcmp(h.magic, "CADD", 4) != 0 || h.nVersion != ADDITIVE_VERSION ||
+				h.dFrameRate <= 0.0 || (uint64_t)h.nPartials * h.nFrames > (1u << 26))
+				return false;
+
+			vecRatio.resize(h.nPartials);
+			vecAmp.resize((size_t)h.nPartials * h.nFrames);
+			if (!f.read((char*)vecRatio.data(), vecRatio.size() * sizeof(float)) ||
+				!f.read((char*)vecAmp.data(), vecAmp.size() * sizeof(float)))
+				return false;
+
+			nFrames = h.nFrames;
+			dFrameRate = h.dFrameRate;
+			dBaseHertz = h.dBaseHertz;
+			return true;
+		}
+
+	public:
+		uint32_t nFrames;
+		FTYPE dFrameRate;
+		FTYPE dBaseHertz;
+		tracked_vector<float, MEM_TABLES> vecRatio;		// Frequency over the played pitch
+		tracked_vector<float, MEM_TABLES> vecAmp;		// Partial major
+	};
+
+
+	// In place radix-2 FFT, the size a power of two
+	inline void fft(vector<complex<double>> &vecX)
+	{
+		size_t n = vecX.size();
+		for (size_t i = 1, j = 0; i < n; i++)
+		{
+			size_t nBit = n >> 1;
+			for (; j & nBit; nBit >>= 1)
+				j ^= nBit;
+			j ^= nBit;
+			if (i < j)
+				swap(vecX[i], vecX[j]);
+		}
+
+		for (size_t nLen = 2; nLen <= n; nLen <<= 1)
+		{
+			double dAngle = -2.0 * PI / nLen;
+			complex<double> wStep(math::cos(dAngle), math::sin(dAngle));
+			for (size_t i = 0; i < n; i += nLen)
+			{
+				complex<double> wk(1.0, 0.0);
+				for (size_t k = 0; k < nLen / 2; k++)
+				{
+					complex<double> u = vecX[i + k];
+					complex<double> v = vecX[i + k + nLen / 2] * wk;
+					vecX[i + k] = u + v;
+					vecX[i + k + nLen / 2] = u - v;
+					wk *= wStep;
+				}
+			}
+		}
+	}
+
+
+	// STFT peak picking and tracking. Each frame's spectral peaks, refined by
+	// parabolic interpolation, continue the nearest track within a bin or so;
+	// tracks survive short gaps. The strongest tracks by energy become the
+	// partials, at their amplitude weighted mean frequency.
+	struct additive_analyser
+	{
+	public:
+		additive_analyser()
+		{
+			nPartials = 32;
+			dFrameRate = 100.0;
+			dFloorDb = -70.0;
+			nMaxGap = 5;
+			nMinFrames = 4;
+			dBaseHertz = 0.0;
+			fMaxSeconds = 30.0;
+		}
+
+		// False if there is nothing to analyse
+		bool Analyse(const vector<FTYPE> &vecSamples, unsigned int nSampleRate, additive_patch &patch)
+		{
+			if (vecSamples.empty() || nSampleRate == 0)
+				return false;
+
+			// About 46 ms windows, enough to separate partials 40 Hz apart
+			size_t N = 1;
+			while (N < nSampleRate * 0.046)
+				N <<= 1;
+			size_t nHop = max((size_t)1, (size_t)math::round_to_int(nSampleRate / dFrameRate));
+			size_t nSamples = min(vecSamples.size(), (size_t)(fMaxSeconds * nSampleRate));
+			uint32_t nFrames = (uint32_t)(nSamples / nHop + 1);
+			FTYPE dBinHertz = (FTYPE)nSampleRate / N;
+
+			vector<FTYPE> vecWindow(N);
+			FTYPE dWindowSum = 0.0;
+			for (size_t i = 0; i < N; i++)
+			{
+				vecWindow[i] = 0.5 - 0.5 * math::cos(2.0 * PI * i / N);
+				dWindowSum += vecWindow[i];
+			}
+
+			// Magnitudes of frame f, sine amplitude scaled, centred on sample
+			// f * nHop. Worked out twice, once for the loudest peak and again to
+			// pick peaks, rather than kept for every frame.
+			vector<FTYPE> mag(N / 2 + 1);
+			vector<complex<double>> vecX(N);
+			auto spectrum = [&](uint32_t f)
+			{
+				for (size_t i = 0; i < N; i++)
+				{
+					long long s = (long long)(f * nHop + i) - (long long)(N / 2);
+					FTYPE x = (s >= 0 && s < (long long)nSamples) ? vecSamples[s] : 0.0;
+					vecX[i] = complex<double>(x * vecWindow[i], 0.0);
+				}
+				fft(vecX);
+				for (size_t k = 0; k <= N / 2; k++)
+					mag[k] = 2.0 * abs(vecX[k]) / dWindowSum;
+			};
+
+			FTYPE dPeak = 0.0;
+			for (uint32_t f = 0; f < nFrames; f++)
+			{
+				spectrum(f);
+				for (size_t k = 0; k <= N / 2; k++)
+					dPeak = max(dPeak, mag[k]);
+			}
+			if (dPeak <= 0.0)
+				return false;
+
+			FTYPE dFloor = dPeak * math::exp(dFloorDb / 20.0 * 2.302585092994046);
+			vector<track> vecTracks;
+			vector<size_t> vecActive;
+			vector<peak> vecPeaks;
+
+			for (uint32_t f = 0; f < nFrames; f++)
+			{
+				spectrum(f);
+				vecPeaks.clear();
+				for (size_t k = 1; k < N / 2; k++)
+				{
+					if (mag[k] < dFloor || mag[k] <= mag[k - 1] || mag[k] < mag[k + 1])
+						continue;
+
+					// Parabola through the log magnitudes of the three bins
+					FTYPE a = math::log(max(mag[k - 1], 1e-12)), b = math::log(mag[k]), c = math::log(max(mag[k + 1], 1e-12));
+					FTYPE dDenom = a - 2.0 * b + c;
+					FTYPE p = dDenom != 0.0 ? 0.5 * (a - c) / dDenom : 0.0;
+					vecPeaks.push_back({ (k + p) * dBinHertz, math::exp(b - 0.25 * (a - c) * p) });
+				}
+
+				// Loudest peaks choose first
+				sort(vecPeaks.begin(), vecPeaks.end(), [](const peak &x, const peak &y) { return x.dAmp > y.dAmp; });
+				vector<bool> vecTaken(vecActive.size(), false);
+				for (auto &pk : vecPeaks)
+				{
+					FTYPE dTolerance = 1.5 * dBinHertz + 0.01 * pk.dHertz;
+					int nBest = -1;
+					for (size_t t = 0; t < vecActive.size(); t++)
+					{
+						FTYPE d = fabs(vecTracks[vecActive[t]].dLastHertz - pk.dHertz);
+						if (!vecTaken[t] && d < dTolerance && (nBest < 0 || d < fabs(vecTracks[vecActive[nBest]].dLastHertz - pk.dHertz)))
+							nBest = (int)t;
+					}
+
+					if (nBest < 0)
+					{
+						vecActive.push_back(vecTracks.size());
+						vecTaken.push_back(true);
+						vecTracks.push_back(track());
+						vecTracks.back().vecPoints.push_back({ f, pk.dHertz, pk.dAmp });
+						vecTracks.back().dLastHertz = pk.dHertz;
+						continue;
+					}
+
+					vecTaken[nBest] = true;
+					track &tr = vecTracks[vecActive[nBest]];
+					tr.vecPoints.push_back({ f, pk.dHertz, pk.dAmp });
+					tr.dLastHertz = pk.dHertz;
+				}
+
+				// Tracks that went quiet for too long are finished
+				vector<size_t> vecStill;
+				for (auto t : vecActive)
+					if (f - vecTracks[t].vecPoints.back().nFrame <= nMaxGap)
+						vecStill.push_back(t);
+				vecActive.swap(vecStill);
+			}
+
+			// Blips from transients and window sidelobes are not partials
+			vecTracks.erase(remove_if(vecTracks.begin(), vecTracks.end(),
+				[this](const track &tr) { return tr.vecPoints.size() < nMinFrames; }), vecTracks.end());
+
+			// Strongest tracks first
+			for (auto &tr : vecTracks)
+			{
+				FTYPE dWeight = 0.0;
+				tr.dEnergy = 0.0;
+				tr.dHertz = 0.0;
+				for (auto &pt : tr.vecPoints)
+				{
+					tr.dEnergy += pt.dAmp * pt.dAmp;
+					tr.dHertz += pt.dHertz * pt.dAmp;
+					dWeight += pt.dAmp;
+				}
+				tr.dHertz /= dWeight;
+			}
+			sort(vecTracks.begin(), vecTracks.end(), [](const track &x, const track &y) { return x.dEnergy > y.dEnergy; });
+			vecTracks.resize(min(vecTracks.size(), nPartials));
+			sort(vecTracks.begin(), vecTracks.end(), [](const track &x, const track &y) { return x.dHertz < y.dHertz; });
+
+			// Pitch: given, or the lowest partial with a tenth of the top energy
+			FTYPE dBase = dBaseHertz;
+			FTYPE dTopEnergy = 0.0;
+			for (auto &tr : vecTracks)
+				dTopEnergy = max(dTopEnergy, tr.dEnergy);
+			for (size_t t = 0; dBase <= 0.0 && t < vecTracks.size(); t++)
+				if (vecTracks[t].dEnergy >= 0.1 * dTopEnergy)
+					dBase = vecTracks[t].dHertz;
+
+			patch.nFrames = nFrames;
+			patch.dFrameRate = (FTYPE)nSampleRate / nHop;
+			patch.dBaseHertz = dBase;
+			patch.vecRatio.resize(vecTracks.size());
+			patch.vecAmp.assign((size_t)vecTracks.size() * nFrames, 0.0f);
+			for (size_t t = 0; t < vecTracks.size(); t++)
+			{
+				patch.vecRatio[t] = (float)(vecTracks[t].dHertz / dBase);
+
+				// Points as measured, gaps bridged linearly
+				float *pAmp = patch.vecAmp.data() + t * nFrames;
+				const vector<point> &pts = vecTracks[t].vecPoints;
+				for (size_t i = 0; i < pts.size(); i++)
+				{
+					pAmp[pts[i].nFrame] = (float)pts[i].dAmp;
+					if (i > 0)
+						for (uint32_t g = pts[i - 1].nFrame + 1; g < pts[i].nFrame; g++)
+						{
+							FTYPE x = (FTYPE)(g - pts[i - 1].nFrame) / (pts[i].nFrame - pts[i - 1].nFrame);
+							pAmp[g] = (float)(pts[i - 1].dAmp + x * (pts[i].dAmp - pts[i - 1].dAmp));
+						}
+				}
+			}
+			return !vecTracks.empty();
+		}
+
+	public:
+		size_t nPartials;		// Kept, strongest first
+		FTYPE dFrameRate;		// Envelope points per second
+		FTYPE dFloorDb;			// Peaks this far under the loudest are ignored
+		uint32_t nMaxGap;		// Frames a track may miss and carry on
+		size_t nMinFrames;		// Shorter tracks are dropped
+		FTYPE dBaseHertz;		// Known pitch of the recording, 0 to estimate it
+		FTYPE fMaxSeconds;		// Analysed from the start of the recording, the rest ignored
+
+	private:
+		struct peak
+		{
+			FTYPE dHertz;
+			FTYPE dAmp;
+		};
+
+		struct point
+		{
+			uint32_t nFrame;
+			FTYPE dHertz;
+			FTYPE dAmp;
+		};
+
+		struct track
+		{
+			vector<point> vecPoints;
+			FTYPE dLastHertz = 0.0;
+			FTYPE dHertz = 0.0;
+			FTYPE dEnergy = 0.0;
+		};
+	};
+
+
+	// Adds nSamples of a bank of sines into pOut. Partial p runs at pHertz[p],
+	// starting at phase w * dLifeTime so it is a pure function of time, with its
+	// amplitude ramped from pAmp0[p] to pAmp1[p] over the block. Between the
+	// exact phases at the start of each call a rotation steps four consecutive
+	// samples of one partial at a time, so there is no sin() per sample.
+	inline void osc_bank(const FTYPE *pHertz, const FTYPE *pAmp0, const FTYPE *pAmp1, size_t nPartials,
+		FTYPE dLifeTime, FTYPE dTimeStep, FTYPE *pOut, unsigned int nSamples)
+	{
+		for (size_t p = 0; p < nPartials; p++)
+		{
+			if (pAmp0[p] == 0.0 && pAmp1[p] == 0.0)
+				continue;
+
+			FTYPE dStep = w(pHertz[p]) * dTimeStep;
+			FTYPE dPhase = w(pHertz[p]) * dLifeTime;
+			FTYPE dAmpInc = (pAmp1[p] - pAmp0[p]) / nSamples;
+			unsigned int s = 0;
+
+#ifdef SYNTH_FMA
+			if (nSamples >= 4)
+			{
+				// Lanes hold samples s..s+3, each step rotates all four by 4 samples
+				__m256d vSin = _mm256_set_pd(math::sin(dPhase + 3 * dStep), math::sin(dPhase + 2 * dStep), math::sin(dPhase + dStep), math::sin(dPhase));
+				__m256d vCos = _mm256_set_pd(math::cos(dPhase + 3 * dStep), math::cos(dPhase + 2 * dStep), math::cos(dPhase + dStep), math::cos(dPhase));
+				__m256d vRotSin = _mm256_set1_pd(math::sin(4.0 * dStep));
+				__m256d vRotCos = _mm256_set1_pd(math::cos(4.0 * dStep));
+				__m256d vAmp = _mm256_add_pd(_mm256_set1_pd(pAmp0[p]), _mm256_mul_pd(_mm256_set_pd(3.0, 2.0, 1.0, 0.0), _mm256_set1_pd(dAmpInc)));
+				__m256d vAmpInc = _mm256_set1_pd(4.0 * dAmpInc);
+
+				for (; s + 4 <= nSamples; s += 4)
+				{
+					_mm256_storeu_pd(pOut + s, _mm256_fmadd_pd(vAmp, vSin, _mm256_loadu_pd(pOut + s)));
+					__m256d vNewSin = _mm256_fmadd_pd(vSin, vRotCos, _mm256_mul_pd(vCos, vRotSin));
+					vCos = _mm256_fmsub_pd(vCos, vRotCos, _mm256_mul_pd(vSin, vRotSin));
+					vSin = vNewSin;
+					vAmp = _mm256_add_pd(vAmp, vAmpInc);
+				}
+			}
+#endif
+			FTYPE dSin = math::sin(dPhase + s * dStep), dCos = math::cos(dPhase + s * dStep);
+			FTYPE dRotSin = math::sin(dStep), dRotCos = math::cos(dStep);
+			for (; s < nSamples; s++)
+			{
+				pOut[s] += (pAmp0[p] + s * dAmpInc) * dSin;
+				FTYPE dNewSin = dSin * dRotCos + dCos * dRotSin;
+				dCos = dCos * dRotCos - dSin * dRotSin;
+				dSin = dNewSin;
+			}
+		}
+	}
+
+
+	// Plays an additive_patch, the played note setting the pitch the partial
+	// ratios are relative to. The patch envelopes carry the recorded attack and
+	// decay; env only adds the release. Partials over Nyquist are dropped.
+	struct instrument_additive : public instrument_base
+	{
+		instrument_additive() : patch(&mem), vecHertz(tracked_allocator<FTYPE, MEM_SCRATCH>(&mem)),
+			vecAmp0(tracked_allocator<FTYPE, MEM_SCRATCH>(&mem)), vecAmp1(tracked_allocator<FTYPE, MEM_SCRATCH>(&mem))
+		{
+			env.dAttackTime = 0.002;
+			env.dDecayTime = 0.0;
+			env.dSustainAmplitude = 1.0;
+			env.dReleaseTime = 0.2;
+			fMaxLifeTime = -1.0;
+			dVolume = 1.0;
+			name = L"Additive";
+			nSampleRate = 44100;
+		}
+
+		// Call again after changing patch other than through Load
+		virtual void Prepare(unsigned int sampleRate)
+		{
+			nSampleRate = sampleRate;
+			Reserve();
+		}
+
+		bool Load(const wstring &sPath)
+		{
+			if (!patch.Read(sPath))
+				return false;
+			Reserve();
+			return true;
+		}
+
+		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished)
+		{
+			FTYPE dSample = 0.0;
+			SoundBlock(dTime, 1.0 / nSampleRate, n, &dSample, 1, bNoteFinished);
+			return dSample;
+		}
+
+		virtual bool SoundBlock(const FTYPE dTime, const FTYPE dTimeStep, const synth::note &n, FTYPE *pOut, unsigned int nSamples, bool &bNoteFinished)
+		{
+			// Never allocates: partials beyond the buffers Prepare sized are left out
+			size_t nPartials = min(patch.Partials(), vecHertz.size());
+			if (nPartials == 0 || dTime - n.on > patch.Duration())
+			{
+				bNoteFinished = true;
+				return true;
+			}
+
+			FTYPE dNyquist = 0.5 / dTimeStep;
+			for (size_t p = 0; p < nPartials; p++)
+				vecHertz[p] = scale(n.id) * patch.vecRatio[p];
+
+			// Envelopes move at the frame rate, so ramps of up to 256 samples
+			// between their values follow them closely enough
+			unsigned int s = 0;
+			while (s < nSamples)
+			{
+				unsigned int nChunk = min(256u, nSamples - s);
+				FTYPE t0 = dTime + s * dTimeStep;
+				FTYPE t1 = t0 + nChunk * dTimeStep;
+				FTYPE dEnv0 = synth::env(t0, env, n.on, n.off) * dVolume;
+				FTYPE dEnv1 = synth::env(t1, env, n.on, n.off) * dVolume;
+				if (dEnv1 <= 0.0 && t1 - n.on > env.dAttackTime) bNoteFinished = true;
+
+				for (size_t p = 0; p < nPartials; p++)
+				{
+					bool bAudible = vecHertz[p] < dNyquist;
+					vecAmp0[p] = bAudible ? Envelope(p, t0 - n.on) * dEnv0 : 0.0;
+					vecAmp1[p] = bAudible ? Envelope(p, t1 - n.on) * dEnv1 : 0.0;
+				}
+				osc_bank(vecHertz.data(), vecAmp0.data(), vecAmp1.data(), nPartials, t0 - n.on, dTimeStep, pOut + s, nChunk);
+				s += nChunk;
+			}
+			return true;
+		}
+
+	private:
+		// Per partial buffers for the patch, so rendering doesn't allocate
+		void Reserve()
+		{
+			vecHertz.resize(patch.Partials());
+			vecAmp0.resize(patch.Partials());
+			vecAmp1.resize(patch.Partials());
+		}
+
+		FTYPE Envelope(size_t p, FTYPE dLifeTime) const
+		{
+			FTYPE x = dLifeTime * patch.dFrameRate;
+			if (x < 0.0 || x >= patch.nFrames - 1)
+				return 0.0;
+			size_t f = (size_t)x;
+			const float *pAmp = patch.Amplitudes(p);
+			return pAmp[f] + (x - f) * (pAmp[f + 1] - pAmp[f]);
+		}
+
+	public:
+		additive_patch patch;
+
+	private:
+		unsigned int nSampleRate;
+		tracked_vector<FTYPE, MEM_SCRATCH> vecHertz;
+		tracked_vector<FTYPE, MEM_SCRATCH> vecAmp0;
+		tracked_vector<FTYPE, MEM_SCRATCH> vecAmp1;
+	};
+
+}
@@ -0,0 +1,474 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "Engine.h"
+#include "Granular.h"
+#include "Wavetable.h"
+#include "Scheduler.h"
+
+namespace synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Benchmarks
+	//
+	// Times the oscillators, the envelope, every instrument's sound() and the
+	// engine mix in ns/sample. With counters on, each benchmark is also measured
+	// with hardware performance counters (Linux perf_event_open only; elsewhere
+	// the counters report as unavailable and only timings are shown). Last, as
+	// many engines as the block scheduler admits play together for a second.
+
+	struct perf_sample
+	{
+		bool bValid = false;
+		uint64_t nCycles = 0;
+		uint64_t nInstructions = 0;
+		uint64_t nL1Misses = 0;		// L1 data read misses
+		uint64_t nLLCMisses = 0;	// Last level cache misses
+		uint64_t nBranchMisses = 0;
+
+		FTYPE IPC() const
+		{
+			return nCycles > 0 ? (FTYPE)nInstructions / nCycles : 0.0;
+		}
+	};
+
+	// One group of counters for the calling thread, read together so the ratios
+	// come from the same interval
+	struct perf_counters
+	{
+	public:
+		~perf_counters()
+		{
+			Close();
+		}
+
+		// False if the counters can't be opened (not Linux, no PMU, or
+		// perf_event_paranoid forbids it)
+		bool Open()
+		{
+#ifdef __linux__
+			Close();
+			const uint64_t nL1Read = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+			const pair<uint32_t, uint64_t> events[COUNTERS] = {
+				{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+				{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+				{ PERF_TYPE_HW_CACHE, nL1Read },
+				{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+				{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES } };
+
+			for (int i = 0; i < COUNTERS; i++)
+			{
+				perf_event_attr attr = {};
+				attr.size = sizeof(attr);
+				attr.type = events[i].first;
+				attr.config = events[i].second;
+				attr.disabled = i == 0 ? 1 : 0;	// The leader starts the group
+				attr.exclude_kernel = 1;
+				attr.exclude_hv = 1;
+				attr.read_format = PERF_FORMAT_GROUP;
+
+				nFd[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, i == 0 ? -1 : nFd[0], 0);
+				if (nFd[i] < 0)
+				{
+					Close();
+					return false;
+				}
+			}
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		void Close()
+		{
+#ifdef __linux__
+			for (int i = COUNTERS - 1; i >= 0; i--)
+				if (nFd[i] >= 0)
+				{
+					close(nFd[i]);
+					nFd[i] = -1;
+				}
+#endif
+		}
+
+		bool IsOpen() const
+		{
+			return nFd[0] >= 0;
+		}
+
+		void Start()
+		{
+#ifdef __linux__
+			if (!IsOpen()) return;
+			ioctl(nFd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+			ioctl(nFd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+		}
+
+		perf_sample Stop()
+		{
+			perf_sample s;
+#ifdef __linux__
+			if (!IsOpen()) return s;
+			ioctl(nFd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+			uint64_t nValues[1 + COUNTERS] = {};	// Count, then one value per event
+			if (read(nFd[0], nValues, sizeof(nValues)) != (ssize_t)sizeof(nValues) || nValues[0] != COUNTERS)
+				return s;
+
+			s.bValid = true;
+			s.nCycles = nValues[1];
+			s.nInstructions = nValues[2];
+			s.nL1Misses = nValues[3];
+			s.nLLCMisses = nValues[4];
+			s.nBranchMisses = nValues[5];
+#endif
+			return s;
+		}
+
+	private:
+		static const int COUNTERS = 5;
+		int nFd[COUNTERS] = { -1, -1, -1, -1, -1 };
+	};
+
+
+	struct bench_result
+	{
+		string sName;
+		uint64_t nSamples;
+		FTYPE fNanoseconds;
+		perf_sample counters;
+	};
+
+	// Error of a compact storage format against double
+	struct bench_quality
+	{
+		string sName;
+		size_t nBytes;		// Storage used
+		FTYPE dMaxError;
+		FTYPE dSNR;			// dB
+	};
+
+	// Engines packed onto the block scheduler
+	struct bench_packing
+	{
+		size_t nEngines;
+		unsigned int nWorkers;
+		FTYPE fUtilisation;		// Cores, as admitted
+		unsigned long long nBlocks;
+		unsigned long long nMissed;
+	};
+
+	struct bench_suite
+	{
+	public:
+		bench_suite(bool counters = false, unsigned int sampleRate = 44100)
+		{
+			nSampleRate = sampleRate;
+			bCounters = counters && perf.Open();
+		}
+
+		// Runs func once to warm up, then times nRepeats runs of it. func returns
+		// the number of samples it produced.
+		template<class F>
+		void Run(const string &sName, F func, int nRepeats = 5)
+		{
+			func();
+
+			bench_result r = { sName, 0, 0.0, {} };
+			perf_sample total;
+			for (int i = 0; i < nRepeats; i++)
+			{
+				if (bCounters) perf.Start();
+				auto t0 = chrono::steady_clock::now();
+				r.nSamples += func();
+				auto t1 = chrono::steady_clock::now();
+				perf_sample s = bCounters ? perf.Stop() : perf_sample();
+
+				r.fNanoseconds += chrono::duration<FTYPE, nano>(t1 - t0).count();
+				total.bValid = s.bValid;
+				total.nCycles += s.nCycles;
+				total.nInstructions += s.nInstructions;
+				total.nL1Misses += s.nL1Misses;
+				total.nLLCMisses += s.nLLCMisses;
+				total.nBranchMisses += s.nBranchMisses;
+			}
+			r.counters = total;
+			vecResults.push_back(r);
+		}
+
+		// Oscillators, envelope, instruments and the mix at a few voice counts
+		void RunAll()
+		{
+			const unsigned int nSamples = nSampleRate;
+			FTYPE dTimeStep = 1.0 / nSampleRate;
+			volatile FTYPE dSink = 0.0;
+
+			const pair<const char*, TYPE> oscs[] = { { "osc sine", OSC_SINE }, { "osc square", OSC_SQUARE },
+				{ "osc triangle", OSC_TRIANGLE }, { "osc saw analogue", OSC_SAW_ANA }, { "osc saw digital", OSC_SAW_DIG },
+				{ "osc noise", OSC_NOISE } };
+			for (auto &o : oscs)
+				Run(o.first, [&]() {
+					FTYPE d = 0.0;
+					for (unsigned int s = 0; s < nSamples; s++)
+						d += osc(s * dTimeStep, 440.0, o.second);
+					dSink = d;
+					return (uint64_t)nSamples; });
+
+			envelope_adsr env;
+			Run("envelope", [&]() {
+				FTYPE d = 0.0;
+				for (unsigned int s = 0; s < nSamples; s++)
+					d += synth::env(s * dTimeStep, env, 0.0, 0.5);
+				dSink = d;
+				return (uint64_t)nSamples; });
+
+			instrument_bell instBell;
+			instrument_bell8 instBell8;
+			instrument_harmonica instHarm;
+			instrument_drumkick instKick;
+			instrument_drumsnare instSnare;
+			instrument_drumhihat instHiHat;
+			instrument_granular instGranular;
+			instrument_wavetable instWavetable;
+			instrument_base *instruments[] = { &instBell, &instBell8, &instHarm, &instKick, &instSnare, &instHiHat, &instGranular, &instWavetable };
+
+			for (auto inst : instruments)
+			{
+				inst->Prepare(nSampleRate);
+				string sName = "sound " + string(inst->name.begin(), inst->name.end());
+				Run(sName, [&]() {
+					note n;
+					n.id = 64;
+					n.active = true;
+					n.channel = inst;
+					FTYPE d = 0.0;
+					bool bNoteFinished = false;
+					FTYPE dBlock[256];
+
+					// Through the block form where the instrument has one, as the engine does
+					for (unsigned int b = 0; b + 256 <= nSamples; b += 256)
+					{
+						for (auto &x : dBlock) x = 0.0;
+						if (!inst->SoundBlock(b * dTimeStep, dTimeStep, n, dBlock, 256, bNoteFinished))
+							for (unsigned int s = 0; s < 256; s++)
+								dBlock[s] = inst->sound((b + s) * dTimeStep, n, bNoteFinished);
+						d += dBlock[0] + dBlock[255];
+					}
+					dSink = d;
+					return (uint64_t)(nSamples / 256 * 256); });
+			}
+
+			// The mix cycles through all instruments, so the virtual call target
+			// changes from voice to voice as it does in a real arrangement
+			for (unsigned int nVoices : { 8u, 64u, 256u })
+			{
+				engine e(nSampleRate, 256);
+				for (auto inst : instruments)
+					e.AddInstrument(inst);
+				vector<FTYPE> vecBlock(e.nBlockSamples);
+
+				Run("mix " + to_string(nVoices) + " voices", [&]() {
+					e.vecNotes.clear();
+					e.dGlobalTime = 0.0;
+					for (unsigned int v = 0; v < nVoices; v++)
+					{
+						note n;
+						n.id = 40 + v % 48;
+						n.on = 0.0;
+						n.off = 10.0;
+						n.active = true;
+						n.channel = instruments[v % 8];
+						e.vecNotes.push_back(n);
+					}
+					unsigned int nBlocks = max(1u, nSamples / nVoices / e.nBlockSamples);
+					for (unsigned int b = 0; b < nBlocks; b++)
+						e.Render(vecBlock.data(), e.nBlockSamples);
+					return (uint64_t)nBlocks * e.nBlockSamples; });
+			}
+
+			RunStorage();
+			RunScheduler();
+		}
+
+		// Wavetable playback and a sample cache in double, half and bfloat16: the
+		// speed of each and the error of the compact ones against double
+		void RunStorage()
+		{
+			const pair<const char*, SAMPLE_FORMAT> formats[] = { { "double", FMT_DOUBLE }, { "half", FMT_HALF }, { "bfloat16", FMT_BFLOAT16 } };
+			vector<FTYPE> vecReference;
+
+			for (auto &f : formats)
+			{
+				instrument_wavetable inst;
+				inst.format = f.second;
+				inst.Prepare(nSampleRate);
+
+				engine e(nSampleRate, 256);
+				e.AddInstrument(&inst);
+				vector<FTYPE> vecOut(nSampleRate / 256 * 256);
+				Run(string("wavetable ") + f.first + " x16", [&]() {
+					e.vecNotes.clear();
+					e.dGlobalTime = 0.0;
+					for (int v = 0; v < 16; v++)
+					{
+						note n;
+						n.id = 30 + v * 4;
+						n.off = 10.0;
+						n.active = true;
+						n.channel = &inst;
+						e.vecNotes.push_back(n);
+					}
+					for (size_t b = 0; b < vecOut.size(); b += 256)
+						e.Render(vecOut.data() + b, 256);
+					return (uint64_t)vecOut.size() * 16; });
+
+				if (f.second == FMT_DOUBLE)
+					vecReference = vecOut;
+				else
+					Compare(string("wavetable ") + f.first, inst.mem.Usage().nCurrent[MEM_TABLES], vecReference, vecOut);
+			}
+
+			// A second of bell, stored and loaded back
+			instrument_bell instBell;
+			note n;
+			n.id = 64;
+			n.off = 0.5;
+			n.active = true;
+			n.channel = &instBell;
+			vector<FTYPE> vecBell(nSampleRate), vecLoaded(nSampleRate);
+			bool bNoteFinished = false;
+			for (unsigned int s = 0; s < nSampleRate; s++)
+				vecBell[s] = instBell.sound((FTYPE)s / nSampleRate, n, bNoteFinished);
+
+			memory_account acc;
+			sample_cache<int, half> cacheHalf(&acc);
+			sample_cache<int, bfloat16> cacheBfloat(&acc);
+			auto &bufHalf = cacheHalf.Insert(0, vecBell.data(), vecBell.size());
+			Run("cache load half", [&]() { cacheHalf.Load(bufHalf, 0, vecLoaded.data(), vecLoaded.size()); return (uint64_t)vecLoaded.size(); });
+			Compare("cache half", bufHalf.size() * sizeof(half), vecBell, vecLoaded);
+			auto &bufBfloat = cacheBfloat.Insert(0, vecBell.data(), vecBell.size());
+			Run("cache load bfloat16", [&]() { cacheBfloat.Load(bufBfloat, 0, vecLoaded.data(), vecLoaded.size()); return (uint64_t)vecLoaded.size(); });
+			Compare("cache bfloat16", bufBfloat.size() * sizeof(bfloat16), vecBell, vecLoaded);
+		}
+
+		// Engines of eight held harmonica voices, admitted until the scheduler
+		// refuses one, then played together for dSeconds
+		void RunScheduler(FTYPE dSeconds = 1.0, size_t nMaxEngines = 256)
+		{
+			struct hosted
+			{
+				instrument_harmonica inst;
+				engine e;
+
+				hosted(unsigned int nSampleRate) : e(nSampleRate, 256)
+				{
+					e.AddInstrument(&inst);
+					for (int v = 0; v < 8; v++)
+					{
+						note n;
+						n.id = 52 + v * 3;
+						n.active = true;
+						n.channel = &inst;
+						e.vecNotes.push_back(n);
+					}
+				}
+			};
+
+			// Every engine is alike, so one stand-in measures them all
+			block_scheduler scheduler;
+			hosted probe(nSampleRate);
+			vector<unique_ptr<hosted>> vecHosted;
+			while (vecHosted.size() < nMaxEngines)
+			{
+				auto h = make_unique<hosted>(nSampleRate);
+				if (!scheduler.Admit(&h->e, probe.e))
+					break;
+				vecHosted.push_back(move(h));
+			}
+
+			bench_packing p = { vecHosted.size(), scheduler.nWorkers, scheduler.GetUtilisation(), 0, 0 };
+			scheduler.Start();
+			this_thread::sleep_for(chrono::duration<FTYPE>(dSeconds));
+			scheduler.Stop();
+
+			for (auto &h : vecHosted)
+			{
+				block_scheduler::engine_stats s = scheduler.GetStats(&h->e);
+				p.nBlocks += s.nBlocks;
+				p.nMissed += s.nMissed;
+				scheduler.Remove(&h->e);
+			}
+			vecPacking.push_back(p);
+		}
+
+		void Compare(const string &sName, size_t nBytes, const vector<FTYPE> &vecReference, const vector<FTYPE> &vecTest)
+		{
+			FTYPE dSignal = 0.0, dNoise = 0.0, dMax = 0.0;
+			for (size_t i = 0; i < min(vecReference.size(), vecTest.size()); i++)
+			{
+				FTYPE d = vecTest[i] - vecReference[i];
+				dSignal += vecReference[i] * vecReference[i];
+				dNoise += d * d;
+				dMax = max(dMax, math::fabs(d));
+			}
+			FTYPE dSNR = dNoise > 0.0 ? 10.0 * log10(dSignal / dNoise) : INFINITY;
+			vecQuality.push_back({ sName, nBytes, dMax, dSNR });
+		}
+
+		void Print() const
+		{
+			printf("%-24s %10s", "benchmark", "ns/sample");
+			if (bCounters)
+				printf(" %8s %8s %10s %10s %10s", "IPC", "cyc/smp", "L1 miss/k", "LLC miss/k", "br miss/k");
+			printf("\n");
+
+			for (auto &r : vecResults)
+			{
+				printf("%-24s %10.2f", r.sName.c_str(), r.fNanoseconds / max<uint64_t>(1, r.nSamples));
+				if (bCounters && r.counters.bValid)
+				{
+					// Misses per thousand samples
+					FTYPE dPerK = 1000.0 / max<uint64_t>(1, r.nSamples);
+					printf(" %8.2f %8.1f %10.2f %10.2f %10.2f", r.counters.IPC(), (FTYPE)r.counters.nCycles / max<uint64_t>(1, r.nSamples),
+						r.counters.nL1Misses * dPerK, r.counters.nLLCMisses * dPerK, r.counters.nBranchMisses * dPerK);
+				}
+				printf("\n");
+			}
+
+			if (!bCounters)
+				printf("(hardware counters off or unavailable)\n");
+
+			if (!vecQuality.empty())
+			{
+				printf("\n%-24s %10s %12s %10s\n", "storage", "KB", "max error", "SNR dB");
+				for (auto &q : vecQuality)
+					printf("%-24s %10zu %12.3g %10.1f\n", q.sName.c_str(), q.nBytes / 1024, q.dMaxError, q.dSNR);
+			}
+
+			for (auto &p : vecPacking)
+				printf("\nscheduler: %zu engines on %u workers, %.2f cores admitted, %llu blocks, %llu late\n",
+					p.nEngines, p.nWorkers, p.fUtilisation, p.nBlocks, p.nMissed);
+		}
+
+	public:
+		unsigned int nSampleRate;
+		bool bCounters;
+		vector<bench_result> vecResults;
+		vector<bench_quality> vecQuality;
+		vector<bench_packing> vecPacking;
+
+	private:
+		perf_counters perf;
+	};
+
+}
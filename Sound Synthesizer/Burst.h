@@ -0,0 +1,227 @@
+#pragma once
+#include <chrono>
+
+#include "Engine.h"
+
+namespace synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Burst Rendering
+	//
+	// Race to idle for playback nobody is playing along to. Instead of rendering
+	// a block every few milliseconds, an engine renders seconds ahead into a deep
+	// ring as fast as it can, then its thread sleeps until the device has drained
+	// the ring down to the low watermark, so the CPU can stay in deep sleep in
+	// between. Notes for the engine have to be scheduled at least fDepth ahead.
+	// Live voices belong on a separate engine rendered block by block, mixed on
+	// top in the device callback.
+
+	struct burst_renderer
+	{
+	public:
+		struct stats
+		{
+			unsigned long long nBursts;
+			unsigned long long nUnderruns;	// Device blocks that ran dry
+			FTYPE fBusy;					// Fraction of wall time spent rendering
+		};
+
+		burst_renderer(engine &e, FTYPE depth = 2.0, FTYPE lowWater = 0.5)
+			: eng(e), vecRing(tracked_allocator<FTYPE, MEM_IO>(&e.mem))
+		{
+			// Whole blocks, so a block never wraps
+			size_t nBlocks = max((size_t)2, (size_t)(depth * e.nSampleRate / e.nBlockSamples));
+			vecRing.assign(nBlocks * e.nBlockSamples, 0.0);
+			vecStates.reserve(nBlocks);
+			for (size_t b = 0; b < nBlocks; b++)
+				vecStates.push_back({ 0.0, tracked_vector<note, MEM_VOICES>(tracked_allocator<note, MEM_VOICES>(&e.mem)) });
+			nLowWater = min(vecRing.size() - e.nBlockSamples, (size_t)(lowWater * e.nSampleRate));
+			fDepth = (FTYPE)vecRing.size() / e.nSampleRate;
+
+			nRead = 0;
+			nWrite = 0;
+			nDiscard = 0;
+			nDeficit = 0;
+			nBursts = 0;
+			nUnderruns = 0;
+			fBusySeconds = 0.0;
+			bRunning = false;
+		}
+
+		~burst_renderer()
+		{
+			Stop();
+		}
+
+		void Start()
+		{
+			if (bRunning) return;
+			bRunning = true;
+			tStarted = chrono::steady_clock::now();
+			thrBurst = thread(&burst_renderer::BurstThread, this);
+		}
+
+		void Stop()
+		{
+			{
+				unique_lock<mutex> lm(muxBurst);
+				bRunning = false;
+			}
+			cvBurst.notify_one();
+			if (thrBurst.joinable())
+				thrBurst.join();
+		}
+
+		// Device side, never blocks: adds the next nFrames of the stream to pOut.
+		// A dry ring plays silence, and the engine skips the same time so it stays
+		// in step with the device clock.
+		void Mix(FTYPE *pOut, unsigned int nFrames)
+		{
+			size_t r = max(nRead.load(memory_order_relaxed), nDiscard.load(memory_order_acquire));
+			size_t w = nWrite.load(memory_order_acquire);
+			size_t nAvailable = min((size_t)nFrames, w - r);
+
+			for (size_t s = 0; s < nAvailable; s++)
+				pOut[s] += vecRing[(r + s) % vecRing.size()];
+			nRead.store(r + nAvailable, memory_order_release);
+
+			if (nAvailable < nFrames)
+			{
+				nDeficit += nFrames - nAvailable;
+				nUnderruns++;
+				cvBurst.notify_one();
+			}
+		}
+
+		// Drops everything rendered ahead, so the engine picks up changes (a seek,
+		// new notes) from the current play position, to within a block. The clock
+		// goes back to that position and voices that finished since are restored
+		// from the block the device is in; notes added since stay. Flush before
+		// taking notes out, or they come back.
+		void Flush()
+		{
+			unique_lock<mutex> lm(muxBurst);
+			size_t w = nWrite.load(memory_order_relaxed);
+			size_t r = max(nRead.load(memory_order_acquire), nDiscard.load(memory_order_relaxed));
+			if (w > r)
+			{
+				// Its state is still held: the writer never gets a whole ring ahead
+				// of the device
+				size_t nBlockStart = r - r % eng.nBlockSamples;
+				const block_state &state = vecStates[(nBlockStart / eng.nBlockSamples) % vecStates.size()];
+
+				unique_lock<mutex> ln(eng.muxNotes);
+				for (auto &n : state.vecNotes)
+					if (find_if(eng.vecNotes.begin(), eng.vecNotes.end(), [&n](const note &m) {
+							return m.channel == n.channel && m.id == n.id && m.on == n.on; }) == eng.vecNotes.end())
+						eng.vecNotes.push_back(n);
+				eng.dGlobalTime = state.dTime + (FTYPE)(r - nBlockStart) / eng.nSampleRate;
+			}
+			nDiscard.store(w, memory_order_release);
+			lm.unlock();
+			cvBurst.notify_one();
+		}
+
+		stats GetStats()
+		{
+			unique_lock<mutex> lm(muxBurst);
+			FTYPE fWall = chrono::duration<FTYPE>(chrono::steady_clock::now() - tStarted).count();
+			return { nBursts, nUnderruns.load(), fWall > 0.0 ? fBusySeconds / fWall : 0.0 };
+		}
+
+	public:
+		FTYPE fDepth;		// Seconds rendered ahead when full
+
+	private:
+		// Still to be played
+		size_t Buffered() const
+		{
+			return nWrite.load(memory_order_relaxed) - max(nRead.load(memory_order_acquire), nDiscard.load(memory_order_relaxed));
+		}
+
+		// Free to write. Flushed samples stay reserved until the device has
+		// skipped them, it may still be reading one.
+		size_t Space() const
+		{
+			return vecRing.size() - (nWrite.load(memory_order_relaxed) - nRead.load(memory_order_acquire));
+		}
+
+		// The clock and voices as the block at stream position w starts, for Flush
+		void Snapshot(size_t w)
+		{
+			block_state &state = vecStates[(w / eng.nBlockSamples) % vecStates.size()];
+			unique_lock<mutex> ln(eng.muxNotes);
+			state.dTime = eng.dGlobalTime;
+			state.vecNotes.assign(eng.vecNotes.begin(), eng.vecNotes.end());
+		}
+
+		void BurstThread()
+		{
+			unique_lock<mutex> lm(muxBurst);
+			while (bRunning)
+			{
+				// Sleep until the ring would reach the low watermark
+				size_t nBuffered = Buffered();
+				if (nBuffered > nLowWater)
+				{
+					auto tDrained = chrono::duration<FTYPE>((FTYPE)(nBuffered - nLowWater) / eng.nSampleRate);
+					cvBurst.wait_for(lm, tDrained);
+					continue;
+				}
+
+				// Time the device already played through silence
+				eng.dGlobalTime += (FTYPE)nDeficit.exchange(0) / eng.nSampleRate;
+
+				// Fill it right up in one go
+				auto t0 = chrono::steady_clock::now();
+				size_t nStart = nWrite.load(memory_order_relaxed);
+				while (bRunning && Space() >= eng.nBlockSamples)
+				{
+					size_t w = nWrite.load(memory_order_relaxed);
+					Snapshot(w);
+					eng.Render(vecRing.data() + w % vecRing.size(), eng.nBlockSamples);
+					nWrite.store(w + eng.nBlockSamples, memory_order_release);
+
+					// Let a Flush in between blocks
+					lm.unlock();
+					lm.lock();
+				}
+				fBusySeconds += chrono::duration<FTYPE>(chrono::steady_clock::now() - t0).count();
+				nBursts++;
+
+				// Straight after a Flush, until the device moves past the old samples
+				if (nWrite.load(memory_order_relaxed) == nStart)
+					cvBurst.wait_for(lm, chrono::duration<FTYPE>((FTYPE)eng.nBlockSamples / eng.nSampleRate));
+			}
+		}
+
+	private:
+		struct block_state
+		{
+			FTYPE dTime;
+			tracked_vector<note, MEM_VOICES> vecNotes;
+		};
+
+		engine &eng;
+		tracked_vector<FTYPE, MEM_IO> vecRing;
+		vector<block_state> vecStates;	// One per block of the ring
+		size_t nLowWater;
+
+		// Stream positions in samples, only ever increasing
+		atomic<size_t> nRead;		// Device side
+		atomic<size_t> nWrite;		// Burst thread
+		atomic<size_t> nDiscard;	// Everything before this was flushed
+		atomic<size_t> nDeficit;	// Played as silence, not yet skipped by the engine
+
+		unsigned long long nBursts;
+		atomic<unsigned long long> nUnderruns;
+		FTYPE fBusySeconds;
+		chrono::steady_clock::time_point tStarted;
+
+		thread thrBurst;
+		mutex muxBurst;
+		condition_variable cvBurst;
+		atomic<bool> bRunning;
+	};
+
+}
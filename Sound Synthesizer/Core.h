@@ -2,6 +2,8 @@
 #define FTYPE double
 
 #include "Noise.h"
+#include "Memory.h"
+#include "Math.h"
 
 namespace synth
 {
@@ -16,22 +18,29 @@ namespace synth
 
 	struct instrument_base;
 
+	// note::off of a note not yet released. Any time, 0 included, is a release.
+	const FTYPE NOTE_HELD = -1.0;
+
 	// A basic note
 	struct note
 	{
 		int id;		// Position in scale
 		FTYPE on;	// Time note was activated
-		FTYPE off;	// Time note was deactivated
+		FTYPE off;	// Time note was deactivated, NOTE_HELD until then
 		bool active;
 		instrument_base *channel;
+		FTYPE azimuth;	// Direction in radians for spatial output, 0 is front
+		FTYPE velocity;	// 0 to 1, a modulation source
 
 		note()
 		{
 			id = 0;
 			on = 0.0;
-			off = 0.0;
+			off = NOTE_HELD;
 			active = false;
 			channel = nullptr;
+			azimuth = 0.0;
+			velocity = 1.0;
 		}
 
 		//bool operator==(const note& n1, const note& n2) { return n1.id == n2.id; }
@@ -53,32 +62,32 @@ namespace synth
 		const FTYPE dLFOHertz = 0.0, const FTYPE dLFOAmplitude = 0.0, FTYPE dCustom = 50.0)
 	{
 
-		FTYPE dFreq = w(dHertz) * dTime + dLFOAmplitude * dHertz * (sin(w(dLFOHertz) * dTime));
+		FTYPE dFreq = w(dHertz) * dTime + dLFOAmplitude * dHertz * (math::sin(w(dLFOHertz) * dTime));
 
 		switch (t)
 		{
 		case OSC_SINE: // Sine wave bewteen -1 and +1
-			return sin(dFreq);
+			return math::sin(dFreq);
 
 		case OSC_SQUARE: // Square wave between -1 and +1
-			return sin(dFreq) > 0 ? 1.0 : -1.0;
+			return math::sin(dFreq) > 0 ? 1.0 : -1.0;
 
 		case OSC_TRIANGLE: // Triangle wave between -1 and +1
-			return asin(sin(dFreq)) * (2.0 / PI);
+			return math::triangle(dFreq);
 
 		case OSC_SAW_ANA: // Saw wave (analogue / warm / slow)
 		{
 			FTYPE dOutput = 0.0;
 			for (FTYPE n = 1.0; n < dCustom; n++)
-				dOutput += (sin(n*dFreq)) / n;
+				dOutput += (math::sin(n*dFreq)) / n;
 			return dOutput * (2.0 / PI);
 		}
 
 		case OSC_SAW_DIG:
-			return (2.0 / PI) * (dHertz * PI * fmod(dTime, 1.0 / dHertz) - (PI / 2.0));
+			return (2.0 / PI) * (dHertz * PI * math::fmod(dTime, 1.0 / dHertz) - (PI / 2.0));
 
 		case OSC_NOISE:
-			return 2.0 * ((FTYPE)rand() / (FTYPE)RAND_MAX) - 1.0;
+			return math::noise();
 
 		default:
 			return 0.0;
@@ -95,7 +104,7 @@ namespace synth
 		switch (nScaleID)
 		{
 		case SCALE_DEFAULT: default:
-			return 8 * pow(1.0594630943592952645618252949463, nNoteID);
+			return 8 * math::semitones(nNoteID);
 		}
 	}
 
@@ -130,12 +139,12 @@ namespace synth
 			FTYPE dAmplitude = 0.0;
 			FTYPE dReleaseAmplitude = 0.0;
 
-			if (dTimeOn > dTimeOff) // Note is on
+			if (dTimeOn > dTimeOff || dTime < dTimeOff) // Note is on, or its release is scheduled later
 			{
 				FTYPE dLifeTime = dTime - dTimeOn;
 
 				if (dLifeTime <= dAttackTime)
-					dAmplitude = (dLifeTime / dAttackTime) * dStartAmplitude;
+					dAmplitude = dAttackTime > 0.0 ? (dLifeTime / dAttackTime) * dStartAmplitude : dStartAmplitude;
 
 				if (dLifeTime > dAttackTime && dLifeTime <= (dAttackTime + dDecayTime))
 					dAmplitude = ((dLifeTime - dAttackTime) / dDecayTime) * (dSustainAmplitude - dStartAmplitude) + dStartAmplitude;
@@ -148,7 +157,7 @@ namespace synth
 				FTYPE dLifeTime = dTimeOff - dTimeOn;
 
 				if (dLifeTime <= dAttackTime)
-					dReleaseAmplitude = (dLifeTime / dAttackTime) * dStartAmplitude;
+					dReleaseAmplitude = dAttackTime > 0.0 ? (dLifeTime / dAttackTime) * dStartAmplitude : dStartAmplitude;
 
 				if (dLifeTime > dAttackTime && dLifeTime <= (dAttackTime + dDecayTime))
 					dReleaseAmplitude = ((dLifeTime - dAttackTime) / dDecayTime) * (dSustainAmplitude - dStartAmplitude) + dStartAmplitude;
@@ -156,7 +165,8 @@ namespace synth
 				if (dLifeTime > (dAttackTime + dDecayTime))
 					dReleaseAmplitude = dSustainAmplitude;
 
-				dAmplitude = ((dTime - dTimeOff) / dReleaseTime) * (0.0 - dReleaseAmplitude) + dReleaseAmplitude;
+				if (dReleaseTime > 0.0)
+					dAmplitude = ((dTime - dTimeOff) / dReleaseTime) * (0.0 - dReleaseAmplitude) + dReleaseAmplitude;
 			}
 
 			// Amplitude should not be negative
@@ -173,13 +183,113 @@ namespace synth
 	}
 
 
+	// One block of live input, sample-aligned with the block being rendered:
+	// pSamples[s] was captured as output sample dStart + s * dStep was played
+	struct input_block
+	{
+		const FTYPE *pSamples = nullptr;
+		unsigned int nSamples = 0;
+		FTYPE dStart = 0.0;
+		FTYPE dStep = 0.0;
+
+		// Input at dTime, silence outside the block
+		FTYPE At(const FTYPE dTime) const
+		{
+			if (pSamples == nullptr || dStep <= 0.0)
+				return 0.0;
+			long long s = math::round_to_int((dTime - dStart) / dStep);
+			return (s >= 0 && s < (long long)nSamples) ? pSamples[s] : 0.0;
+		}
+	};
+
+
 	struct instrument_base
 	{
 		FTYPE dVolume;
 		synth::envelope_adsr env;
 		FTYPE fMaxLifeTime;
 		wstring name;
+		memory_account mem;	// Tables and caches owned by this instrument
+		FTYPE fDetail = 1.0;	// Fraction of full harmonic counts, lowered for draft renders
+		const input_block *pInput = nullptr;	// Set by the engine, live input for the current block
+
+		virtual ~instrument_base() {}
 		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished) = 0;
+
+		// Builds anything sound() would otherwise build on first use
+		virtual void Prepare(unsigned int nSampleRate) {}
+
+		// Block form of sound() for instruments that render a run of samples more
+		// cheaply than one call per sample. Adds nSamples, the first at dTime, into
+		// pOut. Returns false if not implemented, and the engine calls sound().
+		virtual bool SoundBlock(const FTYPE dTime, const FTYPE dTimeStep, const synth::note &n, FTYPE *pOut, unsigned int nSamples, bool &bNoteFinished) { return false; }
+
+		// Called by the engine once per block, before SoundBlock for any of this
+		// instrument's voices, to render sources they all share
+		virtual void SharedBlock(const FTYPE dTime, const FTYPE dTimeStep, unsigned int nSamples) {}
+
+		// Instruments that render all their voices in one call set bBlockVoices,
+		// and after SharedBlock the engine passes them every voice of theirs
+		// sounding in the block
+		bool bBlockVoices = false;
+		virtual void VoiceBlock(const FTYPE dTime, const FTYPE dTimeStep, unsigned int nSamples, const synth::note *const *ppVoices, size_t nVoices) {}
+
+		// Instruments that track the live input set bFollowsInput, and while the
+		// engine has an input they get SharedBlock every block, sounding or not,
+		// so what they follow is current when a note starts
+		bool bFollowsInput = false;
+
+		// Direction of a voice at dTime for spatial output, for instruments that
+		// move their voices around
+		virtual FTYPE Azimuth(const FTYPE dTime, const synth::note &n) { return n.azimuth; }
+
+		// True once the voice is silent for good at dTime, from its times alone,
+		// so it can be tracked without rendering it. May answer later than the
+		// voice actually stops, never earlier.
+		virtual bool Finished(const FTYPE dTime, const synth::note &n) const
+		{
+			if (fMaxLifeTime > 0.0 && dTime - n.on >= fMaxLifeTime)
+				return true;
+			return n.off >= n.on && dTime >= n.off + env.dReleaseTime;
+		}
+	};
+
+
+	// Phase-insensitive sources (noise, metallic clusters, free running LFOs)
+	// rendered once per block and read by every voice of an instrument, so
+	// overlapping hits cost one source plus an envelope each. The block is the
+	// engine's, started by SharedBlock. A run of a voice outside it (rendered
+	// away from the engine) makes its own noise through sound() rather than
+	// restarting the block that other voices have already read.
+	struct shared_sources
+	{
+		FTYPE dStart = 0.0;
+		FTYPE dStep = 0.0;
+		unsigned int nSamples = 0;
+		unsigned long long nBlock = 0;	// Changes with every block
+		vector<FTYPE> vecNoise;
+
+		void Begin(const FTYPE dTime, const FTYPE dTimeStep, unsigned int n)
+		{
+			dStart = dTime;
+			dStep = dTimeStep;
+			nSamples = n;
+			nBlock++;
+			vecNoise.resize(n);
+			for (unsigned int s = 0; s < n; s++)
+				vecNoise[s] = math::noise();
+		}
+
+		// Where a run of a voice starts in the block, false if it doesn't fit in it
+		bool Offset(const FTYPE dTime, const FTYPE dTimeStep, unsigned int n, unsigned int &nOffset) const
+		{
+			FTYPE dOffset = dStep > 0.0 ? (dTime - dStart) / dStep : -1.0;
+			long long nFound = math::round_to_int(dOffset);
+			if (dTimeStep != dStep || nFound < 0 || nFound + n > nSamples || math::fabs(dOffset - nFound) > 0.01)
+				return false;
+			nOffset = (unsigned int)nFound;
+			return true;
+		}
 	};
 
 	struct instrument_bell : public instrument_base
@@ -198,7 +308,7 @@ namespace synth
 		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished)
 		{
 			FTYPE dAmplitude = synth::env(dTime, env, n.on, n.off);
-			if (dAmplitude <= 0.0) bNoteFinished = true;
+			if (dAmplitude <= 0.0 && dTime - n.on > env.dAttackTime) bNoteFinished = true;
 
 			FTYPE dSound =
 				+1.00 * synth::osc(dTime - n.on, synth::scale(n.id + 12), synth::OSC_SINE, 5.0, 0.001)
@@ -226,7 +336,7 @@ namespace synth
 		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished)
 		{
 			FTYPE dAmplitude = synth::env(dTime, env, n.on, n.off);
-			if (dAmplitude <= 0.0) bNoteFinished = true;
+			if (dAmplitude <= 0.0 && dTime - n.on > env.dAttackTime) bNoteFinished = true;
 
 			FTYPE dSound =
 				+1.00 * synth::osc(dTime - n.on, synth::scale(n.id), synth::OSC_SQUARE, 5.0, 0.001)
@@ -254,10 +364,10 @@ namespace synth
 		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished)
 		{
 			FTYPE dAmplitude = synth::env(dTime, env, n.on, n.off);
-			if (dAmplitude <= 0.0) bNoteFinished = true;
+			if (dAmplitude <= 0.0 && dTime - n.on > env.dAttackTime) bNoteFinished = true;
 
 			FTYPE dSound =
-				+1.0  * synth::osc(n.on - dTime, synth::scale(n.id - 12), synth::OSC_SAW_ANA, 5.0, 0.001, 100)
+				+1.0  * synth::osc(n.on - dTime, synth::scale(n.id - 12), synth::OSC_SAW_ANA, 5.0, 0.001, max(2.0, 100 * fDetail))
 				+ 1.00 * synth::osc(dTime - n.on, synth::scale(n.id), synth::OSC_SQUARE, 5.0, 0.001)
 				+ 0.50 * synth::osc(dTime - n.on, synth::scale(n.id + 12), synth::OSC_SQUARE)
 				+ 0.05  * synth::osc(dTime - n.on, synth::scale(n.id + 24), synth::OSC_NOISE);
@@ -293,6 +403,32 @@ namespace synth
 			return dAmplitude * dSound * dVolume;
 		}
 
+		virtual void SharedBlock(const FTYPE dTime, const FTYPE dTimeStep, unsigned int nSamples)
+		{
+			shared.Begin(dTime, dTimeStep, nSamples);
+		}
+
+		// The body follows the hit, the noise is shared
+		virtual bool SoundBlock(const FTYPE dTime, const FTYPE dTimeStep, const synth::note &n, FTYPE *pOut, unsigned int nSamples, bool &bNoteFinished)
+		{
+			unsigned int nOffset;
+			if (!shared.Offset(dTime, dTimeStep, nSamples, nOffset))
+				return false;
+			const FTYPE *pNoise = shared.vecNoise.data() + nOffset;
+			for (unsigned int s = 0; s < nSamples && !bNoteFinished; s++)
+			{
+				FTYPE t = dTime + s * dTimeStep;
+				FTYPE dAmplitude = synth::env(t, env, n.on, n.off);
+				if (fMaxLifeTime > 0.0 && t - n.on >= fMaxLifeTime) bNoteFinished = true;
+
+				FTYPE dSound = 0.99 * synth::osc(t - n.on, synth::scale(n.id - 36), synth::OSC_SINE, 1.0, 1.0) + 0.01 * pNoise[s];
+				pOut[s] += dAmplitude * dSound * dVolume;
+			}
+			return true;
+		}
+
+	private:
+		shared_sources shared;
 	};
 
 	struct instrument_drumsnare : public instrument_base
@@ -320,6 +456,32 @@ namespace synth
 			return dAmplitude * dSound * dVolume;
 		}
 
+		virtual void SharedBlock(const FTYPE dTime, const FTYPE dTimeStep, unsigned int nSamples)
+		{
+			shared.Begin(dTime, dTimeStep, nSamples);
+		}
+
+		// The tone follows the hit, the noise is shared
+		virtual bool SoundBlock(const FTYPE dTime, const FTYPE dTimeStep, const synth::note &n, FTYPE *pOut, unsigned int nSamples, bool &bNoteFinished)
+		{
+			unsigned int nOffset;
+			if (!shared.Offset(dTime, dTimeStep, nSamples, nOffset))
+				return false;
+			const FTYPE *pNoise = shared.vecNoise.data() + nOffset;
+			for (unsigned int s = 0; s < nSamples && !bNoteFinished; s++)
+			{
+				FTYPE t = dTime + s * dTimeStep;
+				FTYPE dAmplitude = synth::env(t, env, n.on, n.off);
+				if (fMaxLifeTime > 0.0 && t - n.on >= fMaxLifeTime) bNoteFinished = true;
+
+				FTYPE dSound = 0.5 * synth::osc(t - n.on, synth::scale(n.id - 24), synth::OSC_SINE, 0.5, 1.0) + 0.5 * pNoise[s];
+				pOut[s] += dAmplitude * dSound * dVolume;
+			}
+			return true;
+		}
+
+	private:
+		shared_sources shared;
 	};
 
 
@@ -348,6 +510,72 @@ namespace synth
 			return dAmplitude * dSound * dVolume;
 		}
 
+		// Clusters no voice read in the last block are freed for other ids, so
+		// there are only ever as many as ids sounding at once
+		virtual void SharedBlock(const FTYPE dTime, const FTYPE dTimeStep, unsigned int nSamples)
+		{
+			shared.Begin(dTime, dTimeStep, nSamples);
+			for (auto &c : vecClusters)
+				if (c.nBlock + 1 < shared.nBlock)
+					c.bFree = true;
+		}
+
+		// Noise and the metallic square are both shared, the square free running
+		// rather than restarted by each hit
+		virtual bool SoundBlock(const FTYPE dTime, const FTYPE dTimeStep, const synth::note &n, FTYPE *pOut, unsigned int nSamples, bool &bNoteFinished)
+		{
+			unsigned int nOffset;
+			if (!shared.Offset(dTime, dTimeStep, nSamples, nOffset))
+				return false;
+			const FTYPE *pNoise = shared.vecNoise.data() + nOffset;
+			const FTYPE *pSquare = Cluster(n.id) + nOffset;
+			for (unsigned int s = 0; s < nSamples && !bNoteFinished; s++)
+			{
+				FTYPE t = dTime + s * dTimeStep;
+				FTYPE dAmplitude = synth::env(t, env, n.on, n.off);
+				if (fMaxLifeTime > 0.0 && t - n.on >= fMaxLifeTime) bNoteFinished = true;
+
+				pOut[s] += dAmplitude * (0.1 * pSquare[s] + 0.9 * pNoise[s]) * dVolume;
+			}
+			return true;
+		}
+
+	private:
+		// Square for one note id over the whole shared block, built by the first
+		// voice to need it
+		const FTYPE* Cluster(int nId)
+		{
+			auto c = find_if(vecClusters.begin(), vecClusters.end(), [nId](const cluster &x) { return !x.bFree && x.nId == nId; });
+			if (c == vecClusters.end())
+				c = find_if(vecClusters.begin(), vecClusters.end(), [](const cluster &x) { return x.bFree; });
+			if (c == vecClusters.end())
+			{
+				vecClusters.push_back({ nId, 0, false, {} });
+				c = vecClusters.end() - 1;
+			}
+			else if (c->bFree)
+				*c = { nId, 0, false, move(c->vecWave) };
+
+			if (c->nBlock != shared.nBlock)
+			{
+				c->nBlock = shared.nBlock;
+				c->vecWave.resize(shared.nSamples);
+				for (unsigned int s = 0; s < shared.nSamples; s++)
+					c->vecWave[s] = synth::osc(shared.dStart + s * shared.dStep, synth::scale(nId - 12), synth::OSC_SQUARE, 1.5, 1);
+			}
+			return c->vecWave.data();
+		}
+
+		struct cluster
+		{
+			int nId;
+			unsigned long long nBlock;
+			bool bFree;
+			vector<FTYPE> vecWave;
+		};
+
+		shared_sources shared;
+		vector<cluster> vecClusters;
 	};
 
 
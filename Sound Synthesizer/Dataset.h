@@ -0,0 +1,283 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+
+#include "Engine.h"
+
+namespace synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Dataset Shards
+	//
+	// Renders large numbers of short randomized clips into a few big files rather
+	// than one file per clip. Every worker thread appends 16-bit PCM to its own
+	// shard (<prefix>_<worker>_<n>.pcm) through a large buffer, and writes the
+	// matching index (.idx) of offsets and clip parameters when the shard closes.
+
+	// What to generate. Every clip's parameters come from (nSeed, clip number)
+	// alone, so any clip can be regenerated without rendering the others.
+	struct dataset_spec
+	{
+		uint64_t nClips = 1000;
+		uint64_t nSeed = 1;
+		unsigned int nSampleRate = 22050;
+		FTYPE fMinLength = 1.0;			// Clip length, seconds
+		FTYPE fMaxLength = 4.0;
+		int nMinNote = 40;				// scale() ids
+		int nMaxNote = 90;
+		int nMaxNotes = 4;				// Notes per clip
+		FTYPE fMinVolume = 0.3;
+		FTYPE fMaxVolume = 1.0;
+		FTYPE fMaxAttack = 0.1;
+		FTYPE fMaxDecay = 0.5;
+		FTYPE fMaxRelease = 0.5;
+		uint64_t nShardBytes = 1ull << 30;	// Start a new shard after this much PCM
+		size_t nWriteBuffer = 8 << 20;		// Bytes buffered per write
+		unsigned int nWorkers = thread::hardware_concurrency();
+		wstring sPrefix = L"dataset";
+	};
+
+	struct shard_header
+	{
+		char magic[4];			// "CSHD" for PCM shards, "CSIX" for indices
+		uint32_t nVersion;
+		uint32_t nSampleRate;
+		uint32_t nCount;		// Clips in the shard (index only)
+	};
+
+	// One index record per clip
+	struct shard_clip
+	{
+		uint64_t nClip;			// Clip number within the dataset
+		uint64_t nOffset;		// Byte offset of the clip's PCM in the shard
+		uint32_t nSamples;
+		uint16_t nInstrument;	// Index into dataset_instruments()
+		uint16_t nNotes;
+		int16_t nNoteId[4];		// First notes of the clip
+		float fNoteOn[4];		// Their start times, seconds
+		float fNoteLength;
+		float fVolume;
+		float fAttack;
+		float fDecay;
+		float fSustain;
+		float fRelease;
+	};
+
+	static_assert(sizeof(shard_header) == 16, "shard_header layout");
+	static_assert(sizeof(shard_clip) == 72, "shard_clip layout");
+
+	// Instruments the generator picks from, in index order
+	vector<unique_ptr<instrument_base>> dataset_instruments()
+	{
+		vector<unique_ptr<instrument_base>> vec;
+		vec.emplace_back(new instrument_bell());
+		vec.emplace_back(new instrument_bell8());
+		vec.emplace_back(new instrument_harmonica());
+		vec.emplace_back(new instrument_drumkick());
+		vec.emplace_back(new instrument_drumsnare());
+		vec.emplace_back(new instrument_drumhihat());
+		return vec;
+	}
+
+	// Draws the parameters of one clip from the spec
+	shard_clip dataset_clip(const dataset_spec &spec, uint64_t nClip, size_t nInstruments)
+	{
+		// splitmix64 of (seed, clip) so neighbouring clips get unrelated streams
+		uint64_t z = spec.nSeed * 0x9E3779B97F4A7C15ull + nClip + 1;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		math::random rng(z ^ (z >> 31));
+		auto uni = [&rng]() { return rng.uniform(); };
+
+		shard_clip c = {};
+		c.nClip = nClip;
+		FTYPE fLength = spec.fMinLength + uni() * (spec.fMaxLength - spec.fMinLength);
+		c.nSamples = (uint32_t)(fLength * spec.nSampleRate);
+		c.nInstrument = (uint16_t)(rng.next() % nInstruments);
+		c.nNotes = (uint16_t)(1 + rng.next() % max(1, min(spec.nMaxNotes, 4)));
+		c.fNoteLength = (float)(0.1 + uni() * fLength * 0.5);
+		for (int n = 0; n < c.nNotes; n++)
+		{
+			c.nNoteId[n] = (int16_t)(spec.nMinNote + rng.next() % max(1, spec.nMaxNote - spec.nMinNote + 1));
+			c.fNoteOn[n] = (float)(uni() * fLength * 0.5);
+		}
+		c.fVolume = (float)(spec.fMinVolume + uni() * (spec.fMaxVolume - spec.fMinVolume));
+		c.fAttack = (float)(uni() * spec.fMaxAttack);
+		c.fDecay = (float)(0.01 + uni() * spec.fMaxDecay);
+		c.fSustain = (float)uni();
+		c.fRelease = (float)(0.01 + uni() * spec.fMaxRelease);
+		return c;
+	}
+
+
+	struct dataset_renderer
+	{
+	public:
+		dataset_renderer(const dataset_spec &s) : spec(s)
+		{
+			nNextClip = 0;
+			nClipsDone = 0;
+			nSamplesDone = 0;
+			bFailed = false;
+		}
+
+		// Renders the whole dataset on spec.nWorkers threads. Returns false if any
+		// shard could not be written.
+		bool Run()
+		{
+			auto t0 = chrono::steady_clock::now();
+
+			vector<thread> vecWorkers;
+			for (unsigned int w = 0; w < max(1u, spec.nWorkers); w++)
+				vecWorkers.push_back(thread(&dataset_renderer::WorkerThread, this, w));
+			for (auto &t : vecWorkers)
+				t.join();
+
+			fSeconds = chrono::duration<FTYPE>(chrono::steady_clock::now() - t0).count();
+			return !bFailed;
+		}
+
+		// Audio seconds rendered per wall clock second
+		FTYPE RealtimeFactor() const
+		{
+			return fSeconds > 0.0 ? ((FTYPE)nSamplesDone / spec.nSampleRate) / fSeconds : 0.0;
+		}
+
+	public:
+		const dataset_spec &spec;
+		atomic<uint64_t> nClipsDone;
+		atomic<uint64_t> nSamplesDone;
+		FTYPE fSeconds = 0.0;
+
+	private:
+		struct shard_writer
+		{
+			bool Open(const wstring &sPath, const dataset_spec &spec)
+			{
+				sIndexPath = filesystem::path(sPath).replace_extension(L".idx").wstring();
+				file.open(filesystem::path(sPath), ios::binary);
+				if (!file.is_open())
+					return false;
+
+				shard_header h = { { 'C', 'S', 'H', 'D' }, 1, spec.nSampleRate, 0 };
+				vecBuffer.reserve(spec.nWriteBuffer);
+				vecIndex.clear();
+				Append(&h, sizeof(h));
+				return true;
+			}
+
+			void Append(const void *pData, size_t nBytes)
+			{
+				if (vecBuffer.size() + nBytes > vecBuffer.capacity())
+					Flush();
+				if (nBytes >= vecBuffer.capacity())
+					file.write((const char*)pData, nBytes);
+				else
+					vecBuffer.insert(vecBuffer.end(), (const char*)pData, (const char*)pData + nBytes);
+				nBytesWritten += nBytes;
+			}
+
+			void Flush()
+			{
+				file.write(vecBuffer.data(), vecBuffer.size());
+				vecBuffer.clear();
+			}
+
+			bool Close(const dataset_spec &spec)
+			{
+				Flush();
+				bool bOk = file.good();
+				file.close();
+
+				ofstream idx(filesystem::path(sIndexPath), ios::binary);
+				shard_header h = { { 'C', 'S', 'I', 'X' }, 1, spec.nSampleRate, (uint32_t)vecIndex.size() };
+				idx.write((const char*)&h, sizeof(h));
+				idx.write((const char*)vecIndex.data(), vecIndex.size() * sizeof(shard_clip));
+				nBytesWritten = 0;
+				return bOk && idx.good();
+			}
+
+			ofstream file;
+			wstring sIndexPath;
+			vector<char> vecBuffer;
+			vector<shard_clip> vecIndex;
+			uint64_t nBytesWritten = 0;
+		};
+
+		void WorkerThread(unsigned int nWorker)
+		{
+			auto vecInstruments = dataset_instruments();
+			engine e(spec.nSampleRate, 1024);
+			vector<FTYPE> vecMix;
+			vector<int16_t> vecPCM;
+
+			shard_writer shard;
+			int nShard = 0;
+			bool bOpen = false;
+
+			while (!bFailed)
+			{
+				uint64_t nClip = nNextClip++;
+				if (nClip >= spec.nClips)
+					break;
+
+				if (!bOpen)
+				{
+					wstring sPath = spec.sPrefix + L"_" + to_wstring(nWorker) + L"_" + to_wstring(nShard++) + L".pcm";
+					if (!shard.Open(sPath, spec)) { bFailed = true; break; }
+					bOpen = true;
+				}
+
+				// Set the instrument up for this clip and schedule its notes
+				shard_clip c = dataset_clip(spec, nClip, vecInstruments.size());
+				math::noise_source() = math::random((spec.nSeed + 1) * 0x9E3779B97F4A7C15ull ^ nClip);
+				instrument_base *inst = vecInstruments[c.nInstrument].get();
+				inst->dVolume = c.fVolume;
+				inst->env.dAttackTime = c.fAttack;
+				inst->env.dDecayTime = c.fDecay;
+				inst->env.dSustainAmplitude = c.fSustain;
+				inst->env.dReleaseTime = c.fRelease;
+
+				e.vecNotes.clear();
+				e.dGlobalTime = 0.0;
+				for (int n = 0; n < c.nNotes; n++)
+				{
+					note nt;
+					nt.id = c.nNoteId[n];
+					nt.on = c.fNoteOn[n];
+					nt.off = nt.on + c.fNoteLength;
+					nt.active = true;
+					nt.channel = inst;
+					e.vecNotes.push_back(nt);
+				}
+
+				vecMix.resize(c.nSamples);
+				vecPCM.resize(c.nSamples);
+				e.Render(vecMix.data(), c.nSamples);
+				for (uint32_t s = 0; s < c.nSamples; s++)
+					vecPCM[s] = (int16_t)(max(-1.0, min(1.0, vecMix[s])) * 32767.0);
+
+				c.nOffset = shard.nBytesWritten;
+				shard.Append(vecPCM.data(), vecPCM.size() * sizeof(int16_t));
+				shard.vecIndex.push_back(c);
+
+				nClipsDone++;
+				nSamplesDone += c.nSamples;
+
+				if (shard.nBytesWritten >= spec.nShardBytes)
+				{
+					if (!shard.Close(spec)) bFailed = true;
+					bOpen = false;
+				}
+			}
+
+			if (bOpen && !shard.Close(spec))
+				bFailed = true;
+		}
+
+	private:
+		atomic<uint64_t> nNextClip;
+		atomic<bool> bFailed;
+	};
+
+}
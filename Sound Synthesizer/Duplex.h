@@ -0,0 +1,490 @@
+#pragma once
+#include "Core.h"
+
+namespace synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Duplex Input
+	//
+	// Live input (a mic, a line in, a file standing in for one) captured in
+	// blocks and handed to the engine one output block at a time, so instruments
+	// can follow or process it. The capture side writes into a ring of two
+	// blocks and the render side reads exactly one output block from it, so
+	// input never waits behind more than a block. Both sides count in samples:
+	// input that arrives late is played as silence and skipped when it turns up,
+	// input that finds the ring full is dropped and played as silence in its
+	// place, so later input stays aligned with the output clock either way.
+
+	struct input_ring
+	{
+	public:
+		struct stats
+		{
+			unsigned long long nUnderruns;	// Output blocks the input was late for
+			unsigned long long nOverruns;	// Capture blocks that found the ring full
+		};
+
+		input_ring(memory_account *account = nullptr) : vecRing(tracked_allocator<FTYPE, MEM_IO>(account))
+		{
+			Reset(256);
+		}
+
+		// Not while either side is running
+		void Reset(unsigned int blockSamples)
+		{
+			vecRing.assign(2 * (size_t)blockSamples, 0.0);
+			nRead = 0;
+			nWrite = 0;
+			nLost = 0;
+			nLostAt = 0;
+			nOwed = 0;
+			nUnderruns = 0;
+			nOverruns = 0;
+		}
+
+		// Capture side, never blocks
+		void Write(const FTYPE *pIn, unsigned int nSamples)
+		{
+			size_t w = nWrite.load(memory_order_relaxed);
+			size_t nSpace = vecRing.size() - (w - nRead.load(memory_order_acquire));
+			size_t nCopy = min((size_t)nSamples, nSpace);
+
+			for (size_t s = 0; s < nCopy; s++)
+				vecRing[(w + s) % vecRing.size()] = pIn[s];
+			nWrite.store(w + nCopy, memory_order_release);
+
+			// Where the gap goes. Further drops before the render side reaches it
+			// are added to the same gap, up to a block: input that keeps running
+			// ahead (a faster clock) is skipped rather than delayed further.
+			if (nCopy < nSamples)
+			{
+				size_t nGap = nLost.load(memory_order_acquire);
+				if (nGap == 0)
+					nLostAt.store(w + nCopy, memory_order_relaxed);
+				size_t nMaxGap = vecRing.size() / 2;
+				if (nGap < nMaxGap)
+					nLost.fetch_add(min(nSamples - nCopy, nMaxGap - nGap), memory_order_release);
+				nOverruns++;
+			}
+		}
+
+		// Render side, never blocks: fills pOut with the next nSamples of input
+		void Read(FTYPE *pOut, unsigned int nSamples)
+		{
+			size_t r = nRead.load(memory_order_relaxed);
+			size_t w = nWrite.load(memory_order_acquire);
+
+			// Already played as silence
+			size_t nSkip = min(nOwed, w - r);
+			r += nSkip;
+			nOwed -= nSkip;
+
+			unsigned int s = 0;
+			while (s < nSamples)
+			{
+				size_t nEnd = w;
+				size_t nGap = nLost.load(memory_order_acquire);
+				if (nGap > 0)
+				{
+					size_t nAt = nLostAt.load(memory_order_relaxed);
+					if (nAt <= r)
+					{
+						size_t nSilence = min(nGap, (size_t)(nSamples - s));
+						for (size_t i = 0; i < nSilence; i++)
+							pOut[s++] = 0.0;
+						nLost.fetch_sub(nSilence, memory_order_relaxed);
+						continue;
+					}
+					nEnd = min(nEnd, nAt);
+				}
+
+				size_t nCopy = min((size_t)(nSamples - s), nEnd - r);
+				if (nCopy == 0)
+					break;
+				for (size_t i = 0; i < nCopy; i++)
+					pOut[s++] = vecRing[(r + i) % vecRing.size()];
+				r += nCopy;
+			}
+			nRead.store(r, memory_order_release);
+
+			if (s < nSamples)
+			{
+				nOwed += nSamples - s;
+				nUnderruns++;
+				for (; s < nSamples; s++)
+					pOut[s] = 0.0;
+			}
+		}
+
+		stats GetStats() const
+		{
+			return { nUnderruns, nOverruns.load() };
+		}
+
+	private:
+		tracked_vector<FTYPE, MEM_IO> vecRing;
+
+		// Stream positions in samples, only ever increasing
+		atomic<size_t> nRead;		// Render side
+		atomic<size_t> nWrite;		// Capture side
+		atomic<size_t> nLost;		// Dropped by the capture side, not yet played as silence
+		atomic<size_t> nLostAt;		// Write position the dropped samples belong at
+		size_t nOwed;				// Played as silence, skipped when it arrives
+
+		unsigned long long nUnderruns;
+		atomic<unsigned long long> nOverruns;
+	};
+
+
+	// Where captured blocks come from. Sources with a clock of their own (a
+	// device) write into the ring from their own thread once started; the rest
+	// are pumped by the render side, one output block at a time.
+	struct input_source
+	{
+		virtual ~input_source() {}
+		virtual bool Start(input_ring &ring, unsigned int nSampleRate, unsigned int nBlockSamples) { return true; }
+		virtual void Stop() {}
+		virtual void Pump(input_ring &ring, unsigned int nSamples) {}
+	};
+
+	// Silence, for running duplex without an input
+	struct input_null : public input_source
+	{
+		virtual bool Start(input_ring &ring, unsigned int nSampleRate, unsigned int nBlockSamples)
+		{
+			vecSilence.assign(nBlockSamples, 0.0);
+			return true;
+		}
+
+		virtual void Pump(input_ring &ring, unsigned int nSamples)
+		{
+			if (vecSilence.size() < nSamples)
+				vecSilence.resize(nSamples, 0.0);
+			ring.Write(vecSilence.data(), nSamples);
+		}
+
+	private:
+		vector<FTYPE> vecSilence;
+	};
+
+	// A recording played as if it were being captured, in step with the output
+	struct input_file : public input_source
+	{
+		input_file(vector<FTYPE> samples, bool loop = true) : vecSamples(std::move(samples))
+		{
+			bLoop = loop;
+			nPosition = 0;
+		}
+
+		virtual bool Start(input_ring &ring, unsigned int nSampleRate, unsigned int nBlockSamples)
+		{
+			nPosition = 0;
+			vecBlock.assign(nBlockSamples, 0.0);
+			return true;
+		}
+
+		virtual void Pump(input_ring &ring, unsigned int nSamples)
+		{
+			if (vecBlock.size() < nSamples)
+				vecBlock.resize(nSamples);
+			for (unsigned int s = 0; s < nSamples; s++)
+			{
+				if (bLoop && !vecSamples.empty() && nPosition >= vecSamples.size())
+					nPosition = 0;
+				vecBlock[s] = nPosition < vecSamples.size() ? vecSamples[nPosition] : 0.0;
+				nPosition++;
+			}
+			ring.Write(vecBlock.data(), nSamples);
+		}
+
+	private:
+		vector<FTYPE> vecSamples;
+		vector<FTYPE> vecBlock;
+		size_t nPosition;
+		bool bLoop;
+	};
+
+#ifdef _WIN32
+	// A waveIn device, mono 16 bit. Buffers of one block are queued on the
+	// device and each one filled is copied into the ring and queued again.
+	struct input_wavein : public input_source
+	{
+		input_wavein(wstring sDevice, unsigned int nBuffers = 4)
+		{
+			sInputDevice = sDevice;
+			nBufferCount = nBuffers;
+			hwDevice = nullptr;
+			nFilled = 0;
+			bRunning = false;
+		}
+
+		~input_wavein()
+		{
+			Stop();
+		}
+
+		static vector<wstring> Enumerate()
+		{
+			int nDeviceCount = waveInGetNumDevs();
+			vector<wstring> sDevices;
+			WAVEINCAPS wic;
+			for (int n = 0; n < nDeviceCount; n++)
+				if (waveInGetDevCaps(n, &wic, sizeof(WAVEINCAPS)) == S_OK)
+					sDevices.push_back(wic.szPname);
+			return sDevices;
+		}
+
+		virtual bool Start(input_ring &ring, unsigned int nSampleRate, unsigned int nBlockSamples)
+		{
+			vector<wstring> devices = Enumerate();
+			auto d = find(devices.begin(), devices.end(), sInputDevice);
+			if (d == devices.end())
+				return false;
+
+			WAVEFORMATEX waveFormat;
+			waveFormat.wFormatTag = WAVE_FORMAT_PCM;
+			waveFormat.nSamplesPerSec = nSampleRate;
+			waveFormat.wBitsPerSample = 16;
+			waveFormat.nChannels = 1;
+			waveFormat.nBlockAlign = 2;
+			waveFormat.nAvgBytesPerSec = nSampleRate * 2;
+			waveFormat.cbSize = 0;
+			if (waveInOpen(&hwDevice, (int)distance(devices.begin(), d), &waveFormat, (DWORD_PTR)waveInProcWrap, (DWORD_PTR)this, CALLBACK_FUNCTION) != S_OK)
+				return false;
+
+			nBlock = nBlockSamples;
+			vecCapture.assign((size_t)nBufferCount * nBlock, 0);
+			vecHeaders.assign(nBufferCount, WAVEHDR());
+			vecConvert.assign(nBlock, 0.0);
+			for (unsigned int n = 0; n < nBufferCount; n++)
+			{
+				vecHeaders[n].lpData = (LPSTR)(vecCapture.data() + (size_t)n * nBlock);
+				vecHeaders[n].dwBufferLength = nBlock * sizeof(short);
+				waveInPrepareHeader(hwDevice, &vecHeaders[n], sizeof(WAVEHDR));
+				waveInAddBuffer(hwDevice, &vecHeaders[n], sizeof(WAVEHDR));
+			}
+			platform::lock_memory(vecCapture.data(), sizeof(short) * vecCapture.size());
+			platform::lock_memory(vecConvert.data(), sizeof(FTYPE) * vecConvert.size());
+
+			pRing = &ring;
+			nCurrent = 0;
+			nFilled = 0;
+			bRunning = true;
+			thrCapture = thread(&input_wavein::CaptureThread, this);
+			waveInStart(hwDevice);
+			return true;
+		}
+
+		virtual void Stop()
+		{
+			if (!bRunning)
+				return;
+			{
+				unique_lock<mutex> lm(muxFilled);
+				bRunning = false;
+			}
+			cvFilled.notify_one();
+			thrCapture.join();
+
+			waveInReset(hwDevice);
+			for (auto &h : vecHeaders)
+				waveInUnprepareHeader(hwDevice, &h, sizeof(WAVEHDR));
+			waveInClose(hwDevice);
+			hwDevice = nullptr;
+		}
+
+	private:
+		// The device callback only counts buffers, requeueing from inside it can
+		// deadlock the driver
+		void waveInProc(HWAVEIN hWaveIn, UINT uMsg, DWORD_PTR dwParam1, DWORD_PTR dwParam2)
+		{
+			if (uMsg != WIM_DATA) return;
+
+			nFilled++;
+			unique_lock<mutex> lm(muxFilled);
+			cvFilled.notify_one();
+		}
+
+		static void CALLBACK waveInProcWrap(HWAVEIN hWaveIn, UINT uMsg, DWORD_PTR dwInstance, DWORD_PTR dwParam1, DWORD_PTR dwParam2)
+		{
+			((input_wavein*)dwInstance)->waveInProc(hWaveIn, uMsg, dwParam1, dwParam2);
+		}
+
+		void CaptureThread()
+		{
+			while (bRunning)
+			{
+				if (nFilled == 0)
+				{
+					unique_lock<mutex> lm(muxFilled);
+					cvFilled.wait(lm, [this] { return nFilled > 0 || !bRunning; });
+					continue;
+				}
+				nFilled--;
+
+				WAVEHDR &h = vecHeaders[nCurrent];
+				unsigned int nSamples = min(nBlock, (unsigned int)(h.dwBytesRecorded / sizeof(short)));
+				const short *pCapture = (const short*)h.lpData;
+				for (unsigned int s = 0; s < nSamples; s++)
+					vecConvert[s] = pCapture[s] / 32768.0;
+				pRing->Write(vecConvert.data(), nSamples);
+
+				waveInAddBuffer(hwDevice, &h, sizeof(WAVEHDR));
+				nCurrent = (nCurrent + 1) % nBufferCount;
+			}
+		}
+
+	private:
+		wstring sInputDevice;
+		unsigned int nBufferCount;
+		unsigned int nBlock = 0;
+		unsigned int nCurrent = 0;
+		HWAVEIN hwDevice;
+		vector<short> vecCapture;
+		vector<WAVEHDR> vecHeaders;
+		vector<FTYPE> vecConvert;
+		input_ring *pRing = nullptr;
+
+		thread thrCapture;
+		atomic<unsigned int> nFilled;
+		atomic<bool> bRunning;
+		mutex muxFilled;
+		condition_variable cvFilled;
+	};
+#else
+	// There are no capture devices off Windows
+	struct input_wavein : public input_source
+	{
+		input_wavein(wstring sDevice, unsigned int nBuffers = 4) {}
+
+		static vector<wstring> Enumerate()
+		{
+			return {};
+		}
+
+		virtual bool Start(input_ring &ring, unsigned int nSampleRate, unsigned int nBlockSamples)
+		{
+			return false;
+		}
+	};
+#endif
+
+
+	// A source and its ring, read by the engine once per block
+	struct duplex_input
+	{
+		duplex_input(input_source *source, memory_account *account = nullptr) : ring(account)
+		{
+			pSource = source;
+		}
+
+		~duplex_input()
+		{
+			Stop();
+		}
+
+		bool Start(unsigned int nSampleRate, unsigned int nBlockSamples)
+		{
+			if (pSource == nullptr)
+				return false;
+			ring.Reset(nBlockSamples);
+			return pSource->Start(ring, nSampleRate, nBlockSamples);
+		}
+
+		void Stop()
+		{
+			if (pSource != nullptr)
+				pSource->Stop();
+		}
+
+		// Render side: the input captured alongside the next nSamples of output
+		void Read(FTYPE *pOut, unsigned int nSamples)
+		{
+			pSource->Pump(ring, nSamples);
+			ring.Read(pOut, nSamples);
+		}
+
+		input_ring::stats GetStats() const
+		{
+			return ring.GetStats();
+		}
+
+	private:
+		input_source *pSource;
+		input_ring ring;
+	};
+
+
+	// Envelope follower: a saw at the note's pitch whose level follows the live
+	// input, so playing a chord and speaking into the mic makes the chord talk.
+	// The input's level is followed once per block for all voices, and between
+	// notes too, so a note starts at the level the input is at.
+	struct instrument_follower : public instrument_base
+	{
+		instrument_follower()
+		{
+			env.dAttackTime = 0.01;
+			env.dDecayTime = 0.1;
+			env.dSustainAmplitude = 1.0;
+			env.dReleaseTime = 0.2;
+			fMaxLifeTime = -1.0;
+			dVolume = 1.0;
+			name = L"Follower";
+			bFollowsInput = true;
+		}
+
+		FTYPE fAttack = 0.005;		// Seconds for the level to rise
+		FTYPE fRelease = 0.08;		// Seconds for the level to fall
+		FTYPE fGain = 2.0;			// Level of a full scale input
+
+		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished)
+		{
+			FTYPE dAmplitude = synth::env(dTime, env, n.on, n.off);
+			if (dAmplitude <= 0.0 && dTime - n.on > env.dAttackTime) bNoteFinished = true;
+
+			return dAmplitude * min(1.0, fLevel * fGain) * synth::osc(dTime - n.on, synth::scale(n.id), synth::OSC_SAW_DIG) * dVolume;
+		}
+
+		virtual void SharedBlock(const FTYPE dTime, const FTYPE dTimeStep, unsigned int nSamples)
+		{
+			FTYPE fUp = 1.0 - math::exp(-dTimeStep / fAttack);
+			FTYPE fDown = 1.0 - math::exp(-dTimeStep / fRelease);
+
+			dLevelStart = dTime;
+			dLevelStep = dTimeStep;
+			vecLevel.resize(nSamples);
+			for (unsigned int s = 0; s < nSamples; s++)
+			{
+				FTYPE fIn = pInput != nullptr ? fabs(pInput->At(dTime + s * dTimeStep)) : 0.0;
+				fLevel += (fIn - fLevel) * (fIn > fLevel ? fUp : fDown);
+				vecLevel[s] = min(1.0, fLevel * fGain);
+			}
+		}
+
+		virtual bool SoundBlock(const FTYPE dTime, const FTYPE dTimeStep, const synth::note &n, FTYPE *pOut, unsigned int nSamples, bool &bNoteFinished)
+		{
+			// Outside the engine's block the level holds where it got to
+			long long nOffset = dLevelStep == dTimeStep ? math::round_to_int((dTime - dLevelStart) / dTimeStep) : -1;
+			bool bShared = nOffset >= 0 && (size_t)nOffset + nSamples <= vecLevel.size();
+			FTYPE fHold = min(1.0, fLevel * fGain);
+
+			for (unsigned int s = 0; s < nSamples && !bNoteFinished; s++)
+			{
+				FTYPE t = dTime + s * dTimeStep;
+				FTYPE dAmplitude = synth::env(t, env, n.on, n.off);
+				if (dAmplitude <= 0.0 && t - n.on > env.dAttackTime) bNoteFinished = true;
+
+				FTYPE dLevel = bShared ? vecLevel[nOffset + s] : fHold;
+				pOut[s] += dAmplitude * dLevel * synth::osc(t - n.on, synth::scale(n.id), synth::OSC_SAW_DIG) * dVolume;
+			}
+			return true;
+		}
+
+	private:
+		FTYPE fLevel = 0.0;
+		FTYPE dLevelStart = 0.0;
+		FTYPE dLevelStep = 0.0;
+		vector<FTYPE> vecLevel;
+	};
+
+}
@@ -0,0 +1,214 @@
+#pragma once
+#include "Core.h"
+
+namespace synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Master Effects
+
+	// Effects process whole blocks of the mono master mix in place. Reset clears
+	// what they remember of earlier blocks, as after Prepare, without allocating.
+	struct effect_base
+	{
+		virtual ~effect_base() {}
+		virtual void Prepare(unsigned int nSampleRate) {}
+		virtual void Process(FTYPE *pBuffer, unsigned int nSamples) = 0;
+		virtual void Reset() {}
+	};
+
+	struct effect_delay : public effect_base
+	{
+		FTYPE dDelayTime;
+		FTYPE dFeedback;
+		FTYPE dMix;
+
+		effect_delay()
+		{
+			dDelayTime = 0.3;
+			dFeedback = 0.4;
+			dMix = 0.3;
+			vecLine.assign(1, 0.0);
+			nPosition = 0;
+		}
+
+		virtual void Prepare(unsigned int nSampleRate)
+		{
+			vecLine.assign(max(1u, (unsigned int)(dDelayTime * nSampleRate)), 0.0);
+			nPosition = 0;
+		}
+
+		virtual void Process(FTYPE *pBuffer, unsigned int nSamples)
+		{
+			for (unsigned int n = 0; n < nSamples; n++)
+			{
+				FTYPE dDelayed = vecLine[nPosition];
+				vecLine[nPosition] = pBuffer[n] + dDelayed * dFeedback;
+				pBuffer[n] += dDelayed * dMix;
+				if (++nPosition >= vecLine.size()) nPosition = 0;
+			}
+		}
+
+		virtual void Reset()
+		{
+			fill(vecLine.begin(), vecLine.end(), 0.0);
+			nPosition = 0;
+		}
+
+	private:
+		vector<FTYPE> vecLine;
+		size_t nPosition;
+	};
+
+	// Schroeder style reverb: parallel damped combs into series allpasses
+	struct effect_reverb : public effect_base
+	{
+		FTYPE dRoomSize;	// Comb feedback, 0 to 1
+		FTYPE dDamp;		// High frequency damping in the combs, 0 to 1
+		FTYPE dMix;
+		int nCombs;			// 1 to 4, fewer is cheaper and thinner
+
+		effect_reverb()
+		{
+			dRoomSize = 0.84;
+			dDamp = 0.2;
+			dMix = 0.25;
+			nCombs = 4;
+		}
+
+		virtual void Prepare(unsigned int nSampleRate)
+		{
+			// Classic tunings are given at 44.1kHz
+			const int nCombTuning[4] = { 1557, 1617, 1491, 1422 };
+			const int nAllpassTuning[2] = { 556, 225 };
+			FTYPE dScale = nSampleRate / 44100.0;
+
+			for (int i = 0; i < 4; i++)
+			{
+				comb[i].vecLine.assign(max(1, (int)(nCombTuning[i] * dScale)), 0.0);
+				comb[i].nPosition = 0;
+				comb[i].dStore = 0.0;
+			}
+			for (int i = 0; i < 2; i++)
+			{
+				allpass[i].vecLine.assign(max(1, (int)(nAllpassTuning[i] * dScale)), 0.0);
+				allpass[i].nPosition = 0;
+			}
+		}
+
+		virtual void Process(FTYPE *pBuffer, unsigned int nSamples)
+		{
+			for (unsigned int n = 0; n < nSamples; n++)
+			{
+				FTYPE dInput = pBuffer[n] / nCombs;
+				FTYPE dWet = 0.0;
+
+				for (int i = 0; i < nCombs; i++)
+				{
+					line &c = comb[i];
+					FTYPE dOut = c.vecLine[c.nPosition];
+					c.dStore = dOut * (1.0 - dDamp) + c.dStore * dDamp;
+					c.vecLine[c.nPosition] = dInput + c.dStore * dRoomSize;
+					if (++c.nPosition >= c.vecLine.size()) c.nPosition = 0;
+					dWet += dOut;
+				}
+
+				for (auto &a : allpass)
+				{
+					FTYPE dBuffered = a.vecLine[a.nPosition];
+					a.vecLine[a.nPosition] = dWet + dBuffered * 0.5;
+					dWet = dBuffered - dWet;
+					if (++a.nPosition >= a.vecLine.size()) a.nPosition = 0;
+				}
+
+				pBuffer[n] += dWet * dMix;
+			}
+		}
+
+		virtual void Reset()
+		{
+			for (auto l : { &comb[0], &comb[1], &comb[2], &comb[3], &allpass[0], &allpass[1] })
+			{
+				fill(l->vecLine.begin(), l->vecLine.end(), 0.0);
+				l->nPosition = 0;
+				l->dStore = 0.0;
+			}
+		}
+
+	private:
+		struct line
+		{
+			vector<FTYPE> vecLine = vector<FTYPE>(1, 0.0);
+			size_t nPosition = 0;
+			FTYPE dStore = 0.0;
+		};
+
+		line comb[4];
+		line allpass[2];
+	};
+
+	// Peak limiter, instant attack and exponential release
+	struct effect_limiter : public effect_base
+	{
+		FTYPE dThreshold;
+		FTYPE dReleaseTime;
+
+		effect_limiter()
+		{
+			dThreshold = 0.95;
+			dReleaseTime = 0.1;
+			dGain = 1.0;
+			dRelease = 0.0;
+		}
+
+		virtual void Prepare(unsigned int nSampleRate)
+		{
+			dRelease = math::exp(-1.0 / (dReleaseTime * nSampleRate));
+			dGain = 1.0;
+		}
+
+		virtual void Process(FTYPE *pBuffer, unsigned int nSamples)
+		{
+			for (unsigned int n = 0; n < nSamples; n++)
+			{
+				FTYPE dPeak = math::fabs(pBuffer[n]);
+				FTYPE dTarget = dPeak > dThreshold ? dThreshold / dPeak : 1.0;
+				dGain = dTarget < dGain ? dTarget : dTarget + (dGain - dTarget) * dRelease;
+				pBuffer[n] *= dGain;
+			}
+		}
+
+		virtual void Reset()
+		{
+			dGain = 1.0;
+		}
+
+	private:
+		FTYPE dGain;
+		FTYPE dRelease;
+	};
+
+
+	// Effects applied one after another
+	struct effect_chain
+	{
+		void Process(FTYPE *pBuffer, unsigned int nSamples)
+		{
+			for (auto e : vecEffects)
+				e->Process(pBuffer, nSamples);
+		}
+
+		void Reset()
+		{
+			for (auto e : vecEffects)
+				e->Reset();
+		}
+
+		bool Empty() const
+		{
+			return vecEffects.empty();
+		}
+
+		vector<effect_base*> vecEffects;
+	};
+
+}
@@ -0,0 +1,649 @@
+#pragma once
+#include "Core.h"
+#include "Effects.h"
+#include "Spatial.h"
+#include "TimingWheel.h"
+#include "Duplex.h"
+
+namespace synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Engine
+
+	// Owns the playing notes and mixes them. Can be driven one sample at a time
+	// by NoiseMaker, or a whole block at a time by a host or offline renderer.
+	struct engine
+	{
+	public:
+		struct stats
+		{
+			size_t nVoices;
+			size_t nScheduled;
+			memory_usage mem;
+			vector<pair<wstring, memory_usage>> vecInstruments;
+		};
+
+	public:
+		engine(unsigned int sampleRate = 44100, unsigned int blockSamples = 256)
+			: vecNotes(tracked_allocator<note, MEM_VOICES>(&mem)), vecBlock(tracked_allocator<FTYPE, MEM_SCRATCH>(&mem)),
+			vecFxBuffer(tracked_allocator<FTYPE, MEM_SCRATCH>(&mem)), vecTimes(tracked_allocator<FTYPE, MEM_SCRATCH>(&mem)), spatial(&mem), events(&mem),
+			vecInput(tracked_allocator<FTYPE, MEM_SCRATCH>(&mem))
+		{
+			nSampleRate = sampleRate;
+			nBlockSamples = blockSamples;
+			dGlobalTime = 0.0;
+			dMasterVolume = 0.2;
+			vecBlock.resize(nBlockSamples, 0.0);
+			vecTimes.resize(nBlockSamples, 0.0);
+			vecInput.resize(nBlockSamples, 0.0);
+			pDuplex = nullptr;
+			bPipelined = false;
+			bFxPending = false;
+			bHot = false;
+			bWarmingUp = false;
+		}
+
+		~engine()
+		{
+			SetPipelined(false);
+
+			// Instruments that outlive the engine stop charging it. Those already
+			// gone unlinked themselves.
+			mem.DetachChildren();
+		}
+
+		// Returns amplitude (-1.0 to +1.0) as a function of time
+		FTYPE Sample(FTYPE dTime)
+		{
+			unique_lock<mutex> lm(muxNotes);
+			ReleaseDue(dTime);
+			FTYPE dMixedOutput = Mix(dTime);
+			RemoveFinished();
+			return dMixedOutput;
+		}
+
+		// Renders nSamples starting at dGlobalTime through the master effects and
+		// advances the clock. The note list is locked once for the whole block
+		// rather than once per sample, and each voice renders its whole block in
+		// one go. Sample() bypasses the effects.
+		void Render(FTYPE *pBuffer, unsigned int nSamples)
+		{
+			{
+				unique_lock<mutex> lm(muxNotes);
+				ReleaseDue(dGlobalTime + (FTYPE)nSamples / (FTYPE)nSampleRate);
+				CaptureInput(nSamples);
+				BlockTimes(nSamples);
+				SharedSources(nSamples);
+
+				for (unsigned int s = 0; s < nSamples; s++)
+					pBuffer[s] = 0.0;
+				for (auto &n : vecNotes)
+					RenderVoice(n, pBuffer, nSamples);
+				for (unsigned int s = 0; s < nSamples; s++)
+					pBuffer[s] *= dMasterVolume;
+
+				RemoveFinished();
+			}
+
+			if (fx.Empty())
+				return;
+
+			if (bPipelined)
+				PipelineEffects(pBuffer, nSamples);
+			else
+				fx.Process(pBuffer, nSamples);
+		}
+
+		// Renders nFrames for every speaker into pOut, one plane of nFrames per
+		// speaker, and advances the clock. Each voice renders its own row, takes
+		// its gains from its azimuth once per block, and the rows are mixed to the
+		// speakers as one matrix product. The mono master effects are not applied.
+		// Rows are sized by SetSpeakers and WarmUp, never here: more voices than
+		// rows are mixed in batches, and more frames than a row in parts.
+		void RenderSpatial(FTYPE *pOut, unsigned int nFrames)
+		{
+			unsigned int nPart = spatial.nFrames;
+			if (nPart == 0 || spatial.Rows() == 0)
+				return;
+
+			for (unsigned int f = 0; f < nFrames; f += nPart)
+				RenderSpatialPart(pOut + f, nFrames, min(nPart, nFrames - f));
+		}
+
+		// Duplex mode: each block rendered reads the input captured alongside it
+		// and hands it to the instruments. Null for output only. The input has
+		// to be started, at this engine's rate and block size.
+		void SetInput(duplex_input *pInput)
+		{
+			unique_lock<mutex> lm(muxNotes);
+			pDuplex = pInput;
+			input = input_block();
+		}
+
+		// Speakers for RenderSpatial. Set before rendering starts.
+		void SetSpeakers(const speaker_layout &layout)
+		{
+			unique_lock<mutex> lm(muxNotes);
+			speakers = layout;
+			spatial.Reserve(max(vecNotes.capacity(), SPATIAL_ROWS), speakers.Count(), nBlockSamples);
+		}
+
+		// Renders one block into vecBlock
+		void RenderBlock()
+		{
+			Render(vecBlock.data(), nBlockSamples);
+		}
+
+		void AddNote(const note &n)
+		{
+			unique_lock<mutex> lm(muxNotes);
+			vecNotes.emplace_back(n);
+		}
+
+		// Holds a note until the block it starts in. Far-future notes cost nothing
+		// per block until they are due, so whole songs can be queued up front.
+		timing_wheel<note>::handle Schedule(const note &n)
+		{
+			unique_lock<mutex> lm(muxNotes);
+			return events.Insert(Tick(n.on), n);
+		}
+
+		// False if the note has already started playing
+		bool Cancel(timing_wheel<note>::handle h)
+		{
+			unique_lock<mutex> lm(muxNotes);
+			return events.Cancel(h);
+		}
+
+		// Takes every note matching out, playing or scheduled
+		template<class PRED>
+		void RemoveNotes(PRED pred)
+		{
+			unique_lock<mutex> lm(muxNotes);
+			vecNotes.erase(remove_if(vecNotes.begin(), vecNotes.end(), pred), vecNotes.end());
+			events.CancelIf(pred);
+		}
+
+		// Notes scheduled but not yet playing
+		size_t Pending()
+		{
+			unique_lock<mutex> lm(muxNotes);
+			return events.Size();
+		}
+
+		// Effects run in the order they are added. Add them before rendering starts.
+		void AddEffect(effect_base *effect)
+		{
+			effect->Prepare(nSampleRate);
+			fx.vecEffects.push_back(effect);
+		}
+
+		// In pipelined mode the effects process block N on their own thread while
+		// the voices of block N+1 render, at the cost of one block of latency.
+		// Only blocks of nBlockSamples are pipelined; others run the effects on the
+		// caller's thread, after the block in flight, and keep the same latency.
+		// Turning it off finishes the block in flight and writes it, the last
+		// nBlockSamples of output still owed, to pTail if given.
+		void SetPipelined(bool bEnable, FTYPE *pTail = nullptr)
+		{
+			if (bEnable == bPipelined)
+				return;
+
+			if (bEnable)
+			{
+				vecFxBuffer.assign(nBlockSamples, 0.0);
+				bFxPending = false;
+				bPipelined = true;
+				thrFx = thread(&engine::EffectsThread, this);
+			}
+			else
+			{
+				{
+					unique_lock<mutex> lm(muxFx);
+					cvFxDone.wait(lm, [this] { return !bFxPending; });
+					bPipelined = false;
+				}
+				cvFx.notify_all();
+				thrFx.join();
+
+				if (pTail != nullptr)
+					for (unsigned int n = 0; n < nBlockSamples; n++)
+						pTail[n] = fx.Empty() ? 0.0 : vecFxBuffer[n];
+			}
+		}
+
+		// Samples of delay the engine adds on top of the block it was asked for
+		unsigned int GetLatency() const
+		{
+			return (bPipelined && !fx.Empty()) ? nBlockSamples : 0;
+		}
+
+		// Gets everything the first audible block will touch into memory and cache
+		// before playback starts: grows the voice pool, faults in and locks the
+		// preallocated buffers, has instruments build their tables, runs every
+		// instrument's sound(), then renders blocks with a voice on every instrument
+		// through its SharedBlock, VoiceBlock and SoundBlock, the mix and effects.
+		// Those blocks are mixed at zero gain and never heard. Afterwards the clock,
+		// the voices, the schedule, the noise source and the duplex input are as
+		// they were, and the effects and the pipeline start from silence. Call
+		// after instruments and effects are added and before any notes play.
+		void WarmUp(unsigned int nBlocks = 8, size_t nVoices = 256)
+		{
+			bHot = false;
+
+			{
+				unique_lock<mutex> lm(muxNotes);
+				size_t nPlaying = vecNotes.size();
+				vecNotes.resize(max(nVoices, nPlaying));
+				vecNotes.resize(nPlaying);
+				LockMemory(vecNotes.data(), vecNotes.capacity() * sizeof(note));
+				vecBlockVoices.reserve(vecNotes.capacity());
+			}
+			LockMemory(vecBlock.data(), vecBlock.size() * sizeof(FTYPE));
+			LockMemory(vecFxBuffer.data(), vecFxBuffer.size() * sizeof(FTYPE));
+			LockMemory(vecTimes.data(), vecTimes.size() * sizeof(FTYPE));
+			LockMemory(vecInput.data(), vecInput.size() * sizeof(FTYPE));
+			if (speakers.Count() > 0)
+			{
+				spatial.Reserve(max(nVoices, vecNotes.capacity()), speakers.Count(), nBlockSamples);
+				LockMemory(spatial.Voice(0), max(nVoices, vecNotes.capacity()) * nBlockSamples * sizeof(FTYPE));
+				LockMemory(spatial.Gains(0), max(nVoices, vecNotes.capacity()) * speakers.Count() * sizeof(FTYPE));
+			}
+
+			for (auto inst : vecInstruments)
+				inst->Prepare(nSampleRate);
+
+			// Instrument hot paths, output thrown away
+			math::random rngSave = math::noise_source();
+			FTYPE dTimeStep = 1.0 / (FTYPE)nSampleRate;
+			volatile FTYPE dSink = 0.0;
+			for (auto inst : vecInstruments)
+			{
+				note n;
+				n.id = 64;
+				n.on = dTimeStep;
+				n.active = true;
+				n.channel = inst;
+
+				bool bNoteFinished = false;
+				for (unsigned int s = 0; s < nBlockSamples * nBlocks; s++)
+					dSink = dSink + inst->sound(n.on + s * dTimeStep, n, bNoteFinished);
+			}
+
+			// Block paths, mix and effects on a voice per instrument, released half
+			// way. The voices start before the clock so none can be taken for a
+			// note played later. Scheduled notes stay on the wheel, which doesn't move,
+			// and no input is read.
+			FTYPE dTimeSave = dGlobalTime;
+			FTYPE dVolumeSave = dMasterVolume;
+			vector<note> vecSaved;
+			{
+				unique_lock<mutex> lm(muxNotes);
+				vecSaved.assign(vecNotes.begin(), vecNotes.end());
+				vecNotes.clear();
+				for (auto inst : vecInstruments)
+				{
+					note n;
+					n.id = 64;
+					n.on = dGlobalTime - nBlocks * BlockTime();
+					n.off = dGlobalTime + nBlocks / 2 * BlockTime();
+					n.active = true;
+					n.channel = inst;
+					vecNotes.push_back(n);
+				}
+				bWarmingUp = true;
+				dMasterVolume = 0.0;
+			}
+			for (unsigned int b = 0; b < nBlocks; b++)
+				RenderBlock();
+			{
+				unique_lock<mutex> lm(muxNotes);
+				vecNotes.assign(vecSaved.begin(), vecSaved.end());
+				dGlobalTime = dTimeSave;
+				dMasterVolume = dVolumeSave;
+				bWarmingUp = false;
+			}
+			ResetEffects();
+			math::noise_source() = rngSave;
+
+			bHot = true;
+		}
+
+		// True once WarmUp has finished
+		bool IsHot() const
+		{
+			return bHot;
+		}
+
+		// Charges the instrument's own memory to this engine as well, what it
+		// already holds included
+		void AddInstrument(instrument_base *inst)
+		{
+			inst->mem.SetParent(&mem);
+			inst->pInput = &input;
+			vecInstruments.push_back(inst);
+			vecSharing.reserve(vecInstruments.size() + 8);
+		}
+
+		// Drops the instrument, its playing and scheduled notes, and its memory
+		// from this engine's account
+		void RemoveInstrument(instrument_base *inst)
+		{
+			RemoveNotes([inst](const note &n) { return n.channel == inst; });
+
+			unique_lock<mutex> lm(muxNotes);
+			vecInstruments.erase(remove(vecInstruments.begin(), vecInstruments.end(), inst), vecInstruments.end());
+
+			if (inst->mem.Parent() == &mem)
+				inst->mem.SetParent(nullptr);
+			if (inst->pInput == &input)
+				inst->pInput = nullptr;
+		}
+
+		stats GetStats()
+		{
+			stats s;
+			{
+				unique_lock<mutex> lm(muxNotes);
+				s.nVoices = vecNotes.size();
+				s.nScheduled = events.Size();
+			}
+			s.mem = mem.Usage();
+			for (auto i : vecInstruments)
+				s.vecInstruments.push_back({ i->name, i->mem.Usage() });
+			return s;
+		}
+
+		// Length of one block in seconds
+		FTYPE BlockTime() const
+		{
+			return (FTYPE)nBlockSamples / (FTYPE)nSampleRate;
+		}
+
+	private:
+		// Spatial rows reserved when speakers are set, however few voices there are
+		static constexpr size_t SPATIAL_ROWS = 64;
+
+		// Iterate through all active notes, and mix together. Caller holds muxNotes.
+		FTYPE Mix(FTYPE dTime)
+		{
+			FTYPE dMixedOutput = 0.0;
+
+			for (auto &n : vecNotes)
+			{
+				bool bNoteFinished = false;
+				FTYPE dSound = 0;
+
+				// Note was scheduled ahead of the audio clock and hasn't started yet,
+				// or finished earlier in this block
+				if (dTime < n.on || !n.active)
+					continue;
+
+				// Get sample for this note by using the correct instrument and envelope
+				if (n.channel != nullptr)
+					dSound = n.channel->sound(dTime, n, bNoteFinished);
+
+				// Mix into output
+				dMixedOutput += dSound;
+
+				if (bNoteFinished) // Flag note to be removed
+					n.active = false;
+			}
+
+			return dMixedOutput * dMasterVolume;
+		}
+
+		// nFrames of the output planes, nPlane apart, from pOut. Caller doesn't
+		// hold muxNotes.
+		void RenderSpatialPart(FTYPE *pOut, size_t nPlane, unsigned int nFrames)
+		{
+			unique_lock<mutex> lm(muxNotes);
+			ReleaseDue(dGlobalTime + (FTYPE)nFrames / (FTYPE)nSampleRate);
+			CaptureInput(nFrames);
+			BlockTimes(nFrames);
+			SharedSources(nFrames);
+
+			size_t nRows = 0;
+			bool bAdd = false;
+			for (auto &n : vecNotes)
+			{
+				// Not started before the end of the block, or already finished
+				if (!n.active || n.on > vecTimes[nFrames - 1])
+					continue;
+
+				if (nRows == spatial.Rows())
+				{
+					spatial.Mix(pOut, nPlane, nRows, nFrames, bAdd);
+					bAdd = true;
+					nRows = 0;
+				}
+
+				FTYPE *pVoice = spatial.Voice(nRows);
+				for (unsigned int s = 0; s < nFrames; s++)
+					pVoice[s] = 0.0;
+				RenderVoice(n, pVoice, nFrames);
+
+				FTYPE *pGains = spatial.Gains(nRows);
+				vbap_gains(speakers, n.channel != nullptr ? n.channel->Azimuth(vecTimes[0], n) : n.azimuth, pGains);
+				for (unsigned int c = 0; c < speakers.Count(); c++)
+					pGains[c] *= dMasterVolume;
+				nRows++;
+			}
+
+			spatial.Mix(pOut, nPlane, nRows, nFrames, bAdd);
+			RemoveFinished();
+		}
+
+		// Fills vecTimes with the time of each sample of the next block and moves
+		// the clock past it. Caller holds muxNotes.
+		void BlockTimes(unsigned int nSamples)
+		{
+			FTYPE dTimeStep = 1.0 / (FTYPE)nSampleRate;
+			if (vecTimes.size() < nSamples)
+				vecTimes.resize(nSamples);
+			for (unsigned int s = 0; s < nSamples; s++)
+			{
+				vecTimes[s] = dGlobalTime;
+				dGlobalTime += dTimeStep;
+			}
+		}
+
+		// Reads the input for the block starting at dGlobalTime. Sample() has no
+		// blocks, so instruments see silence there. Caller holds muxNotes.
+		void CaptureInput(unsigned int nSamples)
+		{
+			if (pDuplex == nullptr || bWarmingUp)
+				return;
+			if (vecInput.size() < nSamples)
+				vecInput.resize(nSamples);
+			pDuplex->Read(vecInput.data(), nSamples);
+			input.pSamples = vecInput.data();
+			input.nSamples = nSamples;
+			input.dStart = dGlobalTime;
+			input.dStep = 1.0 / (FTYPE)nSampleRate;
+		}
+
+		// Adds one voice's share of the block (times in vecTimes) into pOut.
+		// Caller holds muxNotes.
+		void RenderVoice(note &n, FTYPE *pOut, unsigned int nSamples)
+		{
+			if (!n.active || n.channel == nullptr)
+				return;
+
+			// Note was scheduled ahead of the audio clock and starts later, if at all
+			unsigned int s = 0;
+			while (s < nSamples && vecTimes[s] < n.on)
+				s++;
+			if (s == nSamples)
+				return;
+
+			bool bNoteFinished = false;
+			if (!n.channel->SoundBlock(vecTimes[s], 1.0 / (FTYPE)nSampleRate, n, pOut + s, nSamples - s, bNoteFinished))
+			{
+				for (; s < nSamples && !bNoteFinished; s++)
+					pOut[s] += n.channel->sound(vecTimes[s], n, bNoteFinished);
+			}
+
+			if (bNoteFinished) // Flag note to be removed
+				n.active = false;
+		}
+
+		// Each instrument with a voice sounding in the block renders what its
+		// voices share, once. Caller holds muxNotes.
+		void SharedSources(unsigned int nSamples)
+		{
+			vecSharing.clear();
+			for (auto &n : vecNotes)
+				if (n.active && n.channel != nullptr && n.on <= vecTimes[nSamples - 1] &&
+					find(vecSharing.begin(), vecSharing.end(), n.channel) == vecSharing.end())
+					vecSharing.push_back(n.channel);
+			if (pDuplex != nullptr)
+				for (auto inst : vecInstruments)
+					if (inst->bFollowsInput && find(vecSharing.begin(), vecSharing.end(), inst) == vecSharing.end())
+						vecSharing.push_back(inst);
+
+			for (auto inst : vecSharing)
+			{
+				inst->SharedBlock(vecTimes[0], 1.0 / (FTYPE)nSampleRate, nSamples);
+				if (!inst->bBlockVoices)
+					continue;
+
+				vecBlockVoices.clear();
+				for (auto &n : vecNotes)
+					if (n.active && n.channel == inst && n.on <= vecTimes[nSamples - 1])
+						vecBlockVoices.push_back(&n);
+				inst->VoiceBlock(vecTimes[0], 1.0 / (FTYPE)nSampleRate, nSamples, vecBlockVoices.data(), vecBlockVoices.size());
+			}
+		}
+
+		void RemoveFinished()
+		{
+			vecNotes.erase(remove_if(vecNotes.begin(), vecNotes.end(), [](note const& item) { return !item.active; }), vecNotes.end());
+		}
+
+		// The wheel ticks once per block length
+		uint64_t Tick(FTYPE dTime) const
+		{
+			if (dTime <= 0.0)
+				return 0;
+			return (uint64_t)(dTime * (FTYPE)nSampleRate / (FTYPE)nBlockSamples);
+		}
+
+		// Moves every scheduled note starting before dEnd into vecNotes. Caller
+		// holds muxNotes.
+		void ReleaseDue(FTYPE dEnd)
+		{
+			if (bWarmingUp)
+				return;
+			events.Advance(Tick(dEnd), vecNotes);
+		}
+
+		// Best effort, failure only means the pages may be paged out again
+		static void LockMemory(void *pData, size_t nBytes)
+		{
+			platform::lock_memory(pData, nBytes);
+		}
+
+		// Waits for the block in flight, empties the pipeline's delay line and
+		// clears the effects' memory of earlier blocks
+		void ResetEffects()
+		{
+			unique_lock<mutex> lm(muxFx);
+			cvFxDone.wait(lm, [this] { return !bFxPending; });
+			fill(vecFxBuffer.begin(), vecFxBuffer.end(), 0.0);
+			fx.Reset();
+		}
+
+		// Collects the previous block from the effects thread and hands it this one.
+		// vecFxBuffer is a delay line of one block: the output is always the
+		// nSamples that went in nBlockSamples earlier. A block of any other size is
+		// processed here once the one in flight is done, so the effects still see
+		// the blocks in order, and takes its output from the front of the line.
+		void PipelineEffects(FTYPE *pBuffer, unsigned int nSamples)
+		{
+			unique_lock<mutex> lm(muxFx);
+			cvFxDone.wait(lm, [this] { return !bFxPending; });
+
+			if (nSamples != nBlockSamples)
+			{
+				fx.Process(pBuffer, nSamples);
+				if (nSamples < nBlockSamples)
+				{
+					for (unsigned int n = 0; n < nSamples; n++)
+						swap(pBuffer[n], vecFxBuffer[n]);
+					rotate(vecFxBuffer.begin(), vecFxBuffer.begin() + nSamples, vecFxBuffer.end());
+				}
+				else
+				{
+					rotate(pBuffer, pBuffer + (nSamples - nBlockSamples), pBuffer + nSamples);
+					for (unsigned int n = 0; n < nBlockSamples; n++)
+						swap(pBuffer[n], vecFxBuffer[n]);
+				}
+				return;
+			}
+
+			for (unsigned int n = 0; n < nBlockSamples; n++)
+				swap(pBuffer[n], vecFxBuffer[n]);
+
+			bFxPending = true;
+			lm.unlock();
+			cvFx.notify_one();
+		}
+
+		void EffectsThread()
+		{
+			unique_lock<mutex> lm(muxFx);
+			while (true)
+			{
+				cvFx.wait(lm, [this] { return bFxPending || !bPipelined; });
+				if (!bPipelined)
+					break;
+
+				lm.unlock();
+				fx.Process(vecFxBuffer.data(), nBlockSamples);
+				lm.lock();
+
+				bFxPending = false;
+				cvFxDone.notify_one();
+			}
+		}
+
+	public:
+		unsigned int nSampleRate;
+		unsigned int nBlockSamples;
+		FTYPE dGlobalTime;
+		FTYPE dMasterVolume;
+
+		memory_account mem;
+		vector<instrument_base*> vecInstruments;
+
+		tracked_vector<note, MEM_VOICES> vecNotes;
+		mutex muxNotes;
+
+		tracked_vector<FTYPE, MEM_SCRATCH> vecBlock;
+
+		effect_chain fx;
+
+		speaker_layout speakers;
+
+	private:
+		atomic<bool> bHot;
+		bool bWarmingUp;	// The wheel and the input stay put. Guarded by muxNotes.
+		atomic<bool> bPipelined;
+		bool bFxPending;
+		tracked_vector<FTYPE, MEM_SCRATCH> vecFxBuffer;
+		thread thrFx;
+		mutex muxFx;
+		condition_variable cvFx;
+		condition_variable cvFxDone;
+		tracked_vector<FTYPE, MEM_SCRATCH> vecTimes;
+		spatial_mixer spatial;
+		timing_wheel<note> events;
+		vector<instrument_base*> vecSharing;
+		vector<const note*> vecBlockVoices;
+		duplex_input *pDuplex;
+		input_block input;
+		tracked_vector<FTYPE, MEM_SCRATCH> vecInput;
+	};
+
+}
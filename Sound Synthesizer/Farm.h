@@ -0,0 +1,648 @@
+#pragma once
+
+// Winsock has to come before Windows.h, so this is included first
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+extern char **environ;
+#endif
+
+#include <cstdint>
+#include <deque>
+
+#include "Render.h"
+
+namespace synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Render Farm
+	//
+	// A coordinator splits renders into jobs, one per time segment of each
+	// output (a full mix or one stem), and hands them to worker processes over
+	// TCP. A worker that crashes, hangs or drops its connection only loses the
+	// job it was on, which goes back on the queue until it has failed
+	// nMaxRetries times. Finished segments are stitched in order into each
+	// output file.
+	//
+	// Workers are this program started with --worker <host:port>. The
+	// coordinator can start them locally, and workers on other hosts can point
+	// at it as well. Every worker opens the song by the path it was given, so
+	// remote hosts need the same path. Messages are little-endian.
+
+#ifdef _WIN32
+	typedef SOCKET net_socket;
+	const net_socket NET_INVALID = INVALID_SOCKET;
+	inline void net_close(net_socket s) { closesocket(s); }
+	inline bool net_startup() { WSADATA wsa; return WSAStartup(MAKEWORD(2, 2), &wsa) == 0; }
+#else
+	typedef int net_socket;
+	const net_socket NET_INVALID = -1;
+	inline void net_close(net_socket s) { close(s); }
+	inline bool net_startup() { signal(SIGPIPE, SIG_IGN); return true; }
+#endif
+
+	enum FARM_MESSAGE : uint32_t
+	{
+		FARM_HELLO = 1,		// Worker -> coordinator: farm_hello
+		FARM_JOB,			// Coordinator -> worker: farm_job, then the song path
+		FARM_RESULT,		// Worker -> coordinator: farm_result, then the samples
+		FARM_QUIT,			// Coordinator -> worker: no payload
+	};
+
+	struct farm_header
+	{
+		char magic[4];			// "CFRM"
+		uint32_t nType;
+		uint32_t nLength;		// Payload bytes after the header
+	};
+
+	struct farm_hello
+	{
+		uint32_t nPid;
+	};
+
+	struct farm_job
+	{
+		uint32_t nJob;
+		uint32_t nPattern;
+		int32_t nStem;
+		uint32_t nSampleRate;
+		double fDetail;
+		int32_t nReverbCombs;
+		uint32_t nPathChars;	// uint32_t code units following
+		double fMaxTail;
+		double fPreroll;
+		double dStart;
+		double dEnd;
+	};
+
+	struct farm_result
+	{
+		uint32_t nJob;
+		uint32_t bOk;
+		uint32_t nSamples;		// int16_t samples following
+		uint32_t nPad;
+	};
+
+	static_assert(sizeof(farm_header) == 12, "farm_header layout");
+	static_assert(sizeof(farm_job) == 64, "farm_job layout");
+
+	inline bool net_send_all(net_socket s, const void *pData, size_t nBytes)
+	{
+		const char *p = (const char*)pData;
+		while (nBytes > 0)
+		{
+			int n = send(s, p, (int)min(nBytes, (size_t)1 << 20), 0);
+			if (n <= 0)
+				return false;
+			p += n;
+			nBytes -= n;
+		}
+		return true;
+	}
+
+	inline bool net_recv_all(net_socket s, void *pData, size_t nBytes)
+	{
+		char *p = (char*)pData;
+		while (nBytes > 0)
+		{
+			int n = recv(s, p, (int)min(nBytes, (size_t)1 << 20), 0);
+			if (n <= 0)
+				return false;
+			p += n;
+			nBytes -= n;
+		}
+		return true;
+	}
+
+	inline bool farm_send(net_socket s, uint32_t nType, const void *pPayload = nullptr, size_t nBytes = 0, const void *pExtra = nullptr, size_t nExtra = 0)
+	{
+		farm_header h = { { 'C', 'F', 'R', 'M' }, nType, (uint32_t)(nBytes + nExtra) };
+		return net_send_all(s, &h, sizeof(h)) && net_send_all(s, pPayload, nBytes) && net_send_all(s, pExtra, nExtra);
+	}
+
+	// Reads one whole message. Anything malformed counts as a lost connection.
+	inline bool farm_recv(net_socket s, uint32_t &nType, vector<char> &vecPayload)
+	{
+		farm_header h;
+		if (!net_recv_all(s, &h, sizeof(h)) || memcmp(h.magic, "CFRM", 4) != 0 || h.nLength > (1u << 30))
+			return false;
+		nType = h.nType;
+		vecPayload.resize(h.nLength);
+		return net_recv_all(s, vecPayload.data(), h.nLength);
+	}
+
+	inline net_socket net_connect(const string &sHost, uint16_t nPort)
+	{
+		addrinfo hints = {}, *pResult = nullptr;
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(sHost.c_str(), to_string(nPort).c_str(), &hints, &pResult) != 0)
+			return NET_INVALID;
+
+		net_socket s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (s != NET_INVALID && connect(s, pResult->ai_addr, (int)pResult->ai_addrlen) != 0)
+		{
+			net_close(s);
+			s = NET_INVALID;
+		}
+		freeaddrinfo(pResult);
+		return s;
+	}
+
+	inline uint32_t current_pid()
+	{
+#ifdef _WIN32
+		return (uint32_t)GetCurrentProcessId();
+#else
+		return (uint32_t)getpid();
+#endif
+	}
+
+
+	// Worker process: renders jobs from a coordinator until told to quit or
+	// the connection goes. False if it never connected.
+	bool farm_worker(const string &sHost, uint16_t nPort)
+	{
+		if (!net_startup())
+			return false;
+		net_socket s = net_connect(sHost, nPort);
+		if (s == NET_INVALID)
+			return false;
+
+		farm_hello hello = { current_pid() };
+		farm_send(s, FARM_HELLO, &hello, sizeof(hello));
+
+		song_file song;
+		wstring sOpen;
+		uint32_t nType;
+		vector<char> vecPayload;
+		vector<int16_t> vecPCM;
+
+		while (farm_recv(s, nType, vecPayload) && nType == FARM_JOB && vecPayload.size() >= sizeof(farm_job))
+		{
+			farm_job j;
+			memcpy(&j, vecPayload.data(), sizeof(j));
+			if (vecPayload.size() != sizeof(j) + (size_t)j.nPathChars * 4)
+				break;
+
+			// The path travels as 32-bit code units, whatever wchar_t is here
+			wstring sPath;
+			for (uint32_t c = 0; c < j.nPathChars; c++)
+			{
+				uint32_t u;
+				memcpy(&u, vecPayload.data() + sizeof(j) + c * 4, 4);
+				sPath.push_back((wchar_t)u);
+			}
+
+			// Jobs of the same song usually follow each other
+			if (sPath != sOpen)
+			{
+				song.Close();
+				sOpen = song.Open(sPath) ? sPath : wstring();
+			}
+
+			render_settings settings = { j.nSampleRate, j.fDetail, j.nReverbCombs, j.fMaxTail, j.fPreroll, 0.0 };
+			render_job job;
+			job.nPattern = j.nPattern;
+			job.nStem = j.nStem;
+			job.dStart = j.dStart;
+			job.dEnd = j.dEnd;
+
+			farm_result r = {};
+			r.nJob = j.nJob;
+			r.bOk = render_segment(song, job, settings, vecPCM) ? 1 : 0;
+			r.nSamples = (uint32_t)vecPCM.size();
+			if (!farm_send(s, FARM_RESULT, &r, sizeof(r), vecPCM.data(), vecPCM.size() * sizeof(int16_t)))
+				break;
+		}
+
+		net_close(s);
+		return true;
+	}
+
+
+	struct render_farm
+	{
+	public:
+		render_farm(const render_settings &settings) : settings(settings)
+		{
+			fSegment = 10.0;
+			nMaxRetries = 3;
+			fJobTimeout = 300.0;
+			fIdleTimeout = 30.0;
+			nJobsFailed = 0;
+			nRetries = 0;
+			nRespawns = 0;
+			fSeconds = 0.0;
+			sListen = NET_INVALID;
+			nPort = 0;
+			nLocalWorkers = 0;
+		}
+
+		~render_farm()
+		{
+			Shutdown();
+		}
+
+		// Listens on every interface so workers on other hosts can connect; port 0
+		// picks a free one
+		bool Listen(uint16_t nListenPort = 0)
+		{
+			if (!net_startup())
+				return false;
+
+			sListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+			if (sListen == NET_INVALID)
+				return false;
+
+			int nYes = 1;
+			setsockopt(sListen, SOL_SOCKET, SO_REUSEADDR, (const char*)&nYes, sizeof(nYes));
+
+			sockaddr_in addr = {};
+			addr.sin_family = AF_INET;
+			addr.sin_addr.s_addr = htonl(INADDR_ANY);
+			addr.sin_port = htons(nListenPort);
+			socklen_t nLen = sizeof(addr);
+			if (::bind(sListen, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(sListen, 64) != 0 ||
+				getsockname(sListen, (sockaddr*)&addr, &nLen) != 0)
+			{
+				net_close(sListen);
+				sListen = NET_INVALID;
+				return false;
+			}
+
+			nPort = ntohs(addr.sin_port);
+			return true;
+		}
+
+		uint16_t Port() const { return nPort; }
+
+		// Starts nWorkers copies of sExe pointed at this coordinator. Workers that
+		// die are restarted, up to nMaxRetries times each on average.
+		bool SpawnLocal(int nWorkers, const wstring &sExe)
+		{
+			sWorkerExe = sExe;
+			nLocalWorkers += nWorkers;
+			for (int w = 0; w < nWorkers; w++)
+				if (!Spawn())
+					return false;
+			return true;
+		}
+
+		// Queues a pattern, or one stem of it, to be rendered into sOutput
+		bool AddOutput(const wstring &sSong, uint32_t nPattern, int nStem, const wstring &sOutput)
+		{
+			song_file song;
+			if (!song.Open(sSong) || nPattern >= song.Header().nPatterns ||
+				(nStem >= 0 && (uint32_t)nStem >= song.Header().nInstruments))
+				return false;
+
+			output o;
+			o.sSong = sSong;
+			o.sOutput = sOutput;
+			o.nFirstJob = vecJobs.size();
+
+			// Fixed length segments, the last one runs on into the release tail
+			FTYPE dLength = song.Patterns()[nPattern].dLength;
+			FTYPE dStart = 0.0;
+			do
+			{
+				job j;
+				j.nOutput = vecOutputs.size();
+				j.spec.nPattern = nPattern;
+				j.spec.nStem = nStem;
+				j.spec.dStart = dStart;
+				dStart += fSegment;
+				j.spec.dEnd = dStart < dLength ? dStart : -1.0;
+				dqQueue.push_back(vecJobs.size());
+				vecJobs.push_back(j);
+			} while (dStart < dLength);
+
+			o.nJobs = vecJobs.size() - o.nFirstJob;
+			vecOutputs.push_back(o);
+			return true;
+		}
+
+		// Hands out jobs until every one has finished or failed for good, then
+		// writes the outputs. True if every output was written.
+		bool Run()
+		{
+			if (sListen == NET_INVALID)
+				return false;
+
+			auto t0 = chrono::steady_clock::now();
+			auto tLastWorker = t0;
+			size_t nDone = 0;
+
+			while (nDone + nJobsFailed < vecJobs.size())
+			{
+				auto tNow = chrono::steady_clock::now();
+				if (!vecWorkers.empty())
+					tLastWorker = tNow;
+				else if (chrono::duration<FTYPE>(tNow - tLastWorker).count() > fIdleTimeout)
+					break;
+
+				// Hand out work to idle workers
+				for (auto &w : vecWorkers)
+					if (w.bReady && w.nJob < 0 && !dqQueue.empty())
+						Assign(w, tNow);
+
+				// Wait for a connection or a message
+				fd_set fds;
+				FD_ZERO(&fds);
+				FD_SET(sListen, &fds);
+				net_socket sMax = sListen;
+				for (auto &w : vecWorkers)
+				{
+					FD_SET(w.s, &fds);
+					sMax = max(sMax, w.s);
+				}
+				timeval tv = { 0, 200000 };
+				if (select((int)sMax + 1, &fds, nullptr, nullptr, &tv) < 0)
+					break;
+
+				if (FD_ISSET(sListen, &fds))
+				{
+					net_socket s = accept(sListen, nullptr, nullptr);
+					if (s != NET_INVALID)
+					{
+						int nYes = 1;
+						setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&nYes, sizeof(nYes));
+						worker w;
+						w.s = s;
+						vecWorkers.push_back(w);
+					}
+				}
+
+				tNow = chrono::steady_clock::now();
+				for (size_t i = 0; i < vecWorkers.size(); )
+				{
+					worker &w = vecWorkers[i];
+					bool bLost = false;
+
+					if (FD_ISSET(w.s, &fds))
+						bLost = !Receive(w, nDone);
+					else if (w.nJob >= 0 && chrono::duration<FTYPE>(tNow - w.tStarted).count() > fJobTimeout)
+						bLost = true;
+
+					if (bLost)
+					{
+						Lost(w);
+						vecWorkers.erase(vecWorkers.begin() + i);
+					}
+					else
+						i++;
+				}
+			}
+
+			Shutdown();
+
+			bool bOk = true;
+			for (auto &o : vecOutputs)
+				bOk = Stitch(o) && bOk;
+
+			fSeconds = chrono::duration<FTYPE>(chrono::steady_clock::now() - t0).count();
+			return bOk && nJobsFailed == 0;
+		}
+
+	public:
+		render_settings settings;
+		FTYPE fSegment;			// Seconds of pattern per job
+		int nMaxRetries;		// Times one job may be lost before its output fails
+		FTYPE fJobTimeout;		// Seconds before a busy worker is given up on
+		FTYPE fIdleTimeout;		// Seconds without any worker before giving up
+
+		size_t nJobsFailed;
+		size_t nRetries;
+		size_t nRespawns;
+		FTYPE fSeconds;
+
+	private:
+		struct job
+		{
+			size_t nOutput;
+			render_job spec;
+			int nLost = 0;
+			bool bDone = false;
+			vector<int16_t> vecPCM;
+		};
+
+		struct output
+		{
+			wstring sSong;
+			wstring sOutput;
+			size_t nFirstJob;
+			size_t nJobs;
+		};
+
+		struct worker
+		{
+			net_socket s;
+			uint32_t nPid = 0;
+			bool bReady = false;	// Said hello
+			long long nJob = -1;
+			chrono::steady_clock::time_point tStarted;
+		};
+
+		void Assign(worker &w, chrono::steady_clock::time_point tNow)
+		{
+			size_t nJob = dqQueue.front();
+			const job &j = vecJobs[nJob];
+			const wstring &sSong = vecOutputs[j.nOutput].sSong;
+
+			farm_job m = {};
+			m.nJob = (uint32_t)nJob;
+			m.nPattern = j.spec.nPattern;
+			m.nStem = j.spec.nStem;
+			m.nSampleRate = settings.nSampleRate;
+			m.fDetail = settings.fDetail;
+			m.nReverbCombs = settings.nReverbCombs;
+			m.fMaxTail = settings.fMaxTail;
+			m.fPreroll = settings.fPreroll;
+			m.dStart = j.spec.dStart;
+			m.dEnd = j.spec.dEnd;
+			m.nPathChars = (uint32_t)sSong.size();
+			vector<uint32_t> vecPath(sSong.begin(), sSong.end());
+
+			// A failed send shows up as a lost connection on the next select
+			dqQueue.pop_front();
+			w.nJob = (long long)nJob;
+			w.tStarted = tNow;
+			farm_send(w.s, FARM_JOB, &m, sizeof(m), vecPath.data(), vecPath.size() * 4);
+		}
+
+		// False if the worker has gone
+		bool Receive(worker &w, size_t &nDone)
+		{
+			uint32_t nType;
+			vector<char> vecPayload;
+			if (!farm_recv(w.s, nType, vecPayload))
+				return false;
+
+			if (nType == FARM_HELLO && vecPayload.size() == sizeof(farm_hello))
+			{
+				farm_hello h;
+				memcpy(&h, vecPayload.data(), sizeof(h));
+				w.nPid = h.nPid;
+				w.bReady = true;
+				return true;
+			}
+
+			if (nType != FARM_RESULT || vecPayload.size() < sizeof(farm_result))
+				return false;
+
+			farm_result r;
+			memcpy(&r, vecPayload.data(), sizeof(r));
+			if (w.nJob != (long long)r.nJob || vecPayload.size() != sizeof(r) + (size_t)r.nSamples * sizeof(int16_t))
+				return false;
+
+			job &j = vecJobs[r.nJob];
+			w.nJob = -1;
+			if (!r.bOk)
+			{
+				// The render itself failed, another worker would fail the same way
+				nJobsFailed++;
+				return true;
+			}
+
+			j.vecPCM.resize(r.nSamples);
+			memcpy(j.vecPCM.data(), vecPayload.data() + sizeof(r), r.nSamples * sizeof(int16_t));
+			j.bDone = true;
+			nDone++;
+			return true;
+		}
+
+		// Requeues the worker's job, and replaces the worker if it was one of ours
+		void Lost(worker &w)
+		{
+			net_close(w.s);
+
+			if (w.nJob >= 0)
+			{
+				job &j = vecJobs[(size_t)w.nJob];
+				if (++j.nLost > nMaxRetries)
+					nJobsFailed++;
+				else
+				{
+					dqQueue.push_front((size_t)w.nJob);
+					nRetries++;
+				}
+			}
+
+			auto p = find(vecSpawned.begin(), vecSpawned.end(), w.nPid);
+			if (w.nPid != 0 && p != vecSpawned.end())
+			{
+				// It may be hung rather than dead
+				Terminate(*p);
+				Reap(*p);
+				vecSpawned.erase(p);
+				if (nRespawns < (size_t)(nLocalWorkers * nMaxRetries) && Spawn())
+					nRespawns++;
+			}
+		}
+
+		bool Stitch(const output &o)
+		{
+			vector<int16_t> vecPCM;
+			for (size_t j = o.nFirstJob; j < o.nFirstJob + o.nJobs; j++)
+			{
+				if (!vecJobs[j].bDone)
+					return false;
+				vecPCM.insert(vecPCM.end(), vecJobs[j].vecPCM.begin(), vecJobs[j].vecPCM.end());
+			}
+			overview peaks(settings.nSampleRate);
+			return write_wav(o.sOutput, vecPCM, settings.nSampleRate, &peaks) && peaks.Write(overview_path(o.sOutput));
+		}
+
+		bool Spawn()
+		{
+			wstring sAddress = L"127.0.0.1:" + to_wstring(nPort);
+#ifdef _WIN32
+			wstring sCommand = L"\"" + sWorkerExe + L"\" --worker " + sAddress;
+			STARTUPINFOW si = { sizeof(si) };
+			PROCESS_INFORMATION pi = {};
+			if (!CreateProcessW(sWorkerExe.c_str(), &sCommand[0], nullptr, nullptr, FALSE, 0, nullptr, nullptr, &si, &pi))
+				return false;
+			CloseHandle(pi.hThread);
+			CloseHandle(pi.hProcess);
+			uint32_t nPid = (uint32_t)pi.dwProcessId;
+#else
+			string sExe = filesystem::path(sWorkerExe).string();
+			string sAddr(sAddress.begin(), sAddress.end());
+			char *argv[] = { &sExe[0], (char*)"--worker", &sAddr[0], nullptr };
+			pid_t pid;
+			if (posix_spawn(&pid, sExe.c_str(), nullptr, nullptr, argv, environ) != 0)
+				return false;
+			uint32_t nPid = (uint32_t)pid;
+#endif
+			vecSpawned.push_back(nPid);
+			return true;
+		}
+
+		static void Terminate(uint32_t nPid)
+		{
+#ifdef _WIN32
+			HANDLE hProcess = OpenProcess(PROCESS_TERMINATE, FALSE, nPid);
+			if (hProcess != nullptr)
+			{
+				TerminateProcess(hProcess, 1);
+				CloseHandle(hProcess);
+			}
+#else
+			kill((pid_t)nPid, SIGKILL);
+#endif
+		}
+
+		static void Reap(uint32_t nPid)
+		{
+#ifndef _WIN32
+			waitpid((pid_t)nPid, nullptr, 0);
+#endif
+		}
+
+		// Tells the workers to quit and waits for the local ones to exit
+		void Shutdown()
+		{
+			for (auto &w : vecWorkers)
+			{
+				farm_send(w.s, FARM_QUIT);
+				net_close(w.s);
+			}
+			vecWorkers.clear();
+
+			for (auto nPid : vecSpawned)
+				Reap(nPid);
+			vecSpawned.clear();
+
+			if (sListen != NET_INVALID)
+				net_close(sListen);
+			sListen = NET_INVALID;
+		}
+
+	private:
+		net_socket sListen;
+		uint16_t nPort;
+		wstring sWorkerExe;
+		int nLocalWorkers;
+		vector<uint32_t> vecSpawned;		// Local workers still running
+
+		vector<job> vecJobs;
+		vector<output> vecOutputs;
+		deque<size_t> dqQueue;
+		vector<worker> vecWorkers;
+	};
+
+}
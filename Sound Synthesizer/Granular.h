@@ -0,0 +1,265 @@
+#pragma once
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "Core.h"
+
+namespace synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Granular Instrument
+
+	// A cloud of short windowed grains read from a source table. Grains are not
+	// evaluated through osc() and env() one at a time: once per block the grains
+	// that overlap it are laid out struct-of-arrays (source position, increment,
+	// window phase, gain), then each is rendered over its span of the block with
+	// table lookups and linear interpolation, four samples per step with AVX2.
+	//
+	// Grain k of a note starts at k / fGrainRate plus a jitter, and its source
+	// position and pitch come from a hash of (note id, k), so the output is still
+	// a pure function of time like every other instrument.
+	struct instrument_granular : public instrument_base
+	{
+		FTYPE fGrainRate;		// Grains started per second
+		FTYPE fGrainLength;		// Seconds
+		FTYPE fScanRate;		// Source seconds advanced per second of note
+		FTYPE fPositionSpread;	// Random source offset, seconds
+		FTYPE fPitchSpread;		// Random detune, semitones
+		FTYPE fMaxRatio;		// Highest playback rate a grain may use
+
+		instrument_granular()
+			: vecSource(tracked_allocator<FTYPE, MEM_TABLES>(&mem)), vecWindow(tracked_allocator<FTYPE, MEM_TABLES>(&mem)),
+			vecPosition(tracked_allocator<FTYPE, MEM_SCRATCH>(&mem)), vecIncrement(tracked_allocator<FTYPE, MEM_SCRATCH>(&mem)),
+			vecPhase(tracked_allocator<FTYPE, MEM_SCRATCH>(&mem)), vecPhaseIncrement(tracked_allocator<FTYPE, MEM_SCRATCH>(&mem)),
+			vecGain(tracked_allocator<FTYPE, MEM_SCRATCH>(&mem)), vecFirst(tracked_allocator<uint32_t, MEM_SCRATCH>(&mem)),
+			vecEnd(tracked_allocator<uint32_t, MEM_SCRATCH>(&mem)), vecMix(tracked_allocator<FTYPE, MEM_SCRATCH>(&mem))
+		{
+			env.dAttackTime = 0.3;
+			env.dDecayTime = 0.2;
+			env.dSustainAmplitude = 0.8;
+			env.dReleaseTime = 0.6;
+			fMaxLifeTime = -1.0;
+			dVolume = 0.5;
+			name = L"Granular";
+
+			fGrainRate = 400.0;
+			fGrainLength = 0.08;
+			fScanRate = 0.25;
+			fPositionSpread = 0.3;
+			fPitchSpread = 0.1;
+			fMaxRatio = 8.0;
+			nSampleRate = 0;
+			nSourceSamples = 0;
+		}
+
+		// Builds the window table and a one second source: detuned partials over a
+		// base at scale(64), every partial a whole number of Hz so the table loops
+		virtual void Prepare(unsigned int sampleRate)
+		{
+			if (sampleRate == nSampleRate)
+				return;
+			nSampleRate = sampleRate;
+
+			vecWindow.resize(WINDOW + 1);
+			for (int i = 0; i <= WINDOW; i++)
+				vecWindow[i] = 0.5 - 0.5 * math::cos(2.0 * PI * i / WINDOW);	// Hann, vecWindow[WINDOW] == 0
+
+			dSourceHertz = math::round_to_int(scale(64));
+			nSourceSamples = nSampleRate;
+			size_t nGuard = (size_t)(fMaxRatio * fGrainLength * nSampleRate) + 2;
+			vecSource.assign(nSourceSamples + nGuard, 0.0);
+			for (int k = 1; k <= 16; k++)
+			{
+				FTYPE dHertz = (FTYPE)math::round_to_int(k * dSourceHertz * (1.0 + 0.003 * k));
+				if (dHertz >= nSampleRate / 2)
+					break;
+				for (size_t s = 0; s < nSourceSamples; s++)
+					vecSource[s] += math::sin(2.0 * PI * dHertz * s / nSampleRate) / k;
+			}
+			for (size_t s = nSourceSamples; s < vecSource.size(); s++)
+				vecSource[s] = vecSource[s % nSourceSamples];
+		}
+
+		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished)
+		{
+			FTYPE dSample = 0.0;
+			SoundBlock(dTime, 1.0 / (nSampleRate > 0 ? nSampleRate : 44100), n, &dSample, 1, bNoteFinished);
+			return dSample;
+		}
+
+		virtual bool SoundBlock(const FTYPE dTime, const FTYPE dTimeStep, const synth::note &n, FTYPE *pOut, unsigned int nSamples, bool &bNoteFinished)
+		{
+			unsigned int nRate = (unsigned int)math::round_to_int(1.0 / dTimeStep);
+			if (nRate != nSampleRate)
+				Prepare(nRate);
+
+			if (vecMix.size() < nSamples)
+				vecMix.resize(nSamples);
+			for (unsigned int s = 0; s < nSamples; s++)
+				vecMix[s] = 0.0;
+
+			size_t nGrains = Schedule(dTime - n.on, dTimeStep, nSamples, n.id);
+			for (size_t g = 0; g < nGrains; g++)
+				RenderGrain(g, vecMix.data());
+
+			for (unsigned int s = 0; s < nSamples; s++)
+			{
+				FTYPE t = dTime + s * dTimeStep;
+				FTYPE dAmplitude = synth::env(t, env, n.on, n.off);
+				if (dAmplitude <= 0.0 && t - n.on > env.dAttackTime) bNoteFinished = true;
+				pOut[s] += dAmplitude * vecMix[s] * dVolume;
+			}
+			return true;
+		}
+
+	private:
+		// Lays out every grain overlapping [dStart, dStart + nSamples * dTimeStep)
+		// of the note's life, returns how many
+		size_t Schedule(FTYPE dStart, FTYPE dTimeStep, unsigned int nSamples, int nNoteId)
+		{
+			FTYPE dEnd = dStart + nSamples * dTimeStep;
+			FTYPE dInterval = 1.0 / fGrainRate;
+			FTYPE dLength = fGrainLength;
+			FTYPE dRatio = scale(nNoteId) / dSourceHertz;
+			FTYPE dGain = 1.0 / std::sqrt(max(1.0, fGrainRate * fGrainLength));
+
+			int64_t kFirst = max<int64_t>(0, (int64_t)math::floor((dStart - dLength) / dInterval) - 1);
+			int64_t kLast = (int64_t)math::floor(dEnd / dInterval);
+
+			size_t nGrains = 0;
+			for (int64_t k = kFirst; k <= kLast; k++)
+			{
+				uint64_t nHash = Hash((uint64_t)k * 0x9E3779B97F4A7C15ull ^ (uint64_t)(nNoteId + 1));
+				FTYPE u0 = (nHash & 0xFFFFF) / 1048576.0;
+				FTYPE u1 = ((nHash >> 20) & 0xFFFFF) / 1048576.0;
+				FTYPE u2 = ((nHash >> 40) & 0xFFFFF) / 1048576.0;
+
+				FTYPE dGrainStart = (k + u0 * 0.5) * dInterval;
+				if (dGrainStart >= dEnd || dGrainStart + dLength <= dStart)
+					continue;
+
+				// First and one past last sample of the block the grain covers
+				FTYPE dFirst = max(0.0, (dGrainStart - dStart) / dTimeStep);
+				uint32_t nFirst = (uint32_t)math::trunc(dFirst);
+				if (nFirst < dFirst) nFirst++;
+				FTYPE dLast = min((FTYPE)nSamples, (dGrainStart + dLength - dStart) / dTimeStep);
+				uint32_t nEnd = (uint32_t)math::trunc(dLast);
+				if (nEnd < dLast) nEnd++;
+				if (nEnd > nSamples) nEnd = nSamples;
+				if (nFirst >= nEnd)
+					continue;
+
+				FTYPE dElapsed = dStart + nFirst * dTimeStep - dGrainStart;
+				FTYPE dDetune = math::exp((u2 - 0.5) * 2.0 * fPitchSpread * (0.69314718055994531 / 12.0));
+				FTYPE dGrainRatio = min(fMaxRatio, dRatio * dDetune);
+				FTYPE dSourceStart = (dGrainStart * fScanRate + u1 * fPositionSpread) * nSampleRate;
+				dSourceStart -= math::floor(dSourceStart / nSourceSamples) * nSourceSamples;
+
+				Grow(nGrains + 1);
+				vecPosition[nGrains] = dSourceStart + dElapsed * dGrainRatio * nSampleRate;
+				vecIncrement[nGrains] = dGrainRatio * nSampleRate * dTimeStep;
+				vecPhase[nGrains] = dElapsed / dLength * WINDOW;
+				vecPhaseIncrement[nGrains] = dTimeStep / dLength * WINDOW;
+				vecGain[nGrains] = dGain;
+				vecFirst[nGrains] = nFirst;
+				vecEnd[nGrains] = nEnd;
+				nGrains++;
+			}
+			return nGrains;
+		}
+
+		// Adds grain g over its span of the block into pMix
+		void RenderGrain(size_t g, FTYPE *pMix)
+		{
+			const FTYPE *pSource = vecSource.data();
+			const FTYPE *pWindow = vecWindow.data();
+			FTYPE dPos = vecPosition[g], dInc = vecIncrement[g];
+			FTYPE dPhase = vecPhase[g], dPhaseInc = vecPhaseIncrement[g];
+			FTYPE dGain = vecGain[g];
+			uint32_t s = vecFirst[g], nEnd = vecEnd[g];
+			FTYPE dLastSource = (FTYPE)(vecSource.size() - 2);
+			FTYPE dLastPhase = (FTYPE)(WINDOW - 1) + 0.999999;
+
+#if defined(__AVX2__)
+			const __m256d vStep = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+			const __m256d vInc = _mm256_set1_pd(dInc), vPhaseInc = _mm256_set1_pd(dPhaseInc), vGain = _mm256_set1_pd(dGain);
+			const __m256d vMaxSource = _mm256_set1_pd(dLastSource), vMaxPhase = _mm256_set1_pd(dLastPhase);
+			for (uint32_t i = 0; s + 4 <= nEnd; s += 4, i += 4)
+			{
+				__m256d vi = _mm256_add_pd(_mm256_set1_pd((FTYPE)i), vStep);
+				__m256d p = _mm256_min_pd(_mm256_add_pd(_mm256_set1_pd(dPos), _mm256_mul_pd(vi, vInc)), vMaxSource);
+				__m256d w = _mm256_min_pd(_mm256_add_pd(_mm256_set1_pd(dPhase), _mm256_mul_pd(vi, vPhaseInc)), vMaxPhase);
+
+				__m128i ip = _mm256_cvttpd_epi32(p);
+				__m128i iw = _mm256_cvttpd_epi32(w);
+				__m256d fp = _mm256_sub_pd(p, _mm256_cvtepi32_pd(ip));
+				__m256d fw = _mm256_sub_pd(w, _mm256_cvtepi32_pd(iw));
+
+				__m256d s0 = _mm256_i32gather_pd(pSource, ip, 8);
+				__m256d s1 = _mm256_i32gather_pd(pSource + 1, ip, 8);
+				__m256d w0 = _mm256_i32gather_pd(pWindow, iw, 8);
+				__m256d w1 = _mm256_i32gather_pd(pWindow + 1, iw, 8);
+
+				__m256d src = _mm256_add_pd(s0, _mm256_mul_pd(fp, _mm256_sub_pd(s1, s0)));
+				__m256d win = _mm256_add_pd(w0, _mm256_mul_pd(fw, _mm256_sub_pd(w1, w0)));
+				__m256d out = _mm256_add_pd(_mm256_loadu_pd(pMix + s), _mm256_mul_pd(vGain, _mm256_mul_pd(win, src)));
+				_mm256_storeu_pd(pMix + s, out);
+			}
+			uint32_t nDone = s - vecFirst[g];
+			dPos += nDone * dInc;
+			dPhase += nDone * dPhaseInc;
+#endif
+			for (uint32_t i = 0; s < nEnd; s++, i++)
+			{
+				FTYPE p = min(dPos + i * dInc, dLastSource);
+				FTYPE w = min(dPhase + i * dPhaseInc, dLastPhase);
+				int32_t ip = (int32_t)p, iw = (int32_t)w;
+				FTYPE src = pSource[ip] + (p - ip) * (pSource[ip + 1] - pSource[ip]);
+				FTYPE win = pWindow[iw] + (w - iw) * (pWindow[iw + 1] - pWindow[iw]);
+				pMix[s] += dGain * (win * src);
+			}
+		}
+
+		void Grow(size_t nGrains)
+		{
+			if (vecPosition.size() >= nGrains)
+				return;
+			size_t nSize = max<size_t>(64, nGrains * 2);
+			vecPosition.resize(nSize);
+			vecIncrement.resize(nSize);
+			vecPhase.resize(nSize);
+			vecPhaseIncrement.resize(nSize);
+			vecGain.resize(nSize);
+			vecFirst.resize(nSize);
+			vecEnd.resize(nSize);
+		}
+
+		static uint64_t Hash(uint64_t z)
+		{
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+			return z ^ (z >> 31);
+		}
+
+	private:
+		static const int WINDOW = 1024;
+
+		unsigned int nSampleRate;
+		size_t nSourceSamples;
+		FTYPE dSourceHertz;
+		tracked_vector<FTYPE, MEM_TABLES> vecSource;
+		tracked_vector<FTYPE, MEM_TABLES> vecWindow;
+
+		// Grains overlapping the current block, struct of arrays
+		tracked_vector<FTYPE, MEM_SCRATCH> vecPosition;
+		tracked_vector<FTYPE, MEM_SCRATCH> vecIncrement;
+		tracked_vector<FTYPE, MEM_SCRATCH> vecPhase;
+		tracked_vector<FTYPE, MEM_SCRATCH> vecPhaseIncrement;
+		tracked_vector<FTYPE, MEM_SCRATCH> vecGain;
+		tracked_vector<uint32_t, MEM_SCRATCH> vecFirst;
+		tracked_vector<uint32_t, MEM_SCRATCH> vecEnd;
+		tracked_vector<FTYPE, MEM_SCRATCH> vecMix;
+	};
+
+}
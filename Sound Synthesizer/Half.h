@@ -0,0 +1,160 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+
+// F16C comes with AVX2 on every CPU that has it; GCC and Clang still want it
+// enabled separately (-mf16c)
+#if defined(__F16C__) || (defined(_MSC_VER) && defined(__AVX2__))
+#define SYNTH_F16C
+#include <immintrin.h>
+#endif
+
+namespace synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Compact Sample Storage
+	//
+	// IEEE half (1-5-10) keeps about 11 bits of precision over a small range,
+	// bfloat16 (1-8-7) keeps 8 bits over the full float range. Either halves the
+	// footprint of float storage and quarters that of double. Samples are
+	// converted to FTYPE when loaded, with F16C where available. Conversions
+	// from double go through float, rounding to nearest even at each step, the
+	// same as the hardware path, so both give identical bits.
+
+	struct half { uint16_t bits; };
+	struct bfloat16 { uint16_t bits; };
+
+	enum SAMPLE_FORMAT
+	{
+		FMT_DOUBLE,
+		FMT_HALF,
+		FMT_BFLOAT16,
+	};
+
+	inline uint16_t float_to_half_bits(float f)
+	{
+		uint32_t x;
+		memcpy(&x, &f, 4);
+		uint32_t nSign = (x >> 16) & 0x8000;
+		uint32_t ax = x & 0x7FFFFFFF;
+
+		if (ax >= 0x7F800000)					// Inf or NaN, keep NaNs quiet
+			return (uint16_t)(nSign | 0x7C00 | (ax > 0x7F800000 ? 0x200 : 0));
+		if (ax >= 0x477FF000)					// Rounds past 65504
+			return (uint16_t)(nSign | 0x7C00);
+		if (ax < 0x38800000)					// Below 2^-14, subnormal in half
+		{
+			if (ax <= 0x33000000)				// At most 2^-25, rounds to zero
+				return (uint16_t)nSign;
+			uint32_t m = (ax & 0x7FFFFF) | 0x800000;
+			uint32_t nShift = 126 - (ax >> 23);
+			uint32_t h = m >> nShift;
+			uint32_t nRem = m & ((1u << nShift) - 1);
+			uint32_t nHalfway = 1u << (nShift - 1);
+			if (nRem > nHalfway || (nRem == nHalfway && (h & 1)))
+				h++;
+			return (uint16_t)(nSign | h);
+		}
+
+		uint32_t h = (ax >> 13) - (112 << 10);	// Rebias the exponent
+		uint32_t nRem = ax & 0x1FFF;
+		if (nRem > 0x1000 || (nRem == 0x1000 && (h & 1)))
+			h++;								// Carries into the exponent as it should
+		return (uint16_t)(nSign | h);
+	}
+
+	inline float half_bits_to_float(uint16_t h)
+	{
+		uint32_t nSign = (uint32_t)(h & 0x8000) << 16;
+		uint32_t e = (h >> 10) & 0x1F;
+		uint32_t m = h & 0x3FF;
+		uint32_t x;
+
+		if (e == 0)
+		{
+			float f = (float)m * (1.0f / 16777216.0f);	// m * 2^-24, exact
+			return nSign ? -f : f;
+		}
+		else if (e == 31)
+			x = nSign | 0x7F800000 | (m << 13);
+		else
+			x = nSign | ((e + 112) << 23) | (m << 13);
+
+		float f;
+		memcpy(&f, &x, 4);
+		return f;
+	}
+
+	inline uint16_t float_to_bfloat16_bits(float f)
+	{
+		uint32_t x;
+		memcpy(&x, &f, 4);
+		if ((x & 0x7FFFFFFF) > 0x7F800000)
+			return (uint16_t)((x >> 16) | 0x40);	// Quiet NaN
+		x += 0x7FFF + ((x >> 16) & 1);
+		return (uint16_t)(x >> 16);
+	}
+
+	inline float bfloat16_bits_to_float(uint16_t b)
+	{
+		uint32_t x = (uint32_t)b << 16;
+		float f;
+		memcpy(&f, &x, 4);
+		return f;
+	}
+
+	inline FTYPE to_ftype(double d) { return (FTYPE)d; }
+	inline FTYPE to_ftype(float f) { return (FTYPE)f; }
+	inline FTYPE to_ftype(half h) { return (FTYPE)half_bits_to_float(h.bits); }
+	inline FTYPE to_ftype(bfloat16 b) { return (FTYPE)bfloat16_bits_to_float(b.bits); }
+
+	inline void from_ftype(FTYPE d, double &out) { out = (double)d; }
+	inline void from_ftype(FTYPE d, float &out) { out = (float)d; }
+	inline void from_ftype(FTYPE d, half &out) { out.bits = float_to_half_bits((float)d); }
+	inline void from_ftype(FTYPE d, bfloat16 &out) { out.bits = float_to_bfloat16_bits((float)d); }
+
+
+	// Block conversions between FTYPE and any storage format
+	template<class S>
+	void store_samples(const FTYPE *pIn, S *pOut, size_t n)
+	{
+		for (size_t i = 0; i < n; i++)
+			from_ftype(pIn[i], pOut[i]);
+	}
+
+	template<class S>
+	void load_samples(const S *pIn, FTYPE *pOut, size_t n)
+	{
+		for (size_t i = 0; i < n; i++)
+			pOut[i] = to_ftype(pIn[i]);
+	}
+
+#ifdef SYNTH_F16C
+	template<>
+	inline void store_samples(const FTYPE *pIn, half *pOut, size_t n)
+	{
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4)
+		{
+			__m128 f = _mm256_cvtpd_ps(_mm256_loadu_pd(pIn + i));
+			_mm_storel_epi64((__m128i*)(pOut + i), _mm_cvtps_ph(f, _MM_FROUND_TO_NEAREST_INT));
+		}
+		for (; i < n; i++)
+			from_ftype(pIn[i], pOut[i]);
+	}
+
+	template<>
+	inline void load_samples(const half *pIn, FTYPE *pOut, size_t n)
+	{
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4)
+		{
+			__m128 f = _mm_cvtph_ps(_mm_loadl_epi64((const __m128i*)(pIn + i)));
+			_mm256_storeu_pd(pOut + i, _mm256_cvtps_pd(f));
+		}
+		for (; i < n; i++)
+			pOut[i] = to_ftype(pIn[i]);
+	}
+#endif
+
+}
@@ -0,0 +1,333 @@
+#pragma once
+#include <cstdint>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "Overview.h"
+
+namespace synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Loudness
+	//
+	// EBU R128 measurement of a mono render as it is produced: integrated
+	// loudness (BS.1770 K-weighting, 400 ms blocks gated at -70 LUFS and 10 LU
+	// below), loudness range (3 s blocks gated at -70 LUFS and 20 LU below, 10th
+	// to 95th percentile) and true peak (4x oversampled). Only the energy of
+	// each 100 ms is kept, a few hundred KB for an hour. Hitting a target is then
+	// a gain applied to the finished file in place, not another render.
+
+	struct loudness_meter
+	{
+	public:
+		loudness_meter(unsigned int sampleRate = 44100)
+		{
+			nSampleRate = sampleRate;
+			nSubBlock = max(1u, nSampleRate / 10);
+
+			// K-weighting for any rate: a high shelf for the head, then a high pass
+			FTYPE K = math::tan(PI * 1681.974450955533 / nSampleRate);
+			FTYPE Q = 0.7071752369554196;
+			FTYPE Vh = math::pow(10.0, 3.999843853973347 / 20.0);
+			FTYPE Vb = math::pow(Vh, 0.4996667741545416);
+			FTYPE a0 = 1.0 + K / Q + K * K;
+			shelf = { (Vh + Vb * K / Q + K * K) / a0, 2.0 * (K * K - Vh) / a0, (Vh - Vb * K / Q + K * K) / a0,
+				2.0 * (K * K - 1.0) / a0, (1.0 - K / Q + K * K) / a0 };
+
+			K = math::tan(PI * 38.13547087602444 / nSampleRate);
+			Q = 0.5003270373238773;
+			a0 = 1.0 + K / Q + K * K;
+			highpass = { 1.0, -2.0, 1.0, 2.0 * (K * K - 1.0) / a0, (1.0 - K / Q + K * K) / a0 };
+
+			// Interpolator phases of a Hann windowed sinc, each summing to one
+			for (int p = 0; p < PHASES; p++)
+			{
+				FTYPE dSum = 0.0;
+				for (int t = 0; t < TAPS; t++)
+				{
+					FTYPE x = (FTYPE)(p + PHASES * t) - PHASES * TAPS / 2;
+					FTYPE dSinc = x == 0.0 ? 1.0 : math::sin(PI * x / PHASES) / (PI * x / PHASES);
+					FTYPE dWindow = 0.5 - 0.5 * math::cos(2.0 * PI * (p + PHASES * t) / (PHASES * TAPS));
+					fPhase[p][t] = dSinc * dWindow;
+					dSum += fPhase[p][t];
+				}
+				for (int t = 0; t < TAPS; t++)
+					fPhase[p][t] /= dSum;
+			}
+
+			Clear();
+		}
+
+		void Clear()
+		{
+			shelf.Reset();
+			highpass.Reset();
+			dSquares = 0.0;
+			nInBlock = 0;
+			vecEnergy.clear();
+			for (auto &x : fHistory)
+				x = 0.0;
+			nHistory = 0;
+			dPeak = 0.0;
+		}
+
+		// Next nSamples of the render, -1.0 to +1.0
+		void Add(const FTYPE *pSamples, size_t nSamples)
+		{
+			for (size_t i = 0; i < nSamples; i++)
+				AddSample(pSamples[i]);
+		}
+
+		// Next nSamples as written to a 16-bit file
+		void Add(const int16_t *pSamples, size_t nSamples)
+		{
+			for (size_t i = 0; i < nSamples; i++)
+				AddSample(pSamples[i] / 32768.0);
+		}
+
+		// LUFS, -infinity for silence
+		FTYPE Integrated() const
+		{
+			vector<FTYPE> vecBlocks;
+			Blocks(4, vecBlocks);
+			return Lufs(GatedMean(vecBlocks, 10.0, nullptr));
+		}
+
+		// LU between quiet and loud passages
+		FTYPE Range() const
+		{
+			vector<FTYPE> vecBlocks, vecGated;
+			Blocks(30, vecBlocks);
+			GatedMean(vecBlocks, 20.0, &vecGated);
+			if (vecGated.size() < 2)
+				return 0.0;
+
+			sort(vecGated.begin(), vecGated.end());
+			auto percentile = [&vecGated](FTYPE f) { return vecGated[(size_t)math::round_to_int(f * (vecGated.size() - 1))]; };
+			return Lufs(percentile(0.95)) - Lufs(percentile(0.10));
+		}
+
+		// dBTP, -infinity for silence
+		FTYPE TruePeak() const
+		{
+			return dPeak > 0.0 ? 20.0 * math::log10(dPeak) : -INFINITY;
+		}
+
+		FTYPE Seconds() const
+		{
+			return ((FTYPE)vecEnergy.size() * nSubBlock + nInBlock) / nSampleRate;
+		}
+
+	private:
+		static const int PHASES = 4;
+		static const int TAPS = 12;
+
+		struct biquad
+		{
+			FTYPE b0, b1, b2, a1, a2;
+			FTYPE z1 = 0.0, z2 = 0.0;
+
+			FTYPE Process(FTYPE x)
+			{
+				FTYPE y = b0 * x + z1;
+				z1 = b1 * x - a1 * y + z2;
+				z2 = b2 * x - a2 * y;
+				return y;
+			}
+
+			void Reset() { z1 = 0.0; z2 = 0.0; }
+		};
+
+		void AddSample(FTYPE x)
+		{
+			FTYPE k = highpass.Process(shelf.Process(x));
+			dSquares += k * k;
+			if (++nInBlock == nSubBlock)
+			{
+				vecEnergy.push_back(dSquares / nSubBlock);
+				dSquares = 0.0;
+				nInBlock = 0;
+			}
+
+			// Each sample twice, so the last TAPS are always in a row
+			nHistory = (nHistory + 1) % TAPS;
+			fHistory[nHistory] = x;
+			fHistory[nHistory + TAPS] = x;
+			const FTYPE *pLast = fHistory + nHistory + 1;
+
+			for (int p = 0; p < PHASES; p++)
+			{
+				FTYPE y = 0.0;
+				for (int t = 0; t < TAPS; t++)
+					y += fPhase[p][t] * pLast[TAPS - 1 - t];
+				dPeak = max(dPeak, fabs(y));
+			}
+			dPeak = max(dPeak, fabs(x));
+		}
+
+		// Mean energy of every run of nSub 100 ms blocks, one run per 100 ms
+		void Blocks(size_t nSub, vector<FTYPE> &vecBlocks) const
+		{
+			FTYPE dSum = 0.0;
+			for (size_t i = 0; i < vecEnergy.size(); i++)
+			{
+				dSum += vecEnergy[i];
+				if (i >= nSub)
+					dSum -= vecEnergy[i - nSub];
+				if (i + 1 >= nSub)
+					vecBlocks.push_back(max(0.0, dSum) / nSub);
+			}
+		}
+
+		// Mean energy of the blocks above -70 LUFS and fRelative LU below the
+		// mean of those
+		static FTYPE GatedMean(const vector<FTYPE> &vecBlocks, FTYPE fRelative, vector<FTYPE> *pGated)
+		{
+			FTYPE dAbsolute = Energy(-70.0);
+			FTYPE dSum = 0.0;
+			size_t nCount = 0;
+			for (FTYPE e : vecBlocks)
+				if (e > dAbsolute)
+				{
+					dSum += e;
+					nCount++;
+				}
+			if (nCount == 0)
+				return 0.0;
+
+			FTYPE dGate = max(dAbsolute, dSum / nCount * math::pow(10.0, -fRelative / 10.0));
+			dSum = 0.0;
+			nCount = 0;
+			for (FTYPE e : vecBlocks)
+				if (e > dGate)
+				{
+					dSum += e;
+					nCount++;
+					if (pGated != nullptr)
+						pGated->push_back(e);
+				}
+			return nCount > 0 ? dSum / nCount : 0.0;
+		}
+
+		static FTYPE Lufs(FTYPE dEnergy)
+		{
+			return dEnergy > 0.0 ? -0.691 + 10.0 * math::log10(dEnergy) : -INFINITY;
+		}
+
+		static FTYPE Energy(FTYPE fLufs)
+		{
+			return math::pow(10.0, (fLufs + 0.691) / 10.0);
+		}
+
+	private:
+		unsigned int nSampleRate;
+		unsigned int nSubBlock;		// Samples per 100 ms
+		biquad shelf;
+		biquad highpass;
+		FTYPE dSquares;
+		unsigned int nInBlock;
+		vector<FTYPE> vecEnergy;	// Mean K-weighted square of each 100 ms
+
+		FTYPE fPhase[PHASES][TAPS];
+		FTYPE fHistory[2 * TAPS];
+		int nHistory;
+		FTYPE dPeak;
+	};
+
+	// dB to bring a measured render to fTarget LUFS, lowered if its true peak
+	// would go over fCeiling dBTP. 0 for silence.
+	inline FTYPE loudness_gain(const loudness_meter &meter, FTYPE fTarget, FTYPE fCeiling = -1.0)
+	{
+		FTYPE fLoudness = meter.Integrated();
+		if (!isfinite(fLoudness))
+			return 0.0;
+		FTYPE fGain = fTarget - fLoudness;
+		FTYPE fPeak = meter.TruePeak();
+		if (isfinite(fPeak))
+			fGain = min(fGain, fCeiling - fPeak);
+		return fGain;
+	}
+
+	// Scales 16-bit samples in place, rounding and saturating
+	inline void gain_pcm16(int16_t *pSamples, size_t nSamples, float fGain)
+	{
+		size_t i = 0;
+#if defined(__AVX2__)
+		__m256 g = _mm256_set1_ps(fGain);
+		for (; i + 16 <= nSamples; i += 16)
+		{
+			__m256i x = _mm256_loadu_si256((const __m256i*)(pSamples + i));
+			__m256i lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(x));
+			__m256i hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(x, 1));
+			lo = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(lo), g));
+			hi = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(hi), g));
+
+			// The pack works within 128 bit lanes, so the halves come out interleaved
+			__m256i y = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8);
+			_mm256_storeu_si256((__m256i*)(pSamples + i), y);
+		}
+#endif
+		for (; i < nSamples; i++)
+			pSamples[i] = (int16_t)max(-32768.0f, min(32767.0f, nearbyintf(pSamples[i] * fGain)));
+	}
+
+	// Applies fGainDb to a 16-bit PCM WAV in place through a mapping of the
+	// file. With pOverview, the overview is rebuilt from the new samples in the
+	// same pass and finished.
+	inline bool normalize_wav(const wstring &sPath, FTYPE fGainDb, overview *pOverview = nullptr)
+	{
+		platform::mapped_file file;
+		if (!file.Open(sPath, true) || file.Size() < 44)
+			return false;
+
+		bool bOk = false;
+		char *pData = file.Data();
+		if (memcmp(pData, "RIFF", 4) == 0 && memcmp(pData + 8, "WAVE", 4) == 0)
+		{
+			size_t nFileSize = file.Size();
+			uint16_t nFormat = 0, nBits = 0;
+			size_t nPos = 12;
+			while (nPos + 8 <= nFileSize)
+			{
+				uint32_t nChunk;
+				memcpy(&nChunk, pData + nPos + 4, 4);
+				if (memcmp(pData + nPos, "fmt ", 4) == 0 && nChunk >= 16 && nPos + 8 + 16 <= nFileSize)
+				{
+					memcpy(&nFormat, pData + nPos + 8, 2);
+					memcpy(&nBits, pData + nPos + 8 + 14, 2);
+				}
+				else if (memcmp(pData + nPos, "data", 4) == 0)
+				{
+					if (nFormat != 1 || nBits != 16 || (nPos + 8) % 2 != 0)
+						break;
+
+					size_t nSamples = min((size_t)nChunk, nFileSize - nPos - 8) / 2;
+					int16_t *pSamples = (int16_t*)(pData + nPos + 8);
+					float fGain = (float)math::pow(10.0, fGainDb / 20.0);
+
+					// In chunks, so the overview reads each while it is in cache
+					const size_t nBlock = 65536;
+					if (pOverview != nullptr)
+						pOverview->Clear();
+					for (size_t n = 0; n < nSamples; n += nBlock)
+					{
+						size_t nCount = min(nBlock, nSamples - n);
+						gain_pcm16(pSamples + n, nCount, fGain);
+						if (pOverview != nullptr)
+							pOverview->Add(pSamples + n, nCount);
+					}
+					if (pOverview != nullptr)
+						pOverview->Finish();
+					bOk = file.Flush();
+					break;
+				}
+				nPos += 8 + nChunk + (nChunk & 1);
+			}
+		}
+
+		return bOk;
+	}
+
+}
@@ -0,0 +1,283 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+// Everything here is built from +, -, *, / and integer conversion, which IEEE 754
+// defines exactly, so results are bit-identical on every x86-64 build. Fused
+// multiply-add contraction would break that: keep /fp:precise (MSVC) or
+// -ffp-contract=off (GCC/Clang) when building with FMA enabled.
+#ifdef _MSC_VER
+#pragma fp_contract(off)
+#endif
+
+namespace synth
+{
+	namespace math
+	{
+		const double PI = 3.14159265358979323846;
+
+		inline double fabs(double x)
+		{
+			return x < 0.0 ? -x : x;
+		}
+
+		// Round toward zero, valid for all finite doubles
+		inline double trunc(double x)
+		{
+			if (fabs(x) >= 4503599627370496.0) // 2^52, already integral
+				return x;
+			return (double)(int64_t)x;
+		}
+
+		inline double floor(double x)
+		{
+			double t = trunc(x);
+			return t > x ? t - 1.0 : t;
+		}
+
+		inline int64_t round_to_int(double x)
+		{
+			return (int64_t)(x >= 0.0 ? x + 0.5 : x - 0.5);
+		}
+
+		// Result has the sign of x, as std::fmod
+		inline double fmod(double x, double y)
+		{
+			return x - y * trunc(x / y);
+		}
+
+		// 2^n built directly in the exponent field
+		inline double pow2i(int n)
+		{
+			if (n > 1023) n = 1023;
+			if (n < -1022) n = -1022;
+			uint64_t nBits = (uint64_t)(n + 1023) << 52;
+			double d;
+			memcpy(&d, &nBits, sizeof(d));
+			return d;
+		}
+
+		// Reduces x to r in [-pi/4, pi/4] with x = r + q * pi/2, returns q
+		inline int64_t reduce_half_pi(double x, double &r)
+		{
+			// pi/2 split in three so that q * part is exact for the leading parts
+			const double dPio2_1 = 1.57079632673412561417e+00;
+			const double dPio2_2 = 6.07710050630396597660e-11;
+			const double dPio2_3 = 2.02226624871116645580e-21;
+			const double dInvPio2 = 6.36619772367581382433e-01;
+
+			int64_t q = round_to_int(x * dInvPio2);
+			double dq = (double)q;
+			r = ((x - dq * dPio2_1) - dq * dPio2_2) - dq * dPio2_3;
+			return q;
+		}
+
+		// Minimax polynomials on [-pi/4, pi/4] (coefficients from fdlibm)
+		inline double kernel_sin(double x)
+		{
+			const double S1 = -1.66666666666666324348e-01, S2 = 8.33333333332248946124e-03;
+			const double S3 = -1.98412698298579493134e-04, S4 = 2.75573137070700676789e-06;
+			const double S5 = -2.50507602534068634195e-08, S6 = 1.58969099521155010221e-10;
+			double z = x * x;
+			double r = S2 + z * (S3 + z * (S4 + z * (S5 + z * S6)));
+			return x + z * x * (S1 + z * r);
+		}
+
+		inline double kernel_cos(double x)
+		{
+			const double C1 = 4.16666666666666019037e-02, C2 = -1.38888888888741095749e-03;
+			const double C3 = 2.48015872894767294178e-05, C4 = -2.75573143513906633035e-07;
+			const double C5 = 2.08757232129817482790e-09, C6 = -1.13596475577881948265e-11;
+			double z = x * x;
+			double r = z * (C1 + z * (C2 + z * (C3 + z * (C4 + z * (C5 + z * C6)))));
+			return 1.0 - (0.5 * z - z * r);
+		}
+
+		// sin(r + q * pi/2). Both kernels are evaluated and the quadrant picked by
+		// selects rather than branches, so loops over sin() can be vectorized
+		inline double sin_quadrant(int64_t q, double r)
+		{
+			double s = kernel_sin(r);
+			double c = kernel_cos(r);
+			double v = (q & 1) ? c : s;
+			return (q & 2) ? -v : v;
+		}
+
+		inline double sin(double x)
+		{
+			double r;
+			int64_t q = reduce_half_pi(x, r);
+			return sin_quadrant(q, r);
+		}
+
+		inline double cos(double x)
+		{
+			double r;
+			int64_t q = reduce_half_pi(x, r);
+			return sin_quadrant(q + 1, r);
+		}
+
+		// asin(sin(x)) * 2/pi, the triangle wave, without either function
+		inline double triangle(double x)
+		{
+			int64_t k = round_to_int(x / PI);
+			double r = (x - (double)k * PI) * (2.0 / PI);
+			return (k & 1) ? -r : r;
+		}
+
+		inline double exp(double x)
+		{
+			const double dLn2Hi = 6.93147180369123816490e-01;
+			const double dLn2Lo = 1.90821492927058770002e-10;
+			const double dInvLn2 = 1.44269504088896338700e+00;
+			const double P1 = 1.66666666666666019037e-01, P2 = -2.77777777770155933842e-03;
+			const double P3 = 6.61375632143793436117e-05, P4 = -1.65339022054652515390e-06;
+			const double P5 = 4.13813679705723846039e-08;
+
+			if (x > 709.78) return pow2i(1023) * 2.0;	// Overflows to infinity
+			if (x < -745.13) return 0.0;
+
+			int64_t k = round_to_int(x * dInvLn2);
+			double hi = x - (double)k * dLn2Hi;
+			double lo = (double)k * dLn2Lo;
+			double r = hi - lo;
+			double z = r * r;
+			double c = r - z * (P1 + z * (P2 + z * (P3 + z * (P4 + z * P5))));
+			double y = 1.0 - ((lo - (r * c) / (2.0 - c)) - hi);
+
+			// Scale in two steps so subnormal results don't need a special case
+			if (k < -1021)
+				return y * pow2i((int)k + 1000) * pow2i(-1000);
+			return y * pow2i((int)k);
+		}
+
+		// Natural log, fdlibm's reduction to [sqrt(2)/2, sqrt(2)) and polynomial
+		inline double log(double x)
+		{
+			const double dLn2Hi = 6.93147180369123816490e-01;
+			const double dLn2Lo = 1.90821492927058770002e-10;
+			const double Lg1 = 6.666666666666735130e-01, Lg2 = 3.999999999940941908e-01;
+			const double Lg3 = 2.857142874366239149e-01, Lg4 = 2.222219843214978396e-01;
+			const double Lg5 = 1.818357216161805012e-01, Lg6 = 1.531383769920937332e-01;
+			const double Lg7 = 1.479819860511658591e-01;
+
+			if (!(x > 0.0))
+				return x == 0.0 ? -std::numeric_limits<double>::infinity() : std::numeric_limits<double>::quiet_NaN();
+			if (x > 1.7976931348623157e308)
+				return x;
+
+			int k = 0;
+			if (x < 2.2250738585072014e-308)	// Subnormal, scale it up by 2^54
+			{
+				x *= 18014398509481984.0;
+				k = -54;
+			}
+
+			uint64_t nBits;
+			memcpy(&nBits, &x, sizeof(nBits));
+			k += (int)(nBits >> 52) - 1023;
+			nBits = (nBits & 0x000FFFFFFFFFFFFFull) | 0x3FF0000000000000ull;
+			double m;
+			memcpy(&m, &nBits, sizeof(m));
+			if (m > 1.4142135623730951)
+			{
+				m *= 0.5;
+				k++;
+			}
+
+			double f = m - 1.0;
+			double s = f / (2.0 + f);
+			double z = s * s;
+			double w = z * z;
+			double t1 = w * (Lg2 + w * (Lg4 + w * Lg6));
+			double t2 = z * (Lg1 + w * (Lg3 + w * (Lg5 + w * Lg7)));
+			double R = t2 + t1;
+			double dHalfSquare = 0.5 * f * f;
+			double dk = (double)k;
+			return dk * dLn2Hi - ((dHalfSquare - (s * (dHalfSquare + R) + dk * dLn2Lo)) - f);
+		}
+
+		inline double log10(double x)
+		{
+			return log(x) * 0.43429448190325182765;
+		}
+
+		// x^y for x > 0, as exp(y log(x)). Within a few ulp while y log(x) is
+		// small, as it is for gains and frequency ratios; not for huge powers.
+		inline double pow(double x, double y)
+		{
+			if (x == 0.0)
+				return y > 0.0 ? 0.0 : std::numeric_limits<double>::infinity();
+			return exp(y * log(x));
+		}
+
+		inline double tan(double x)
+		{
+			double r;
+			int64_t q = reduce_half_pi(x, r);
+			double s = kernel_sin(r);
+			double c = kernel_cos(r);
+			return (q & 1) ? -c / s : s / c;
+		}
+
+		// 2^(n/12), exact to the double nearest each semitone ratio
+		inline double semitones(int n)
+		{
+			static const double dRatio[12] = {
+				1.0, 1.0594630943592953, 1.122462048309373, 1.189207115002721,
+				1.2599210498948732, 1.3348398541700344, 1.4142135623730951, 1.4983070768766815,
+				1.5874010519681996, 1.681792830507429, 1.7817974362806785, 1.887748625363387 };
+
+			int nOctave = n >= 0 ? n / 12 : -((11 - n) / 12);
+			return dRatio[n - nOctave * 12] * pow2i(nOctave);
+		}
+
+		// Block form
+		inline void sin(const double *pIn, double *pOut, size_t n)
+		{
+			for (size_t i = 0; i < n; i++)
+				pOut[i] = sin(pIn[i]);
+		}
+
+
+		// xorshift64* generator. Unlike rand() it produces the same stream with
+		// every C runtime, so noise renders identically on every host.
+		struct random
+		{
+			random(uint64_t nSeed = 0x9E3779B97F4A7C15ull)
+			{
+				nState = nSeed != 0 ? nSeed : 1;
+			}
+
+			uint64_t next()
+			{
+				nState ^= nState >> 12;
+				nState ^= nState << 25;
+				nState ^= nState >> 27;
+				return nState * 0x2545F4914F6CDD1Dull;
+			}
+
+			// Uniform in [0, 1)
+			double uniform()
+			{
+				return (double)(next() >> 11) * (1.0 / 9007199254740992.0);
+			}
+
+			uint64_t nState;
+		};
+
+		// Per thread noise source, reseed it for a reproducible render
+		inline random& noise_source()
+		{
+			thread_local random rng;
+			return rng;
+		}
+
+		// Uniform in [-1, 1)
+		inline double noise()
+		{
+			return 2.0 * noise_source().uniform() - 1.0;
+		}
+	}
+}
@@ -0,0 +1,292 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <type_traits>
+#include <vector>
+using namespace std;
+#define FTYPE double
+
+#include "Half.h"
+
+namespace synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Memory Accounting
+	//
+	// Accounts exist per engine and per instrument. Voices have none of their
+	// own: they are charged under MEM_VOICES to the pool that holds them, the
+	// engine's notes or an instrument's voice list.
+
+	enum MEMORY_CATEGORY {
+		MEM_VOICES,		// Note/voice pools
+		MEM_SCRATCH,	// Block buffers and scratch arenas
+		MEM_TABLES,		// Wavetables and lookup tables
+		MEM_CACHES,		// Rendered sample caches, evictable
+		MEM_IO,			// Device and file rings
+		MEM_CATEGORIES,
+	};
+
+	// Snapshot of an account, in bytes
+	struct memory_usage
+	{
+		size_t nCurrent[MEM_CATEGORIES] = {};
+		size_t nPeak[MEM_CATEGORIES] = {};
+		size_t nBudget[MEM_CATEGORIES] = {};
+
+		size_t Total() const
+		{
+			size_t n = 0;
+			for (int c = 0; c < MEM_CATEGORIES; c++)
+				n += nCurrent[c];
+			return n;
+		}
+	};
+
+	// Counts bytes by category. Accounts chain to a parent (instrument -> engine)
+	// so every allocation is seen at each level. Whichever of a parent and child
+	// goes first unlinks them. A budget of 0 means unlimited.
+	// Counting never refuses an allocation. Only sample_cache enforces a budget,
+	// evicting under MEM_CACHES; tables are read by every voice every block and
+	// are never evicted, so a budget on any other category is only reported
+	// through OverBudget.
+	struct memory_account
+	{
+	public:
+		memory_account(memory_account *parent = nullptr)
+		{
+			pParent = nullptr;
+			for (int c = 0; c < MEM_CATEGORIES; c++)
+			{
+				nCurrent[c] = 0;
+				nPeak[c] = 0;
+				nBudget[c] = 0;
+			}
+			SetParent(parent);
+		}
+
+		memory_account(const memory_account&) = delete;
+		memory_account& operator=(const memory_account&) = delete;
+
+		~memory_account()
+		{
+			DetachChildren();
+			SetParent(nullptr);
+		}
+
+		// Moves the account under another parent, or none, taking what it holds
+		// now along: the old chain stops counting it and the new one counts what
+		// was charged before the move as well as after. Not while anything is
+		// allocating through the account.
+		void SetParent(memory_account *parent)
+		{
+			if (parent == pParent)
+				return;
+
+			for (int c = 0; c < MEM_CATEGORIES; c++)
+			{
+				size_t nBytes = nCurrent[c];
+				if (pParent != nullptr) pParent->Free((MEMORY_CATEGORY)c, nBytes);
+				if (parent != nullptr) parent->Allocate((MEMORY_CATEGORY)c, nBytes);
+			}
+
+			if (pParent != nullptr)
+				pParent->vecChildren.erase(find(pParent->vecChildren.begin(), pParent->vecChildren.end(), this));
+			pParent = parent;
+			if (pParent != nullptr)
+				pParent->vecChildren.push_back(this);
+		}
+
+		memory_account* Parent() const
+		{
+			return pParent;
+		}
+
+		// Every child stops charging this account
+		void DetachChildren()
+		{
+			while (!vecChildren.empty())
+				vecChildren.back()->SetParent(nullptr);
+		}
+
+		void Allocate(MEMORY_CATEGORY c, size_t nBytes)
+		{
+			for (memory_account *a = this; a != nullptr; a = a->pParent)
+			{
+				size_t nNow = a->nCurrent[c].fetch_add(nBytes) + nBytes;
+				size_t nOld = a->nPeak[c].load();
+				while (nNow > nOld && !a->nPeak[c].compare_exchange_weak(nOld, nNow));
+			}
+		}
+
+		void Free(MEMORY_CATEGORY c, size_t nBytes)
+		{
+			for (memory_account *a = this; a != nullptr; a = a->pParent)
+				a->nCurrent[c].fetch_sub(nBytes);
+		}
+
+		void SetBudget(MEMORY_CATEGORY c, size_t nBytes)
+		{
+			nBudget[c] = nBytes;
+		}
+
+		// True if this account, or any parent, is over its budget for the category
+		bool OverBudget(MEMORY_CATEGORY c) const
+		{
+			for (const memory_account *a = this; a != nullptr; a = a->pParent)
+				if (a->nBudget[c] > 0 && a->nCurrent[c] > a->nBudget[c])
+					return true;
+			return false;
+		}
+
+		memory_usage Usage() const
+		{
+			memory_usage u;
+			for (int c = 0; c < MEM_CATEGORIES; c++)
+			{
+				u.nCurrent[c] = nCurrent[c];
+				u.nPeak[c] = nPeak[c];
+				u.nBudget[c] = nBudget[c];
+			}
+			return u;
+		}
+
+	private:
+		memory_account *pParent;
+		vector<memory_account*> vecChildren;
+		atomic<size_t> nCurrent[MEM_CATEGORIES];
+		atomic<size_t> nPeak[MEM_CATEGORIES];
+		atomic<size_t> nBudget[MEM_CATEGORIES];
+	};
+
+
+	// Standard allocator that charges everything it hands out to an account
+	template<class T, MEMORY_CATEGORY C>
+	struct tracked_allocator
+	{
+		typedef T value_type;
+		template<class U> struct rebind { typedef tracked_allocator<U, C> other; };
+
+		tracked_allocator(memory_account *account = nullptr) noexcept : pAccount(account) {}
+		template<class U> tracked_allocator(const tracked_allocator<U, C> &a) noexcept : pAccount(a.pAccount) {}
+
+		T* allocate(size_t n)
+		{
+			if (pAccount != nullptr) pAccount->Allocate(C, n * sizeof(T));
+			return std::allocator<T>().allocate(n);
+		}
+
+		void deallocate(T *p, size_t n)
+		{
+			if (pAccount != nullptr) pAccount->Free(C, n * sizeof(T));
+			std::allocator<T>().deallocate(p, n);
+		}
+
+		template<class U> bool operator==(const tracked_allocator<U, C> &a) const { return pAccount == a.pAccount; }
+		template<class U> bool operator!=(const tracked_allocator<U, C> &a) const { return pAccount != a.pAccount; }
+
+		memory_account *pAccount;
+	};
+
+	template<class T, MEMORY_CATEGORY C>
+	using tracked_vector = vector<T, tracked_allocator<T, C>>;
+
+
+	// Rendered sample buffers kept by key, least recently used evicted first
+	// whenever the owning account (or a parent) goes over its cache budget.
+	// SAMPLE may be half or bfloat16 to store compactly. Not thread safe; fill
+	// and query it from one thread.
+	template<class KEY, class SAMPLE = FTYPE>
+	struct sample_cache
+	{
+	public:
+		typedef tracked_vector<SAMPLE, MEM_CACHES> buffer;
+
+		sample_cache(memory_account *account = nullptr)
+		{
+			pAccount = account;
+		}
+
+		// Returns nullptr if not cached
+		const buffer* Find(const KEY &key)
+		{
+			auto f = mapEntries.find(key);
+			if (f == mapEntries.end())
+				return nullptr;
+
+			// Move to the front of the LRU list
+			listLRU.splice(listLRU.begin(), listLRU, f->second);
+			return &f->second->second;
+		}
+
+		const buffer& Insert(const KEY &key, const SAMPLE *pData, size_t nSamples)
+		{
+			return Insert(key, buffer(pData, pData + nSamples, tracked_allocator<SAMPLE, MEM_CACHES>(pAccount)));
+		}
+
+		// Converts FTYPE samples into the cache's storage format
+		template<class S = SAMPLE, class = typename enable_if<!is_same<S, FTYPE>::value>::type>
+		const buffer& Insert(const KEY &key, const FTYPE *pData, size_t nSamples)
+		{
+			buffer b(nSamples, SAMPLE(), tracked_allocator<SAMPLE, MEM_CACHES>(pAccount));
+			store_samples(pData, b.data(), nSamples);
+			return Insert(key, move(b));
+		}
+
+		const buffer& Insert(const KEY &key, buffer &&b)
+		{
+			Erase(key);
+
+			listLRU.emplace_front(key, move(b));
+			mapEntries[key] = listLRU.begin();
+
+			// Evict until under budget, but never the entry just added
+			while (listLRU.size() > 1 && pAccount != nullptr && pAccount->OverBudget(MEM_CACHES))
+			{
+				mapEntries.erase(listLRU.back().first);
+				listLRU.pop_back();
+				nEvictions++;
+			}
+
+			return listLRU.front().second;
+		}
+
+		// Reads nSamples from nOffset of a cached buffer back as FTYPE
+		static void Load(const buffer &b, size_t nOffset, FTYPE *pOut, size_t nSamples)
+		{
+			load_samples(b.data() + nOffset, pOut, nSamples);
+		}
+
+		void Erase(const KEY &key)
+		{
+			auto f = mapEntries.find(key);
+			if (f != mapEntries.end())
+			{
+				listLRU.erase(f->second);
+				mapEntries.erase(f);
+			}
+		}
+
+		void Clear()
+		{
+			mapEntries.clear();
+			listLRU.clear();
+		}
+
+		size_t Size() const
+		{
+			return listLRU.size();
+		}
+
+	public:
+		memory_account *pAccount;
+		unsigned long long nEvictions = 0;
+
+	private:
+		list<pair<KEY, buffer>> listLRU;
+		map<KEY, typename list<pair<KEY, buffer>>::iterator> mapEntries;
+	};
+
+}
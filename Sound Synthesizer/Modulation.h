@@ -0,0 +1,451 @@
+#pragma once
+#include <cstdint>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "Wavetable.h"
+
+namespace synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Modulation Matrix
+	//
+	// Routes from per-voice sources to the parameters of a voice, kept as a short
+	// list of the routes in use rather than a sources by destinations grid. A
+	// voice evaluates them at control rate, every CONTROL samples, and ramps in
+	// between. Sources no route reads are never computed and destinations no
+	// route writes cost nothing, so an instrument pays only for what is patched.
+
+	enum MOD_SOURCE : uint8_t
+	{
+		MOD_ENVELOPE,	// The instrument's amplitude envelope
+		MOD_ENVELOPE2,	// The matrix's own envelope
+		MOD_LFO1,
+		MOD_LFO2,
+		MOD_VELOCITY,
+		MOD_KEY,		// Octaves from note 64
+		MOD_RANDOM,		// -1 to +1, fixed for the life of a voice
+		MOD_SOURCES,
+	};
+
+	enum MOD_DEST : uint8_t
+	{
+		MOD_PITCH,		// Semitones
+		MOD_GAIN,		// Added to a gain of 1
+		MOD_FILTER,		// Octaves of cutoff
+		MOD_PAN,		// Radians of azimuth
+		MOD_POSITION,	// Wavetable frames
+		MOD_DESTS,
+	};
+
+	struct mod_route
+	{
+		uint8_t nSource;
+		uint8_t nDest;
+		uint16_t nPad;
+		float fAmount;		// Destination units at a source value of 1
+	};
+
+	static_assert(sizeof(mod_route) == 8, "mod_route layout");
+
+	// Every destination at the control points of a run of up to MAX_SAMPLES,
+	// the first at its first sample
+	struct mod_block
+	{
+		static constexpr unsigned int CONTROL = 32;		// Samples between control points
+		static constexpr unsigned int MAX_SAMPLES = 256;
+		static constexpr unsigned int POINTS = 12;		// MAX_SAMPLES / CONTROL + 1, in whole vectors
+
+		unsigned int nPoints = 0;
+		uint32_t nDests = 0;	// Bit per destination some route writes
+		alignas(32) FTYPE fValue[MOD_DESTS][POINTS];
+
+		bool Uses(MOD_DEST d) const
+		{
+			return (nDests >> d) & 1;
+		}
+
+		// Sample s of the run, ramped between control points
+		FTYPE At(MOD_DEST d, unsigned int s) const
+		{
+			unsigned int k = s / CONTROL;
+			FTYPE f = (FTYPE)(s % CONTROL) / CONTROL;
+			return fValue[d][k] + (fValue[d][min(k + 1, nPoints - 1)] - fValue[d][k]) * f;
+		}
+	};
+
+	struct mod_lfo
+	{
+		FTYPE fHertz;
+		TYPE shape;		// OSC_SINE, OSC_TRIANGLE or OSC_SQUARE, from the start of the voice
+	};
+
+	struct modulation_matrix
+	{
+	public:
+		envelope_adsr env2;
+		mod_lfo lfo1;
+		mod_lfo lfo2;
+
+		modulation_matrix()
+		{
+			env2.dAttackTime = 0.0;
+			env2.dDecayTime = 0.5;
+			env2.dSustainAmplitude = 0.2;
+			env2.dReleaseTime = 0.3;
+			lfo1 = { 5.0, OSC_SINE };
+			lfo2 = { 0.25, OSC_TRIANGLE };
+			nSources = 0;
+			nDests = 0;
+		}
+
+		// Sets the amount of a route, 0 removes it
+		void Route(MOD_SOURCE src, MOD_DEST dest, float fAmount)
+		{
+			auto r = find_if(vecRoutes.begin(), vecRoutes.end(), [src, dest](const mod_route &x) { return x.nSource == src && x.nDest == dest; });
+			if (r != vecRoutes.end())
+			{
+				if (fAmount == 0.0f)
+					vecRoutes.erase(r);
+				else
+					r->fAmount = fAmount;
+			}
+			else if (fAmount != 0.0f)
+				vecRoutes.push_back({ src, dest, 0, fAmount });
+
+			nSources = 0;
+			nDests = 0;
+			for (auto &x : vecRoutes)
+			{
+				nSources |= 1u << x.nSource;
+				nDests |= 1u << x.nDest;
+			}
+		}
+
+		void Clear()
+		{
+			vecRoutes.clear();
+			nSources = 0;
+			nDests = 0;
+		}
+
+		size_t Routes() const { return vecRoutes.size(); }
+		bool Uses(MOD_DEST d) const { return (nDests >> d) & 1; }
+
+		// Fills out for nSamples (up to mod_block::MAX_SAMPLES) of voice n from
+		// dTime. envAmp is the instrument's amplitude envelope.
+		void Evaluate(const note &n, envelope_adsr &envAmp, const FTYPE dTime, const FTYPE dTimeStep, unsigned int nSamples, mod_block &out)
+		{
+			const unsigned int C = mod_block::CONTROL;
+			out.nPoints = (min(nSamples, mod_block::MAX_SAMPLES) + C - 1) / C + 1;
+			out.nDests = nDests;
+			unsigned int nVec = (out.nPoints + 3) & ~3u;
+
+			alignas(32) FTYPE fSource[MOD_SOURCES][mod_block::POINTS];
+			for (int src = 0; src < MOD_SOURCES; src++)
+			{
+				if (!((nSources >> src) & 1))
+					continue;
+				FTYPE *pSrc = fSource[src];
+				for (unsigned int k = 0; k < nVec; k++)
+				{
+					FTYPE t = dTime + (FTYPE)(k * C) * dTimeStep;
+					switch (src)
+					{
+					case MOD_ENVELOPE: pSrc[k] = synth::env(t, envAmp, n.on, n.off); break;
+					case MOD_ENVELOPE2: pSrc[k] = synth::env(t, env2, n.on, n.off); break;
+					case MOD_LFO1: pSrc[k] = osc(t - n.on, lfo1.fHertz, lfo1.shape); break;
+					case MOD_LFO2: pSrc[k] = osc(t - n.on, lfo2.fHertz, lfo2.shape); break;
+					case MOD_VELOCITY: pSrc[k] = n.velocity; break;
+					case MOD_KEY: pSrc[k] = (n.id - 64) / 12.0; break;
+					case MOD_RANDOM: pSrc[k] = Random(n); break;
+					}
+				}
+			}
+
+			for (int d = 0; d < MOD_DESTS; d++)
+				if ((nDests >> d) & 1)
+					for (unsigned int k = 0; k < mod_block::POINTS; k++)
+						out.fValue[d][k] = 0.0;
+
+			// Each route adds its source, scaled, to its destination
+			for (auto &r : vecRoutes)
+			{
+				const FTYPE *pSrc = fSource[r.nSource];
+				FTYPE *pDest = out.fValue[r.nDest];
+				unsigned int k = 0;
+#if defined(__AVX2__)
+				__m256d vAmount = _mm256_set1_pd(r.fAmount);
+				for (; k < nVec; k += 4)
+					_mm256_store_pd(pDest + k, _mm256_add_pd(_mm256_load_pd(pDest + k), _mm256_mul_pd(_mm256_load_pd(pSrc + k), vAmount)));
+#endif
+				for (; k < nVec; k++)
+					pDest[k] += pSrc[k] * r.fAmount;
+			}
+		}
+
+	private:
+		// Hash of the voice's key and start time
+		static FTYPE Random(const note &n)
+		{
+			uint64_t nBits;
+			memcpy(&nBits, &n.on, sizeof(nBits));
+			uint64_t h = (nBits ^ ((uint64_t)(uint32_t)n.id << 32)) * 0x9E3779B97F4A7C15ull;
+			h ^= h >> 29;
+			h *= 0xBF58476D1CE4E5B9ull;
+			h ^= h >> 32;
+			return (FTYPE)(h >> 11) / (FTYPE)(1ull << 52) - 1.0;
+		}
+
+	private:
+		vector<mod_route> vecRoutes;
+		uint32_t nSources;	// Bit per source some route reads
+		uint32_t nDests;
+	};
+
+
+	// Wavetable voice through a resonant low pass, every parameter patched
+	// through a modulation matrix. Unlike the other instruments its voices keep
+	// state (phase, filter), found by key and start time, and caught up when
+	// the clock jumps so they still depend only on the time rendered.
+	struct instrument_modsynth : public instrument_base
+	{
+		modulation_matrix mod;
+		FTYPE fPosition;	// Frame with no modulation
+		FTYPE fCutoff;		// Hz with no modulation
+		FTYPE fResonance;	// 0 to 1
+
+		instrument_modsynth() : table(&mem), vecVoices(tracked_allocator<voice, MEM_VOICES>(&mem))
+		{
+			env.dAttackTime = 0.02;
+			env.dDecayTime = 0.4;
+			env.dSustainAmplitude = 0.8;
+			env.dReleaseTime = 0.3;
+			fMaxLifeTime = -1.0;
+			dVolume = 0.4;
+			name = L"Mod Synth";
+
+			fPosition = 0.0;
+			fCutoff = 400.0;
+			fResonance = 0.4;
+			nSampleRate = 44100;
+
+			// Vibrato, a filter sweep that tracks the keyboard, and a slow drift
+			// through the table and across the speakers
+			mod.Route(MOD_LFO1, MOD_PITCH, 0.15f);
+			mod.Route(MOD_ENVELOPE2, MOD_FILTER, 4.0f);
+			mod.Route(MOD_KEY, MOD_FILTER, 1.0f);
+			mod.Route(MOD_LFO2, MOD_POSITION, 3.0f);
+			mod.Route(MOD_LFO2, MOD_PAN, 0.5f);
+
+			vecVoices.reserve(32);
+		}
+
+		// Saw morphing to square over eight frames
+		virtual void Prepare(unsigned int sampleRate)
+		{
+			nSampleRate = sampleRate;
+			if (table.Frames() > 0)
+				return;
+
+			const unsigned int nFrames = 8;
+			table.Build(nFrames, [nFrames](unsigned int f, unsigned int h) {
+				FTYPE m = (FTYPE)f / (nFrames - 1);
+				return (h & 1) ? 1.0 / h : (1.0 - m) / h;
+			});
+		}
+
+		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished)
+		{
+			FTYPE dSample = 0.0;
+			SoundBlock(dTime, 1.0 / nSampleRate, n, &dSample, 1, bNoteFinished);
+			return dSample;
+		}
+
+		virtual bool SoundBlock(const FTYPE dTime, const FTYPE dTimeStep, const synth::note &n, FTYPE *pOut, unsigned int nSamples, bool &bNoteFinished)
+		{
+			if (table.Frames() == 0)
+				Prepare((unsigned int)math::round_to_int(1.0 / dTimeStep));
+
+			voice &v = Voice(n, dTime, dTimeStep);
+			Run(v, n, dTime, dTimeStep, pOut, nSamples, bNoteFinished);
+			v.dLast = dTime + nSamples * dTimeStep;
+			if (bNoteFinished)
+				vecVoices.erase(vecVoices.begin() + (&v - vecVoices.data()));
+			return true;
+		}
+
+		virtual FTYPE Azimuth(const FTYPE dTime, const synth::note &n)
+		{
+			if (!mod.Uses(MOD_PAN))
+				return n.azimuth;
+			mod_block m;
+			mod.Evaluate(n, env, dTime, 1.0 / nSampleRate, 1, m);
+			return n.azimuth + m.fValue[MOD_PAN][0];
+		}
+
+	private:
+		struct voice
+		{
+			int nId;
+			FTYPE dOn;
+			FTYPE dLast;	// End of the last run rendered
+			FTYPE dPhase;	// Cycles, 0 to 1
+			FTYPE z1, z2;	// Filter state
+			FTYPE a1, a2, a3;
+		};
+
+		// Samples of the filter run before a voice picked up mid note, enough for
+		// it to settle at the lowest cutoffs the matrix reaches
+		static constexpr unsigned int SETTLE = 4096;
+
+		// State of the voice, new if it hasn't played yet. Voices that stopped
+		// being rendered without finishing (cut off, or the clock moved) go. One
+		// picked up anywhere but where its last run ended (a seek, a rewound
+		// burst, a segment or a checkpoint starting mid note) is caught up first,
+		// so a voice still renders as a function of time like the other
+		// instruments'.
+		voice& Voice(const note &n, FTYPE dTime, FTYPE dTimeStep)
+		{
+			vecVoices.erase(remove_if(vecVoices.begin(), vecVoices.end(), [dTime](const voice &v) { return math::fabs(dTime - v.dLast) > 1.0; }), vecVoices.end());
+
+			auto v = find_if(vecVoices.begin(), vecVoices.end(), [&n](const voice &x) { return x.nId == n.id && x.dOn == n.on; });
+			if (v == vecVoices.end())
+			{
+				vecVoices.push_back({ n.id, n.on, n.on, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0 });
+				v = vecVoices.end() - 1;
+			}
+
+			if (math::fabs(dTime - v->dLast) > 0.5 * dTimeStep)
+				CatchUp(*v, n, dTime, dTimeStep);
+			return *v;
+		}
+
+		// Restarts the voice at its note on and brings it to dTime: the phase at
+		// control rate, summing the same ramped frequencies the samples would,
+		// and the filter by rendering the last SETTLE samples unheard
+		void CatchUp(voice &v, const note &n, FTYPE dTime, FTYPE dTimeStep)
+		{
+			v = { n.id, n.on, dTime, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0 };
+			long long nTotal = math::round_to_int((dTime - n.on) / dTimeStep);	// Samples from the first of the note
+			if (nTotal <= 0)
+				return;
+
+			unsigned int nSettle = (unsigned int)min((long long)SETTLE, nTotal);
+			long long nPhase = nTotal - nSettle;
+			FTYPE dHertz = scale(n.id);
+			mod_block m;
+
+			for (long long s0 = 0; s0 < nPhase; s0 += mod_block::MAX_SAMPLES)
+			{
+				unsigned int nRun = (unsigned int)min((long long)mod_block::MAX_SAMPLES, nPhase - s0);
+				FTYPE dPointHertz[mod_block::POINTS];
+				PointHertz(n, dHertz, dTime - (nTotal - s0) * dTimeStep, dTimeStep, nRun, m, dPointHertz);
+
+				// Each control interval ramps from one point's frequency toward the next
+				for (unsigned int c = 0; c * mod_block::CONTROL < nRun; c++)
+				{
+					FTYPE L = (FTYPE)min(mod_block::CONTROL, nRun - c * mod_block::CONTROL);
+					FTYPE dNext = dPointHertz[min(c + 1, m.nPoints - 1)];
+					v.dPhase += (L * dPointHertz[c] + (dNext - dPointHertz[c]) * L * (L - 1.0) / (2.0 * mod_block::CONTROL)) * dTimeStep;
+				}
+				v.dPhase -= math::floor(v.dPhase);
+			}
+
+			bool bFinished = false;
+			Run(v, n, dTime - nSettle * dTimeStep, dTimeStep, nullptr, nSettle, bFinished);
+		}
+
+		// Frequency at each control point of a run, band limited for the highest
+		// by the caller
+		void PointHertz(const note &n, FTYPE dHertz, FTYPE dTime, FTYPE dTimeStep, unsigned int nRun, mod_block &m, FTYPE *pHertz)
+		{
+			mod.Evaluate(n, env, dTime, dTimeStep, nRun, m);
+			for (unsigned int p = 0; p < m.nPoints; p++)
+				pHertz[p] = m.Uses(MOD_PITCH) ? dHertz * math::pow(2.0, m.fValue[MOD_PITCH][p] / 12.0) : dHertz;
+		}
+
+		// nSamples of the voice from dTime, added to pOut, or only advancing the
+		// voice if pOut is null
+		void Run(voice &v, const note &n, FTYPE dTime, FTYPE dTimeStep, FTYPE *pOut, unsigned int nSamples, bool &bNoteFinished)
+		{
+			FTYPE dHertz = scale(n.id);
+			FTYPE dLast = (FTYPE)(table.Frames() - 1);
+			FTYPE dNyquist = 0.45 / dTimeStep;
+			FTYPE k = 2.0 - 2.0 * min(0.95, max(0.0, fResonance));
+			mod_block m;
+
+			for (unsigned int s0 = 0; s0 < nSamples && !bNoteFinished; s0 += mod_block::MAX_SAMPLES)
+			{
+				unsigned int nRun = min(mod_block::MAX_SAMPLES, nSamples - s0);
+				FTYPE t0 = dTime + s0 * dTimeStep;
+				FTYPE dPointHertz[mod_block::POINTS];
+				PointHertz(n, dHertz, t0, dTimeStep, nRun, m, dPointHertz);
+				FTYPE dTop = dHertz;
+				for (unsigned int p = 0; p < m.nPoints; p++)
+					dTop = max(dTop, dPointHertz[p]);
+				unsigned int nLevel = wavetable::Level(dTop, (unsigned int)math::round_to_int(1.0 / dTimeStep));
+
+				for (unsigned int s = 0; s < nRun && !bNoteFinished; s++)
+				{
+					// Filter coefficients once per control point
+					if (s % mod_block::CONTROL == 0)
+					{
+						FTYPE dCut = fCutoff * (m.Uses(MOD_FILTER) ? math::pow(2.0, m.fValue[MOD_FILTER][s / mod_block::CONTROL]) : 1.0);
+						FTYPE g = math::tan(PI * min(dCut, dNyquist) * dTimeStep);
+						v.a1 = 1.0 / (1.0 + g * (g + k));
+						v.a2 = g * v.a1;
+						v.a3 = g * v.a2;
+					}
+
+					// The phase starts at the sample nearest the note on, wherever the block does
+					FTYPE t = t0 + s * dTimeStep;
+					if (t < n.on - 0.5 * dTimeStep)
+						continue;
+					FTYPE dAmplitude = synth::env(t, env, n.on, n.off);
+					if (dAmplitude <= 0.0 && t - n.on > env.dAttackTime) bNoteFinished = true;
+
+					// Two frames either side of the position, each read between samples
+					FTYPE dPos = fPosition + (m.Uses(MOD_POSITION) ? m.At(MOD_POSITION, s) : 0.0);
+					dPos = max(0.0, min(dPos, dLast));
+					unsigned int nFrame = (unsigned int)min(dPos, max(0.0, dLast - 1.0));
+					FTYPE dFrameMix = dPos - nFrame;
+					FTYPE dIndex = v.dPhase * wavetable::SIZE;
+					unsigned int i = (unsigned int)dIndex;
+					FTYPE f = dIndex - i;
+					const FTYPE *pA = table.Table(nLevel, nFrame);
+					const FTYPE *pB = table.Table(nLevel, min(nFrame + 1, table.Frames() - 1));
+					FTYPE a = pA[i] + (pA[i + 1] - pA[i]) * f;
+					FTYPE b = pB[i] + (pB[i + 1] - pB[i]) * f;
+					FTYPE x = a + (b - a) * dFrameMix;
+
+					// Trapezoidal state variable low pass
+					FTYPE v3 = x - v.z2;
+					FTYPE v1 = v.a1 * v.z1 + v.a2 * v3;
+					FTYPE v2 = v.z2 + v.a2 * v.z1 + v.a3 * v3;
+					v.z1 = 2.0 * v1 - v.z1;
+					v.z2 = 2.0 * v2 - v.z2;
+
+					if (pOut != nullptr)
+					{
+						FTYPE dGain = m.Uses(MOD_GAIN) ? max(0.0, 1.0 + m.At(MOD_GAIN, s)) : 1.0;
+						pOut[s0 + s] += v2 * dAmplitude * dGain * dVolume;
+					}
+
+					unsigned int c = s / mod_block::CONTROL;
+					FTYPE dRamp = (FTYPE)(s % mod_block::CONTROL) / mod_block::CONTROL;
+					v.dPhase += (dPointHertz[c] + (dPointHertz[min(c + 1, m.nPoints - 1)] - dPointHertz[c]) * dRamp) * dTimeStep;
+					v.dPhase -= math::floor(v.dPhase);
+				}
+			}
+		}
+
+	private:
+		wavetable table;
+		unsigned int nSampleRate;
+		tracked_vector<voice, MEM_VOICES> vecVoices;
+	};
+
+}
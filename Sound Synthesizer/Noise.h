@@ -1,21 +1,24 @@
 
 #pragma once
-#pragma comment(lib, "winmm.lib")
 
 #include <iostream>
 #include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <vector>
 #include <string>
 #include <thread>
 #include <atomic>
+#include <mutex>
 #include <condition_variable>
 using namespace std;
 #define FTYPE double
 
-#include <Windows.h>
+#include "Platform.h"
 
-const double PI = 2.0 * acos(0.0);
+const double PI = 3.14159265358979323846;
 
 template<class T>
 class NoiseMaker
@@ -41,13 +44,18 @@ public:
 		m_nBlockFree = m_nBlockCount;
 		m_nBlockCurrent = 0;
 		m_pBlockMemory = nullptr;
+#ifdef _WIN32
 		m_pWaveHeaders = nullptr;
+#endif
 
 		m_userFunction = nullptr;
+		m_blockFunction = nullptr;
+		m_channelFunction = nullptr;
 
 		// Validate device
 		vector<wstring> devices = Enumerate();
 		auto d = std::find(devices.begin(), devices.end(), sOutputDevice);
+#ifdef _WIN32
 		if (d != devices.end())
 		{
 			// Device is available
@@ -65,13 +73,23 @@ public:
 			if (waveOutOpen(&m_hwDevice, nDeviceID, &waveFormat, (DWORD_PTR)waveOutProcWrap, (DWORD_PTR)this, CALLBACK_FUNCTION) != S_OK)
 				return Destroy();
 		}
+#else
+		// The null device plays from now on
+		if (d == devices.end())
+			return Destroy();
+		m_tStart = chrono::steady_clock::now();
+		m_nBlocksQueued = 0;
+#endif
 
 		// Allocate Wave|Block Memory
 		m_pBlockMemory = new T[m_nBlockCount * m_nBlockSamples];
 		if (m_pBlockMemory == nullptr)
 			return Destroy();
-		ZeroMemory(m_pBlockMemory, sizeof(T) * m_nBlockCount * m_nBlockSamples);
+		memset(m_pBlockMemory, 0, sizeof(T) * m_nBlockCount * m_nBlockSamples);
+
+		m_vecBlockMix.assign(m_nBlockSamples, 0.0);
 
+#ifdef _WIN32
 		m_pWaveHeaders = new WAVEHDR[m_nBlockCount];
 		if (m_pWaveHeaders == nullptr)
 			return Destroy();
@@ -83,6 +101,13 @@ public:
 			m_pWaveHeaders[n].dwBufferLength = m_nBlockSamples * sizeof(T);
 			m_pWaveHeaders[n].lpData = (LPSTR)(m_pBlockMemory + (n * m_nBlockSamples));
 		}
+		synth::platform::lock_memory(m_pWaveHeaders, sizeof(WAVEHDR) * m_nBlockCount);
+#endif
+
+		// Keep everything the audio thread touches resident; the buffers above were
+		// zeroed, so their pages are already faulted in
+		synth::platform::lock_memory(m_pBlockMemory, sizeof(T) * m_nBlockCount * m_nBlockSamples);
+		synth::platform::lock_memory(m_vecBlockMix.data(), sizeof(FTYPE) * m_vecBlockMix.size());
 
 		m_bReady = true;
 
@@ -122,6 +147,9 @@ public:
 public:
 	static vector<wstring> Enumerate()
 	{
+#ifndef _WIN32
+		return { L"Null" };
+#else
 		int nDeviceCount = waveOutGetNumDevs();
 		vector<wstring> sDevices;
 		WAVEOUTCAPS woc;
@@ -129,6 +157,7 @@ public:
 			if (waveOutGetDevCaps(n, &woc, sizeof(WAVEOUTCAPS)) == S_OK)
 				sDevices.push_back(woc.szPname);
 		return sDevices;
+#endif
 	}
 
 	void SetUserFunction(FTYPE(*func)(int,FTYPE))
@@ -136,6 +165,19 @@ public:
 		m_userFunction = func;
 	}
 
+	// Alternative to the user function: fills a whole block of mono frames at once
+	void SetBlockFunction(void(*func)(FTYPE*,unsigned int))
+	{
+		m_blockFunction = func;
+	}
+
+	// Alternative to the user function: fills a block with one plane of frames per
+	// channel, channel c starting at c * nFrames
+	void SetChannelFunction(void(*func)(FTYPE*,unsigned int,unsigned int))
+	{
+		m_channelFunction = func;
+	}
+
 	FTYPE clip(FTYPE dSample, FTYPE dMax)
 	{
 		if (dSample >= 0.0)
@@ -147,6 +189,9 @@ public:
 
 private:
 	FTYPE(*m_userFunction)(int,FTYPE);
+	void(*m_blockFunction)(FTYPE*,unsigned int);
+	void(*m_channelFunction)(FTYPE*,unsigned int,unsigned int);
+	vector<FTYPE> m_vecBlockMix;
 
 	unsigned int m_nSampleRate;
 	unsigned int m_nChannels;
@@ -155,8 +200,13 @@ private:
 	unsigned int m_nBlockCurrent;
 
 	T* m_pBlockMemory;
+#ifdef _WIN32
 	WAVEHDR *m_pWaveHeaders;
 	HWAVEOUT m_hwDevice;
+#else
+	chrono::steady_clock::time_point m_tStart;
+	unsigned long long m_nBlocksQueued;
+#endif
 
 	thread m_thread;
 	atomic<bool> m_bReady;
@@ -166,8 +216,9 @@ private:
 
 	atomic<FTYPE> m_dGlobalTime;
 
+#ifdef _WIN32
 	// Handler for soundcard request for more data
-	void waveOutProc(HWAVEOUT hWaveOut, UINT uMsg, DWORD dwParam1, DWORD dwParam2)
+	void waveOutProc(HWAVEOUT hWaveOut, UINT uMsg, DWORD_PTR dwParam1, DWORD_PTR dwParam2)
 	{
 		if (uMsg != WOM_DONE) return;
 
@@ -177,10 +228,23 @@ private:
 	}
 
 	// Static wrapper for sound card handler
-	static void CALLBACK waveOutProcWrap(HWAVEOUT hWaveOut, UINT uMsg, DWORD dwInstance, DWORD dwParam1, DWORD dwParam2)
+	static void CALLBACK waveOutProcWrap(HWAVEOUT hWaveOut, UINT uMsg, DWORD_PTR dwInstance, DWORD_PTR dwParam1, DWORD_PTR dwParam2)
 	{
 		((NoiseMaker*)dwInstance)->waveOutProc(hWaveOut, uMsg, dwParam1, dwParam2);
 	}
+#else
+	// The null device: a block is done once the blocks queued ahead of it have
+	// had their playing time
+	void NullDeviceWrite()
+	{
+		m_nBlocksQueued++;
+		FTYPE dBlockTime = (FTYPE)(m_nBlockSamples / m_nChannels) / (FTYPE)m_nSampleRate;
+		if (m_nBlocksQueued > m_nBlockCount)
+			this_thread::sleep_until(m_tStart + chrono::duration_cast<chrono::steady_clock::duration>(
+				chrono::duration<FTYPE>((FTYPE)(m_nBlocksQueued - m_nBlockCount) * dBlockTime)));
+		m_nBlockFree++;
+	}
+#endif
 
 	// Main thread. This loop responds to requests from the soundcard to fill 'blocks'
 	// with audio data. If no requests are available it goes dormant until the sound
@@ -208,33 +272,67 @@ private:
 			// Block is here, so use it
 			m_nBlockFree--;
 
+#ifdef _WIN32
 			// Prepare block for processing
 			if (m_pWaveHeaders[m_nBlockCurrent].dwFlags & WHDR_PREPARED)
 				waveOutUnprepareHeader(m_hwDevice, &m_pWaveHeaders[m_nBlockCurrent], sizeof(WAVEHDR));
+#endif
 
 			T nNewSample = 0;
 			int nCurrentBlock = m_nBlockCurrent * m_nBlockSamples;
 
-			for (unsigned int n = 0; n < m_nBlockSamples; n += m_nChannels)
+			if (m_channelFunction != nullptr)
 			{
-				// User Process
+				unsigned int nFrames = m_nBlockSamples / m_nChannels;
+				m_channelFunction(m_vecBlockMix.data(), nFrames, m_nChannels);
+
 				for (unsigned int c = 0; c < m_nChannels; c++)
-				{
-					if (m_userFunction == nullptr)
-						nNewSample = (T)(clip(UserProcess(c, m_dGlobalTime), 1.0) * dMaxSample);
-					else
-						nNewSample = (T)(clip(m_userFunction(c, m_dGlobalTime), 1.0) * dMaxSample);
+					for (unsigned int f = 0; f < nFrames; f++)
+						m_pBlockMemory[nCurrentBlock + f * m_nChannels + c] = (T)(clip(m_vecBlockMix[c * nFrames + f], 1.0) * dMaxSample);
+
+				m_dGlobalTime = m_dGlobalTime + nFrames * dtimeStep;
+			}
+			else if (m_blockFunction != nullptr)
+			{
+				unsigned int nFrames = m_nBlockSamples / m_nChannels;
+				m_blockFunction(m_vecBlockMix.data(), nFrames);
 
-					m_pBlockMemory[nCurrentBlock + n + c] = nNewSample;
-					nPreviousSample = nNewSample;
+				for (unsigned int f = 0; f < nFrames; f++)
+				{
+					nNewSample = (T)(clip(m_vecBlockMix[f], 1.0) * dMaxSample);
+					for (unsigned int c = 0; c < m_nChannels; c++)
+						m_pBlockMemory[nCurrentBlock + f * m_nChannels + c] = nNewSample;
 				}
 
-				m_dGlobalTime = m_dGlobalTime + dtimeStep;
+				m_dGlobalTime = m_dGlobalTime + nFrames * dtimeStep;
+			}
+			else
+			{
+				for (unsigned int n = 0; n < m_nBlockSamples; n += m_nChannels)
+				{
+					// User Process
+					for (unsigned int c = 0; c < m_nChannels; c++)
+					{
+						if (m_userFunction == nullptr)
+							nNewSample = (T)(clip(UserProcess(c, m_dGlobalTime), 1.0) * dMaxSample);
+						else
+							nNewSample = (T)(clip(m_userFunction(c, m_dGlobalTime), 1.0) * dMaxSample);
+
+						m_pBlockMemory[nCurrentBlock + n + c] = nNewSample;
+						nPreviousSample = nNewSample;
+					}
+
+					m_dGlobalTime = m_dGlobalTime + dtimeStep;
+				}
 			}
 
 			// Send block to sound device
+#ifdef _WIN32
 			waveOutPrepareHeader(m_hwDevice, &m_pWaveHeaders[m_nBlockCurrent], sizeof(WAVEHDR));
 			waveOutWrite(m_hwDevice, &m_pWaveHeaders[m_nBlockCurrent], sizeof(WAVEHDR));
+#else
+			NullDeviceWrite();
+#endif
 			m_nBlockCurrent++;
 			m_nBlockCurrent %= m_nBlockCount;
 		}
@@ -0,0 +1,239 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+
+#include "Core.h"
+
+namespace synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Waveform Overview
+	//
+	// Min, max and RMS of a rendered file at several zoom levels, built while the
+	// samples are written and kept in a small sidecar next to it, so a waveform
+	// display never has to read the audio again. The finest level has a bin per
+	// nBinSamples and each level above merges nFactor bins of the one below; an
+	// hour at 44.1 kHz takes about 2 MB.
+
+	struct overview_header
+	{
+		char magic[4];			// "CPKS"
+		uint32_t nVersion;
+		uint32_t nSampleRate;
+		uint32_t nLevels;
+		uint64_t nSamples;		// Samples summarised
+		uint32_t nBinSamples;	// Samples per bin of the finest level
+		uint32_t nFactor;		// Bins merged per bin of the next level
+	};
+
+	static_assert(sizeof(overview_header) == 32, "overview_header layout");
+	const uint32_t OVERVIEW_VERSION = 1;
+
+	// In 16-bit sample units
+	struct overview_bin
+	{
+		int16_t nMin;
+		int16_t nMax;
+		uint16_t nRms;
+		uint16_t nPad;
+	};
+
+	static_assert(sizeof(overview_bin) == 8, "overview_bin layout");
+
+	// The sidecar for a rendered file
+	inline wstring overview_path(const wstring &sAudioPath)
+	{
+		return sAudioPath + L".peaks";
+	}
+
+	struct overview
+	{
+	public:
+		overview(unsigned int sampleRate = 44100, uint32_t binSamples = 1024, uint32_t factor = 4)
+		{
+			nSampleRate = sampleRate;
+			nBinSamples = max(1u, binSamples);
+			nFactor = max(2u, factor);
+			Clear();
+		}
+
+		void Clear()
+		{
+			nSamples = 0;
+			vecLevels.clear();
+			vecPartial.clear();
+		}
+
+		// Streaming: summarises the next nCount samples, adding a bin to each
+		// level whose span they complete
+		void Add(const int16_t *pSamples, size_t nCount)
+		{
+			if (vecPartial.empty())
+				AddLevel();
+
+			for (size_t i = 0; i < nCount; i++)
+			{
+				partial &p = vecPartial[0];
+				int16_t n = pSamples[i];
+				p.nMin = min(p.nMin, n);
+				p.nMax = max(p.nMax, n);
+				p.dSumSquares += (double)n * n;
+				p.nSamples++;
+				if (p.nSamples == nBinSamples)
+					Close(0);
+			}
+			nSamples += nCount;
+		}
+
+		// Closes the bins still open at the end, each level's last bin covering
+		// what there is of it
+		void Finish()
+		{
+			for (size_t l = 0; l < vecPartial.size(); l++)
+				if (vecPartial[l].nSamples > 0)
+					Close(l);
+		}
+
+		// [overview_header][uint32_t bins x nLevels][overview_bin x bins, finest level first]
+		bool Write(const wstring &sPath) const
+		{
+			ofstream f(filesystem::path(sPath), ios::binary);
+			if (!f.is_open())
+				return false;
+
+			overview_header h = {};
+			memcpy(h.magic, "CPKS", 4);
+			h.nVersion = OVERVIEW_VERSION;
+			h.nSampleRate = nSampleRate;
+			h.nLevels = (uint32_t)vecLevels.size();
+			h.nSamples = nSamples;
+			h.nBinSamples = nBinSamples;
+			h.nFactor = nFactor;
+			f.write((const char*)&h, sizeof(h));
+			for (auto &level : vecLevels)
+			{
+				uint32_t nBins = (uint32_t)level.size();
+				f.write((const char*)&nBins, sizeof(nBins));
+			}
+			for (auto &level : vecLevels)
+				f.write((const char*)level.data(), level.size() * sizeof(overview_bin));
+			return f.good();
+		}
+
+		bool Read(const wstring &sPath)
+		{
+			Clear();
+			ifstream f(filesystem::path(sPath), ios::binary);
+			overview_header h;
+			if (!f.read((char*)&h, sizeof(h)) || memcmp(h.magic, "CPKS", 4) != 0 || h.nVersion != OVERVIEW_VERSION ||
+				h.nBinSamples == 0 || h.nFactor < 2 || h.nLevels > 64)
+				return false;
+
+			vector<uint32_t> vecBins(h.nLevels);
+			if (!f.read((char*)vecBins.data(), vecBins.size() * sizeof(uint32_t)))
+				return false;
+
+			vecLevels.resize(h.nLevels);
+			for (uint32_t l = 0; l < h.nLevels; l++)
+			{
+				if (vecBins[l] > (1u << 28))
+					return false;
+				vecLevels[l].resize(vecBins[l]);
+				if (!f.read((char*)vecLevels[l].data(), vecLevels[l].size() * sizeof(overview_bin)))
+					return false;
+			}
+
+			nSampleRate = h.nSampleRate;
+			nSamples = h.nSamples;
+			nBinSamples = h.nBinSamples;
+			nFactor = h.nFactor;
+			return true;
+		}
+
+		size_t Levels() const { return vecLevels.size(); }
+		const vector<overview_bin>& Level(size_t nLevel) const { return vecLevels[nLevel]; }
+
+		// Samples covered by each bin of a level
+		uint64_t BinSamples(size_t nLevel) const
+		{
+			uint64_t n = nBinSamples;
+			for (size_t l = 0; l < nLevel; l++)
+				n *= nFactor;
+			return n;
+		}
+
+		// Coarsest level that still has at least a bin per pixel
+		size_t LevelFor(FTYPE dSamplesPerPixel) const
+		{
+			size_t l = 0;
+			while (l + 1 < vecLevels.size() && (FTYPE)BinSamples(l + 1) <= dSamplesPerPixel)
+				l++;
+			return l;
+		}
+
+	public:
+		unsigned int nSampleRate;
+		uint64_t nSamples;
+		uint32_t nBinSamples;
+		uint32_t nFactor;
+
+	private:
+		// The open bin of a level
+		struct partial
+		{
+			int16_t nMin;
+			int16_t nMax;
+			double dSumSquares;
+			uint64_t nSamples;
+			uint32_t nBins;		// Bins of the level below merged so far
+		};
+
+		void AddLevel()
+		{
+			vecLevels.emplace_back();
+			vecPartial.push_back({ INT16_MAX, INT16_MIN, 0.0, 0, 0 });
+		}
+
+		// Emits level l's open bin and merges it into level l + 1
+		void Close(size_t l)
+		{
+			partial p = vecPartial[l];
+			vecPartial[l] = { INT16_MAX, INT16_MIN, 0.0, 0, 0 };
+
+			uint16_t nRms = (uint16_t)min(32767.0, sqrt(p.dSumSquares / (double)p.nSamples) + 0.5);
+			vecLevels[l].push_back({ p.nMin, p.nMax, nRms, 0 });
+
+			// A level above is only started once this one has more than one bin
+			if (l + 1 == vecPartial.size())
+			{
+				if (vecLevels[l].size() < 2)
+				{
+					topFirst = p;
+					return;
+				}
+				AddLevel();
+				Merge(vecPartial[l + 1], topFirst);
+			}
+
+			partial &up = vecPartial[l + 1];
+			Merge(up, p);
+			if (up.nBins == nFactor)
+				Close(l + 1);
+		}
+
+		static void Merge(partial &into, const partial &from)
+		{
+			into.nMin = min(into.nMin, from.nMin);
+			into.nMax = max(into.nMax, from.nMax);
+			into.dSumSquares += from.dSumSquares;
+			into.nSamples += from.nSamples;
+			into.nBins++;
+		}
+
+	private:
+		vector<vector<overview_bin>> vecLevels;
+		vector<partial> vecPartial;
+		partial topFirst = {};	// The first bin of the top level, until it gets a second
+	};
+
+}
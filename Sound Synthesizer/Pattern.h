@@ -0,0 +1,208 @@
+#pragma once
+#include <coroutine>
+#include <queue>
+
+#include "Core.h"
+
+namespace synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Generative Patterns
+
+	// A pattern is a coroutine that co_yields notes with their "on" and "off"
+	// times already set. It is only resumed when the scheduler needs its next
+	// note, so an idle or sparse pattern costs nothing between the notes it
+	// actually emits. The generators below hold each note for fGate of a step,
+	// so instruments that sustain (the harmonica) release.
+	struct pattern
+	{
+		struct promise_type
+		{
+			note current;
+
+			pattern get_return_object() { return pattern(std::coroutine_handle<promise_type>::from_promise(*this)); }
+			std::suspend_always initial_suspend() noexcept { return {}; }
+			std::suspend_always final_suspend() noexcept { return {}; }
+			std::suspend_always yield_value(note n) { current = n; return {}; }
+			void return_void() {}
+			void unhandled_exception() { std::terminate(); }
+		};
+
+		explicit pattern(std::coroutine_handle<promise_type> h = nullptr) : handle(h) {}
+		pattern(pattern &&p) noexcept : handle(p.handle) { p.handle = nullptr; }
+		pattern(const pattern&) = delete;
+		pattern& operator=(const pattern&) = delete;
+
+		pattern& operator=(pattern &&p) noexcept
+		{
+			if (this != &p)
+			{
+				if (handle) handle.destroy();
+				handle = p.handle;
+				p.handle = nullptr;
+			}
+			return *this;
+		}
+
+		~pattern()
+		{
+			if (handle) handle.destroy();
+		}
+
+		// Runs the generator up to its next note, returns false once it has finished
+		bool Next()
+		{
+			if (!handle || handle.done()) return false;
+			handle.resume();
+			return !handle.done();
+		}
+
+		const note& Current() const
+		{
+			return handle.promise().current;
+		}
+
+		std::coroutine_handle<promise_type> handle;
+	};
+
+
+	// Every nHits of nSteps steps sound, spread as evenly as possible
+	pattern pattern_euclid(instrument_base *inst, int id, int nHits, int nSteps, FTYPE fStepTime, FTYPE dStart = 0.0, FTYPE fGate = 0.5)
+	{
+		if (nHits <= 0 || nSteps <= 0) co_return;
+
+		for (long long nStep = 0; ; nStep++)
+		{
+			int s = (int)(nStep % nSteps);
+			if (((s * nHits) % nSteps) < nHits)
+			{
+				note n;
+				n.id = id;
+				n.on = dStart + nStep * fStepTime;
+				n.off = n.on + fGate * fStepTime;
+				n.active = true;
+				n.channel = inst;
+				co_yield n;
+			}
+		}
+	}
+
+	// Cycles through the given notes, one per step
+	pattern pattern_arpeggio(instrument_base *inst, vector<int> vecIds, FTYPE fStepTime, FTYPE dStart = 0.0, int nRepeats = -1, FTYPE fGate = 0.5)
+	{
+		if (vecIds.empty()) co_return;
+
+		for (int r = 0; nRepeats < 0 || r < nRepeats; r++)
+			for (size_t i = 0; i < vecIds.size(); i++)
+			{
+				note n;
+				n.id = vecIds[i];
+				n.on = dStart + (r * vecIds.size() + i) * fStepTime;
+				n.off = n.on + fGate * fStepTime;
+				n.active = true;
+				n.channel = inst;
+				co_yield n;
+			}
+	}
+
+	// Each step sounds with the given probability. Seeded, so a fill replays
+	// identically. The silent steps before each hit are drawn at once from the
+	// geometric distribution rather than tried one by one, so a resume costs the
+	// same however small the probability; a fill too sparse to ever sound again
+	// finishes.
+	pattern pattern_random_fill(instrument_base *inst, int id, FTYPE fProbability, FTYPE fStepTime, FTYPE dStart = 0.0, unsigned int nSeed = 1, FTYPE fGate = 0.5)
+	{
+		if (fProbability <= 0.0) co_return;
+
+		math::random rng(nSeed);
+		FTYPE dLogMiss = fProbability < 1.0 ? math::log(1.0 - fProbability) : -INFINITY;
+		if (dLogMiss == 0.0) co_return;
+
+		for (FTYPE dStep = 0.0; ; dStep += 1.0)
+		{
+			dStep += math::floor(math::log(1.0 - rng.uniform()) / dLogMiss);
+			if (dStep >= 9007199254740992.0) co_return;
+
+			note n;
+			n.id = id;
+			n.on = dStart + dStep * fStepTime;
+			n.off = n.on + fGate * fStepTime;
+			n.active = true;
+			n.channel = inst;
+			co_yield n;
+		}
+	}
+
+
+	// Runs on the control thread. Patterns are kept in a min-heap ordered by their
+	// next note, and each Update only resumes those whose next note falls inside
+	// the lookahead horizon, so thousands of patterns cost only what they emit.
+	struct pattern_scheduler
+	{
+	public:
+		pattern_scheduler(FTYPE lookahead = 0.1)
+		{
+			fLookahead = lookahead;
+		}
+
+		void Add(pattern p)
+		{
+			if (!p.Next())
+				return;
+
+			size_t nSlot = vecPatterns.size();
+			if (!vecFreeSlots.empty())
+			{
+				nSlot = vecFreeSlots.back();
+				vecFreeSlots.pop_back();
+				vecPatterns[nSlot] = std::move(p);
+			}
+			else
+				vecPatterns.push_back(std::move(p));
+
+			queueDue.push({ vecPatterns[nSlot].Current().on, nSlot });
+		}
+
+		// Collects every note due before dTimeNow + fLookahead into vecNotes
+		int Update(FTYPE dTimeNow)
+		{
+			vecNotes.clear();
+
+			FTYPE dHorizon = dTimeNow + fLookahead;
+			while (!queueDue.empty() && queueDue.top().first < dHorizon)
+			{
+				size_t nSlot = queueDue.top().second;
+				queueDue.pop();
+
+				pattern &p = vecPatterns[nSlot];
+				vecNotes.push_back(p.Current());
+
+				if (p.Next())
+					queueDue.push({ p.Current().on, nSlot });
+				else
+				{
+					p = pattern();
+					vecFreeSlots.push_back(nSlot);
+				}
+			}
+
+			return vecNotes.size();
+		}
+
+		size_t Count() const
+		{
+			return vecPatterns.size() - vecFreeSlots.size();
+		}
+
+	public:
+		FTYPE fLookahead;
+		vector<note> vecNotes;
+
+	private:
+		typedef pair<FTYPE, size_t> due;
+		vector<pattern> vecPatterns;
+		vector<size_t> vecFreeSlots;
+		priority_queue<due, vector<due>, greater<due>> queueDue;
+	};
+
+}
@@ -0,0 +1,173 @@
+#pragma once
+#include <cstddef>
+#include <filesystem>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#include <Windows.h>
+#pragma comment(lib, "winmm.lib")
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace synth
+{
+	namespace platform
+	{
+		//////////////////////////////////////////////////////////////////////////
+		// Platform
+		//
+		// The few operating system services used outside the audio device, with
+		// a Win32 and a POSIX implementation each. The live keyboard and the
+		// waveOut/waveIn devices are Windows only; elsewhere the keyboard reads as
+		// released, there is no input device, and output goes to a null device
+		// that consumes blocks in real time (see NoiseMaker).
+
+		// Keeps the pages resident. Best effort: failure (no privilege, over the
+		// limit) only means they may be paged out again.
+		inline bool lock_memory(void *pData, size_t nBytes)
+		{
+			if (pData == nullptr || nBytes == 0)
+				return false;
+#ifdef _WIN32
+			return VirtualLock(pData, nBytes) != 0;
+#else
+			return mlock(pData, nBytes) == 0;
+#endif
+		}
+
+		// Runs the thread on one core only, where the platform allows it
+		inline void pin_thread(std::thread &t, unsigned int nCore)
+		{
+#ifdef _WIN32
+			SetThreadAffinityMask(t.native_handle(), (DWORD_PTR)1 << (nCore % (sizeof(DWORD_PTR) * 8)));
+#elif defined(__linux__)
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(nCore % CPU_SETSIZE, &set);
+			pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+#else
+			(void)t;
+			(void)nCore;
+#endif
+		}
+
+		// Virtual key codes, as GetAsyncKeyState takes them. Letters and digits
+		// are their upper case ASCII.
+		const int KEY_HOME = 0x24;
+
+		// True while the key is held
+		inline bool key_down(int nKey)
+		{
+#ifdef _WIN32
+			return (GetAsyncKeyState(nKey) & 0x8000) != 0;
+#else
+			(void)nKey;
+			return false;
+#endif
+		}
+
+		// A whole file mapped into memory, read only or read/write. Empty files
+		// don't map.
+		struct mapped_file
+		{
+		public:
+			mapped_file() = default;
+			mapped_file(const mapped_file&) = delete;
+			mapped_file& operator=(const mapped_file&) = delete;
+
+			~mapped_file()
+			{
+				Close();
+			}
+
+			bool Open(const std::wstring &sPath, bool bWrite = false)
+			{
+				Close();
+#ifdef _WIN32
+				hFile = CreateFileW(sPath.c_str(), bWrite ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, bWrite ? 0 : FILE_SHARE_READ,
+					nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+				if (hFile == INVALID_HANDLE_VALUE)
+					return false;
+
+				LARGE_INTEGER nFileSize;
+				if (!GetFileSizeEx(hFile, &nFileSize) || nFileSize.QuadPart <= 0)
+					return Close();
+				nSize = (size_t)nFileSize.QuadPart;
+
+				hMapping = CreateFileMappingW(hFile, nullptr, bWrite ? PAGE_READWRITE : PAGE_READONLY, 0, 0, nullptr);
+				if (hMapping == nullptr)
+					return Close();
+
+				pData = (char*)MapViewOfFile(hMapping, bWrite ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+				if (pData == nullptr)
+					return Close();
+#else
+				nFile = open(std::filesystem::path(sPath).string().c_str(), bWrite ? O_RDWR : O_RDONLY);
+				if (nFile < 0)
+					return false;
+
+				struct stat st;
+				if (fstat(nFile, &st) != 0 || st.st_size <= 0)
+					return Close();
+				nSize = (size_t)st.st_size;
+
+				void *p = mmap(nullptr, nSize, bWrite ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, nFile, 0);
+				if (p == MAP_FAILED)
+					return Close();
+				pData = (char*)p;
+#endif
+				return true;
+			}
+
+			// Writes changes back to the file
+			bool Flush()
+			{
+				if (pData == nullptr)
+					return false;
+#ifdef _WIN32
+				return FlushViewOfFile(pData, 0) != 0;
+#else
+				return msync(pData, nSize, MS_SYNC) == 0;
+#endif
+			}
+
+			bool Close()
+			{
+#ifdef _WIN32
+				if (pData != nullptr) UnmapViewOfFile(pData);
+				if (hMapping != nullptr) CloseHandle(hMapping);
+				if (hFile != INVALID_HANDLE_VALUE) CloseHandle(hFile);
+				hMapping = nullptr;
+				hFile = INVALID_HANDLE_VALUE;
+#else
+				if (pData != nullptr) munmap(pData, nSize);
+				if (nFile >= 0) close(nFile);
+				nFile = -1;
+#endif
+				pData = nullptr;
+				nSize = 0;
+				return false;
+			}
+
+			bool IsOpen() const { return pData != nullptr; }
+			char* Data() const { return pData; }
+			size_t Size() const { return nSize; }
+
+		private:
+#ifdef _WIN32
+			HANDLE hFile = INVALID_HANDLE_VALUE;
+			HANDLE hMapping = nullptr;
+#else
+			int nFile = -1;
+#endif
+			char *pData = nullptr;
+			size_t nSize = 0;
+		};
+	}
+}
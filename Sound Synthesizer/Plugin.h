@@ -0,0 +1,324 @@
+#pragma once
+#include <cstring>
+#include <filesystem>
+
+#ifndef _WIN32
+#include <dlfcn.h>
+#endif
+
+#include "Core.h"
+#include "PluginAbi.h"
+
+namespace synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Instrument Plugins
+	//
+	// Instruments built as shared objects against PluginAbi.h and loaded at run
+	// time, so new ones don't need a rebuild of the synthesizer. The engine hands
+	// the instrument every voice it has in a block at once, and the plugin
+	// renders them all in one call into a buffer per voice, which each voice's
+	// SoundBlock then adds from. A voice rendered outside the engine's blocks is
+	// rendered on its own. Links with -ldl on older glibc.
+
+	// A plugin's shared object and its function table
+	struct plugin_library
+	{
+		plugin_library() = default;
+		plugin_library(const plugin_library&) = delete;
+		plugin_library& operator=(const plugin_library&) = delete;
+		~plugin_library() { Close(); }
+
+		// False if the file won't load, has no entry point, or was built for
+		// another version of the ABI
+		bool Open(const wstring &sPath)
+		{
+			Close();
+#ifdef _WIN32
+			HMODULE h = LoadLibraryW(sPath.c_str());
+			synth_plugin_entry_fn fnEntry = h != nullptr ? (synth_plugin_entry_fn)GetProcAddress(h, SYNTH_PLUGIN_ENTRY) : nullptr;
+#else
+			void *h = dlopen(filesystem::path(sPath).string().c_str(), RTLD_NOW | RTLD_LOCAL);
+			synth_plugin_entry_fn fnEntry = h != nullptr ? (synth_plugin_entry_fn)dlsym(h, SYNTH_PLUGIN_ENTRY) : nullptr;
+#endif
+			if (h == nullptr)
+				return false;
+			pHandle = (void*)h;
+
+			const synth_plugin *p = fnEntry != nullptr ? fnEntry() : nullptr;
+			if (p == nullptr || p->nAbi != SYNTH_PLUGIN_ABI || p->nSize < sizeof(synth_plugin) ||
+				p->create == nullptr || p->destroy == nullptr || p->render == nullptr)
+			{
+				Close();
+				return false;
+			}
+			pPlugin = p;
+			return true;
+		}
+
+		void Close()
+		{
+			pPlugin = nullptr;
+			if (pHandle == nullptr)
+				return;
+#ifdef _WIN32
+			FreeLibrary((HMODULE)pHandle);
+#else
+			dlclose(pHandle);
+#endif
+			pHandle = nullptr;
+		}
+
+		const synth_plugin *pPlugin = nullptr;
+
+	private:
+		void *pHandle = nullptr;
+	};
+
+	struct instrument_plugin : public instrument_base
+	{
+		static const uint32_t MAX_FRAMES = 1024;	// Most the plugin is asked for in one call
+
+		instrument_plugin() : vecVoices(tracked_allocator<voice, MEM_VOICES>(&mem)), vecBatch(tracked_allocator<synth_voice, MEM_VOICES>(&mem)),
+			vecOut(tracked_allocator<float, MEM_SCRATCH>(&mem))
+		{
+			fMaxLifeTime = -1.0;
+			dVolume = 0.5;
+			name = L"Plugin";
+			env.dReleaseTime = 10.0;	// Not used to render, the longest the plugin's own release is taken to be
+			bBlockVoices = true;
+			nSampleRate = 44100;
+
+			vecVoices.reserve(64);
+			vecBatch.reserve(64);
+			vecPointers.reserve(64);
+			vecFinished.reserve(64);
+		}
+
+		~instrument_plugin()
+		{
+			Unload();
+		}
+
+		// Loads a plugin and creates an instance of it at the current rate
+		bool Load(const wstring &sPath)
+		{
+			Unload();
+			if (!library.Open(sPath))
+				return false;
+
+			pState = library.pPlugin->create((double)nSampleRate, MAX_FRAMES);
+			if (pState == nullptr)
+			{
+				library.Close();
+				return false;
+			}
+
+			const char *pName = library.pPlugin->pName;
+			if (pName != nullptr)
+				name = wstring(pName, pName + strlen(pName));
+			return true;
+		}
+
+		void Unload()
+		{
+			if (pState != nullptr)
+				library.pPlugin->destroy(pState);
+			pState = nullptr;
+			vecVoices.clear();
+			library.Close();
+		}
+
+		bool Loaded() const
+		{
+			return pState != nullptr;
+		}
+
+		// A new instance if the rate changed, dropping any voices
+		virtual void Prepare(unsigned int sampleRate)
+		{
+			if (sampleRate == nSampleRate)
+				return;
+			nSampleRate = sampleRate;
+			if (pState == nullptr)
+				return;
+
+			library.pPlugin->destroy(pState);
+			vecVoices.clear();
+			pState = library.pPlugin->create((double)nSampleRate, MAX_FRAMES);
+		}
+
+		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished)
+		{
+			FTYPE dSample = 0.0;
+			SoundBlock(dTime, 1.0 / nSampleRate, n, &dSample, 1, bNoteFinished);
+			return dSample;
+		}
+
+		// Every voice of the block in one call
+		virtual void VoiceBlock(const FTYPE dTime, const FTYPE dTimeStep, unsigned int nSamples, const synth::note *const *ppVoices, size_t nVoices)
+		{
+			if (pState == nullptr)
+				return;
+
+			Expire(dTime);
+			nBlock++;
+			dBlockStart = dTime;
+			dBlockStep = dTimeStep;
+			nBlockSamples = nSamples;
+
+			vecBatch.clear();
+			for (size_t i = 0; i < nVoices; i++)
+			{
+				voice &v = Voice(*ppVoices[i]);
+				v.nBlock = nBlock;
+				v.nSlot = i;
+				vecBatch.push_back(v.sv);
+			}
+
+			vecOut.resize(vecBatch.size() * nSamples);
+			vecFinished.assign(vecBatch.size(), 0);
+			Render(vecBatch.data(), vecBatch.size(), dTime, dTimeStep, nSamples, vecOut.data(), vecFinished.data());
+
+			for (auto &v : vecVoices)
+				if (v.nBlock == nBlock)
+				{
+					v.bFinished = vecFinished[v.nSlot] != 0;
+					v.dLast = dTime + nSamples * dTimeStep;
+				}
+		}
+
+		virtual bool SoundBlock(const FTYPE dTime, const FTYPE dTimeStep, const synth::note &n, FTYPE *pOut, unsigned int nSamples, bool &bNoteFinished)
+		{
+			if (pState == nullptr)
+			{
+				bNoteFinished = true;
+				return true;
+			}
+
+			// From the block's batch if this run lies inside it
+			const float *pSource = nullptr;
+			auto it = find_if(vecVoices.begin(), vecVoices.end(), [&n](const voice &v) { return v.sv.nNote == n.id && v.sv.dOn == n.on; });
+			FTYPE dOffset = dBlockStep > 0.0 ? (dTime - dBlockStart) / dBlockStep : -1.0;
+			long long nOffset = math::round_to_int(dOffset);
+			if (it != vecVoices.end() && it->nBlock == nBlock && dTimeStep == dBlockStep &&
+				nOffset >= 0 && nOffset + nSamples <= nBlockSamples && math::fabs(dOffset - nOffset) < 0.01)
+				pSource = vecOut.data() + it->nSlot * nBlockSamples + nOffset;
+			else
+			{
+				Expire(dTime);
+				voice &v = Voice(n);
+				v.nBlock = 0;
+				vecSingle.resize(nSamples);
+				uint8_t nFinished = 0;
+				Render(&v.sv, 1, dTime, dTimeStep, nSamples, vecSingle.data(), &nFinished);
+				v.bFinished = nFinished != 0;
+				v.dLast = dTime + nSamples * dTimeStep;
+				it = vecVoices.begin() + (&v - vecVoices.data());
+				pSource = vecSingle.data();
+			}
+
+			for (unsigned int s = 0; s < nSamples; s++)
+				pOut[s] += pSource[s] * dVolume;
+
+			if (it->bFinished)
+			{
+				bNoteFinished = true;
+				vecVoices.erase(it);
+			}
+			return true;
+		}
+
+	private:
+		struct voice
+		{
+			synth_voice sv;
+			FTYPE dLast;				// End of the last run rendered
+			unsigned long long nBlock;	// Block it was last batched in
+			size_t nSlot;				// Its buffer in that block
+			bool bFinished;
+		};
+
+		// State of the voice, new if it hasn't played yet, with its release
+		// passed on when it first shows
+		voice& Voice(const note &n)
+		{
+			auto it = find_if(vecVoices.begin(), vecVoices.end(), [&n](const voice &v) { return v.sv.nNote == n.id && v.sv.dOn == n.on; });
+			if (it == vecVoices.end())
+			{
+				voice v = {};
+				v.sv.nKey = nNextKey++;
+				v.sv.nNote = n.id;
+				v.sv.dHertz = scale(n.id);
+				v.sv.dVelocity = n.velocity;
+				v.sv.dOn = n.on;
+				v.sv.dOff = NOTE_HELD;
+				v.dLast = n.on;
+				vecVoices.push_back(v);
+				it = vecVoices.end() - 1;
+				if (library.pPlugin->note_on != nullptr)
+					library.pPlugin->note_on(pState, &it->sv);
+			}
+
+			if (n.off >= n.on && it->sv.dOff != n.off)
+			{
+				it->sv.dOff = n.off;
+				if (library.pPlugin->note_off != nullptr)
+					library.pPlugin->note_off(pState, &it->sv);
+			}
+			return *it;
+		}
+
+		// Voices that stopped being rendered without finishing go
+		void Expire(FTYPE dTime)
+		{
+			for (size_t i = 0; i < vecVoices.size();)
+			{
+				if (math::fabs(dTime - vecVoices[i].dLast) <= 1.0)
+				{
+					i++;
+					continue;
+				}
+				if (library.pPlugin->note_end != nullptr)
+					library.pPlugin->note_end(pState, vecVoices[i].sv.nKey);
+				vecVoices.erase(vecVoices.begin() + i);
+			}
+		}
+
+		// nSamples for each of nVoices into pOut, voice after voice, in calls of
+		// at most MAX_FRAMES
+		void Render(const synth_voice *pVoices, size_t nVoices, FTYPE dTime, FTYPE dTimeStep, unsigned int nSamples, float *pOut, uint8_t *pFinished)
+		{
+			if (nVoices == 0)
+				return;
+
+			vecPointers.resize(nVoices);
+			for (unsigned int s = 0; s < nSamples; s += MAX_FRAMES)
+			{
+				uint32_t nFrames = min((uint32_t)MAX_FRAMES, nSamples - s);
+				for (size_t v = 0; v < nVoices; v++)
+					vecPointers[v] = pOut + v * nSamples + s;
+				library.pPlugin->render(pState, dTime + s * dTimeStep, dTimeStep, pVoices, (uint32_t)nVoices, vecPointers.data(), nFrames, pFinished);
+			}
+		}
+
+	private:
+		plugin_library library;
+		void *pState = nullptr;
+		unsigned int nSampleRate;
+		uint64_t nNextKey = 1;
+
+		tracked_vector<voice, MEM_VOICES> vecVoices;
+		tracked_vector<synth_voice, MEM_VOICES> vecBatch;
+		tracked_vector<float, MEM_SCRATCH> vecOut;	// A buffer of nBlockSamples per batched voice
+		vector<float> vecSingle;
+		vector<float*> vecPointers;
+		vector<uint8_t> vecFinished;
+
+		unsigned long long nBlock = 0;
+		FTYPE dBlockStart = 0.0;
+		FTYPE dBlockStep = 0.0;
+		unsigned int nBlockSamples = 0;
+	};
+
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <stdint.h>
+
+//////////////////////////////////////////////////////////////////////////////
+// Instrument Plugin ABI
+//
+// The C interface between the synthesizer and instruments built as shared
+// objects, and the only header a plugin needs. A plugin exports one function,
+// synth_plugin_entry, returning a static table of the functions below. The
+// host tells it about voices as they start, are released and are dropped, and
+// once per block asks it to render every voice it is playing in one call.
+//
+// All calls for one instance come from one thread at a time. create and
+// destroy may allocate; the rest run on the audio thread and should not.
+
+#ifdef _WIN32
+#define SYNTH_PLUGIN_EXPORT __declspec(dllexport)
+#else
+#define SYNTH_PLUGIN_EXPORT __attribute__((visibility("default")))
+#endif
+
+#define SYNTH_PLUGIN_ABI 1
+#define SYNTH_PLUGIN_ENTRY "synth_plugin_entry"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A voice as the host sees it. Times are seconds on the host's clock.
+typedef struct synth_voice
+{
+	uint64_t nKey;		// Unique for the life of the instance
+	int32_t nNote;		// Position in the scale, as played
+	int32_t nPad;
+	double dHertz;		// Pitch of nNote
+	double dVelocity;	// 0 to 1
+	double dOn;
+	double dOff;		// Negative until released
+} synth_voice;
+
+typedef struct synth_plugin
+{
+	uint32_t nAbi;		// SYNTH_PLUGIN_ABI
+	uint32_t nSize;		// sizeof(synth_plugin), for tables that grow
+	const char *pName;
+
+	// An instance rendering at dSampleRate, never asked for more than
+	// nMaxFrames at once. Returns null on failure.
+	void* (*create)(double dSampleRate, uint32_t nMaxFrames);
+	void (*destroy)(void *pState);
+
+	// Optional, may be null
+	void (*note_on)(void *pState, const synth_voice *pVoice);
+	void (*note_off)(void *pState, const synth_voice *pVoice);
+
+	// Optional. The host won't render the voice again, without it having
+	// finished (cut off, or the clock moved).
+	void (*note_end)(void *pState, uint64_t nKey);
+
+	// Writes nFrames samples, the first at dTime, for each of nVoices voices
+	// into ppOut[v], -1 to +1 before the host's volume. A voice is silent before
+	// its dOn. Sets pFinished[v] to 1 once the voice has fallen silent for good,
+	// after which the host drops it without calling note_end.
+	void (*render)(void *pState, double dTime, double dTimeStep, const synth_voice *pVoices, uint32_t nVoices,
+		float *const *ppOut, uint32_t nFrames, uint8_t *pFinished);
+} synth_plugin;
+
+typedef const synth_plugin* (*synth_plugin_entry_fn)(void);
+
+#ifdef __cplusplus
+}
+#endif
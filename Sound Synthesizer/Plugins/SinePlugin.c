@@ -0,0 +1,139 @@
+// An example instrument plugin: a sine with a short attack and release,
+// louder the harder it is played. The SinePlugin project in the solution, or
+// from this directory:
+//
+//   cc -std=c99 -O2 -shared -fPIC SinePlugin.c -o SinePlugin.so -lm
+//
+// and played with --plugin <path to the built file>.
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "../PluginAbi.h"
+
+#define MAX_VOICES 64
+
+typedef struct sine_voice
+{
+	uint64_t nKey;
+	double dPhase;	// Cycles, 0 to 1
+} sine_voice;
+
+typedef struct sine_state
+{
+	double dAttack;
+	double dRelease;
+	sine_voice voices[MAX_VOICES];
+	int nVoices;
+} sine_state;
+
+static sine_voice* find_voice(sine_state *p, uint64_t nKey)
+{
+	for (int i = 0; i < p->nVoices; i++)
+		if (p->voices[i].nKey == nKey)
+			return &p->voices[i];
+	return NULL;
+}
+
+static void drop_voice(sine_state *p, uint64_t nKey)
+{
+	sine_voice *v = find_voice(p, nKey);
+	if (v != NULL)
+		*v = p->voices[--p->nVoices];
+}
+
+static void* sine_create(double dSampleRate, uint32_t nMaxFrames)
+{
+	(void)dSampleRate;
+	(void)nMaxFrames;
+	sine_state *p = (sine_state*)calloc(1, sizeof(sine_state));
+	if (p != NULL)
+	{
+		p->dAttack = 0.01;
+		p->dRelease = 0.3;
+	}
+	return p;
+}
+
+static void sine_destroy(void *pState)
+{
+	free(pState);
+}
+
+static void sine_note_on(void *pState, const synth_voice *pVoice)
+{
+	sine_state *p = (sine_state*)pState;
+	if (p->nVoices == MAX_VOICES || find_voice(p, pVoice->nKey) != NULL)
+		return;
+	p->voices[p->nVoices].nKey = pVoice->nKey;
+	p->voices[p->nVoices].dPhase = 0.0;
+	p->nVoices++;
+}
+
+static void sine_note_end(void *pState, uint64_t nKey)
+{
+	drop_voice((sine_state*)pState, nKey);
+}
+
+static void sine_render(void *pState, double dTime, double dTimeStep, const synth_voice *pVoices, uint32_t nVoices,
+	float *const *ppOut, uint32_t nFrames, uint8_t *pFinished)
+{
+	sine_state *p = (sine_state*)pState;
+	for (uint32_t i = 0; i < nVoices; i++)
+	{
+		const synth_voice *sv = &pVoices[i];
+		sine_voice *v = find_voice(p, sv->nKey);
+		float *pOut = ppOut[i];
+		if (v == NULL)
+		{
+			// More voices than it keeps
+			for (uint32_t s = 0; s < nFrames; s++)
+				pOut[s] = 0.0f;
+			pFinished[i] = 1;
+			continue;
+		}
+
+		double dStep = sv->dHertz * dTimeStep;
+		for (uint32_t s = 0; s < nFrames; s++)
+		{
+			double t = dTime + s * dTimeStep;
+			if (t < sv->dOn)
+			{
+				pOut[s] = 0.0f;
+				continue;
+			}
+
+			double dLevel = fmin(1.0, (t - sv->dOn) / p->dAttack);
+			if (sv->dOff >= 0.0 && t >= sv->dOff)
+				dLevel *= fmax(0.0, 1.0 - (t - sv->dOff) / p->dRelease);
+
+			pOut[s] = (float)(sin(2.0 * 3.14159265358979323846 * v->dPhase) * dLevel * sv->dVelocity);
+			v->dPhase += dStep;
+			v->dPhase -= floor(v->dPhase);
+		}
+
+		double tEnd = dTime + nFrames * dTimeStep;
+		if (sv->dOff >= 0.0 && tEnd >= sv->dOff + p->dRelease)
+		{
+			pFinished[i] = 1;
+			drop_voice(p, sv->nKey);
+		}
+	}
+}
+
+static const synth_plugin plugin = {
+	SYNTH_PLUGIN_ABI,
+	sizeof(synth_plugin),
+	"Sine",
+	sine_create,
+	sine_destroy,
+	sine_note_on,
+	NULL,
+	sine_note_end,
+	sine_render,
+};
+
+SYNTH_PLUGIN_EXPORT const synth_plugin* synth_plugin_entry(void)
+{
+	return &plugin;
+}
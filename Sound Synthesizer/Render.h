@@ -0,0 +1,282 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+
+#include "Engine.h"
+#include "Granular.h"
+#include "Wavetable.h"
+#include "Song.h"
+#include "Loudness.h"
+
+namespace synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Offline Rendering
+	//
+	// Bounces a song pattern to a 16-bit WAV file faster than realtime. A draft
+	// render trades quality for speed so an arrangement can be heard quickly; the
+	// final render re-renders the same song and pattern with full settings.
+
+	struct render_settings
+	{
+		unsigned int nSampleRate;
+		FTYPE fDetail;			// instrument_base::fDetail
+		int nReverbCombs;		// effect_reverb::nCombs
+		FTYPE fMaxTail;			// Seconds rendered after the pattern for releases
+		FTYPE fPreroll;			// Seconds rendered and dropped before a segment
+		FTYPE fLoudnessTarget;	// LUFS render_song normalises to, 0 to leave as rendered
+
+		static render_settings Final()
+		{
+			return { 44100, 1.0, 4, 10.0, 4.0, 0.0 };
+		}
+
+		// Half rate, a tenth of the saw partials and a two comb reverb
+		static render_settings Draft()
+		{
+			return { 22050, 0.1, 2, 10.0, 4.0, 0.0 };
+		}
+	};
+
+	struct render_result
+	{
+		bool bOk = false;
+		FTYPE fAudioSeconds = 0.0;
+		FTYPE fSeconds = 0.0;		// Wall clock spent rendering, excluding the write
+		FTYPE fLoudness = -INFINITY;	// Integrated LUFS, as written
+		FTYPE fTruePeak = -INFINITY;	// dBTP, as written
+		FTYPE fLoudnessRange = 0.0;		// LU
+		FTYPE fGain = 0.0;				// dB applied to reach the loudness target
+
+		// Audio seconds rendered per wall clock second
+		FTYPE RealtimeFactor() const
+		{
+			return fSeconds > 0.0 ? fAudioSeconds / fSeconds : 0.0;
+		}
+	};
+
+	// Mono 16-bit PCM WAV. With pOverview, the samples are summarised into it as
+	// they are written, and it is finished.
+	bool write_wav(const wstring &sPath, const vector<int16_t> &vecPCM, unsigned int nSampleRate, overview *pOverview = nullptr)
+	{
+		ofstream f(filesystem::path(sPath), ios::binary);
+		if (!f.is_open())
+			return false;
+
+		uint32_t nData = (uint32_t)(vecPCM.size() * sizeof(int16_t));
+		auto u32 = [&f](uint32_t n) { f.write((const char*)&n, 4); };
+		auto u16 = [&f](uint16_t n) { f.write((const char*)&n, 2); };
+
+		f.write("RIFF", 4); u32(36 + nData); f.write("WAVE", 4);
+		f.write("fmt ", 4); u32(16); u16(1); u16(1); u32(nSampleRate); u32(nSampleRate * 2); u16(2); u16(16);
+		f.write("data", 4); u32(nData);
+
+		// In chunks, so each is summarised while it is still in cache
+		const size_t nChunk = 65536;
+		for (size_t n = 0; n < vecPCM.size(); n += nChunk)
+		{
+			size_t nCount = min(nChunk, vecPCM.size() - n);
+			f.write((const char*)(vecPCM.data() + n), nCount * sizeof(int16_t));
+			if (pOverview != nullptr)
+				pOverview->Add(vecPCM.data() + n, nCount);
+		}
+		if (pOverview != nullptr)
+			pOverview->Finish();
+		return f.good();
+	}
+
+	// Mono samples (-1.0 to +1.0) from a 16-bit PCM or 32-bit float WAV file,
+	// channels averaged
+	bool read_wav(const wstring &sPath, vector<FTYPE> &vecSamples, unsigned int &nSampleRate)
+	{
+		ifstream f(filesystem::path(sPath), ios::binary);
+		char riff[12];
+		if (!f.read(riff, 12) || memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0)
+			return false;
+
+		uint16_t nFormat = 0, nChannels = 0, nBits = 0;
+		nSampleRate = 0;
+		char id[4];
+		uint32_t nSize;
+		while (f.read(id, 4) && f.read((char*)&nSize, 4))
+		{
+			if (memcmp(id, "fmt ", 4) == 0 && nSize >= 16)
+			{
+				vector<char> fmt(nSize);
+				f.read(fmt.data(), nSize);
+				memcpy(&nFormat, fmt.data(), 2);
+				memcpy(&nChannels, fmt.data() + 2, 2);
+				memcpy(&nSampleRate, fmt.data() + 4, 4);
+				memcpy(&nBits, fmt.data() + 14, 2);
+			}
+			else if (memcmp(id, "data", 4) == 0)
+			{
+				bool bPCM16 = nFormat == 1 && nBits == 16;
+				bool bFloat = nFormat == 3 && nBits == 32;
+				if (nChannels == 0 || (!bPCM16 && !bFloat))
+					return false;
+
+				vector<char> data(nSize);
+				f.read(data.data(), nSize);
+				size_t nFrames = f.gcount() / (nChannels * (nBits / 8));
+				vecSamples.assign(nFrames, 0.0);
+				for (size_t i = 0; i < nFrames; i++)
+					for (uint16_t c = 0; c < nChannels; c++)
+					{
+						size_t nAt = (i * nChannels + c) * (nBits / 8);
+						if (bPCM16)
+						{
+							int16_t v;
+							memcpy(&v, data.data() + nAt, 2);
+							vecSamples[i] += v / 32768.0 / nChannels;
+						}
+						else
+						{
+							float v;
+							memcpy(&v, data.data() + nAt, 4);
+							vecSamples[i] += v / nChannels;
+						}
+					}
+				return true;
+			}
+			else
+				f.seekg(nSize + (nSize & 1), ios::cur);
+		}
+		return false;
+	}
+
+	// Part of a render: one pattern, or one instrument of it (a stem), between
+	// two times. Segments of the same pattern concatenate sample for sample,
+	// provided fPreroll outlasts the effect tails: reverb left over from before
+	// a segment's preroll is otherwise missing from it, a 1 LSB seam at most.
+	struct render_job
+	{
+		uint32_t nPattern = 0;
+		int nStem = -1;			// Song instrument index, -1 for the full mix
+		FTYPE dStart = 0.0;		// Seconds from the start of the pattern
+		FTYPE dEnd = -1.0;		// Negative runs on until the release tail is over
+	};
+
+	// Renders a job with its own engine, instruments and effects, so the same
+	// inputs always give the same samples for the same settings. Samples are
+	// numbered from the start of the pattern; a segment starting later renders
+	// fPreroll seconds first and drops them, so notes already sounding and the
+	// effect tails are settled when its first sample is kept.
+	bool render_segment(const song_file &song, const render_job &job, const render_settings &settings, vector<int16_t> &vecPCM, loudness_meter *pMeter = nullptr)
+	{
+		vecPCM.clear();
+		if (!song.IsOpen() || job.nPattern >= song.Header().nPatterns)
+			return false;
+
+		engine e(settings.nSampleRate, 1024);
+		instrument_bell instBell;
+		instrument_bell8 instBell8;
+		instrument_harmonica instHarm;
+		instrument_drumkick instKick;
+		instrument_drumsnare instSnare;
+		instrument_drumhihat instHiHat;
+		instrument_granular instGranular;
+		instrument_wavetable instWavetable;
+		for (instrument_base *inst : initializer_list<instrument_base*>{ &instBell, &instBell8, &instHarm, &instKick, &instSnare, &instHiHat, &instGranular, &instWavetable })
+		{
+			inst->fDetail = settings.fDetail;
+			e.AddInstrument(inst);
+		}
+
+		effect_reverb fxReverb;
+		effect_limiter fxLimiter;
+		fxReverb.nCombs = max(1, min(4, settings.nReverbCombs));
+		e.AddEffect(&fxReverb);
+		e.AddEffect(&fxLimiter);
+
+		math::noise_source() = math::random();
+		song_player player(song, e);
+		player.Play(job.nPattern, 0.0, false);
+		FTYPE dEnd = song.Patterns()[job.nPattern].dLength;
+
+		// A stem only keeps its own instrument
+		if (job.nStem >= 0)
+			for (size_t c = 0; c < player.vecChannel.size(); c++)
+				if ((int)c != job.nStem)
+					player.vecChannel[c] = nullptr;
+
+		size_t nFirst = (size_t)max(0.0, job.dStart * settings.nSampleRate);
+		size_t nRendered = (size_t)max(0.0, (job.dStart - settings.fPreroll) * settings.nSampleRate);
+		nRendered -= nRendered % e.nBlockSamples;
+		e.dGlobalTime = (FTYPE)nRendered / settings.nSampleRate;
+
+		// The whole pattern is queued up front, the engine starts each note in its block
+		int nNew = player.Update(dEnd + settings.fMaxTail);
+		for (int a = 0; a < nNew; a++)
+			e.Schedule(player.vecNotes[a]);
+
+		// Past the pattern, on the first block where every note has released, by
+		// the note times rather than by this engine's voices, so every segment
+		// agrees where the song stops
+		size_t nTail = (size_t)-math::floor(-dEnd * settings.nSampleRate / e.nBlockSamples) * e.nBlockSamples;
+		auto bSounding = [&](FTYPE dTime)
+		{
+			for (int a = 0; a < nNew; a++)
+				if (!player.vecNotes[a].channel->Finished(dTime, player.vecNotes[a]))
+					return true;
+			return false;
+		};
+		while ((FTYPE)nTail / settings.nSampleRate < dEnd + settings.fMaxTail && bSounding((FTYPE)nTail / settings.nSampleRate))
+			nTail += e.nBlockSamples;
+		size_t nLast = job.dEnd < 0.0 ? nTail : (size_t)(job.dEnd * settings.nSampleRate);
+
+		vector<FTYPE> vecBlock(e.nBlockSamples);
+		while (nRendered < nLast)
+		{
+			// Each block's clock and noise come from its place in the pattern, not
+			// from the blocks before it, so any segment renders it alike
+			e.dGlobalTime = (FTYPE)nRendered / settings.nSampleRate;
+			math::noise_source() = math::random((nRendered / e.nBlockSamples + 1) * 0x9E3779B97F4A7C15ull);
+			e.Render(vecBlock.data(), e.nBlockSamples);
+			size_t nKept = vecPCM.size();
+			for (unsigned int s = 0; s < e.nBlockSamples && nRendered < nLast; s++, nRendered++)
+				if (nRendered >= nFirst)
+					vecPCM.push_back((int16_t)(max(-1.0, min(1.0, vecBlock[s])) * 32767.0));
+			if (pMeter != nullptr)
+				pMeter->Add(vecPCM.data() + nKept, vecPCM.size() - nKept);
+		}
+
+		return true;
+	}
+
+	// Renders a whole pattern, release tail included, to a file with its
+	// overview sidecar
+	render_result render_song(const song_file &song, uint32_t nPattern, const render_settings &settings, const wstring &sOutput)
+	{
+		render_result r;
+		render_job job;
+		job.nPattern = nPattern;
+
+		vector<int16_t> vecPCM;
+		loudness_meter meter(settings.nSampleRate);
+		auto t0 = chrono::steady_clock::now();
+		if (!render_segment(song, job, settings, vecPCM, &meter))
+			return r;
+
+		r.fSeconds = chrono::duration<FTYPE>(chrono::steady_clock::now() - t0).count();
+		r.fAudioSeconds = (FTYPE)vecPCM.size() / settings.nSampleRate;
+		r.fLoudness = meter.Integrated();
+		r.fTruePeak = meter.TruePeak();
+		r.fLoudnessRange = meter.Range();
+
+		overview peaks(settings.nSampleRate);
+		r.bOk = write_wav(sOutput, vecPCM, settings.nSampleRate, &peaks);
+
+		// A gain over the written file, which also rebuilds the overview
+		if (r.bOk && settings.fLoudnessTarget != 0.0)
+		{
+			r.fGain = loudness_gain(meter, settings.fLoudnessTarget);
+			r.bOk = normalize_wav(sOutput, r.fGain, &peaks);
+			r.fLoudness += r.fGain;
+			r.fTruePeak += r.fGain;
+		}
+		r.bOk = r.bOk && peaks.Write(overview_path(sOutput));
+		return r;
+	}
+
+}
@@ -0,0 +1,298 @@
+#pragma once
+#include <chrono>
+#include <memory>
+#include <map>
+#include <queue>
+
+#include "Engine.h"
+
+namespace synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Block Scheduler
+
+	// Runs block renders for many engines on a fixed set of pinned worker threads.
+	// Each engine releases one block per block period and that block must be done
+	// by the next release; workers always pick the released block with the
+	// earliest deadline. Engines are only admitted if the measured cost of
+	// everything already running, plus the new engine, still fits.
+	struct block_scheduler
+	{
+	public:
+		typedef chrono::steady_clock clock;
+		typedef void(*block_callback)(engine &e, void *pUser);
+
+		struct engine_stats
+		{
+			FTYPE fCost;		// Smoothed render time of one block (seconds)
+			FTYPE fCostPeak;	// Worst render time seen (seconds)
+			FTYPE fPeriod;		// Block period (seconds)
+			unsigned long long nBlocks;
+			unsigned long long nMissed;	// Blocks finished after their deadline
+		};
+
+	public:
+		block_scheduler(unsigned int workers = thread::hardware_concurrency(), FTYPE utilisation = 0.8)
+		{
+			nWorkers = workers > 0 ? workers : 1;
+			fUtilisationBound = utilisation;
+			fCostMargin = 1.5;
+			bRunning = false;
+		}
+
+		~block_scheduler()
+		{
+			Stop();
+		}
+
+		void Start()
+		{
+			if (bRunning) return;
+			bRunning = true;
+
+			for (unsigned int i = 0; i < nWorkers; i++)
+			{
+				vecWorkers.push_back(thread(&block_scheduler::WorkerThread, this));
+				platform::pin_thread(vecWorkers.back(), i);
+			}
+		}
+
+		void Stop()
+		{
+			{
+				unique_lock<mutex> lm(muxJobs);
+				bRunning = false;
+			}
+			cvJobs.notify_all();
+
+			for (auto &t : vecWorkers)
+				t.join();
+			vecWorkers.clear();
+		}
+
+		// Limits the sum of cost/period over a session's engines, in cores
+		void SetSessionQuota(int nSession, FTYPE fCores)
+		{
+			unique_lock<mutex> lm(muxJobs);
+			mapQuota[nSession] = fCores;
+		}
+
+		// Measures the cost of a block on probe, a stand-in set up like e (same
+		// rate, block size, instruments and a typical voice load), then admits e if
+		// both the global and the session budget allow. Returns false if rejected.
+		// e itself is never rendered here, since that would play its notes, release
+		// its schedule and move its effects. An engine can't be copied (it owns
+		// threads and is linked to its instruments), so the caller builds the copy.
+		bool Admit(engine *e, engine &probe, int nSession = 0, block_callback pCallback = nullptr, void *pUser = nullptr, unsigned int nProbeBlocks = 4)
+		{
+			if (&probe == e || probe.nSampleRate != e->nSampleRate || probe.nBlockSamples != e->nBlockSamples)
+				return false;
+
+			FTYPE fCost = 0.0;
+			for (unsigned int i = 0; i < nProbeBlocks; i++)
+			{
+				auto t0 = clock::now();
+				probe.RenderBlock();
+				fCost = max(fCost, chrono::duration<FTYPE>(clock::now() - t0).count());
+			}
+
+			return Admit(e, fCost, nSession, pCallback, pUser);
+		}
+
+		// As above, but with a caller supplied cost estimate for one block (seconds)
+		bool Admit(engine *e, FTYPE fCost, int nSession, block_callback pCallback, void *pUser)
+		{
+			unique_lock<mutex> lm(muxJobs);
+
+			FTYPE fLoad = fCost * fCostMargin / e->BlockTime();
+			if (Utilisation(-1) + fLoad > fUtilisationBound * nWorkers)
+				return false;
+
+			auto q = mapQuota.find(nSession);
+			if (q != mapQuota.end() && Utilisation(nSession) + fLoad > q->second)
+				return false;
+
+			auto j = make_unique<job>();
+			j->pEngine = e;
+			j->nSession = nSession;
+			j->pCallback = pCallback;
+			j->pUser = pUser;
+			j->period = chrono::duration_cast<clock::duration>(chrono::duration<FTYPE>(e->BlockTime()));
+			j->tRelease = clock::now();
+			j->stats = { fCost, fCost, e->BlockTime(), 0, 0 };
+			j->bActive = true;
+			j->bBusy = false;
+
+			queueReleases.push({ j->tRelease, j.get() });
+			vecJobs.push_back(move(j));
+			lm.unlock();
+
+			cvJobs.notify_one();
+			return true;
+		}
+
+		// Blocks until the engine is no longer being rendered, then forgets it, so
+		// it may be destroyed or admitted again
+		void Remove(engine *e)
+		{
+			unique_lock<mutex> lm(muxJobs);
+
+			// Admit may grow vecJobs while this waits, so hold the jobs, not iterators
+			vector<job*> vecRemoved;
+			for (auto &j : vecJobs)
+				if (j->pEngine == e)
+				{
+					j->bActive = false;
+					vecRemoved.push_back(j.get());
+				}
+			for (auto j : vecRemoved)
+				cvIdle.wait(lm, [j] { return !j->bBusy; });
+
+			Purge(queueReleases, e);
+			Purge(queueReady, e);
+			vecJobs.erase(remove_if(vecJobs.begin(), vecJobs.end(), [e](const unique_ptr<job> &j) { return j->pEngine == e; }), vecJobs.end());
+		}
+
+		// Engines admitted and not removed
+		size_t Count()
+		{
+			unique_lock<mutex> lm(muxJobs);
+			return vecJobs.size();
+		}
+
+		engine_stats GetStats(engine *e)
+		{
+			unique_lock<mutex> lm(muxJobs);
+			for (auto &j : vecJobs)
+				if (j->pEngine == e && j->bActive)
+					return j->stats;
+			return engine_stats{};
+		}
+
+		// Fraction of a core in use, over all engines (nSession < 0) or one session
+		FTYPE GetUtilisation(int nSession = -1)
+		{
+			unique_lock<mutex> lm(muxJobs);
+			return Utilisation(nSession);
+		}
+
+	private:
+		struct job
+		{
+			engine *pEngine;
+			int nSession;
+			block_callback pCallback;
+			void *pUser;
+			clock::duration period;
+			clock::time_point tRelease;
+			engine_stats stats;
+			bool bActive;
+			bool bBusy;
+		};
+
+		typedef pair<clock::time_point, job*> entry;
+		typedef priority_queue<entry, vector<entry>, greater<entry>> time_queue;
+
+		// Caller holds muxJobs
+		FTYPE Utilisation(int nSession)
+		{
+			FTYPE fLoad = 0.0;
+			for (auto &j : vecJobs)
+				if (j->bActive && (nSession < 0 || j->nSession == nSession))
+					fLoad += j->stats.fCost * fCostMargin / j->stats.fPeriod;
+			return fLoad;
+		}
+
+		// Drops the engine's entries from a queue. Caller holds muxJobs.
+		static void Purge(time_queue &queue, engine *e)
+		{
+			vector<entry> vecKeep;
+			for (; !queue.empty(); queue.pop())
+				if (queue.top().second->pEngine != e)
+					vecKeep.push_back(queue.top());
+			queue = time_queue(greater<entry>(), move(vecKeep));
+		}
+
+		void WorkerThread()
+		{
+			unique_lock<mutex> lm(muxJobs);
+
+			while (bRunning)
+			{
+				// Everything whose release time has passed becomes ready, ordered by deadline
+				auto tNow = clock::now();
+				while (!queueReleases.empty() && queueReleases.top().first <= tNow)
+				{
+					job *j = queueReleases.top().second;
+					queueReleases.pop();
+					if (j->bActive)
+						queueReady.push({ j->tRelease + j->period, j });
+				}
+
+				if (queueReady.empty())
+				{
+					// By value: the queue may grow, and move, while this waits
+					if (queueReleases.empty())
+						cvJobs.wait(lm);
+					else
+					{
+						clock::time_point tNext = queueReleases.top().first;
+						cvJobs.wait_until(lm, tNext);
+					}
+					continue;
+				}
+
+				job *j = queueReady.top().second;
+				clock::time_point tDeadline = queueReady.top().first;
+				queueReady.pop();
+				if (!j->bActive)
+					continue;
+
+				j->bBusy = true;
+				lm.unlock();
+
+				auto t0 = clock::now();
+				j->pEngine->RenderBlock();
+				if (j->pCallback != nullptr)
+					j->pCallback(*j->pEngine, j->pUser);
+				auto t1 = clock::now();
+
+				lm.lock();
+				FTYPE fCost = chrono::duration<FTYPE>(t1 - t0).count();
+				j->stats.fCost = 0.95 * j->stats.fCost + 0.05 * fCost;
+				j->stats.fCostPeak = max(j->stats.fCostPeak, fCost);
+				j->stats.nBlocks++;
+				if (t1 > tDeadline)
+					j->stats.nMissed++;
+				j->bBusy = false;
+
+				// Next block of this engine is released one period later
+				if (j->bActive)
+				{
+					j->tRelease += j->period;
+					queueReleases.push({ j->tRelease, j });
+					cvJobs.notify_one();
+				}
+				else
+					cvIdle.notify_all();
+			}
+		}
+
+	public:
+		unsigned int nWorkers;
+		FTYPE fUtilisationBound;	// Admission limit, as a fraction of each worker
+		FTYPE fCostMargin;			// Headroom applied to measured costs
+
+	private:
+		vector<thread> vecWorkers;
+		vector<unique_ptr<job>> vecJobs;
+		map<int, FTYPE> mapQuota;
+		time_queue queueReleases;
+		time_queue queueReady;
+		mutex muxJobs;
+		condition_variable cvJobs;
+		condition_variable cvIdle;
+		bool bRunning;
+	};
+
+}
@@ -0,0 +1,262 @@
+#pragma once
+#include <cstdint>
+
+#include "Engine.h"
+
+namespace synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Binary Song Format
+	//
+	// [song_header][song_instrument x nInstruments][song_pattern x nPatterns][song_event x nEvents]
+	//
+	// Every record is fixed size and 8 byte aligned, so a mapped file is played in
+	// place. A pattern is a range of events sorted by time relative to its start.
+
+	const uint32_t SONG_VERSION = 1;
+
+	struct song_header
+	{
+		char magic[4];			// "CSNG"
+		uint32_t nVersion;
+		uint32_t nInstruments;
+		uint32_t nPatterns;
+		uint32_t nEvents;
+		uint32_t nInstrumentOffset;	// Byte offsets from the start of the file
+		uint32_t nPatternOffset;
+		uint32_t nEventOffset;
+		double dTempo;
+	};
+
+	struct song_instrument
+	{
+		char name[32];			// Matched against instrument_base::name when played
+	};
+
+	struct song_pattern
+	{
+		char name[24];
+		uint32_t nFirstEvent;
+		uint32_t nEvents;
+		double dLength;			// Seconds, used when looping
+	};
+
+	struct song_event
+	{
+		double dTime;			// Seconds from the start of the pattern
+		float fDuration;		// Seconds until release, 0 leaves it to the envelope
+		uint16_t nInstrument;	// Index into the instrument table
+		int16_t nNoteId;		// Position in scale
+	};
+
+	static_assert(sizeof(song_header) == 40, "song_header layout");
+	static_assert(sizeof(song_instrument) == 32, "song_instrument layout");
+	static_assert(sizeof(song_pattern) == 40, "song_pattern layout");
+	static_assert(sizeof(song_event) == 16, "song_event layout");
+
+
+	// A read-only memory mapped song. Opening only validates the header and
+	// tables; events are read straight out of the mapping while playing.
+	struct song_file
+	{
+	public:
+		song_file()
+		{
+			m_pData = nullptr;
+			m_nSize = 0;
+		}
+
+		~song_file()
+		{
+			Close();
+		}
+
+		song_file(const song_file&) = delete;
+		song_file& operator=(const song_file&) = delete;
+
+		bool Open(const wstring &sPath)
+		{
+			Close();
+
+			if (!m_file.Open(sPath) || m_file.Size() < sizeof(song_header))
+				return Close();
+			m_pData = m_file.Data();
+			m_nSize = m_file.Size();
+
+			if (!Validate())
+				return Close();
+
+			return true;
+		}
+
+		bool Close()
+		{
+			m_file.Close();
+			m_pData = nullptr;
+			m_nSize = 0;
+			return false;
+		}
+
+		bool IsOpen() const { return m_pData != nullptr; }
+
+		const song_header& Header() const { return *(const song_header*)m_pData; }
+		const song_instrument* Instruments() const { return (const song_instrument*)(m_pData + Header().nInstrumentOffset); }
+		const song_pattern* Patterns() const { return (const song_pattern*)(m_pData + Header().nPatternOffset); }
+		const song_event* Events() const { return (const song_event*)(m_pData + Header().nEventOffset); }
+
+	private:
+		bool Validate()
+		{
+			const song_header &h = Header();
+			if (memcmp(h.magic, "CSNG", 4) != 0 || h.nVersion != SONG_VERSION)
+				return false;
+
+			auto fits = [this](uint32_t nOffset, uint32_t nCount, size_t nRecord)
+			{
+				return nOffset % 8 == 0 && (uint64_t)nOffset + (uint64_t)nCount * nRecord <= m_nSize;
+			};
+
+			if (!fits(h.nInstrumentOffset, h.nInstruments, sizeof(song_instrument)) ||
+				!fits(h.nPatternOffset, h.nPatterns, sizeof(song_pattern)) ||
+				!fits(h.nEventOffset, h.nEvents, sizeof(song_event)))
+				return false;
+
+			for (uint32_t p = 0; p < h.nPatterns; p++)
+				if ((uint64_t)Patterns()[p].nFirstEvent + Patterns()[p].nEvents > h.nEvents)
+					return false;
+
+			return true;
+		}
+
+	private:
+		platform::mapped_file m_file;
+		const char *m_pData;
+		size_t m_nSize;
+	};
+
+
+	// Plays one pattern of a mapped song into an engine, optionally looping.
+	// Works like the sequencer: Update collects the notes due before
+	// dTimeNow + fLookahead, with their on (and off) times already set.
+	struct song_player
+	{
+	public:
+		song_player(const song_file &file, engine &e, FTYPE lookahead = 0.1) : song(file)
+		{
+			fLookahead = lookahead;
+			bLoop = false;
+			m_pPattern = nullptr;
+			m_nNext = 0;
+			m_dPatternStart = 0.0;
+
+			// Bind the instrument table to the engine's instruments by name
+			for (uint32_t i = 0; song.IsOpen() && i < song.Header().nInstruments; i++)
+			{
+				const song_instrument &si = song.Instruments()[i];
+				string sName(si.name, strnlen(si.name, sizeof(si.name)));
+				wstring sWide(sName.begin(), sName.end());
+
+				instrument_base *inst = nullptr;
+				for (auto ei : e.vecInstruments)
+					if (ei->name == sWide)
+						inst = ei;
+				vecChannel.push_back(inst);
+			}
+		}
+
+		bool Play(uint32_t nPattern, FTYPE dStart, bool loop = false)
+		{
+			if (!song.IsOpen() || nPattern >= song.Header().nPatterns)
+				return false;
+
+			m_pPattern = &song.Patterns()[nPattern];
+			m_nNext = 0;
+			m_dPatternStart = dStart;
+			bLoop = loop && m_pPattern->dLength > 0.0 && m_pPattern->nEvents > 0;
+			return true;
+		}
+
+		void Stop()
+		{
+			m_pPattern = nullptr;
+		}
+
+		int Update(FTYPE dTimeNow)
+		{
+			vecNotes.clear();
+			if (m_pPattern == nullptr)
+				return 0;
+
+			const song_event *pEvents = song.Events() + m_pPattern->nFirstEvent;
+			FTYPE dHorizon = dTimeNow + fLookahead;
+
+			while (m_pPattern != nullptr)
+			{
+				if (m_nNext >= m_pPattern->nEvents)
+				{
+					if (!bLoop)
+					{
+						m_pPattern = nullptr;
+						break;
+					}
+					m_nNext = 0;
+					m_dPatternStart += m_pPattern->dLength;
+				}
+
+				const song_event &ev = pEvents[m_nNext];
+				FTYPE dOn = m_dPatternStart + ev.dTime;
+				if (dOn >= dHorizon)
+					break;
+				m_nNext++;
+
+				if (ev.nInstrument >= vecChannel.size() || vecChannel[ev.nInstrument] == nullptr)
+					continue;
+
+				note n;
+				n.id = ev.nNoteId;
+				n.on = dOn;
+				n.off = ev.fDuration > 0.0f ? dOn + ev.fDuration : NOTE_HELD;
+				n.active = true;
+				n.channel = vecChannel[ev.nInstrument];
+				vecNotes.push_back(n);
+			}
+
+			return vecNotes.size();
+		}
+
+		bool IsPlaying() const { return m_pPattern != nullptr; }
+
+		// Where the player is in its pattern, for checkpointing and seeking
+		struct position
+		{
+			const song_pattern *pPattern;
+			uint32_t nNext;
+			FTYPE dPatternStart;
+		};
+
+		position GetPosition() const
+		{
+			return { m_pPattern, m_nNext, m_dPatternStart };
+		}
+
+		void SetPosition(const position &p)
+		{
+			m_pPattern = p.pPattern;
+			m_nNext = p.nNext;
+			m_dPatternStart = p.dPatternStart;
+		}
+
+	public:
+		const song_file &song;
+		FTYPE fLookahead;
+		bool bLoop;
+		vector<instrument_base*> vecChannel;
+		vector<note> vecNotes;
+
+	private:
+		const song_pattern *m_pPattern;
+		uint32_t m_nNext;
+		FTYPE m_dPatternStart;
+	};
+
+}
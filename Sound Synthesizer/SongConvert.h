@@ -0,0 +1,278 @@
+#pragma once
+#include <filesystem>
+#include <map>
+
+#include "Song.h"
+
+namespace synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Song Conversion
+
+	// Collects instruments and patterns in memory and writes the binary song file
+	struct song_builder
+	{
+	public:
+		song_builder(double tempo = 120.0)
+		{
+			dTempo = tempo;
+		}
+
+		uint16_t AddInstrument(const string &sName)
+		{
+			for (size_t i = 0; i < vecInstruments.size(); i++)
+				if (vecInstruments[i] == sName)
+					return (uint16_t)i;
+			vecInstruments.push_back(sName.substr(0, sizeof(song_instrument::name) - 1));
+			return (uint16_t)(vecInstruments.size() - 1);
+		}
+
+		// Events may be in any order, they are sorted here
+		void AddPattern(const string &sName, double dLength, vector<song_event> vecEvents)
+		{
+			stable_sort(vecEvents.begin(), vecEvents.end(), [](const song_event &a, const song_event &b) { return a.dTime < b.dTime; });
+			vecPatterns.push_back({ sName, dLength, move(vecEvents) });
+		}
+
+		bool Write(const wstring &sPath)
+		{
+			song_header h = {};
+			memcpy(h.magic, "CSNG", 4);
+			h.nVersion = SONG_VERSION;
+			h.nInstruments = (uint32_t)vecInstruments.size();
+			h.nPatterns = (uint32_t)vecPatterns.size();
+			h.nEvents = 0;
+			for (auto &p : vecPatterns)
+				h.nEvents += (uint32_t)p.vecEvents.size();
+			h.nInstrumentOffset = sizeof(song_header);
+			h.nPatternOffset = h.nInstrumentOffset + h.nInstruments * sizeof(song_instrument);
+			h.nEventOffset = h.nPatternOffset + h.nPatterns * sizeof(song_pattern);
+			h.dTempo = dTempo;
+
+			ofstream f(filesystem::path(sPath), ios::binary);
+			if (!f.is_open())
+				return false;
+
+			f.write((const char*)&h, sizeof(h));
+
+			for (auto &sName : vecInstruments)
+			{
+				song_instrument si = {};
+				memcpy(si.name, sName.c_str(), sName.size());
+				f.write((const char*)&si, sizeof(si));
+			}
+
+			uint32_t nFirst = 0;
+			for (auto &p : vecPatterns)
+			{
+				song_pattern sp = {};
+				memcpy(sp.name, p.sName.c_str(), min(p.sName.size(), sizeof(sp.name) - 1));
+				sp.nFirstEvent = nFirst;
+				sp.nEvents = (uint32_t)p.vecEvents.size();
+				sp.dLength = p.dLength;
+				f.write((const char*)&sp, sizeof(sp));
+				nFirst += sp.nEvents;
+			}
+
+			for (auto &p : vecPatterns)
+				f.write((const char*)p.vecEvents.data(), p.vecEvents.size() * sizeof(song_event));
+
+			return f.good();
+		}
+
+	public:
+		struct pattern_entry
+		{
+			string sName;
+			double dLength;
+			vector<song_event> vecEvents;
+		};
+
+		double dTempo;
+		vector<string> vecInstruments;
+		vector<pattern_entry> vecPatterns;
+	};
+
+
+	// Converts sequencer style beat strings. Each line is "<instrument>: <beat>",
+	// e.g. "Drum Kick: X...X...X..X.X..", with an optional "tempo: 90" line.
+	// Every beat string becomes one channel of a single pattern.
+	bool song_from_text(const wstring &sPath, song_builder &song, int nSubBeats = 4)
+	{
+		ifstream f{ filesystem::path(sPath) };
+		if (!f.is_open())
+			return false;
+
+		vector<pair<string, string>> vecChannels;
+		string sLine;
+		while (getline(f, sLine))
+		{
+			size_t nColon = sLine.find(':');
+			if (sLine.empty() || sLine[0] == '#' || nColon == string::npos)
+				continue;
+
+			string sKey = sLine.substr(0, nColon);
+			string sValue = sLine.substr(nColon + 1);
+			sValue.erase(0, sValue.find_first_not_of(" \t"));
+			sValue.erase(sValue.find_last_not_of(" \t\r") + 1);
+
+			if (sKey == "tempo")
+				song.dTempo = atof(sValue.c_str());
+			else
+				vecChannels.push_back({ sKey, sValue });
+		}
+
+		if (vecChannels.empty() || song.dTempo <= 0.0)
+			return false;
+
+		double dStepTime = (60.0 / song.dTempo) / (double)nSubBeats;
+		size_t nSteps = 0;
+		vector<song_event> vecEvents;
+		for (auto &c : vecChannels)
+		{
+			uint16_t nInstrument = song.AddInstrument(c.first);
+			for (size_t s = 0; s < c.second.size(); s++)
+				if (c.second[s] == 'X')
+					vecEvents.push_back({ s * dStepTime, 0.0f, nInstrument, 64 });
+			nSteps = max(nSteps, c.second.size());
+		}
+
+		song.AddPattern("text", nSteps * dStepTime, move(vecEvents));
+		return true;
+	}
+
+
+	// Converts a standard MIDI file (format 0 or 1, PPQN timing) into a single
+	// pattern. MIDI note numbers map directly onto scale() ids. Channels are
+	// bound to instruments by vecChannelNames (16 entries, by MIDI channel).
+	bool song_from_midi(const wstring &sPath, song_builder &song, const vector<string> &vecChannelNames)
+	{
+		ifstream f(filesystem::path(sPath), ios::binary);
+		if (!f.is_open())
+			return false;
+		vector<uint8_t> data((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+
+		size_t p = 0;
+		auto u8 = [&]() -> uint32_t { return p < data.size() ? data[p++] : 0; };
+		auto u16 = [&]() -> uint32_t { uint32_t n = u8() << 8; return n | u8(); };
+		auto u32 = [&]() -> uint32_t { uint32_t n = u16() << 16; return n | u16(); };
+		auto vlq = [&]() -> uint32_t { uint32_t n = 0, b; do { b = u8(); n = (n << 7) | (b & 0x7F); } while ((b & 0x80) && p < data.size()); return n; };
+
+		if (data.size() < 14 || memcmp(data.data(), "MThd", 4) != 0)
+			return false;
+		p = 4;
+		uint32_t nHeaderLength = u32();
+		uint32_t nFormat = u16();
+		uint32_t nTracks = u16();
+		uint32_t nDivision = u16();
+		p = 8 + nHeaderLength;
+		if (nFormat > 1 || (nDivision & 0x8000) || nDivision == 0)
+			return false;
+
+		struct midi_event { uint64_t nTick; uint32_t nOrder; int nType; int nChannel; int nKey; uint32_t nTempo; };
+		vector<midi_event> vecMidi;
+
+		for (uint32_t t = 0; t < nTracks && p + 8 <= data.size(); t++)
+		{
+			if (memcmp(&data[p], "MTrk", 4) != 0)
+				return false;
+			p += 4;
+			size_t nEnd = min(data.size(), (size_t)u32() + p);
+
+			uint64_t nTick = 0;
+			uint32_t nStatus = 0;
+			while (p < nEnd)
+			{
+				nTick += vlq();
+				uint32_t b = u8();
+				if (b & 0x80)
+					nStatus = b;
+				else
+					p--; // Running status
+
+				uint32_t nType = nStatus & 0xF0;
+				int nChannel = nStatus & 0x0F;
+
+				if (nStatus == 0xFF)
+				{
+					uint32_t nMeta = u8();
+					uint32_t nLength = vlq();
+					if (nMeta == 0x51 && nLength == 3)
+					{
+						uint32_t nTempo = (u8() << 16);
+						nTempo |= u16();
+						if (nTempo == 0)
+							return false; // Zero microseconds per beat, no valid file has it
+						vecMidi.push_back({ nTick, (uint32_t)vecMidi.size(), 2, 0, 0, nTempo });
+					}
+					else
+						p += nLength;
+					nStatus = 0;
+				}
+				else if (nStatus == 0xF0 || nStatus == 0xF7)
+				{
+					p += vlq();
+					nStatus = 0;
+				}
+				else if (nType == 0x80 || nType == 0x90)
+				{
+					int nKey = u8();
+					int nVelocity = u8();
+					int nOn = (nType == 0x90 && nVelocity > 0) ? 1 : 0;
+					vecMidi.push_back({ nTick, (uint32_t)vecMidi.size(), nOn, nChannel, nKey, 0 });
+				}
+				else if (nType == 0xC0 || nType == 0xD0)
+					p += 1;
+				else if (nType == 0xA0 || nType == 0xB0 || nType == 0xE0)
+					p += 2;
+				else
+					break; // Unknown status, skip the rest of the track
+			}
+			p = nEnd;
+		}
+
+		// Merge the tracks and walk the tempo map to turn ticks into seconds
+		sort(vecMidi.begin(), vecMidi.end(), [](const midi_event &a, const midi_event &b) { return a.nTick != b.nTick ? a.nTick < b.nTick : a.nOrder < b.nOrder; });
+
+		double dSecondsPerTick = 0.5 / nDivision;	// 120bpm until told otherwise
+		double dTime = 0.0;
+		uint64_t nLastTick = 0;
+		bool bTempoSet = false;
+		map<pair<int, int>, vector<size_t>> mapHeld;
+		vector<song_event> vecEvents;
+
+		for (auto &m : vecMidi)
+		{
+			dTime += (m.nTick - nLastTick) * dSecondsPerTick;
+			nLastTick = m.nTick;
+
+			if (m.nType == 2)
+			{
+				dSecondsPerTick = (m.nTempo / 1000000.0) / nDivision;
+				if (!bTempoSet)
+					song.dTempo = 60000000.0 / m.nTempo;
+				bTempoSet = true;
+			}
+			else if (m.nType == 1)
+			{
+				string sName = m.nChannel < (int)vecChannelNames.size() ? vecChannelNames[m.nChannel] : "Channel " + to_string(m.nChannel + 1);
+				mapHeld[{ m.nChannel, m.nKey }].push_back(vecEvents.size());
+				vecEvents.push_back({ dTime, 0.0f, song.AddInstrument(sName), (int16_t)m.nKey });
+			}
+			else
+			{
+				auto &held = mapHeld[{ m.nChannel, m.nKey }];
+				if (!held.empty())
+				{
+					song_event &ev = vecEvents[held.front()];
+					ev.fDuration = (float)max(dTime - ev.dTime, 1e-4);
+					held.erase(held.begin());
+				}
+			}
+		}
+
+		song.AddPattern("midi", dTime, move(vecEvents));
+		return true;
+	}
+
+}
@@ -0,0 +1,210 @@
+#pragma once
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "Core.h"
+
+namespace synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Spatial Output
+
+	// Speakers in a horizontal ring, by azimuth in radians (0 is front, positive
+	// is anticlockwise seen from above). Output channel n drives speaker n.
+	struct speaker_layout
+	{
+		vector<FTYPE> vecAzimuth;
+
+		// n speakers evenly spaced, the first at dOffset
+		static speaker_layout Ring(unsigned int n, FTYPE dOffset = 0.0)
+		{
+			speaker_layout l;
+			for (unsigned int i = 0; i < n; i++)
+				l.vecAzimuth.push_back(dOffset + 2.0 * PI * i / n);
+			return l;
+		}
+
+		unsigned int Count() const
+		{
+			return (unsigned int)vecAzimuth.size();
+		}
+	};
+
+	// Pairwise 2D VBAP: pans between the two neighbouring speakers that enclose
+	// dAzimuth, constant power. Writes layout.Count() gains to pGains.
+	void vbap_gains(const speaker_layout &layout, FTYPE dAzimuth, FTYPE *pGains)
+	{
+		unsigned int nSpeakers = layout.Count();
+		for (unsigned int i = 0; i < nSpeakers; i++)
+			pGains[i] = 0.0;
+		if (nSpeakers == 0)
+			return;
+		if (nSpeakers == 1)
+		{
+			pGains[0] = 1.0;
+			return;
+		}
+
+		auto wrap = [](FTYPE a) { a = math::fmod(a, 2.0 * PI); return a < 0.0 ? a + 2.0 * PI : a; };
+		FTYPE px = math::cos(dAzimuth), py = math::sin(dAzimuth);
+
+		// Nearest speaker on each side, measured anticlockwise from the source
+		unsigned int nLeft = 0, nRight = 0;
+		FTYPE dLeft = 4.0 * PI, dRight = 4.0 * PI;
+		for (unsigned int i = 0; i < nSpeakers; i++)
+		{
+			FTYPE d = wrap(layout.vecAzimuth[i] - dAzimuth);
+			if (d < dLeft) { dLeft = d; nLeft = i; }
+			d = wrap(dAzimuth - layout.vecAzimuth[i]);
+			if (d < dRight) { dRight = d; nRight = i; }
+		}
+
+		if (nLeft == nRight)
+		{
+			pGains[nLeft] = 1.0;
+			return;
+		}
+
+		// Solve p = g1 * l1 + g2 * l2 for the pair's unit vectors
+		FTYPE l1x = math::cos(layout.vecAzimuth[nRight]), l1y = math::sin(layout.vecAzimuth[nRight]);
+		FTYPE l2x = math::cos(layout.vecAzimuth[nLeft]), l2y = math::sin(layout.vecAzimuth[nLeft]);
+		FTYPE dDet = l1x * l2y - l2x * l1y;
+		FTYPE g1, g2;
+		if (math::fabs(dDet) < 1e-9)
+		{
+			// Opposite speakers (only two in the ring), pan by projection
+			g1 = max(0.0, px * l1x + py * l1y);
+			g2 = max(0.0, px * l2x + py * l2y);
+		}
+		else
+		{
+			g1 = max(0.0, (px * l2y - l2x * py) / dDet);
+			g2 = max(0.0, (l1x * py - px * l1y) / dDet);
+		}
+
+		FTYPE dPower = g1 * g1 + g2 * g2;
+		FTYPE dNorm = dPower > 0.0 ? 1.0 / std::sqrt(dPower) : 0.0;
+		pGains[nRight] = g1 * dNorm;
+		pGains[nLeft] = g2 * dNorm;
+	}
+
+
+	// Mixes a block of voices to a block of channels as one matrix product,
+	// channels(c, s) = sum over v of gains(v, c) * voices(v, s). Voices are rows
+	// of nFrames samples, gains are rows of nChannels, output is planar. More
+	// voices than there are rows are mixed a batch of rows at a time.
+	struct spatial_mixer
+	{
+		static_assert(sizeof(FTYPE) == sizeof(double), "spatial_mixer kernels are written for double");
+
+	public:
+		spatial_mixer(memory_account *account = nullptr)
+			: vecVoices(tracked_allocator<FTYPE, MEM_SCRATCH>(account)), vecGains(tracked_allocator<FTYPE, MEM_SCRATCH>(account))
+		{
+			nVoiceCapacity = 0;
+			nChannels = 0;
+			nFrames = 0;
+		}
+
+		// Grows the buffers; only allocates when the shape gets bigger. Rows come
+		// in fours, so batches of rows add up in the same order as one pass would.
+		void Reserve(size_t nVoices, unsigned int channels, unsigned int frames)
+		{
+			nVoices = (nVoices + 3) / 4 * 4;
+			if (nVoices <= nVoiceCapacity && channels == nChannels && frames == nFrames)
+				return;
+
+			nVoiceCapacity = max(nVoices, nVoiceCapacity);
+			nChannels = channels;
+			nFrames = frames;
+			vecVoices.resize(nVoiceCapacity * nFrames, 0.0);
+			vecGains.resize(nVoiceCapacity * nChannels, 0.0);
+		}
+
+		FTYPE* Voice(size_t v) { return vecVoices.data() + v * nFrames; }
+		FTYPE* Gains(size_t v) { return vecGains.data() + v * nChannels; }
+		size_t Rows() const { return nVoiceCapacity; }
+
+		// Mixes the first nVoices rows, frames samples of each (at most nFrames),
+		// into pOut: nChannels planes, nPlane samples apart. bAdd adds to what is
+		// there, for the second and later batches.
+		void Mix(FTYPE *pOut, size_t nPlane, size_t nVoices, unsigned int frames, bool bAdd = false)
+		{
+			for (unsigned int c = 0; c < nChannels; c++)
+			{
+				FTYPE *pChannel = pOut + (size_t)c * nPlane;
+				if (!bAdd)
+					for (unsigned int s = 0; s < frames; s++)
+						pChannel[s] = 0.0;
+
+				// Four voices per pass, so each output sample is loaded and stored
+				// once per four multiply-adds
+				size_t v = 0;
+				for (; v + 4 <= nVoices; v += 4)
+				{
+					const FTYPE g[4] = { Gains(v)[c], Gains(v + 1)[c], Gains(v + 2)[c], Gains(v + 3)[c] };
+					if (g[0] == 0.0 && g[1] == 0.0 && g[2] == 0.0 && g[3] == 0.0)
+						continue;
+					Accumulate4(pChannel, Voice(v), g, frames);
+				}
+				for (; v < nVoices; v++)
+				{
+					FTYPE g = Gains(v)[c];
+					if (g == 0.0)
+						continue;
+					const FTYPE *pVoice = Voice(v);
+					for (unsigned int s = 0; s < frames; s++)
+						pChannel[s] += g * pVoice[s];
+				}
+			}
+		}
+
+	private:
+		// pOut += g[0] * row 0 + ... + g[3] * row 3 over frames samples, rows
+		// nFrames apart
+		void Accumulate4(FTYPE *pOut, const FTYPE *pRows, const FTYPE *g, unsigned int frames)
+		{
+			const FTYPE *p0 = pRows, *p1 = pRows + nFrames, *p2 = pRows + 2 * nFrames, *p3 = pRows + 3 * nFrames;
+			unsigned int s = 0;
+
+#if defined(__AVX__)
+			__m256d g0 = _mm256_set1_pd(g[0]), g1 = _mm256_set1_pd(g[1]), g2 = _mm256_set1_pd(g[2]), g3 = _mm256_set1_pd(g[3]);
+			for (; s + 4 <= frames; s += 4)
+			{
+				__m256d a = _mm256_loadu_pd(pOut + s);
+				a = _mm256_add_pd(a, _mm256_mul_pd(g0, _mm256_loadu_pd(p0 + s)));
+				a = _mm256_add_pd(a, _mm256_mul_pd(g1, _mm256_loadu_pd(p1 + s)));
+				a = _mm256_add_pd(a, _mm256_mul_pd(g2, _mm256_loadu_pd(p2 + s)));
+				a = _mm256_add_pd(a, _mm256_mul_pd(g3, _mm256_loadu_pd(p3 + s)));
+				_mm256_storeu_pd(pOut + s, a);
+			}
+#elif defined(_M_X64) || defined(__SSE2__)
+			__m128d g0 = _mm_set1_pd(g[0]), g1 = _mm_set1_pd(g[1]), g2 = _mm_set1_pd(g[2]), g3 = _mm_set1_pd(g[3]);
+			for (; s + 2 <= frames; s += 2)
+			{
+				__m128d a = _mm_loadu_pd(pOut + s);
+				a = _mm_add_pd(a, _mm_mul_pd(g0, _mm_loadu_pd(p0 + s)));
+				a = _mm_add_pd(a, _mm_mul_pd(g1, _mm_loadu_pd(p1 + s)));
+				a = _mm_add_pd(a, _mm_mul_pd(g2, _mm_loadu_pd(p2 + s)));
+				a = _mm_add_pd(a, _mm_mul_pd(g3, _mm_loadu_pd(p3 + s)));
+				_mm_storeu_pd(pOut + s, a);
+			}
+#endif
+			for (; s < frames; s++)
+				pOut[s] = (((pOut[s] + g[0] * p0[s]) + g[1] * p1[s]) + g[2] * p2[s]) + g[3] * p3[s];
+		}
+
+	public:
+		unsigned int nChannels;
+		unsigned int nFrames;
+
+	private:
+		size_t nVoiceCapacity;
+		tracked_vector<FTYPE, MEM_SCRATCH> vecVoices;
+		tracked_vector<FTYPE, MEM_SCRATCH> vecGains;
+	};
+
+}
@@ -0,0 +1,1000 @@
+// Regression tests. From Sound Synthesizer/:
+//
+//   g++ -std=c++20 -O2 Tests/Tests.cpp -o tests -lpthread -ldl && ./tests
+//
+// or build the Tests project in the solution. Prints each failure and exits
+// non-zero if there were any.
+
+#include <cstdio>
+#include "../Engine.h"
+#include "../Granular.h"
+#include "../Wavetable.h"
+#include "../SongConvert.h"
+#include "../Transport.h"
+#include "../Additive.h"
+#include "../Scheduler.h"
+#include "../Burst.h"
+#include "../Pattern.h"
+#include "../Render.h"
+#include "../Plugin.h"
+using namespace std;
+
+static int nFailed = 0;
+
+#define CHECK(x) do { if (!(x)) { printf("%s:%d: %s failed\n", __FILE__, __LINE__, #x); nFailed++; } } while (0)
+
+// The portable math against the C runtime's, across the ranges the sample
+// paths use
+static void TestMath()
+{
+	FTYPE dLog = 0.0, dPow = 0.0, dTan = 0.0;
+	for (int i = 0; i < 100000; i++)
+	{
+		FTYPE x = exp(-700.0 + 1400.0 * i / 100000);
+		dLog = max(dLog, fabs(synth::math::log(x) - log(x)) / max(1e-300, fabs(log(x))));
+		FTYPE y = -10.0 + 20.0 * i / 100000;
+		dPow = max(dPow, fabs(synth::math::pow(2.0, y) - pow(2.0, y)) / pow(2.0, y));
+		FTYPE t = -1.5 + 3.0 * i / 100000;
+		dTan = max(dTan, fabs(synth::math::tan(t) - tan(t)) / max(1e-300, fabs(tan(t))));
+	}
+	CHECK(dLog < 1e-15);
+	CHECK(dPow < 1e-14);
+	CHECK(dTan < 1e-15);
+	CHECK(synth::math::log(1.0) == 0.0);
+	CHECK(synth::math::log(0.0) == -INFINITY);
+	CHECK(fabs(synth::math::log10(1e-5) + 5.0) < 1e-14);
+}
+
+static unique_ptr<synth::instrument_base> MakeInstrument(int i)
+{
+	switch (i)
+	{
+	case 0: return make_unique<synth::instrument_bell>();
+	case 1: return make_unique<synth::instrument_bell8>();
+	case 2: return make_unique<synth::instrument_harmonica>();
+	case 3: return make_unique<synth::instrument_drumkick>();
+	case 4: return make_unique<synth::instrument_drumsnare>();
+	case 5: return make_unique<synth::instrument_drumhihat>();
+	case 6: return make_unique<synth::instrument_granular>();
+	case 7: return make_unique<synth::instrument_wavetable>();
+	}
+	return nullptr;
+}
+
+// Every instrument, a note struck at t = 0 through the reverb and limiter, held
+// or released, with and without a release time. Nothing may go NaN or full
+// scale, and every instrument has to be heard.
+static void TestNoteAtZero()
+{
+	for (FTYPE dRelease : { 0.0, 0.2 })
+		for (bool bHeld : { true, false })
+			for (int i = 0; i < 8; i++)
+			{
+				synth::effect_reverb fxReverb;
+				synth::effect_limiter fxLimiter;
+				synth::engine e;
+				unique_ptr<synth::instrument_base> inst = MakeInstrument(i);
+				e.AddInstrument(inst.get());
+				e.AddEffect(&fxReverb);
+				e.AddEffect(&fxLimiter);
+				inst->env.dReleaseTime = dRelease;
+
+				synth::note n;
+				n.id = 64;
+				n.on = 0.0;
+				n.off = bHeld ? synth::NOTE_HELD : 0.05;
+				n.active = true;
+				n.channel = inst.get();
+				e.vecNotes.push_back(n);
+
+				vector<FTYPE> vecOut(256);
+				bool bFinite = true;
+				FTYPE dPeak = 0.0;
+				for (int b = 0; b < 40; b++)
+				{
+					e.Render(vecOut.data(), (unsigned int)vecOut.size());
+					for (FTYPE d : vecOut)
+					{
+						bFinite = bFinite && isfinite(d);
+						dPeak = max(dPeak, fabs(d));
+					}
+				}
+
+				if (!bFinite || dPeak <= 0.0 || dPeak >= 0.99)
+					wprintf(L"%ls, release %g, %ls: peak %g\n", inst->name.c_str(), dRelease, bHeld ? L"held" : L"released", dPeak);
+				CHECK(bFinite);
+				CHECK(dPeak > 0.0);
+				CHECK(dPeak < 0.99);
+			}
+}
+
+// An instrument's memory moves with it between engines, whichever of the
+// two is destroyed first
+static void TestInstrumentMemory()
+{
+	synth::instrument_wavetable inst;
+	inst.Prepare(44100);
+	size_t nTables = inst.mem.Usage().nCurrent[synth::MEM_TABLES];
+	CHECK(nTables > 0);
+
+	{
+		synth::engine e;
+		size_t nBefore = e.mem.Usage().nCurrent[synth::MEM_TABLES];
+		e.AddInstrument(&inst);
+		CHECK(e.mem.Usage().nCurrent[synth::MEM_TABLES] == nBefore + nTables);
+		e.RemoveInstrument(&inst);
+		CHECK(e.mem.Usage().nCurrent[synth::MEM_TABLES] == nBefore);
+		CHECK(inst.mem.Parent() == nullptr);
+
+		e.AddInstrument(&inst);
+	}
+	CHECK(inst.mem.Parent() == nullptr);
+
+	synth::engine e;
+	size_t nBefore = e.mem.Usage().nCurrent[synth::MEM_TABLES];
+	{
+		synth::instrument_wavetable instShort;
+		e.AddInstrument(&instShort);
+		instShort.Prepare(44100);
+		e.RemoveInstrument(&instShort);
+		e.AddInstrument(&instShort);
+	}
+	CHECK(e.mem.Usage().nCurrent[synth::MEM_TABLES] == nBefore);
+}
+
+// A cache under an engine's budget evicts its least recently used buffers,
+// never the one just added, and gives their memory back
+static void TestCacheBudget()
+{
+	synth::engine e;
+	synth::memory_account acc(&e.mem);
+	synth::sample_cache<int, synth::half> cache(&acc);
+	vector<FTYPE> vecSamples(1000, 0.5);
+	e.mem.SetBudget(synth::MEM_CACHES, 2500 * sizeof(synth::half));
+
+	cache.Insert(0, vecSamples.data(), vecSamples.size());
+	cache.Insert(1, vecSamples.data(), vecSamples.size());
+	CHECK(cache.Find(0) != nullptr);
+	cache.Insert(2, vecSamples.data(), vecSamples.size());
+	CHECK(cache.Size() == 2);
+	CHECK(cache.nEvictions == 1);
+	CHECK(cache.Find(1) == nullptr);
+	CHECK(cache.Find(0) != nullptr && cache.Find(2) != nullptr);
+	CHECK(!acc.OverBudget(synth::MEM_CACHES));
+
+	vector<FTYPE> vecLong(4000, 0.5);
+	cache.Insert(3, vecLong.data(), vecLong.size());
+	CHECK(cache.Size() == 1 && cache.Find(3) != nullptr);
+	cache.Clear();
+	CHECK(e.mem.Usage().nCurrent[synth::MEM_CACHES] == 0);
+}
+
+// Half and bfloat16 conversions at their edges: subnormals, the largest
+// finite values and the overflow boundary, infinities and NaNs
+static void TestCompactSamples()
+{
+	auto bits = [](uint32_t x) { float f; memcpy(&f, &x, 4); return f; };
+
+	// Every half but the NaNs comes back to the same bits
+	for (uint32_t h = 0; h < 0x10000; h++)
+	{
+		float f = synth::half_bits_to_float((uint16_t)h);
+		if ((h & 0x7C00) == 0x7C00 && (h & 0x3FF) != 0)
+			CHECK(f != f && (synth::float_to_half_bits(f) & 0x7FFF) > 0x7C00);
+		else
+			CHECK(synth::float_to_half_bits(f) == h);
+	}
+
+	CHECK(synth::float_to_half_bits(65504.0f) == 0x7BFF);
+	CHECK(synth::float_to_half_bits(65519.0f) == 0x7BFF);
+	CHECK(synth::float_to_half_bits(65520.0f) == 0x7C00);
+	CHECK(synth::float_to_half_bits(-65520.0f) == 0xFC00);
+	CHECK(synth::float_to_half_bits(bits(0x7F800000)) == 0x7C00);
+	CHECK(synth::float_to_half_bits(bits(0x7F800001)) > 0x7C00);
+	CHECK(synth::float_to_half_bits(bits(0xFFC00000)) > 0xFC00);
+	CHECK(synth::float_to_half_bits(bits(0x33800000)) == 0x0001);		// 2^-24
+	CHECK(synth::float_to_half_bits(bits(0x33000000)) == 0x0000);		// 2^-25 ties to even
+	CHECK(synth::float_to_half_bits(bits(0x33000001)) == 0x0001);
+	CHECK(synth::float_to_half_bits(bits(0x33C00000)) == 0x0002);		// 1.5 * 2^-24 ties to even
+	CHECK(synth::float_to_half_bits(bits(0x387FE000)) == 0x0400);		// Rounds up to the smallest normal
+	CHECK(synth::float_to_half_bits(bits(0x80000001)) == 0x8000);
+
+	CHECK(synth::float_to_bfloat16_bits(1.0f) == 0x3F80);
+	CHECK(synth::float_to_bfloat16_bits(bits(0x3F808000)) == 0x3F80);
+	CHECK(synth::float_to_bfloat16_bits(bits(0x3F818000)) == 0x3F82);
+	CHECK(synth::float_to_bfloat16_bits(bits(0x7F7FFFFF)) == 0x7F80);	// FLT_MAX rounds to infinity
+	CHECK(synth::float_to_bfloat16_bits(bits(0x7F800000)) == 0x7F80);
+	CHECK(synth::float_to_bfloat16_bits(bits(0x7F800001)) == 0x7FC0);	// A NaN stays one
+	CHECK(synth::float_to_bfloat16_bits(bits(0xFF80FFFF)) == 0xFFC0);
+	CHECK(synth::float_to_bfloat16_bits(bits(0x00018000)) == 0x0002);	// Subnormals round like the rest
+	CHECK(synth::bfloat16_bits_to_float(0x0001) == bits(0x00010000));
+
+	// The block conversions, vectorised or not, agree with the scalar ones
+	const FTYPE dEdges[8] = { 65519.0, 65520.0, -65536.0, ldexp(1.0, -25), ldexp(3.0, -25), ldexp(1.0, -14), -0.0, NAN };
+	synth::half hOut[8];
+	FTYPE dBack[8];
+	synth::store_samples(dEdges, hOut, 8);
+	synth::load_samples(hOut, dBack, 8);
+	for (int i = 0; i < 8; i++)
+	{
+		synth::half h;
+		synth::from_ftype(dEdges[i], h);
+		CHECK(hOut[i].bits == h.bits);
+		CHECK(dBack[i] == synth::to_ftype(h) || (dBack[i] != dBack[i] && i == 7));
+	}
+}
+
+// Counts every render, to catch the control thread rendering
+struct counting_bell : public synth::instrument_bell
+{
+	atomic<int> nRenders = 0;
+
+	virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished)
+	{
+		nRenders++;
+		return synth::instrument_bell::sound(dTime, n, bNoteFinished);
+	}
+
+	virtual bool SoundBlock(const FTYPE dTime, const FTYPE dTimeStep, const synth::note &n, FTYPE *pOut, unsigned int nSamples, bool &bNoteFinished)
+	{
+		nRenders++;
+		return false;
+	}
+};
+
+// The transport tracks the song's voices from their times, without rendering
+// them itself, and hands them to the engine through its schedule. A seek
+// brings back exactly the voices still ringing.
+static void TestTransport()
+{
+	synth::song_builder b;
+	uint16_t nBell = b.AddInstrument("Bell");
+	vector<synth::song_event> vecEvents;
+	for (int i = 0; i < 10; i++)
+		vecEvents.push_back({ i * 0.5, 0.3f, nBell, (int16_t)(60 + i) });
+	b.AddPattern("test", 5.0, vecEvents);
+	wstring sPath = (filesystem::temp_directory_path() / "synth_test.csong").wstring();
+	CHECK(b.Write(sPath));
+
+	{
+		synth::song_file song;
+		CHECK(song.Open(sPath));
+		counting_bell inst;
+		synth::engine e;
+		e.AddInstrument(&inst);
+
+		synth::song_player player(song, e);
+		synth::song_transport transport(player, e, 1.0);
+		CHECK(transport.Play(0, 0.0));
+		transport.Scan();
+		transport.Update(1.0);
+		CHECK(e.Pending() > 0);
+		transport.Seek(2.6, 10.0);
+		CHECK(inst.nRenders == 0);
+		CHECK(e.vecNotes.empty());
+
+		// Each note is released 0.3 s in and rings 1 s after: at 2.6 those from 1.5
+		// on, and 3.0 is past the player's lookahead
+		e.dGlobalTime = 10.0;
+		vector<FTYPE> vecOut(e.nBlockSamples);
+		e.Render(vecOut.data(), e.nBlockSamples);
+		vector<int> vecIds;
+		for (auto &n : e.vecNotes)
+			vecIds.push_back(n.id);
+		sort(vecIds.begin(), vecIds.end());
+		CHECK((vecIds == vector<int>{ 63, 64, 65 }));
+		CHECK(inst.nRenders > 0);
+	}
+	filesystem::remove(sPath);
+}
+
+// A song written by the builder reads back field for field, a damaged one is
+// refused, and a MIDI file with a tempo of zero is rejected rather than
+// dividing by it
+static void TestSongFormat()
+{
+	synth::song_builder b(96.0);
+	uint16_t nBell = b.AddInstrument("Bell");
+	uint16_t nKick = b.AddInstrument("Drum Kick");
+	CHECK(b.AddInstrument("Bell") == nBell);
+	b.AddPattern("a", 2.0, { { 1.5, 0.25f, nKick, 40 }, { 0.5, 0.0f, nBell, 64 }, { 0.5, 1.0f, nKick, 41 } });
+	b.AddPattern("b", 1.0, { { 0.0, 0.5f, nBell, -3 } });
+	wstring sPath = (filesystem::temp_directory_path() / "synth_format.csong").wstring();
+	CHECK(b.Write(sPath));
+
+	{
+		synth::song_file song;
+		CHECK(song.Open(sPath));
+		const synth::song_header &h = song.Header();
+		CHECK(memcmp(h.magic, "CSNG", 4) == 0 && h.nVersion == synth::SONG_VERSION);
+		CHECK(h.nInstruments == 2 && h.nPatterns == 2 && h.nEvents == 4 && h.dTempo == 96.0);
+		CHECK(string(song.Instruments()[nBell].name) == "Bell" && string(song.Instruments()[nKick].name) == "Drum Kick");
+		const synth::song_pattern *pPatterns = song.Patterns();
+		CHECK(string(pPatterns[0].name) == "a" && pPatterns[0].nFirstEvent == 0 && pPatterns[0].nEvents == 3 && pPatterns[0].dLength == 2.0);
+		CHECK(string(pPatterns[1].name) == "b" && pPatterns[1].nFirstEvent == 3 && pPatterns[1].nEvents == 1 && pPatterns[1].dLength == 1.0);
+
+		// Sorted by time, in insertion order where times tie
+		const synth::song_event *pEvents = song.Events();
+		CHECK(pEvents[0].dTime == 0.5 && pEvents[0].nInstrument == nBell && pEvents[0].nNoteId == 64 && pEvents[0].fDuration == 0.0f);
+		CHECK(pEvents[1].dTime == 0.5 && pEvents[1].nInstrument == nKick && pEvents[1].nNoteId == 41 && pEvents[1].fDuration == 1.0f);
+		CHECK(pEvents[2].dTime == 1.5 && pEvents[2].nNoteId == 40 && pEvents[2].fDuration == 0.25f);
+		CHECK(pEvents[3].dTime == 0.0 && pEvents[3].nNoteId == -3);
+	}
+
+	// Cut into the event table
+	filesystem::resize_file(filesystem::path(sPath), filesystem::file_size(filesystem::path(sPath)) - 8);
+	{
+		synth::song_file song;
+		CHECK(!song.Open(sPath));
+	}
+	filesystem::remove(sPath);
+
+	// One track at 96 ticks a beat: a tempo, then a note a beat long
+	auto midi = [](uint32_t nTempo)
+	{
+		vector<uint8_t> track = { 0x00, 0xFF, 0x51, 0x03, (uint8_t)(nTempo >> 16), (uint8_t)(nTempo >> 8), (uint8_t)nTempo,
+			0x00, 0x90, 0x3C, 0x40, 0x60, 0x80, 0x3C, 0x00, 0x00, 0xFF, 0x2F, 0x00 };
+		vector<uint8_t> file = { 'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, 0, 96, 'M', 'T', 'r', 'k', 0, 0, 0, (uint8_t)track.size() };
+		file.insert(file.end(), track.begin(), track.end());
+		return file;
+	};
+	wstring sMidi = (filesystem::temp_directory_path() / "synth_format.mid").wstring();
+	auto convert = [&](uint32_t nTempo, synth::song_builder &song)
+	{
+		vector<uint8_t> file = midi(nTempo);
+		ofstream(filesystem::path(sMidi), ios::binary).write((const char*)file.data(), file.size());
+		return synth::song_from_midi(sMidi, song, vector<string>(16, "Bell"));
+	};
+
+	synth::song_builder song;
+	CHECK(convert(1000000, song));
+	CHECK(song.dTempo == 60.0 && song.vecPatterns.size() == 1 && song.vecPatterns[0].vecEvents.size() == 1);
+	CHECK(song.vecPatterns[0].vecEvents[0].fDuration == 1.0f && song.vecPatterns[0].dLength == 1.0);
+
+	synth::song_builder bad;
+	CHECK(!convert(0, bad));
+	filesystem::remove(sMidi);
+}
+
+// A steady input for duplex tests
+struct input_constant : public synth::input_source
+{
+	FTYPE fValue = 0.5;
+	int nPumps = 0;
+
+	virtual void Pump(synth::input_ring &ring, unsigned int nSamples)
+	{
+		nPumps++;
+		vector<FTYPE> vecIn(nSamples, fValue);
+		ring.Write(vecIn.data(), nSamples);
+	}
+};
+
+// The follower tracks the input between notes, so a note struck into a steady
+// input starts at its level instead of rising from wherever the last note left it
+static void TestFollowerLevel()
+{
+	input_constant source;
+	synth::duplex_input input(&source);
+	synth::instrument_follower inst;
+	inst.env.dAttackTime = 0.0;
+	synth::engine e;
+	e.AddInstrument(&inst);
+	CHECK(input.Start(e.nSampleRate, e.nBlockSamples));
+	e.SetInput(&input);
+
+	vector<FTYPE> vecOut(e.nBlockSamples);
+	for (int b = 0; b < 20; b++)
+		e.Render(vecOut.data(), e.nBlockSamples);
+
+	synth::note n;
+	n.id = 64;
+	n.on = e.dGlobalTime;
+	n.active = true;
+	n.channel = &inst;
+	e.AddNote(n);
+	e.Render(vecOut.data(), e.nBlockSamples);
+
+	// A full level saw through the master volume, over its first 32 samples
+	FTYPE dPeak = 0.0;
+	for (int s = 0; s < 32; s++)
+		dPeak = max(dPeak, fabs(vecOut[s]));
+	CHECK(dPeak > 0.05);
+	e.SetInput(nullptr);
+}
+
+// Analysis stops at fMaxSeconds, and a prepared instrument renders without
+// allocating
+static void TestAdditive()
+{
+	vector<FTYPE> vecSamples(44100 * 3);
+	for (size_t s = 0; s < vecSamples.size(); s++)
+		vecSamples[s] = 0.5 * synth::math::sin(2.0 * synth::math::PI * 220.0 * s / 44100.0);
+
+	synth::additive_analyser analyser;
+	analyser.fMaxSeconds = 1.0;
+	synth::instrument_additive inst;
+	CHECK(analyser.Analyse(vecSamples, 44100, inst.patch));
+	CHECK(inst.patch.Duration() <= 1.0);
+	inst.Prepare(44100);
+
+	size_t nScratch = inst.mem.Usage().nPeak[synth::MEM_SCRATCH];
+	synth::note n;
+	n.id = 64;
+	n.active = true;
+	n.channel = &inst;
+	vector<FTYPE> vecOut(256);
+	bool bFinished = false;
+	CHECK(inst.SoundBlock(0.1, 1.0 / 44100.0, n, vecOut.data(), (unsigned int)vecOut.size(), bFinished));
+	CHECK(inst.mem.Usage().nPeak[synth::MEM_SCRATCH] == nScratch);
+	CHECK(!bFinished);
+}
+
+// More voices than the spatial rows reserved are mixed in batches, without
+// the audio thread allocating, to the same output as rows for all of them
+static void TestSpatialRows()
+{
+	vector<vector<FTYPE>> vecRuns;
+	for (size_t nRows : { 0, 256 })
+	{
+		synth::instrument_bell inst;
+		synth::engine e;
+		e.AddInstrument(&inst);
+		e.SetSpeakers(synth::speaker_layout::Ring(4));
+		if (nRows > 0)
+			e.WarmUp(1, nRows);
+
+		for (int v = 0; v < 150; v++)
+		{
+			synth::note n;
+			n.id = 40 + v % 40;
+			n.on = 0.0;
+			n.active = true;
+			n.channel = &inst;
+			n.azimuth = 0.1 * v;
+			e.AddNote(n);
+		}
+
+		size_t nScratch = e.mem.Usage().nPeak[synth::MEM_SCRATCH];
+		vector<FTYPE> vecOut(4 * 1000), vecAll;
+		for (unsigned int nFrames : { 256, 256, 1000, 100 })
+		{
+			e.RenderSpatial(vecOut.data(), nFrames);
+			vecAll.insert(vecAll.end(), vecOut.begin(), vecOut.begin() + 4 * nFrames);
+		}
+		CHECK(e.mem.Usage().nPeak[synth::MEM_SCRATCH] == nScratch);
+		CHECK(fabs(e.dGlobalTime - 1612.0 / e.nSampleRate) < 1e-9);
+		vecRuns.push_back(vecAll);
+	}
+	CHECK(vecRuns[0] == vecRuns[1]);
+	CHECK(*max_element(vecRuns[0].begin(), vecRuns[0].end()) > 0.0);
+}
+
+// Voices read the same shared block even when a run outside it comes between
+// them, which falls back to per voice noise instead of starting a new block
+static void TestSharedSources()
+{
+	synth::instrument_drumhihat instHiHat;
+	synth::instrument_drumsnare instSnare;
+	for (synth::instrument_base *inst : { (synth::instrument_base*)&instHiHat, (synth::instrument_base*)&instSnare })
+	{
+		const FTYPE dStep = 1.0 / 44100.0;
+		synth::note n;
+		n.id = 64;
+		n.on = 0.0;
+		n.active = true;
+		n.channel = inst;
+
+		vector<FTYPE> vecA(256, 0.0), vecB(256, 0.0), vecOutside(300, 0.0);
+		bool bFinished = false;
+		inst->SharedBlock(0.0, dStep, 256);
+		CHECK(inst->SoundBlock(0.0, dStep, n, vecA.data(), 256, bFinished));
+		CHECK(!inst->SoundBlock(0.5, dStep, n, vecOutside.data(), 300, bFinished));
+		CHECK(!inst->SoundBlock(128 * dStep, dStep, n, vecOutside.data(), 256, bFinished));
+		CHECK(inst->SoundBlock(0.0, dStep, n, vecB.data(), 256, bFinished));
+		CHECK(vecA == vecB);
+		CHECK(*max_element(vecA.begin(), vecA.end()) > 0.0);
+	}
+}
+
+// A pipelined engine gives the synchronous output one block later, sample for
+// sample, whatever the sizes of the blocks asked for, and owes its last block
+// when pipelining is turned off
+static void TestPipelined()
+{
+	synth::instrument_bell instSync, instPiped;
+	synth::effect_reverb fxReverbSync, fxReverbPiped;
+	synth::effect_limiter fxLimiterSync, fxLimiterPiped;
+	synth::engine eSync, ePiped;
+	eSync.AddInstrument(&instSync);
+	eSync.AddEffect(&fxReverbSync);
+	eSync.AddEffect(&fxLimiterSync);
+	ePiped.AddInstrument(&instPiped);
+	ePiped.AddEffect(&fxReverbPiped);
+	ePiped.AddEffect(&fxLimiterPiped);
+	ePiped.SetPipelined(true);
+	CHECK(ePiped.GetLatency() == ePiped.nBlockSamples);
+
+	for (int i = 0; i < 4; i++)
+	{
+		synth::note n;
+		n.id = 60 + i * 4;
+		n.on = i * 0.05;
+		n.off = n.on + 0.1;
+		n.active = true;
+		n.channel = &instSync;
+		eSync.Schedule(n);
+		n.channel = &instPiped;
+		ePiped.Schedule(n);
+	}
+
+	vector<FTYPE> vecSync, vecPiped;
+	vector<FTYPE> vecBlock(1024);
+	for (unsigned int nSamples : { 256, 256, 100, 256, 300, 256, 17, 1000, 256, 256, 256, 1, 256 })
+	{
+		eSync.Render(vecBlock.data(), nSamples);
+		vecSync.insert(vecSync.end(), vecBlock.begin(), vecBlock.begin() + nSamples);
+		ePiped.Render(vecBlock.data(), nSamples);
+		vecPiped.insert(vecPiped.end(), vecBlock.begin(), vecBlock.begin() + nSamples);
+	}
+	vector<FTYPE> vecTail(ePiped.nBlockSamples);
+	ePiped.SetPipelined(false, vecTail.data());
+	vecPiped.insert(vecPiped.end(), vecTail.begin(), vecTail.end());
+
+	CHECK(vecPiped.size() == vecSync.size() + ePiped.nBlockSamples);
+	CHECK(equal(vecSync.begin(), vecSync.end(), vecPiped.begin() + ePiped.nBlockSamples));
+	CHECK(all_of(vecPiped.begin(), vecPiped.begin() + ePiped.nBlockSamples, [](FTYPE d) { return d == 0.0; }));
+	CHECK(*max_element(vecSync.begin(), vecSync.end()) > 0.0);
+
+	// Synchronous again, straight on from the tail
+	eSync.Render(vecBlock.data(), 256);
+	vector<FTYPE> vecNext(vecBlock.begin(), vecBlock.begin() + 256);
+	ePiped.Render(vecBlock.data(), 256);
+	CHECK(equal(vecNext.begin(), vecNext.end(), vecBlock.begin()));
+}
+
+// Events come out of the wheel in tick order, on the Advance that reaches
+// their tick and not before, across the boundaries of every level and the
+// overflow list; cancelled ones and stale handles never come out
+static void TestTimingWheel()
+{
+	synth::timing_wheel<int> wheel;
+	vector<int> vecOut;
+
+	// Either side of each level's turn, advanced to exactly one at a time
+	const uint64_t nEdges[] = { 1, 255, 256, 257, 65535, 65536, 65537, 1ull << 24, (1ull << 24) + 1, 1ull << 32, (1ull << 32) + 1, (1ull << 40) + 3 };
+	for (int i = 0; i < 12; i++)
+		wheel.Insert(nEdges[i], i);
+	auto hCancelled = wheel.Insert(65536, 100);
+	CHECK(wheel.Cancel(hCancelled));
+	CHECK(!wheel.Cancel(hCancelled));
+	for (int i = 0; i < 12; i++)
+	{
+		wheel.Advance(nEdges[i] - 1, vecOut);
+		CHECK(vecOut.empty());
+		wheel.Advance(nEdges[i], vecOut);
+		CHECK(vecOut.size() == 1 && vecOut[0] == i);
+		vecOut.clear();
+	}
+	CHECK(wheel.Size() == 0);
+
+	// Random ticks, cancels and steps against a plain list
+	synth::math::random rng(7);
+	map<int, uint64_t> mapTicks;
+	map<int, synth::timing_wheel<int>::handle> mapHandles;
+	vector<synth::timing_wheel<int>::handle> vecStale;
+	const uint64_t nSpans[] = { 300, 70000, 1ull << 26, 1ull << 34 };
+	int nNext = 0;
+	for (int nRound = 0; nRound < 400; nRound++)
+	{
+		for (int n = 0; n < 8; n++)
+		{
+			uint64_t nTick = wheel.Now() + rng.next() % nSpans[rng.next() % 4];
+			mapTicks[nNext] = nTick;
+			mapHandles[nNext] = wheel.Insert(nTick, nNext);
+			nNext++;
+		}
+		if (!mapHandles.empty() && rng.next() % 2 == 0)
+		{
+			auto h = next(mapHandles.begin(), rng.next() % mapHandles.size());
+			CHECK(wheel.Cancel(h->second));
+			vecStale.push_back(h->second);
+			mapTicks.erase(h->first);
+			mapHandles.erase(h);
+		}
+
+		uint64_t nFrom = wheel.Now();
+		uint64_t nTo = nFrom + rng.next() % nSpans[rng.next() % 4];
+		wheel.Advance(nTo, vecOut);
+		uint64_t nLast = 0;
+		for (int id : vecOut)
+		{
+			CHECK(mapTicks.count(id) == 1);
+			if (mapTicks.count(id) == 0)
+				continue;
+			CHECK(mapTicks[id] <= nTo && mapTicks[id] >= nLast);
+			nLast = mapTicks[id];
+			vecStale.push_back(mapHandles[id]);
+			mapTicks.erase(id);
+			mapHandles.erase(id);
+		}
+		for (auto &t : mapTicks)
+			CHECK(t.second > nTo);
+		CHECK(wheel.Size() == mapTicks.size());
+		vecOut.clear();
+	}
+	for (auto h : vecStale)
+		CHECK(!wheel.Cancel(h));
+}
+
+// Admission stops at the budget, the workers render every admitted engine, and
+// a removed engine is neither rendered again nor remembered
+static void TestScheduler()
+{
+	synth::block_scheduler scheduler(2, 0.5);
+
+	counting_bell instA, instB;
+	synth::engine eA, eB;
+	eA.AddInstrument(&instA);
+	eB.AddInstrument(&instB);
+
+	// A block costing its whole period is two cores with the margin, over the
+	// bound of one; so is a session quota of a tenth of a core
+	CHECK(!scheduler.Admit(&eA, eA.BlockTime(), 0, nullptr, nullptr));
+	scheduler.SetSessionQuota(1, 0.1);
+	CHECK(!scheduler.Admit(&eA, 0.1 * eA.BlockTime(), 1, nullptr, nullptr));
+	CHECK(scheduler.Admit(&eA, 0.1 * eA.BlockTime(), 0, nullptr, nullptr));
+	CHECK(scheduler.Admit(&eB, 0.1 * eB.BlockTime(), 0, nullptr, nullptr));
+	CHECK(scheduler.Count() == 2);
+
+	for (synth::engine *e : { &eA, &eB })
+	{
+		synth::note n;
+		n.id = 64;
+		n.on = 0.0;
+		n.active = true;
+		n.channel = e == &eA ? (synth::instrument_base*)&instA : &instB;
+		e->AddNote(n);
+	}
+
+	scheduler.Start();
+	this_thread::sleep_for(chrono::milliseconds(200));
+	scheduler.Remove(&eA);
+	CHECK(scheduler.Count() == 1);
+	CHECK(scheduler.GetStats(&eA).nBlocks == 0);
+	int nRenders = instA.nRenders;
+	CHECK(nRenders > 0);
+	this_thread::sleep_for(chrono::milliseconds(50));
+	CHECK(instA.nRenders == nRenders);
+	CHECK(scheduler.GetStats(&eB).nBlocks > 0);
+
+	// Engines admitted while a removal waits on a busy one
+	CHECK(scheduler.Admit(&eA, 0.1 * eA.BlockTime(), 0, nullptr, nullptr));
+	vector<unique_ptr<synth::engine>> vecMore;
+	for (int i = 0; i < 64; i++)
+		vecMore.push_back(make_unique<synth::engine>());
+	thread thrAdmit([&] { for (auto &e : vecMore) scheduler.Admit(e.get(), 1e-6, 0, nullptr, nullptr); });
+	scheduler.Remove(&eA);
+	thrAdmit.join();
+	CHECK(scheduler.Count() == 65);
+	scheduler.Stop();
+	for (auto &e : vecMore)
+		scheduler.Remove(e.get());
+	scheduler.Remove(&eB);
+	CHECK(scheduler.Count() == 0);
+
+	// Probing measures the stand-in and leaves the engine as it was
+	synth::engine eProbe, eOdd(44100, 128);
+	counting_bell instProbe;
+	eProbe.AddInstrument(&instProbe);
+	synth::note n;
+	n.id = 64;
+	n.on = 0.0;
+	n.active = true;
+	n.channel = &instA;
+	eA.dGlobalTime = 0.0;
+	eA.vecNotes.clear();
+	eA.AddNote(n);
+	n.on = 0.01;
+	eA.Schedule(n);
+	n.channel = &instProbe;
+	eProbe.AddNote(n);
+	instA.nRenders = 0;
+	CHECK(!scheduler.Admit(&eA, eOdd));
+	CHECK(!scheduler.Admit(&eA, eA));
+	CHECK(scheduler.Admit(&eA, eProbe));
+	CHECK(instProbe.nRenders > 0);
+	CHECK(instA.nRenders == 0 && eA.dGlobalTime == 0.0 && eA.vecNotes.size() == 1 && eA.Pending() == 1);
+	scheduler.Remove(&eA);
+}
+
+// A flush rewinds the clock to the device's position and brings back a voice
+// that finished in the part rendered ahead
+static void TestBurstFlush()
+{
+	synth::instrument_bell inst;
+	synth::engine e;
+	e.AddInstrument(&inst);
+	synth::note n;
+	n.id = 64;
+	n.on = 0.0;
+	n.off = 0.1;
+	n.active = true;
+	n.channel = &inst;
+	e.AddNote(n);
+
+	synth::burst_renderer burst(e, 2.0, 0.5);
+	burst.Start();
+	for (int i = 0; i < 10000 && burst.GetStats().nBursts == 0; i++)
+		this_thread::sleep_for(chrono::milliseconds(1));
+	burst.Stop();
+
+	// The device plays a third of a second, the bell is gone from what was
+	// rendered after
+	vector<FTYPE> vecOut(256);
+	size_t nPlayed = 0;
+	for (; nPlayed < e.nSampleRate / 3; nPlayed += vecOut.size())
+		burst.Mix(vecOut.data(), (unsigned int)vecOut.size());
+	{
+		unique_lock<mutex> lm(e.muxNotes);
+		CHECK(e.vecNotes.empty());
+	}
+
+	burst.Flush();
+	{
+		unique_lock<mutex> lm(e.muxNotes);
+		CHECK(fabs(e.dGlobalTime - (FTYPE)nPlayed / e.nSampleRate) < 1e-9);
+		CHECK(e.vecNotes.size() == 1 && e.vecNotes[0].on == 0.0);
+	}
+}
+
+// Counts each of the block hooks the engine calls
+struct hooked_bell : public synth::instrument_bell
+{
+	int nShared = 0, nVoiceBlocks = 0, nSoundBlocks = 0;
+
+	hooked_bell()
+	{
+		bBlockVoices = true;
+	}
+
+	virtual void SharedBlock(const FTYPE dTime, const FTYPE dTimeStep, unsigned int nSamples)
+	{
+		nShared++;
+	}
+
+	virtual void VoiceBlock(const FTYPE dTime, const FTYPE dTimeStep, unsigned int nSamples, const synth::note *const *ppVoices, size_t nVoices)
+	{
+		nVoiceBlocks++;
+	}
+
+	virtual bool SoundBlock(const FTYPE dTime, const FTYPE dTimeStep, const synth::note &n, FTYPE *pOut, unsigned int nSamples, bool &bNoteFinished)
+	{
+		nSoundBlocks++;
+		return false;
+	}
+};
+
+// WarmUp runs every block hook, and leaves the clock, the voices, the
+// schedule and the output as it found them
+static void TestWarmUp()
+{
+	hooked_bell inst;
+	synth::engine e;
+	e.AddInstrument(&inst);
+	e.dGlobalTime = 1.0;
+
+	synth::note n;
+	n.id = 64;
+	n.on = 1.0 + 8 * e.BlockTime();
+	n.active = true;
+	n.channel = &inst;
+	e.Schedule(n);
+	n.on = 0.5;
+	e.AddNote(n);
+
+	e.WarmUp(8);
+	CHECK(e.IsHot());
+	CHECK(inst.nShared > 0 && inst.nVoiceBlocks > 0 && inst.nSoundBlocks > 0);
+	CHECK(e.dGlobalTime == 1.0);
+	CHECK(e.vecNotes.size() == 1 && e.vecNotes[0].on == 0.5);
+	CHECK(e.Pending() == 1);
+
+	// The scheduled note comes out around its own block, not before
+	vector<FTYPE> vecOut(e.nBlockSamples);
+	for (int b = 0; b < 6; b++)
+		e.Render(vecOut.data(), e.nBlockSamples);
+	CHECK(e.Pending() == 1);
+	for (int b = 0; b < 3; b++)
+		e.Render(vecOut.data(), e.nBlockSamples);
+	CHECK(e.Pending() == 0);
+
+	// Nothing warmed up is heard, synchronous or pipelined: the effects and the
+	// pipeline start from silence, and the noise and the input are left alone
+	for (bool bPipelined : { false, true })
+	{
+		synth::instrument_bell instBell;
+		synth::instrument_drumhihat instHiHat;
+		synth::effect_reverb fxReverb;
+		synth::effect_limiter fxLimiter;
+		input_constant source;
+		synth::duplex_input input(&source);
+		synth::engine eQuiet;
+		eQuiet.AddInstrument(&instBell);
+		eQuiet.AddInstrument(&instHiHat);
+		eQuiet.AddEffect(&fxReverb);
+		eQuiet.AddEffect(&fxLimiter);
+		CHECK(input.Start(eQuiet.nSampleRate, eQuiet.nBlockSamples));
+		eQuiet.SetInput(&input);
+		eQuiet.SetPipelined(bPipelined);
+
+		uint64_t nNoise = synth::math::noise_source().nState;
+		eQuiet.WarmUp(8);
+		CHECK(synth::math::noise_source().nState == nNoise);
+		CHECK(source.nPumps == 0);
+		CHECK(eQuiet.dMasterVolume == 0.2);
+
+		bool bSilent = true;
+		for (int b = 0; b < 4; b++)
+		{
+			eQuiet.Render(vecOut.data(), eQuiet.nBlockSamples);
+			bSilent = bSilent && all_of(vecOut.begin(), vecOut.end(), [](FTYPE d) { return d == 0.0; });
+		}
+		CHECK(bSilent);
+		CHECK(source.nPumps == 4);
+		eQuiet.SetPipelined(false);
+		eQuiet.SetInput(nullptr);
+	}
+}
+
+// Generated notes are released a gate after they start, so a held instrument
+// falls silent, and a fill too sparse to hit still resumes at once
+static void TestPatterns()
+{
+	synth::instrument_harmonica harmonica;
+	synth::pattern_scheduler patterns(1.0);
+	patterns.Add(synth::pattern_euclid(&harmonica, 64, 3, 8, 0.1));
+	patterns.Add(synth::pattern_arpeggio(&harmonica, { 64, 67 }, 0.1, 0.0, 1));
+	patterns.Add(synth::pattern_random_fill(&harmonica, 64, 0.5, 0.1));
+	patterns.Update(0.0);
+	CHECK(!patterns.vecNotes.empty());
+	for (auto &n : patterns.vecNotes)
+		CHECK(n.off > n.on && fabs(n.off - n.on - 0.05) < 1e-12);
+
+	synth::engine e(44100, 256);
+	synth::note n = patterns.vecNotes[0];
+	n.on = 0.0;
+	n.off = 0.05;
+	e.AddNote(n);
+	vector<FTYPE> vecOut(e.nBlockSamples);
+	for (int b = 0; b < 200; b++)
+		e.Render(vecOut.data(), e.nBlockSamples);
+	CHECK(e.vecNotes.empty());
+
+	// Odds of 1e-15 a step: the next hit is far away or the fill has finished,
+	// but finding out must not step through every silent step
+	synth::pattern p = synth::pattern_random_fill(&harmonica, 64, 1e-15, 0.1);
+	if (p.Next())
+		CHECK(p.Current().on > 1e6);
+	synth::pattern q = synth::pattern_random_fill(&harmonica, 64, 1e-300, 0.1);
+	CHECK(!q.Next());
+
+	// Every step sounds at probability 1
+	synth::pattern r = synth::pattern_random_fill(&harmonica, 64, 1.0, 0.1);
+	for (int i = 0; i < 4; i++)
+		CHECK(r.Next() && fabs(r.Current().on - 0.1 * i) < 1e-12);
+}
+
+// A pattern rendered in segments of any length, stitched together, is the
+// pattern rendered whole, noise and release tail included
+static void TestFarmSegments()
+{
+	synth::song_builder b(120.0);
+	uint16_t nHiHat = b.AddInstrument("Drum HiHat"), nSnare = b.AddInstrument("Drum Snare"), nBell = b.AddInstrument("Bell");
+	vector<synth::song_event> vecEvents;
+	for (int i = 0; i < 24; i++)
+		vecEvents.push_back({ i * 0.125, 0.0f, nHiHat, (int16_t)(60 + i % 5) });
+	for (int i = 0; i < 6; i++)
+		vecEvents.push_back({ 0.25 + i * 0.5, 0.0f, nSnare, 64 });
+	for (int i = 0; i < 3; i++)
+		vecEvents.push_back({ i * 1.0, 0.6f, nBell, (int16_t)(64 + i) });
+	b.AddPattern("noise", 3.0, vecEvents);
+
+	wstring sPath = (filesystem::temp_directory_path() / "synth_segments.csong").wstring();
+	CHECK(b.Write(sPath));
+	synth::song_file song;
+	CHECK(song.Open(sPath));
+
+	synth::render_settings settings = synth::render_settings::Draft();
+	synth::render_job job;
+	vector<int16_t> vecWhole;
+	CHECK(synth::render_segment(song, job, settings, vecWhole));
+	CHECK(vecWhole.size() > 3 * settings.nSampleRate);
+
+	for (FTYPE fSegment : { 1.0, 0.7 })
+	{
+		vector<int16_t> vecStitched, vecPart;
+		for (job.dStart = 0.0; job.dStart < 3.0; job.dStart += fSegment)
+		{
+			job.dEnd = job.dStart + fSegment < 3.0 ? job.dStart + fSegment : -1.0;
+			CHECK(synth::render_segment(song, job, settings, vecPart));
+			vecStitched.insert(vecStitched.end(), vecPart.begin(), vecPart.end());
+		}
+		CHECK(vecStitched == vecWhole);
+	}
+	song.Close();
+	filesystem::remove(sPath);
+}
+
+// A plugin that won't load leaves the instrument unloaded, and an engine
+// playing it drops the voice and stays silent
+static void TestPluginLoadFailure()
+{
+	synth::instrument_plugin inst;
+	wstring sMissing = (filesystem::temp_directory_path() / "synth_no_such_plugin.so").wstring();
+	filesystem::remove(sMissing);
+	CHECK(!inst.Load(sMissing));
+	CHECK(!inst.Loaded());
+
+	filesystem::path pathText = filesystem::temp_directory_path() / "synth_not_a_plugin.so";
+	{
+		ofstream f(pathText);
+		f << "not a shared object";
+	}
+	CHECK(!inst.Load(pathText.wstring()));
+	CHECK(!inst.Loaded());
+	filesystem::remove(pathText);
+
+	// Loads, but has no entry point
+#ifdef _WIN32
+	CHECK(!inst.Load(L"kernel32.dll"));
+#else
+	CHECK(!inst.Load(L"libm.so.6"));
+#endif
+	CHECK(!inst.Loaded());
+	CHECK(inst.name == L"Plugin");
+
+	synth::engine e;
+	e.AddInstrument(&inst);
+	synth::note n;
+	n.id = 64;
+	n.on = 0.0;
+	n.active = true;
+	n.channel = &inst;
+	e.vecNotes.push_back(n);
+	vector<FTYPE> vecOut(256);
+	e.Render(vecOut.data(), (unsigned int)vecOut.size());
+	CHECK(all_of(vecOut.begin(), vecOut.end(), [](FTYPE d) { return d == 0.0; }));
+	e.Render(vecOut.data(), (unsigned int)vecOut.size());
+	CHECK(e.vecNotes.empty());
+	e.RemoveInstrument(&inst);
+}
+
+int main()
+{
+	TestMath();
+	TestNoteAtZero();
+	TestInstrumentMemory();
+	TestCacheBudget();
+	TestCompactSamples();
+	TestTransport();
+	TestSongFormat();
+	TestFollowerLevel();
+	TestAdditive();
+	TestSharedSources();
+	TestPipelined();
+	TestSpatialRows();
+	TestScheduler();
+	TestTimingWheel();
+	TestBurstFlush();
+	TestWarmUp();
+	TestPatterns();
+	TestFarmSegments();
+	TestPluginLoadFailure();
+
+	if (nFailed > 0)
+		printf("%d checks failed\n", nFailed);
+	else
+		printf("All tests passed\n");
+	return nFailed > 0 ? 1 : 0;
+}
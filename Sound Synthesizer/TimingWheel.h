@@ -0,0 +1,297 @@
+#pragma once
+#include <cstdint>
+
+#include "Memory.h"
+
+namespace synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Timing Wheel
+	//
+	// Future events keyed by an integer tick. Four levels of 256 slots, each
+	// level's slot spanning a whole turn of the level below, cover 2^32 ticks
+	// from now; later events wait in an overflow list. Insert and Cancel are O(1)
+	// (entries are pooled and linked into their slot). Advance skips whole turns
+	// of a level that has nothing on it, so it costs little more than the entries
+	// that fall due or cascade down a level. Nothing is ever sorted.
+
+	template<class T>
+	struct timing_wheel
+	{
+	public:
+		// Returned by Insert, used to cancel. Stale handles are detected.
+		struct handle
+		{
+			uint32_t nIndex = NONE;
+			uint32_t nGeneration = 0;
+		};
+
+		timing_wheel(memory_account *account = nullptr) : vecEntries(tracked_allocator<entry, MEM_VOICES>(account))
+		{
+			nNow = 0;
+			nCount = 0;
+			nFree = NONE;
+			for (auto &level : nSlots)
+				for (auto &slot : level)
+					slot = NONE;
+			nOverflow = NONE;
+			nDue = NONE;
+			for (auto &n : nLevelCount)
+				n = 0;
+		}
+
+		// Ticks at or before Now() come out of the next Advance
+		handle Insert(uint64_t nTick, const T &value)
+		{
+			uint32_t i = Allocate();
+			entry &e = vecEntries[i];
+			e.nTick = nTick;
+			e.value = value;
+			Place(i);
+			nCount++;
+			return { i, e.nGeneration };
+		}
+
+		// False if the event already came out or was cancelled
+		bool Cancel(handle h)
+		{
+			if (h.nIndex >= vecEntries.size())
+				return false;
+			entry &e = vecEntries[h.nIndex];
+			if (e.nList == NONE || e.nGeneration != h.nGeneration)
+				return false;
+
+			Unlink(h.nIndex);
+			nLevelCount[Level(e.nList)]--;
+			Release(h.nIndex);
+			nCount--;
+			return true;
+		}
+
+		// Moves the wheel to nTick, appending every event due by then to vecOut in
+		// tick order (events of the same tick in no particular order)
+		template<class OUT>
+		void Advance(uint64_t nTick, OUT &vecOut)
+		{
+			TakeList(nDue, vecOut);
+
+			while (nNow < nTick)
+			{
+				// Nothing pending: jump straight there
+				if (nCount == 0)
+				{
+					nNow = nTick;
+					break;
+				}
+
+				// Nothing on the finest levels: skip to the last tick before the next
+				// slot of the lowest level that has something
+				int nLowest = 0;
+				while (nLevelCount[nLowest] == 0)
+					nLowest++;
+				if (nLowest > 0)
+				{
+					uint64_t nNext = ((nNow >> (BITS * nLowest)) + 1) << (BITS * nLowest);
+					if (nNext - 1 > nNow)
+						nNow = min(nTick, nNext - 1);
+					if (nNow == nTick)
+						break;
+				}
+
+				nNow++;
+				uint32_t nSlot = (uint32_t)(nNow & MASK);
+
+				// Entering a new turn of a level pulls the matching slot of the level
+				// above down into finer slots, highest level first
+				if (nSlot == 0)
+					Cascade();
+
+				TakeList(nSlots[0][nSlot], vecOut);
+
+				// Cascaded entries for exactly this tick
+				TakeList(nDue, vecOut);
+			}
+		}
+
+		// Cancels every pending event whose value matches, returns how many
+		template<class PRED>
+		size_t CancelIf(PRED pred)
+		{
+			size_t nCancelled = 0;
+			for (uint32_t i = 0; i < (uint32_t)vecEntries.size(); i++)
+			{
+				entry &e = vecEntries[i];
+				if (e.nList == NONE || !pred(e.value))
+					continue;
+				Unlink(i);
+				nLevelCount[Level(e.nList)]--;
+				Release(i);
+				nCount--;
+				nCancelled++;
+			}
+			return nCancelled;
+		}
+
+		uint64_t Now() const { return nNow; }
+		size_t Size() const { return nCount; }
+
+		// Preallocates entries so inserts don't allocate
+		void Reserve(size_t nEntries)
+		{
+			vecEntries.reserve(nEntries);
+		}
+
+	private:
+		static const uint32_t NONE = 0xFFFFFFFF;
+		static const int LEVELS = 4;
+		static const int BITS = 8;
+		static const uint32_t SLOTS = 1u << BITS;
+		static const uint64_t MASK = SLOTS - 1;
+
+		struct entry
+		{
+			uint64_t nTick;
+			T value;
+			uint32_t nNext;
+			uint32_t nPrev;
+			uint32_t nList;		// Id of the list it's on, NONE when free
+			uint32_t nGeneration;
+		};
+
+		// List ids: LEVELS * SLOTS slots, then overflow, then due
+		static const uint32_t LIST_OVERFLOW = LEVELS * SLOTS;
+		static const uint32_t LIST_DUE = LEVELS * SLOTS + 1;
+
+		// 0 to LEVELS - 1 for the slots, LEVELS for overflow, LEVELS + 1 for due
+		static int Level(uint32_t nList)
+		{
+			return nList >= LIST_OVERFLOW ? LEVELS + (nList - LIST_OVERFLOW) : nList / SLOTS;
+		}
+
+		uint32_t& Head(uint32_t nList)
+		{
+			if (nList == LIST_OVERFLOW) return nOverflow;
+			if (nList == LIST_DUE) return nDue;
+			return nSlots[nList / SLOTS][nList % SLOTS];
+		}
+
+		void Place(uint32_t i)
+		{
+			uint64_t nTick = vecEntries[i].nTick;
+			uint32_t nList;
+
+			if (nTick <= nNow)
+				nList = LIST_DUE;
+			else
+			{
+				// Lowest level on which the tick is within the current turn
+				nList = LIST_OVERFLOW;
+				for (int l = 0; l < LEVELS; l++)
+				{
+					int nShift = BITS * (l + 1);
+					if ((nTick >> nShift) == (nNow >> nShift))
+					{
+						nList = l * SLOTS + (uint32_t)((nTick >> (BITS * l)) & MASK);
+						break;
+					}
+				}
+			}
+
+			entry &e = vecEntries[i];
+			uint32_t &nHead = Head(nList);
+			e.nList = nList;
+			nLevelCount[Level(nList)]++;
+			e.nPrev = NONE;
+			e.nNext = nHead;
+			if (nHead != NONE)
+				vecEntries[nHead].nPrev = i;
+			nHead = i;
+		}
+
+		void Unlink(uint32_t i)
+		{
+			entry &e = vecEntries[i];
+			if (e.nPrev != NONE)
+				vecEntries[e.nPrev].nNext = e.nNext;
+			else
+				Head(e.nList) = e.nNext;
+			if (e.nNext != NONE)
+				vecEntries[e.nNext].nPrev = e.nPrev;
+		}
+
+		// Re-places every entry of a list relative to the new nNow
+		void Redistribute(uint32_t &nHead)
+		{
+			uint32_t i = nHead;
+			nHead = NONE;
+			while (i != NONE)
+			{
+				uint32_t nNext = vecEntries[i].nNext;
+				nLevelCount[Level(vecEntries[i].nList)]--;
+				Place(i);
+				i = nNext;
+			}
+		}
+
+		void Cascade()
+		{
+			int nTop = 1;
+			while (nTop < LEVELS && ((nNow >> (BITS * nTop)) & MASK) == 0)
+				nTop++;
+
+			if (nTop == LEVELS)
+				Redistribute(nOverflow);
+			for (int l = min(nTop, LEVELS - 1); l >= 1; l--)
+				Redistribute(nSlots[l][(nNow >> (BITS * l)) & MASK]);
+		}
+
+		template<class OUT>
+		void TakeList(uint32_t &nHead, OUT &vecOut)
+		{
+			uint32_t i = nHead;
+			nHead = NONE;
+			while (i != NONE)
+			{
+				uint32_t nNext = vecEntries[i].nNext;
+				nLevelCount[Level(vecEntries[i].nList)]--;
+				vecOut.push_back(vecEntries[i].value);
+				Release(i);
+				nCount--;
+				i = nNext;
+			}
+		}
+
+		uint32_t Allocate()
+		{
+			if (nFree != NONE)
+			{
+				uint32_t i = nFree;
+				nFree = vecEntries[i].nNext;
+				return i;
+			}
+			vecEntries.push_back(entry());
+			vecEntries.back().nGeneration = 0;
+			return (uint32_t)(vecEntries.size() - 1);
+		}
+
+		void Release(uint32_t i)
+		{
+			entry &e = vecEntries[i];
+			e.nList = NONE;
+			e.nGeneration++;
+			e.nNext = nFree;
+			nFree = i;
+		}
+
+	private:
+		tracked_vector<entry, MEM_VOICES> vecEntries;
+		uint32_t nSlots[LEVELS][SLOTS];
+		uint32_t nOverflow;
+		uint32_t nDue;
+		size_t nLevelCount[LEVELS + 2];
+		uint32_t nFree;
+		uint64_t nNow;
+		size_t nCount;
+	};
+
+}
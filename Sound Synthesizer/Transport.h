@@ -0,0 +1,199 @@
+#pragma once
+#include "Song.h"
+
+namespace synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Song Transport
+
+	// Plays a song_player into an engine and keeps checkpoints of the song's state
+	// at regular intervals: the player's position and every voice still ringing.
+	// Whether a voice still rings is told from its times by the instrument,
+	// without rendering it away from the audio thread. Notes reach the engine
+	// through its schedule. A seek restores the nearest checkpoint before the
+	// target and fast-forwards the rest at control rate, instead of simulating
+	// from the start.
+	//
+	// Checkpoints assume voices are pure functions of time. Voices that keep state
+	// of their own are not held by a checkpoint: the modsynth's phase and filter
+	// are caught up from the note's times (the filter over its last few thousand
+	// samples only), so after a seek its output is close to, but not exactly,
+	// what playing through would give. Granular grains are hashed from the note
+	// and grain index, so they seek exactly.
+	//
+	// The transport works in song time (seconds from the start of the pattern);
+	// dOffset maps it onto the engine's clock.
+	struct song_transport
+	{
+	public:
+		struct checkpoint
+		{
+			FTYPE dSongTime;
+			song_player::position pos;
+			vector<note> vecVoices;		// In song time
+		};
+
+	public:
+		song_transport(song_player &p, engine &e, FTYPE interval = 5.0, FTYPE step = 0.01) : player(p), eng(e)
+		{
+			fInterval = interval;
+			fStep = step;
+			dOffset = 0.0;
+			dNextCheckpoint = 0.0;
+		}
+
+		// Song time 0 plays at engine time dStart
+		bool Play(uint32_t nPattern, FTYPE dStart, bool loop = false)
+		{
+			RemoveVoices();
+			vecVoices.clear();
+			dOffset = dStart;
+			dNextCheckpoint = 0.0;
+			return player.Play(nPattern, 0.0, loop);
+		}
+
+		// Call from the control loop in place of player.Update
+		int Update(FTYPE dTimeNow)
+		{
+			FTYPE dSongTime = dTimeNow - dOffset;
+			int nNew = Advance(dSongTime);
+
+			if (dSongTime >= dNextCheckpoint)
+			{
+				Record(dSongTime);
+				dNextCheckpoint = dSongTime + fInterval;
+			}
+
+			for (int a = 0; a < nNew; a++)
+				Schedule(player.vecNotes[a]);
+
+			return nNew;
+		}
+
+		// Simulates the current pattern once at control rate to record every
+		// checkpoint up front, then rewinds. Call after Play, before Update.
+		void Scan()
+		{
+			song_player::position start = player.GetPosition();
+			if (start.pPattern == nullptr)
+				return;
+
+			vector<note> vecSaved = vecVoices;
+			for (FTYPE t = 0.0; t < start.pPattern->dLength && player.IsPlaying(); t += fStep)
+			{
+				Advance(t);
+				if (t >= dNextCheckpoint)
+				{
+					Record(t);
+					dNextCheckpoint = t + fInterval;
+				}
+			}
+
+			player.SetPosition(start);
+			vecVoices = vecSaved;
+			dNextCheckpoint = 0.0;
+		}
+
+		// Jumps so that dSongTime plays at engine time dTimeNow
+		void Seek(FTYPE dSongTime, FTYPE dTimeNow)
+		{
+			RemoveVoices();
+
+			// Latest checkpoint at or before the target
+			auto cp = upper_bound(vecCheckpoints.begin(), vecCheckpoints.end(), dSongTime,
+				[](FTYPE t, const checkpoint &c) { return t < c.dSongTime; });
+
+			FTYPE t = 0.0;
+			if (cp != vecCheckpoints.begin())
+			{
+				--cp;
+				player.SetPosition(cp->pos);
+				vecVoices = cp->vecVoices;
+				t = cp->dSongTime;
+			}
+			else
+			{
+				song_player::position pos = player.GetPosition();
+				if (pos.pPattern != nullptr)
+					player.SetPosition({ pos.pPattern, 0, 0.0 });
+				vecVoices.clear();
+			}
+
+			// Fast-forward the remainder at control rate
+			for (; t < dSongTime; t += fStep)
+				Advance(t);
+			Advance(dSongTime);
+
+			dOffset = dTimeNow - dSongTime;
+			dNextCheckpoint = dSongTime + fInterval;
+
+			for (auto &n : vecVoices)
+				Schedule(n);
+		}
+
+		FTYPE SongTime(FTYPE dTimeNow) const
+		{
+			return dTimeNow - dOffset;
+		}
+
+	private:
+		// Runs the player up to dSongTime, adds what it emits to the tracked voices
+		// and drops voices that have finished
+		int Advance(FTYPE dSongTime)
+		{
+			int nNew = player.Update(dSongTime);
+			vecVoices.insert(vecVoices.end(), player.vecNotes.begin(), player.vecNotes.begin() + nNew);
+
+			vecVoices.erase(remove_if(vecVoices.begin(), vecVoices.end(), [dSongTime](note const& item)
+				{ return item.channel == nullptr || (dSongTime >= item.on && item.channel->Finished(dSongTime, item)); }), vecVoices.end());
+
+			return nNew;
+		}
+
+		// Hands a note in song time to the engine
+		void Schedule(note n)
+		{
+			n.on += dOffset;
+			if (n.off != NOTE_HELD) n.off += dOffset;
+			eng.Schedule(n);
+		}
+
+		void Record(FTYPE dSongTime)
+		{
+			auto cp = lower_bound(vecCheckpoints.begin(), vecCheckpoints.end(), dSongTime,
+				[](const checkpoint &c, FTYPE t) { return c.dSongTime < t; });
+			if (cp != vecCheckpoints.end() && cp->dSongTime - dSongTime < fInterval * 0.5)
+				return; // Already have one close enough
+
+			vecCheckpoints.insert(cp, { dSongTime, player.GetPosition(), vecVoices });
+		}
+
+		// Takes the song's voices back out of the engine, playing or scheduled
+		void RemoveVoices()
+		{
+			if (vecVoices.empty())
+				return;
+
+			eng.RemoveNotes([this](note const& item)
+			{
+				for (auto &v : vecVoices)
+					if (v.channel == item.channel && v.id == item.id && v.on + dOffset == item.on)
+						return true;
+				return false;
+			});
+		}
+
+	public:
+		song_player &player;
+		engine &eng;
+		FTYPE fInterval;	// Seconds of song between checkpoints
+		FTYPE fStep;		// Control rate used when fast-forwarding
+		vector<checkpoint> vecCheckpoints;
+
+	private:
+		vector<note> vecVoices;
+		FTYPE dOffset;
+		FTYPE dNextCheckpoint;
+	};
+
+}
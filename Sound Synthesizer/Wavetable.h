@@ -0,0 +1,379 @@
+#pragma once
+#include <functional>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "Core.h"
+
+namespace synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Wavetables
+
+	// Single cycle frames, each stored at several band limits (mip levels). Level
+	// L keeps harmonics up to HARMONICS >> L, and a note reads the lowest level
+	// whose top harmonic stays under Nyquist, so high notes don't alias. Tables
+	// can be stored as double, half or bfloat16.
+	struct wavetable
+	{
+	public:
+		static const unsigned int SIZE = 2048;			// Samples per cycle
+		static const unsigned int HARMONICS = 256;		// At level 0
+		static const unsigned int LEVELS = 9;			// Down to a single harmonic
+
+		wavetable(memory_account *account = nullptr) : vecData(tracked_allocator<FTYPE, MEM_TABLES>(account)),
+			vecHalf(tracked_allocator<half, MEM_TABLES>(account)), vecBfloat(tracked_allocator<bfloat16, MEM_TABLES>(account))
+		{
+			nFrames = 0;
+			format = FMT_DOUBLE;
+		}
+
+		// fAmplitude(frame, harmonic) gives the sine amplitude of each harmonic
+		// (from 1) of each frame. Frames are normalised to a peak of 1 at level 0,
+		// with the same scale used at every level.
+		void Build(unsigned int frames, const function<FTYPE(unsigned int, unsigned int)> &fAmplitude, SAMPLE_FORMAT fmt = FMT_DOUBLE)
+		{
+			nFrames = max(1u, frames);
+			format = FMT_DOUBLE;
+			vecData.assign((size_t)nFrames * LEVELS * STRIDE, 0.0);
+			vecHalf.clear();
+			vecHalf.shrink_to_fit();
+			vecBfloat.clear();
+			vecBfloat.shrink_to_fit();
+
+			// sin(2 pi h s / SIZE) is exactly entry (h * s) mod SIZE of one cycle
+			vector<FTYPE> vecSine(SIZE);
+			for (unsigned int s = 0; s < SIZE; s++)
+				vecSine[s] = math::sin(2.0 * PI * s / SIZE);
+
+			for (unsigned int f = 0; f < nFrames; f++)
+			{
+				// Each level is the next one up plus its extra harmonics, so build
+				// from the top level down
+				vector<FTYPE> vecAccum(SIZE, 0.0);
+				unsigned int nHave = 0;
+				for (int l = LEVELS - 1; l >= 0; l--)
+				{
+					unsigned int nTop = HARMONICS >> l;
+					for (unsigned int h = nHave + 1; h <= nTop; h++)
+					{
+						FTYPE a = fAmplitude(f, h);
+						if (a == 0.0)
+							continue;
+						for (unsigned int s = 0; s < SIZE; s++)
+							vecAccum[s] += a * vecSine[(h * s) % SIZE];
+					}
+					nHave = nTop;
+
+					FTYPE *pTable = Table(l, f);
+					for (unsigned int s = 0; s < SIZE; s++)
+						pTable[s] = vecAccum[s];
+					pTable[SIZE] = pTable[0];	// Guard for interpolation
+				}
+
+				FTYPE dPeak = 0.0;
+				for (unsigned int s = 0; s < SIZE; s++)
+					dPeak = max(dPeak, math::fabs(Table(0, f)[s]));
+				if (dPeak > 0.0)
+					for (unsigned int l = 0; l < LEVELS; l++)
+						for (unsigned int s = 0; s <= SIZE; s++)
+							Table(l, f)[s] /= dPeak;
+			}
+
+			// Compact formats replace the double tables
+			if (fmt == FMT_HALF)
+			{
+				vecHalf.resize(vecData.size());
+				store_samples(vecData.data(), vecHalf.data(), vecData.size());
+			}
+			else if (fmt == FMT_BFLOAT16)
+			{
+				vecBfloat.resize(vecData.size());
+				store_samples(vecData.data(), vecBfloat.data(), vecData.size());
+			}
+			if (fmt != FMT_DOUBLE)
+			{
+				vecData.clear();
+				vecData.shrink_to_fit();
+			}
+			format = fmt;
+		}
+
+		// SIZE + 1 samples, the last a copy of the first. Only the accessor for
+		// Format() has data.
+		FTYPE* Table(unsigned int nLevel, unsigned int nFrame)
+		{
+			return vecData.data() + Offset(nLevel, nFrame);
+		}
+
+		const half* HalfTable(unsigned int nLevel, unsigned int nFrame) const
+		{
+			return vecHalf.data() + Offset(nLevel, nFrame);
+		}
+
+		const bfloat16* BfloatTable(unsigned int nLevel, unsigned int nFrame) const
+		{
+			return vecBfloat.data() + Offset(nLevel, nFrame);
+		}
+
+		SAMPLE_FORMAT Format() const
+		{
+			return format;
+		}
+
+		// Lowest level with every harmonic of dHertz under Nyquist
+		static unsigned int Level(FTYPE dHertz, unsigned int nSampleRate)
+		{
+			for (unsigned int l = 0; l < LEVELS; l++)
+				if ((HARMONICS >> l) * dHertz < nSampleRate * 0.5)
+					return l;
+			return LEVELS - 1;
+		}
+
+		unsigned int Frames() const
+		{
+			return nFrames;
+		}
+
+	private:
+		static size_t Offset(unsigned int nLevel, unsigned int nFrame)
+		{
+			return ((size_t)nFrame * LEVELS + nLevel) * STRIDE;
+		}
+
+	private:
+		static const unsigned int STRIDE = SIZE + 1;
+		unsigned int nFrames;
+		SAMPLE_FORMAT format;
+		tracked_vector<FTYPE, MEM_TABLES> vecData;
+		tracked_vector<half, MEM_TABLES> vecHalf;
+		tracked_vector<bfloat16, MEM_TABLES> vecBfloat;
+	};
+
+#if defined(__AVX2__)
+	// Loads p[i] and p[i + 1] for four indices as doubles
+	inline void gather_pairs(const double *p, __m128i ip, __m256d &v0, __m256d &v1)
+	{
+		v0 = _mm256_i32gather_pd(p, ip, 8);
+		v1 = _mm256_i32gather_pd(p + 1, ip, 8);
+	}
+
+	// 16-bit formats fetch both neighbours with one 32-bit gather per index
+	inline void gather_pairs(const bfloat16 *p, __m128i ip, __m256d &v0, __m256d &v1)
+	{
+		__m128i v = _mm_i32gather_epi32((const int*)p, ip, 2);
+		v0 = _mm256_cvtps_pd(_mm_castsi128_ps(_mm_slli_epi32(v, 16)));
+		v1 = _mm256_cvtps_pd(_mm_castsi128_ps(_mm_and_si128(v, _mm_set1_epi32((int)0xFFFF0000))));
+	}
+
+	inline void gather_pairs(const half *p, __m128i ip, __m256d &v0, __m256d &v1)
+	{
+		__m128i v = _mm_i32gather_epi32((const int*)p, ip, 2);
+#ifdef SYNTH_F16C
+		__m128i lo = _mm_and_si128(v, _mm_set1_epi32(0xFFFF));
+		__m128i hi = _mm_srli_epi32(v, 16);
+		__m256 f = _mm256_cvtph_ps(_mm_packus_epi32(lo, hi));
+		v0 = _mm256_cvtps_pd(_mm256_castps256_ps128(f));
+		v1 = _mm256_cvtps_pd(_mm256_extractf128_ps(f, 1));
+#else
+		alignas(16) uint32_t n[4];
+		_mm_store_si128((__m128i*)n, v);
+		v0 = _mm256_set_pd(half_bits_to_float(n[3] & 0xFFFF), half_bits_to_float(n[2] & 0xFFFF), half_bits_to_float(n[1] & 0xFFFF), half_bits_to_float(n[0] & 0xFFFF));
+		v1 = _mm256_set_pd(half_bits_to_float(n[3] >> 16), half_bits_to_float(n[2] >> 16), half_bits_to_float(n[1] >> 16), half_bits_to_float(n[0] >> 16));
+#endif
+	}
+#endif
+
+
+	// Scans through the frames of a wavetable. Each voice's position moves from
+	// fPosition at fScanRate frames per second, plus an LFO, and is evaluated once
+	// per block and ramped across it. Per sample the voice reads the two
+	// neighbouring frames at its phase and crossfades between them.
+	struct instrument_wavetable : public instrument_base
+	{
+		FTYPE fPosition;	// Starting frame, 0 to Frames() - 1
+		FTYPE fScanRate;	// Frames per second
+		FTYPE fLFOHertz;
+		FTYPE fLFODepth;	// Frames
+		SAMPLE_FORMAT format;	// Table storage, set before Prepare
+
+		instrument_wavetable() : table(&mem)
+		{
+			env.dAttackTime = 0.05;
+			env.dDecayTime = 0.5;
+			env.dSustainAmplitude = 0.7;
+			env.dReleaseTime = 0.4;
+			fMaxLifeTime = -1.0;
+			dVolume = 0.4;
+			name = L"Wavetable";
+
+			fPosition = 0.0;
+			fScanRate = 6.0;
+			fLFOHertz = 0.5;
+			fLFODepth = 1.5;
+			nSampleRate = 44100;
+			format = FMT_DOUBLE;
+		}
+
+		// Default morph: sine to saw over the first half of the frames, then saw
+		// to a hollow square with a formant bump around the 6th harmonic
+		virtual void Prepare(unsigned int sampleRate)
+		{
+			nSampleRate = sampleRate;
+			if (table.Frames() > 0)
+				return;
+
+			const unsigned int nFrames = 16;
+			table.Build(nFrames, [nFrames](unsigned int f, unsigned int h) {
+				FTYPE m = (FTYPE)f / (nFrames - 1);
+				FTYPE dSine = h == 1 ? 1.0 : 0.0;
+				FTYPE dSaw = 1.0 / h;
+				FTYPE dSquare = (h & 1) ? 1.0 / h : 0.0;
+				dSquare *= 1.0 + 2.0 * math::exp(-(h - 6.0) * (h - 6.0) / 8.0);
+				return m < 0.5 ? dSine + (dSaw - dSine) * (m * 2.0) : dSaw + (dSquare - dSaw) * (m * 2.0 - 1.0);
+			}, format);
+		}
+
+		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished)
+		{
+			FTYPE dSample = 0.0;
+			SoundBlock(dTime, 1.0 / nSampleRate, n, &dSample, 1, bNoteFinished);
+			return dSample;
+		}
+
+		virtual bool SoundBlock(const FTYPE dTime, const FTYPE dTimeStep, const synth::note &n, FTYPE *pOut, unsigned int nSamples, bool &bNoteFinished)
+		{
+			if (table.Frames() == 0)
+				Prepare((unsigned int)math::round_to_int(1.0 / dTimeStep));
+
+			FTYPE dHertz = scale(n.id);
+			unsigned int nLevel = wavetable::Level(dHertz, (unsigned int)math::round_to_int(1.0 / dTimeStep));
+
+			// Phase in table samples, from the note's own start so it is a pure
+			// function of time
+			FTYPE dCycles = dHertz * (dTime - n.on);
+			FTYPE dPhase = (dCycles - math::floor(dCycles)) * wavetable::SIZE;
+			FTYPE dPhaseInc = dHertz * dTimeStep * wavetable::SIZE;
+
+			// Position at both ends of the block, ramped between
+			FTYPE dPos0 = Position(dTime - n.on);
+			FTYPE dPos1 = Position(dTime - n.on + nSamples * dTimeStep);
+			FTYPE dPosInc = (dPos1 - dPos0) / nSamples;
+
+			unsigned int s = 0;
+			while (s < nSamples)
+			{
+				// Run of samples that stays between the same two frames
+				unsigned int nFrame = (unsigned int)max(0.0, min(math::floor(dPos0 + s * dPosInc), (FTYPE)table.Frames() - 2.0));
+				unsigned int nRun = nSamples - s;
+				if (dPosInc != 0.0)
+				{
+					FTYPE dEdge = dPosInc > 0.0 ? nFrame + 1.0 : (FTYPE)nFrame;
+					FTYPE dSteps = (dEdge - (dPos0 + s * dPosInc)) / dPosInc;
+					if (dSteps > 0.0 && dSteps < nRun)
+						nRun = max(1u, (unsigned int)math::trunc(dSteps) + 1);
+				}
+
+				unsigned int nNext = min(nFrame + 1, table.Frames() - 1);
+				FTYPE dFrameMix = dPos0 + s * dPosInc - nFrame;
+				if (table.Format() == FMT_HALF)
+					ReadFrames(table.HalfTable(nLevel, nFrame), table.HalfTable(nLevel, nNext),
+						dPhase + s * dPhaseInc, dPhaseInc, dFrameMix, dPosInc, pOut + s, nRun, dTime + s * dTimeStep, dTimeStep, n, bNoteFinished);
+				else if (table.Format() == FMT_BFLOAT16)
+					ReadFrames(table.BfloatTable(nLevel, nFrame), table.BfloatTable(nLevel, nNext),
+						dPhase + s * dPhaseInc, dPhaseInc, dFrameMix, dPosInc, pOut + s, nRun, dTime + s * dTimeStep, dTimeStep, n, bNoteFinished);
+				else
+					ReadFrames((const FTYPE*)table.Table(nLevel, nFrame), (const FTYPE*)table.Table(nLevel, nNext),
+						dPhase + s * dPhaseInc, dPhaseInc, dFrameMix, dPosInc, pOut + s, nRun, dTime + s * dTimeStep, dTimeStep, n, bNoteFinished);
+				s += nRun;
+			}
+			return true;
+		}
+
+	private:
+		FTYPE Position(FTYPE dLifeTime)
+		{
+			FTYPE dPos = fPosition + fScanRate * dLifeTime + fLFODepth * math::sin(w(fLFOHertz) * dLifeTime);
+			FTYPE dLast = (FTYPE)(table.Frames() - 1);
+
+			// Scan back and forth rather than jumping from the last frame to the first
+			FTYPE dCycle = 2.0 * dLast;
+			if (dCycle <= 0.0)
+				return 0.0;
+			dPos -= math::floor(dPos / dCycle) * dCycle;
+			return dPos > dLast ? dCycle - dPos : dPos;
+		}
+
+		// Adds nSamples of the crossfade between frames pA and pB into pOut.
+		// dMix is the weight of pB, moving by dMixInc per sample.
+		template<class S>
+		void ReadFrames(const S *pA, const S *pB, FTYPE dPhase, FTYPE dPhaseInc, FTYPE dMix, FTYPE dMixInc,
+			FTYPE *pOut, unsigned int nSamples, FTYPE dTime, FTYPE dTimeStep, const note &n, bool &bNoteFinished)
+		{
+			const FTYPE dSize = (FTYPE)wavetable::SIZE;
+			const FTYPE dMaxPhase = dSize - 1e-6;	// Wrapping can round up to dSize
+			unsigned int s = 0;
+
+			// Envelope per sample, as every other instrument
+			FTYPE dEnv[64];
+			while (s < nSamples)
+			{
+				unsigned int nChunk = min(64u, nSamples - s);
+				for (unsigned int i = 0; i < nChunk; i++)
+				{
+					FTYPE t = dTime + (s + i) * dTimeStep;
+					dEnv[i] = synth::env(t, env, n.on, n.off) * dVolume;
+					if (dEnv[i] <= 0.0 && t - n.on > env.dAttackTime) bNoteFinished = true;
+				}
+
+				unsigned int i = 0;
+#if defined(__AVX2__)
+				const __m256d vStep = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+				const __m256d vSize = _mm256_set1_pd(dSize);
+				for (; i + 4 <= nChunk; i += 4)
+				{
+					__m256d vi = _mm256_add_pd(_mm256_set1_pd((FTYPE)(s + i)), vStep);
+					__m256d p = _mm256_add_pd(_mm256_set1_pd(dPhase), _mm256_mul_pd(vi, _mm256_set1_pd(dPhaseInc)));
+					p = _mm256_sub_pd(p, _mm256_mul_pd(_mm256_floor_pd(_mm256_div_pd(p, vSize)), vSize));
+					p = _mm256_max_pd(_mm256_min_pd(p, _mm256_set1_pd(dMaxPhase)), _mm256_setzero_pd());
+					__m256d x = _mm256_add_pd(_mm256_set1_pd(dMix), _mm256_mul_pd(vi, _mm256_set1_pd(dMixInc)));
+
+					__m128i ip = _mm256_cvttpd_epi32(p);
+					__m256d fp = _mm256_sub_pd(p, _mm256_cvtepi32_pd(ip));
+					__m256d a0, a1, b0, b1;
+					gather_pairs(pA, ip, a0, a1);
+					gather_pairs(pB, ip, b0, b1);
+					__m256d a = _mm256_add_pd(a0, _mm256_mul_pd(fp, _mm256_sub_pd(a1, a0)));
+					__m256d b = _mm256_add_pd(b0, _mm256_mul_pd(fp, _mm256_sub_pd(b1, b0)));
+					__m256d v = _mm256_add_pd(a, _mm256_mul_pd(x, _mm256_sub_pd(b, a)));
+
+					__m256d out = _mm256_add_pd(_mm256_loadu_pd(pOut + s + i), _mm256_mul_pd(v, _mm256_loadu_pd(dEnv + i)));
+					_mm256_storeu_pd(pOut + s + i, out);
+				}
+#endif
+				for (; i < nChunk; i++)
+				{
+					FTYPE p = dPhase + (s + i) * dPhaseInc;
+					p -= math::floor(p / dSize) * dSize;
+					p = max(0.0, min(p, dMaxPhase));
+					FTYPE x = dMix + (s + i) * dMixInc;
+					int ip = (int)p;
+					FTYPE fp = p - ip;
+					FTYPE a0 = to_ftype(pA[ip]), a1 = to_ftype(pA[ip + 1]);
+					FTYPE b0 = to_ftype(pB[ip]), b1 = to_ftype(pB[ip + 1]);
+					FTYPE a = a0 + fp * (a1 - a0);
+					FTYPE b = b0 + fp * (b1 - b0);
+					pOut[s + i] += (a + x * (b - a)) * dEnv[i];
+				}
+				s += nChunk;
+			}
+		}
+
+	private:
+		unsigned int nSampleRate;
+		wavetable table;
+	};
+
+}
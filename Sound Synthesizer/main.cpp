@@ -1,68 +1,380 @@
+#include "Farm.h"
 #include <list>
 #include <iostream>
 #include <algorithm>
-#include "Core.h"
+#include "Engine.h"
+#include "Granular.h"
+#include "Wavetable.h"
+#include "Pattern.h"
+#include "SongConvert.h"
+#include "Transport.h"
+#include "Dataset.h"
+#include "Render.h"
+#include "Bench.h"
+#include "Burst.h"
+#include "Additive.h"
+#include "Modulation.h"
+#include "Plugin.h"
 using namespace std;
 
 //#include "Noise.h"
 
-vector<synth::note> vecNotes;
-mutex muxNotes;
+synth::engine engine(44100, 256);
 synth::instrument_bell instBell;
 synth::instrument_harmonica instHarm;
 synth::instrument_drumkick instKick;
 synth::instrument_drumsnare instSnare;
 synth::instrument_drumhihat instHiHat;
+synth::instrument_granular instGranular;
+synth::instrument_wavetable instWavetable;
+synth::instrument_additive instAdditive;
+synth::instrument_follower instFollower;
+synth::instrument_modsynth instModSynth;
+synth::instrument_plugin instPlugin;
+synth::effect_reverb fxReverb;
+synth::effect_limiter fxLimiter;
 
-typedef bool(*lambda)(synth::note const& item);
-template<class T>
-void safe_remove(T &v, lambda f)
+// With --burst the song and generative patterns play on their own engine and
+// instruments, rendered seconds ahead, while the device thread renders the live ones
+synth::engine engineBacking(44100, 256);
+synth::instrument_bell instBackingBell;
+synth::instrument_harmonica instBackingHarm;
+synth::instrument_drumkick instBackingKick;
+synth::instrument_drumsnare instBackingSnare;
+synth::instrument_drumhihat instBackingHiHat;
+synth::instrument_granular instBackingGranular;
+synth::instrument_wavetable instBackingWavetable;
+synth::effect_reverb fxBackingReverb;
+synth::effect_limiter fxBackingLimiter;
+synth::burst_renderer *pBurst = nullptr;
+
+// Fills a block of mono frames (-1.0 to +1.0) from the engine
+void MakeNoise(FTYPE *pBuffer, unsigned int nFrames)
 {
-	auto n = v.begin();
-	while (n != v.end())
-		if (!f(*n))
-			n = v.erase(n);
-		else
-			++n;
+	engine.Render(pBuffer, nFrames);
+	if (pBurst != nullptr)
+		pBurst->Mix(pBuffer, nFrames);
 }
 
-// Returns amplitude (-1.0 to +1.0) as a function of time
-FTYPE MakeNoise(int nChannel, FTYPE dTime)
+// Fills a block for a speaker ring, one plane of frames per speaker
+void MakeSpatialNoise(FTYPE *pBuffer, unsigned int nFrames, unsigned int nChannels)
 {
-	unique_lock<mutex> lm(muxNotes);
-	FTYPE dMixedOutput = 0.0;
+	engine.RenderSpatial(pBuffer, nFrames);
+}
 
-	// Iterate through all active notes, and mix together
-	for (auto &n : vecNotes)
+// Converts a MIDI file (.mid) or a text beat pattern into the binary song format
+bool ConvertSong(const wstring &sInput, const wstring &sOutput)
+{
+	synth::song_builder song;
+	bool bOk;
+
+	if (sInput.size() > 4 && sInput.substr(sInput.size() - 4) == L".mid")
 	{
-		bool bNoteFinished = false;
-		FTYPE dSound = 0;
+		vector<string> vecChannels(16, "Harmonica");
+		vecChannels[9] = "Drum Kick";
+		bOk = synth::song_from_midi(sInput, song, vecChannels);
+	}
+	else
+		bOk = synth::song_from_text(sInput, song);
+
+	if (!bOk || !song.Write(sOutput))
+	{
+		wcout << L"Could not convert " << sInput << endl;
+		return false;
+	}
+
+	wcout << L"Wrote " << sOutput << endl;
+	return true;
+}
+
+// Renders a randomized dataset into packed shards: --dataset <prefix> <clips> [seed]
+int RenderDataset(const vector<wstring> &vecArgs)
+{
+	synth::dataset_spec spec;
+	spec.sPrefix = vecArgs[1];
+	spec.nClips = stoull(vecArgs[2]);
+	if (vecArgs.size() > 3)
+		spec.nSeed = stoull(vecArgs[3]);
 
-		// Get sample for this note by using the correct instrument and envelope
-		if (n.channel != nullptr)
-			dSound = n.channel->sound(dTime, n, bNoteFinished);
+	synth::dataset_renderer renderer(spec);
+	bool bOk = renderer.Run();
 
-		// Mix into output
-		dMixedOutput += dSound;
+	wcout << renderer.nClipsDone << L" clips in " << renderer.fSeconds << L"s, "
+		<< renderer.RealtimeFactor() << L"x realtime" << endl;
+	return bOk ? 0 : 1;
+}
 
-		if (bNoteFinished) // Flag note to be removed
-			n.active = false;
+// Bounces the first pattern of a song to WAV:
+// --render <song> <out.wav> [--draft] [--loudness <LUFS>]
+int RenderSong(const vector<wstring> &vecArgs)
+{
+	synth::song_file song;
+	if (!song.Open(vecArgs[1]))
+	{
+		wcout << L"Could not open song " << vecArgs[1] << endl;
+		return 1;
 	}
-	safe_remove<vector<synth::note>>(vecNotes, [](synth::note const& item) { return item.active; });
-	return dMixedOutput * 0.2;
+
+	bool bDraft = find(vecArgs.begin(), vecArgs.end(), L"--draft") != vecArgs.end();
+	synth::render_settings settings = bDraft ? synth::render_settings::Draft() : synth::render_settings::Final();
+	auto a = find(vecArgs.begin(), vecArgs.end(), L"--loudness");
+	if (a != vecArgs.end() && a + 1 != vecArgs.end())
+		settings.fLoudnessTarget = stod(*(a + 1));
+
+	synth::render_result r = synth::render_song(song, 0, settings, vecArgs[2]);
+
+	wcout << (bDraft ? L"Draft: " : L"Final: ") << r.fAudioSeconds << L"s of audio in " << r.fSeconds << L"s, "
+		<< r.RealtimeFactor() << L"x realtime" << endl;
+	wcout << r.fLoudness << L" LUFS, " << r.fTruePeak << L" dBTP, range " << r.fLoudnessRange << L" LU";
+	if (settings.fLoudnessTarget != 0.0)
+		wcout << L", " << r.fGain << L" dB applied";
+	wcout << endl;
+	return r.bOk ? 0 : 1;
 }
 
-int main()
+// Builds an additive patch from a recording: --analyse <in.wav> <out.patch> [partials]
+int AnalyseSound(const vector<wstring> &vecArgs)
 {
+	vector<FTYPE> vecSamples;
+	unsigned int nSampleRate;
+	if (!synth::read_wav(vecArgs[1], vecSamples, nSampleRate))
+	{
+		wcout << L"Could not read " << vecArgs[1] << endl;
+		return 1;
+	}
+
+	synth::additive_analyser analyser;
+	if (vecArgs.size() > 3)
+		analyser.nPartials = max(1, stoi(vecArgs[3]));
+
+	synth::additive_patch patch;
+	if (!analyser.Analyse(vecSamples, nSampleRate, patch) || !patch.Write(vecArgs[2]))
+	{
+		wcout << L"Could not analyse " << vecArgs[1] << endl;
+		return 1;
+	}
+
+	wcout << patch.Partials() << L" partials over " << patch.Duration() << L"s, pitch " << patch.dBaseHertz << L" Hz, "
+		<< (patch.vecAmp.size() + patch.vecRatio.size()) * sizeof(float) / 1024 << L" KB" << endl;
+	return 0;
+}
+
+// Splits a render over worker processes:
+// --farm <song> <out.wav> [--workers N] [--segment S] [--port P] [--stems] [--draft]
+// Workers on other hosts join with --worker <coordinator host:port>.
+int RenderFarm(const vector<wstring> &vecArgs, const wstring &sExe)
+{
+	auto option = [&vecArgs](const wstring &sName)
+	{
+		auto a = find(vecArgs.begin(), vecArgs.end(), sName);
+		return (a != vecArgs.end() && a + 1 != vecArgs.end()) ? *(a + 1) : wstring();
+	};
+	bool bDraft = find(vecArgs.begin(), vecArgs.end(), L"--draft") != vecArgs.end();
+	bool bStems = find(vecArgs.begin(), vecArgs.end(), L"--stems") != vecArgs.end();
+
+	synth::render_farm farm(bDraft ? synth::render_settings::Draft() : synth::render_settings::Final());
+	if (!option(L"--segment").empty())
+		farm.fSegment = max(1.0, stod(option(L"--segment")));
+
+	if (!farm.Listen(option(L"--port").empty() ? 0 : (uint16_t)stoi(option(L"--port"))))
+	{
+		wcout << L"Could not listen for workers" << endl;
+		return 1;
+	}
+
+	// The full mix, or one file per song instrument named after it
+	bool bQueued = true;
+	if (bStems)
+	{
+		synth::song_file song;
+		wstring sBase = vecArgs[2].size() > 4 ? vecArgs[2].substr(0, vecArgs[2].size() - 4) : vecArgs[2];
+		for (uint32_t i = 0; song.Open(vecArgs[1]) && i < song.Header().nInstruments; i++)
+		{
+			const synth::song_instrument &si = song.Instruments()[i];
+			string sName(si.name, strnlen(si.name, sizeof(si.name)));
+			bQueued = farm.AddOutput(vecArgs[1], 0, i, sBase + L"_" + wstring(sName.begin(), sName.end()) + L".wav") && bQueued;
+		}
+	}
+	else
+		bQueued = farm.AddOutput(vecArgs[1], 0, -1, vecArgs[2]);
+
+	if (!bQueued)
+	{
+		wcout << L"Could not open song " << vecArgs[1] << endl;
+		return 1;
+	}
+
+	int nWorkers = option(L"--workers").empty() ? (int)max(1u, thread::hardware_concurrency()) : stoi(option(L"--workers"));
+	wcout << L"Coordinator on port " << farm.Port() << L", starting " << nWorkers << L" local workers" << endl;
+	if (!farm.SpawnLocal(nWorkers, sExe))
+		wcout << L"Could not start every local worker" << endl;
+
+	bool bOk = farm.Run();
+	wcout << (bOk ? L"Rendered in " : L"Failed after ") << farm.fSeconds << L"s, " << farm.nRetries << L" retries, "
+		<< farm.nRespawns << L" workers restarted" << endl;
+	return bOk ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+	vector<wstring> vecArgs;
+	for (int a = 1; a < argc; a++)
+		vecArgs.push_back(filesystem::path(argv[a]).wstring());
+
+	// Command line tools
+	if (vecArgs.size() == 3 && vecArgs[0] == L"--convert")
+		return ConvertSong(vecArgs[1], vecArgs[2]) ? 0 : 1;
+
+	if (vecArgs.size() >= 3 && vecArgs[0] == L"--dataset")
+		return RenderDataset(vecArgs);
+
+	if (vecArgs.size() >= 3 && vecArgs[0] == L"--render")
+		return RenderSong(vecArgs);
+
+	if (vecArgs.size() >= 3 && vecArgs[0] == L"--analyse")
+		return AnalyseSound(vecArgs);
+
+	if (vecArgs.size() >= 3 && vecArgs[0] == L"--farm")
+		return RenderFarm(vecArgs, filesystem::path(argv[0]).wstring());
+
+	if (vecArgs.size() == 2 && vecArgs[0] == L"--worker")
+	{
+		string sAddress(argv[2]);
+		size_t nColon = sAddress.rfind(':');
+		if (nColon == string::npos)
+			return 1;
+		return synth::farm_worker(sAddress.substr(0, nColon), (uint16_t)stoi(sAddress.substr(nColon + 1))) ? 0 : 1;
+	}
+
+	// Kernel timings, with hardware counters if asked: --bench [--counters]
+	if (vecArgs.size() >= 1 && vecArgs[0] == L"--bench")
+	{
+		synth::bench_suite bench(vecArgs.size() > 1 && vecArgs[1] == L"--counters");
+		bench.RunAll();
+		bench.Print();
+		return 0;
+	}
+
+	// Value following a playback option, empty if not given
+	auto option = [&vecArgs](const wstring &sName)
+	{
+		auto a = find(vecArgs.begin(), vecArgs.end(), sName);
+		return (a != vecArgs.end() && a + 1 != vecArgs.end()) ? *(a + 1) : wstring();
+	};
+
+	engine.AddInstrument(&instBell);
+	engine.AddInstrument(&instHarm);
+	engine.AddInstrument(&instKick);
+	engine.AddInstrument(&instSnare);
+	engine.AddInstrument(&instHiHat);
+	engine.AddInstrument(&instGranular);
+	engine.AddInstrument(&instWavetable);
+	engine.AddInstrument(&instAdditive);
+	engine.AddInstrument(&instFollower);
+	engine.AddInstrument(&instModSynth);
+	engine.AddInstrument(&instPlugin);
+
+	// --patch <file> plays an analysed patch from the keyboard instead of the harmonica
+	synth::instrument_base *pKeys = &instHarm;
+	wstring sPatch = option(L"--patch");
+	if (!sPatch.empty())
+	{
+		if (instAdditive.Load(sPatch))
+			pKeys = &instAdditive;
+		else
+			wcout << L"Could not load patch " << sPatch << endl;
+	}
+
+	// --modsynth plays the modulation matrix synth from the keyboard
+	if (find(vecArgs.begin(), vecArgs.end(), L"--modsynth") != vecArgs.end())
+		pKeys = &instModSynth;
+
+	// --plugin <file> plays an instrument loaded from a shared object
+	wstring sPlugin = option(L"--plugin");
+	if (!sPlugin.empty())
+	{
+		if (instPlugin.Load(sPlugin))
+			pKeys = &instPlugin;
+		else
+			wcout << L"Could not load plugin " << sPlugin << endl;
+	}
+
+	// --speakers <n> pans voices over a ring of n speakers instead of mono
+	unsigned int nSpeakers = option(L"--speakers").empty() ? 1 : max(1, stoi(option(L"--speakers")));
+	if (nSpeakers > 1)
+		engine.SetSpeakers(synth::speaker_layout::Ring(nSpeakers));
+
+	// --burst saves power on backing tracks: the song and patterns are rendered
+	// in bursts well ahead and the CPU sleeps in between. Mono only.
+	bool bBurst = nSpeakers == 1 && find(vecArgs.begin(), vecArgs.end(), L"--burst") != vecArgs.end();
+	synth::engine &backing = bBurst ? engineBacking : engine;
+	synth::burst_renderer burst(engineBacking, 2.0, 0.5);
+
+	// Master effects, processed on their own core one block behind the voices.
+	// Not in burst mode, where the effects thread would wake every block.
+	engine.AddEffect(&fxReverb);
+	engine.AddEffect(&fxLimiter);
+	engine.SetPipelined(!bBurst);
+
+	if (bBurst)
+	{
+		for (synth::instrument_base *inst : initializer_list<synth::instrument_base*>{ &instBackingBell, &instBackingHarm,
+			&instBackingKick, &instBackingSnare, &instBackingHiHat, &instBackingGranular, &instBackingWavetable })
+			engineBacking.AddInstrument(inst);
+		engineBacking.AddEffect(&fxBackingReverb);
+		engineBacking.AddEffect(&fxBackingLimiter);
+		engineBacking.WarmUp();
+	}
+
+	// Cold caches and page faults are paid for here, not on the first key press
+	engine.WarmUp();
+
+	// --input <device|file.wav|null> runs full duplex: the keyboard plays a saw
+	// that follows the input's level, unless --patch chose the keys
+	unique_ptr<synth::input_source> pInputSource;
+	wstring sInput = option(L"--input");
+	if (sInput == L"null")
+		pInputSource = make_unique<synth::input_null>();
+	else if (sInput.size() > 4 && sInput.substr(sInput.size() - 4) == L".wav")
+	{
+		vector<FTYPE> vecSamples;
+		unsigned int nRate;
+		if (synth::read_wav(sInput, vecSamples, nRate))
+		{
+			if (nRate != engine.nSampleRate)
+				wcout << sInput << L" is " << nRate << L" Hz, played at " << engine.nSampleRate << L" Hz" << endl;
+			pInputSource = make_unique<synth::input_file>(std::move(vecSamples));
+		}
+		else
+			wcout << L"Could not read " << sInput << endl;
+	}
+	else if (!sInput.empty())
+		pInputSource = make_unique<synth::input_wavein>(sInput);
+
+	synth::duplex_input duplex(pInputSource ? pInputSource.get() : nullptr, &engine.mem);
+	if (pInputSource)
+	{
+		if (duplex.Start(engine.nSampleRate, engine.nBlockSamples))
+		{
+			engine.SetInput(&duplex);
+			if (sPatch.empty())
+				pKeys = &instFollower;
+		}
+		else
+			wcout << L"Could not open input " << sInput << endl;
+	}
 
 	// Get all sound hardware
 	vector<wstring> devices = NoiseMaker<short>::Enumerate();
 
 	// Create sound machine
-	NoiseMaker<short> sound(devices[0], 44100, 1, 8, 256);
+	NoiseMaker<short> sound(devices[0], 44100, nSpeakers, 8, 256 * nSpeakers);
 
 	// Link noise function with sound machine
-	sound.SetUserFunction(MakeNoise);
+	if (nSpeakers > 1)
+		sound.SetChannelFunction(MakeSpatialNoise);
+	else
+		sound.SetBlockFunction(MakeNoise);
 
 	//intial clock stuff 
 	auto clock_old_time = chrono::high_resolution_clock::now();
@@ -82,7 +394,36 @@ int main()
 	seq.vecChannel.at(1).sBeat = L"..X...X...X...X.";
 	seq.vecChannel.at(2).sBeat = L"X.X.X.X.X.X.X.XX";
 
+	// Generative patterns, resumed only as far as the lookahead requires
+	// Burst mode needs them scheduled past everything already rendered ahead.
+	FTYPE fLookahead = bBurst ? burst.fDepth + 0.1 : 0.1;
+	synth::pattern_scheduler patterns(fLookahead);
+	patterns.Add(synth::pattern_arpeggio(bBurst ? &instBackingBell : &instBell, { 64, 67, 71, 74 }, seq.fBeatTime * 2.0));
+
+	// Binary song given with --song, played straight out of the mapped file
+	synth::song_file songFile;
+	wstring sSong = option(L"--song");
+	if (!sSong.empty() && !songFile.Open(sSong))
+		wcout << L"Could not open song " << sSong << endl;
+	synth::song_player songPlayer(songFile, backing, fLookahead);
+	synth::song_transport transport(songPlayer, backing);
+	if (songFile.IsOpen())
+	{
+		transport.Play(0, 0.0, true);
+		transport.Scan();	// Checkpoints up front so Home restarts instantly
+	}
+	bool bHomeHeld = false;
+
+	if (bBurst)
+	{
+		burst.Start();
+		pBurst = &burst;
+	}
+
 	wcout << "Welcome To My Sound Synthesizer" << endl;
+	wcout << "Engine latency: " << engine.GetLatency() << " samples" << (engine.IsHot() ? ", warmed up" : "") << endl;
+	if (bBurst)
+		wcout << "Backing rendered " << burst.fDepth << "s ahead in bursts" << endl;
 	// Display a keyboard
 	wcout << endl <<
 		"|   |   |   |   |   | |   |   |   |   | |   | |   |   |   |" << endl <<
@@ -107,43 +448,60 @@ int main()
 
 		// Sequencer
 		int newNotes = seq.Update(dElapsedTime);
-		muxNotes.lock();
+		engine.muxNotes.lock();
 		for (int a = 0; a < newNotes; a++)
 		{
 			seq.vecNotes[a].on = dTimeNow;
-			vecNotes.emplace_back(seq.vecNotes[a]);
+			engine.vecNotes.emplace_back(seq.vecNotes[a]);
+		}
+		engine.muxNotes.unlock();
+
+		// Generative patterns
+		int newPatternNotes = patterns.Update(dTimeNow);
+		for (int a = 0; a < newPatternNotes; a++)
+			backing.Schedule(patterns.vecNotes[a]);
+
+		// Song, Home jumps back to the start
+		bool bHome = synth::platform::key_down(synth::platform::KEY_HOME);
+		if (bHome && !bHomeHeld && songPlayer.IsPlaying())
+		{
+			if (bBurst)
+				burst.Flush();	// Otherwise heard only once the ring drains
+			transport.Seek(0.0, dTimeNow);
 		}
-		muxNotes.unlock();
+		bHomeHeld = bHome;
+		transport.Update(dTimeNow);
 
 		// Keyboard 
 		for (int k = 0; k < 16; k++)
 		{
-			short nKeyState = GetAsyncKeyState((unsigned char)("ZSXCFVGBNJMK\xbcL\xbe\xbf"[k]));
+			bool bKeyDown = synth::platform::key_down((unsigned char)("ZSXCFVGBNJMK\xbcL\xbe\xbf"[k]));
 
 			// Check if note already exists in currently playing notes
-			muxNotes.lock();
-			auto noteFound = find_if(vecNotes.begin(), vecNotes.end(), [&k](synth::note const& item) { return item.id == k + 64 && item.channel == &instHarm; });
-			if (noteFound == vecNotes.end())
+			engine.muxNotes.lock();
+			auto noteFound = find_if(engine.vecNotes.begin(), engine.vecNotes.end(), [&k, pKeys](synth::note const& item) { return item.id == k + 64 && item.channel == pKeys; });
+			if (noteFound == engine.vecNotes.end())
 			{
 				// Note not found in vector
-				if (nKeyState & 0x8000)
+				if (bKeyDown)
 				{
 					// Key has been pressed so create a new note
 					synth::note n;
 					n.id = k + 64;
 					n.on = dTimeNow;
 					n.active = true;
+					n.azimuth = (7.5 - k) / 7.5 * (PI / 2.0);	// Low keys to the left
 					//set the instrument u want to play here 
-					n.channel = &instHarm;
+					n.channel = pKeys;
 
 					// Add note to vector
-					vecNotes.emplace_back(n);
+					engine.vecNotes.emplace_back(n);
 				}
 			}
 			else
 			{
 				// Note exists in vector
-				if (nKeyState & 0x8000)
+				if (bKeyDown)
 				{
 					// Key is still held, so do nothing
 					if (noteFound->off > noteFound->on)
@@ -160,7 +518,7 @@ int main()
 						noteFound->off = dTimeNow;
 				}
 			}
-			muxNotes.unlock();
+			engine.muxNotes.unlock();
 		}
 
 		